@@ -0,0 +1,568 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Microbenchmarks and end-to-end metadata extraction throughput.
+ *
+ * Every benchmark is run until it has taken at least the minimum time,
+ * then one JSON object per benchmark is written to stdout:
+ *   {"bench": ..., "file": ..., "iters": ..., "ns_per_op": ...,
+ *    "syscalls_per_op": ..., "allocs_per_op": ...}
+ *
+ * Allocations are counted through tiff_set_allocator. Files are read
+ * through a wrapper around tiff_pread_mgr, which has no buffering of its
+ * own, so each call to it that reaches the kernel counts as a syscall
+ * (a map counts two: the size check and the mmap).
+ *
+ * Usage: ghetto_bench [-t min_seconds] [-f filter] file...
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define TAG_MAKE            271
+#define TAG_MODEL           272
+#define TAG_DATETIME        306
+#define TAG_EXIFIFD         34665
+#define TAG_MAKERNOTE       37500
+
+#define SWAP_BUFFER_SIZE    65536
+#define MAX_CHAIN           100000
+
+static unsigned long allocs;
+static unsigned long syscalls;
+
+/*******************************************************************/
+/* Counting allocator and file manager                             */
+/*******************************************************************/
+static void *count_alloc(void *ctx, size_t size)
+{
+    allocs++;
+    return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size)
+{
+    allocs++;
+    return realloc(ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+static const tiff_allocator_t count_allocator = {
+    .alloc = count_alloc,
+    .realloc = count_realloc,
+    .free = count_free,
+};
+
+static TIFF_STATUS count_open(tiff_file_hdl_t **hdl, const char *file,
+                              const char *mode)
+{
+    syscalls++;
+    return tiff_pread_mgr->open(hdl, file, mode);
+}
+
+static TIFF_STATUS count_close(tiff_file_hdl_t *hdl)
+{
+    syscalls++;
+    return tiff_pread_mgr->close(hdl);
+}
+
+static TIFF_STATUS count_read(tiff_file_hdl_t *hdl, size_t size, size_t nmemb,
+                              void *buf, size_t *count)
+{
+    syscalls++;
+    return tiff_pread_mgr->read(hdl, size, nmemb, buf, count);
+}
+
+static TIFF_STATUS count_seek(tiff_file_hdl_t *hdl, size_t offset, int whence)
+{
+    /* Only SEEK_END needs the kernel, for the file size */
+    if (whence == TIFF_SEEK_END) {
+        syscalls++;
+    }
+    return tiff_pread_mgr->seek(hdl, offset, whence);
+}
+
+static TIFF_STATUS count_map(tiff_file_hdl_t *hdl, size_t offset, size_t len,
+                             void **addr)
+{
+    syscalls += 2;
+    return tiff_pread_mgr->map(hdl, offset, len, addr);
+}
+
+static TIFF_STATUS count_unmap(tiff_file_hdl_t *hdl, void *addr, size_t len)
+{
+    syscalls++;
+    return tiff_pread_mgr->unmap(hdl, addr, len);
+}
+
+static TIFF_STATUS count_prefetch(tiff_file_hdl_t *hdl, size_t offset,
+                                  size_t len)
+{
+    syscalls++;
+    return tiff_pread_mgr->prefetch(hdl, offset, len);
+}
+
+static TIFF_STATUS count_identify(tiff_file_hdl_t *hdl, uint64_t *id)
+{
+    syscalls++;
+    return tiff_pread_mgr->identify(hdl, id);
+}
+
+static TIFF_STATUS count_size(tiff_file_hdl_t *hdl, size_t *size)
+{
+    syscalls++;
+    return tiff_pread_mgr->size(hdl, size);
+}
+
+static tiff_file_mgr_t count_mgr = {
+    .open = count_open,
+    .close = count_close,
+    .read = count_read,
+    .seek = count_seek,
+    .map = count_map,
+    .unmap = count_unmap,
+    .prefetch = count_prefetch,
+    .identify = count_identify,
+    .size = count_size,
+};
+
+/*******************************************************************/
+/* Benchmarks                                                      */
+/*******************************************************************/
+/* State shared by the benchmarks of one file */
+struct ctx {
+    const char *path;
+    tiff_t *fp;
+    tiff_off_t base;
+    tiff_ifd_t *ifd;
+    tiff_ifd_t *exif;           /* EXIF IFD, if the base IFD has one */
+    tiff_ifd_t *big_ifd;
+    tiff_tag_t *big_tag;        /* Tag with the most data, in either IFD */
+    size_t big_len;
+    void *buf;
+};
+
+static TIFF_STATUS open_file(tiff_t **fp, const char *path)
+{
+    tiff_open_options_t opts = { .mgr = &count_mgr, .allocator = NULL };
+
+    return tiff_open_opts(fp, path, "r", &opts);
+}
+
+/* Each benchmark does ops operations per call, and returns nonzero if
+ * anything failed.
+ */
+struct bench {
+    const char *name;
+    int per_file;
+    unsigned ops;
+    int (*run)(struct ctx *c);
+};
+
+static int bench_open_sniff(struct ctx *c)
+{
+    return tiff_reopen(c->fp, c->path, "r") != TIFF_OK;
+}
+
+static int bench_read_ifd(struct ctx *c)
+{
+    tiff_ifd_t *ifd;
+
+    if (tiff_read_ifd(c->fp, c->base, &ifd) != TIFF_OK) {
+        return 1;
+    }
+
+    return tiff_free_ifd(c->fp, ifd) != TIFF_OK;
+}
+
+/* Half of these are in every corpus file's base IFD, half are not */
+static const tiff_tag_id_t find_ids[] = {
+    256, 257, 273, 305, 300, 1000, 40000, 65535
+};
+
+static int bench_find_tag(struct ctx *c)
+{
+    tiff_tag_t *tag;
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof(find_ids) / sizeof(find_ids[0]); i++) {
+        found += tiff_get_tag(c->fp, c->ifd, find_ids[i], &tag) == TIFF_OK;
+    }
+
+    return found == 0;
+}
+
+static int bench_get_tag_data(struct ctx *c)
+{
+    return tiff_get_tag_data(c->fp, c->big_ifd, c->big_tag, c->buf) != TIFF_OK;
+}
+
+static int bench_walk_chain(struct ctx *c)
+{
+    tiff_off_t off = c->base;
+    tiff_ifd_t *ifd;
+    size_t n;
+
+    for (n = 0; off != 0 && n < MAX_CHAIN; n++) {
+        if (tiff_read_ifd(c->fp, off, &ifd) != TIFF_OK) {
+            return 1;
+        }
+        tiff_get_next_ifd_offset(c->fp, ifd, &off);
+        tiff_free_ifd(c->fp, ifd);
+    }
+
+    return 0;
+}
+
+/* What a catalogue or indexer does with each file */
+static int bench_extract_metadata(struct ctx *c)
+{
+    tiff_t *fp;
+    tiff_ifd_t *ifd, *exif;
+    tiff_tag_t *tag;
+    tiff_off_t off;
+    unsigned width, height, channels, compression;
+    int bits, data_type, tiles, tile_w, tile_h, id, type, count;
+    char str[256];
+    UINT32 exif_off;
+    size_t n;
+    int ret = 1;
+
+    if (open_file(&fp, c->path) != TIFF_OK) {
+        return 1;
+    }
+
+    if (tiff_get_base_ifd_offset(fp, &off) != TIFF_OK ||
+        tiff_read_ifd(fp, off, &ifd) != TIFF_OK)
+    {
+        goto done_close;
+    }
+
+    if (tiff_get_image_attribs(fp, ifd, &width, &height, &channels) ||
+        tiff_get_image_sample_info(fp, ifd, &bits, &data_type) ||
+        tiff_get_image_structure(fp, ifd, &tiles, &tile_w, &tile_h,
+            &compression))
+    {
+        goto done_free;
+    }
+
+    if (tiff_get_tag(fp, ifd, TAG_MAKE, &tag) == TIFF_OK) {
+        tiff_get_tag_info(fp, tag, &id, &type, &count);
+        if (count <= (int)sizeof(str)) {
+            tiff_get_tag_data(fp, ifd, tag, str);
+        }
+    }
+
+    if (tiff_get_tag(fp, ifd, TAG_MODEL, &tag) == TIFF_OK) {
+        tiff_get_tag_info(fp, tag, &id, &type, &count);
+        if (count <= (int)sizeof(str)) {
+            tiff_get_tag_data(fp, ifd, tag, str);
+        }
+    }
+
+    if (tiff_get_tag_u32(fp, ifd, TAG_EXIFIFD, &exif_off) == TIFF_OK &&
+        tiff_read_ifd(fp, exif_off, &exif) == TIFF_OK)
+    {
+        /* Only the size of the MakerNote; its contents are vendor junk */
+        if (tiff_get_tag(fp, exif, TAG_MAKERNOTE, &tag) == TIFF_OK) {
+            tiff_get_tag_info(fp, tag, &id, &type, &count);
+        }
+        tiff_free_ifd(fp, exif);
+    }
+
+    /* Count the images in the file */
+    tiff_get_next_ifd_offset(fp, ifd, &off);
+    for (n = 1; off != 0 && n < MAX_CHAIN; n++) {
+        tiff_ifd_t *next;
+
+        if (tiff_read_ifd(fp, off, &next) != TIFF_OK) {
+            break;
+        }
+        tiff_get_next_ifd_offset(fp, next, &off);
+        tiff_free_ifd(fp, next);
+    }
+
+    ret = 0;
+
+done_free:
+    tiff_free_ifd(fp, ifd);
+done_close:
+    tiff_close(fp);
+    return ret;
+}
+
+static int bench_swap(struct ctx *c, size_t width)
+{
+    switch (width) {
+    case 2:
+        tiff_swap_word_buffer(c->buf, SWAP_BUFFER_SIZE / 2, !MACH_ENDIANESS);
+        break;
+    case 4:
+        tiff_swap_dword_buffer(c->buf, SWAP_BUFFER_SIZE / 4, !MACH_ENDIANESS);
+        break;
+    default:
+        tiff_swap_qword_buffer(c->buf, SWAP_BUFFER_SIZE / 8, !MACH_ENDIANESS);
+        break;
+    }
+
+    return 0;
+}
+
+static int bench_swap_word(struct ctx *c) { return bench_swap(c, 2); }
+static int bench_swap_dword(struct ctx *c) { return bench_swap(c, 4); }
+static int bench_swap_qword(struct ctx *c) { return bench_swap(c, 8); }
+
+static const struct bench benches[] = {
+    { "swap_word_64k", 0, 1, bench_swap_word },
+    { "swap_dword_64k", 0, 1, bench_swap_dword },
+    { "swap_qword_64k", 0, 1, bench_swap_qword },
+    { "open_sniff", 1, 1, bench_open_sniff },
+    { "read_ifd", 1, 1, bench_read_ifd },
+    { "find_tag", 1, sizeof(find_ids) / sizeof(find_ids[0]), bench_find_tag },
+    { "get_tag_data", 1, 1, bench_get_tag_data },
+    { "walk_chain", 1, 1, bench_walk_chain },
+    { "extract_metadata", 1, 1, bench_extract_metadata },
+};
+
+/*******************************************************************/
+/* Driver                                                          */
+/*******************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int run_bench(const struct bench *b, struct ctx *c, const char *file,
+                     double min_ns)
+{
+    unsigned long iters = 1, i, a, s;
+    double start, elapsed;
+
+    /* Warm up, then double the iterations until the run is long enough */
+    if (b->run(c)) {
+        fprintf(stderr, "%s: %s failed\n", file, b->name);
+        return 1;
+    }
+
+    for (;;) {
+        a = allocs;
+        s = syscalls;
+        start = now_ns();
+
+        for (i = 0; i < iters; i++) {
+            b->run(c);
+        }
+
+        elapsed = now_ns() - start;
+
+        if (elapsed >= min_ns || iters >= (1ul << 40)) {
+            break;
+        }
+
+        iters *= 2;
+    }
+
+    iters *= b->ops;
+
+    printf("{\"bench\": \"%s\", \"file\": \"%s\", \"iters\": %lu, "
+           "\"ns_per_op\": %.1f, \"syscalls_per_op\": %.2f, "
+           "\"allocs_per_op\": %.2f}\n",
+           b->name, file, iters, elapsed / iters,
+           (double)(syscalls - s) / iters, (double)(allocs - a) / iters);
+    fflush(stdout);
+
+    return 0;
+}
+
+/* Find the tag of ifd with the most data */
+static void ctx_find_big_tag(struct ctx *c, tiff_ifd_t *ifd)
+{
+    tiff_tag_t *tag;
+    size_t i, count, len;
+    int id, type, n;
+
+    if (tiff_get_ifd_tag_count(c->fp, ifd, &count) != TIFF_OK) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        tiff_get_tag_indexed(c->fp, ifd, i, &tag);
+        tiff_get_tag_info(c->fp, tag, &id, &type, &n);
+
+        /* Big enough for any type */
+        len = (size_t)n * 8;
+        if (c->big_tag == NULL || len > c->big_len) {
+            c->big_ifd = ifd;
+            c->big_tag = tag;
+            c->big_len = len;
+        }
+    }
+}
+
+/* Set up the shared state for a file; returns nonzero if it won't open */
+static int ctx_open(struct ctx *c, const char *path)
+{
+    UINT32 exif_off;
+
+    memset(c, 0, sizeof(*c));
+    c->path = path;
+
+    if (open_file(&c->fp, path) != TIFF_OK ||
+        tiff_get_base_ifd_offset(c->fp, &c->base) != TIFF_OK ||
+        tiff_read_ifd(c->fp, c->base, &c->ifd) != TIFF_OK)
+    {
+        return 1;
+    }
+
+    ctx_find_big_tag(c, c->ifd);
+
+    if (tiff_get_tag_u32(c->fp, c->ifd, TAG_EXIFIFD, &exif_off) == TIFF_OK &&
+        tiff_read_ifd(c->fp, exif_off, &c->exif) == TIFF_OK)
+    {
+        ctx_find_big_tag(c, c->exif);
+    }
+
+    if (c->big_tag == NULL || (c->buf = malloc(c->big_len)) == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void ctx_close(struct ctx *c)
+{
+    free(c->buf);
+    if (c->exif) {
+        tiff_free_ifd(c->fp, c->exif);
+    }
+    if (c->ifd) {
+        tiff_free_ifd(c->fp, c->ifd);
+    }
+    if (c->fp) {
+        tiff_close(c->fp);
+    }
+}
+
+/* The file's name without directory or extension */
+static const char *file_label(const char *path, char *buf, size_t len)
+{
+    const char *base = strrchr(path, '/');
+    char *dot;
+
+    snprintf(buf, len, "%s", base ? base + 1 : path);
+    if ( (dot = strrchr(buf, '.')) != NULL ) {
+        *dot = '\0';
+    }
+
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    double min_ns = 0.25e9;
+    char label[256];
+    struct ctx c;
+    size_t i;
+    int opt, f, failed = 0;
+
+    while ( (opt = getopt(argc, argv, "t:f:")) != -1 ) {
+        switch (opt) {
+        case 't':
+            min_ns = atof(optarg) * 1e9;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t min_seconds] [-f filter] file...\n",
+                argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (tiff_set_allocator(&count_allocator) != TIFF_OK) {
+        return EXIT_FAILURE;
+    }
+
+    /* Benchmarks that don't need a file */
+    memset(&c, 0, sizeof(c));
+    c.buf = calloc(1, SWAP_BUFFER_SIZE);
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (!benches[i].per_file &&
+            (filter == NULL || strstr(benches[i].name, filter)))
+        {
+            failed |= run_bench(&benches[i], &c, "", min_ns);
+        }
+    }
+
+    free(c.buf);
+
+    for (f = optind; f < argc; f++) {
+        file_label(argv[f], label, sizeof(label));
+
+        if (ctx_open(&c, argv[f])) {
+            fprintf(stderr, "%s: could not open\n", argv[f]);
+            ctx_close(&c);
+            failed = 1;
+            continue;
+        }
+
+        for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+            if (benches[i].per_file &&
+                (filter == NULL || strstr(benches[i].name, filter)))
+            {
+                failed |= run_bench(&benches[i], &c, label, min_ns);
+            }
+        }
+
+        ctx_close(&c);
+    }
+
+    tiff_set_allocator(NULL);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,511 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Synthetic TIFF corpus for the benchmarks. Every file is built from
+ * fixed patterns, so the same corpus comes out on every run and every
+ * machine. Each layout is written in both byte orders:
+ *  - basic:      a small RGB image with a typical set of tags
+ *  - chain:      a long chain of small IFDs
+ *  - makernote:  an EXIF IFD carrying a huge MakerNote
+ *  - strips:     thousands of one-row strips
+ *  - tiled:      thousands of small tiles
+ *
+ * Usage: ghetto_corpus <directory>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define TYPE_BYTE       1
+#define TYPE_ASCII      2
+#define TYPE_SHORT      3
+#define TYPE_LONG       4
+#define TYPE_RATIONAL   5
+#define TYPE_UNDEFINED  7
+
+#define TAG_NEWSUBFILETYPE  254
+#define TAG_IMAGEWIDTH      256
+#define TAG_IMAGELENGTH     257
+#define TAG_BITSPERSAMPLE   258
+#define TAG_COMPRESSION     259
+#define TAG_PHOTOMETRIC     262
+#define TAG_MAKE            271
+#define TAG_MODEL           272
+#define TAG_STRIPOFFSETS    273
+#define TAG_SAMPLESPERPIXEL 277
+#define TAG_ROWSPERSTRIP    278
+#define TAG_STRIPBYTECOUNTS 279
+#define TAG_XRESOLUTION     282
+#define TAG_YRESOLUTION     283
+#define TAG_PLANARCONFIG    284
+#define TAG_RESOLUTIONUNIT  296
+#define TAG_SOFTWARE        305
+#define TAG_DATETIME        306
+#define TAG_TILEWIDTH       322
+#define TAG_TILELENGTH      323
+#define TAG_TILEOFFSETS     324
+#define TAG_TILEBYTECOUNTS  325
+#define TAG_EXPOSURETIME    33434
+#define TAG_EXIFIFD         34665
+#define TAG_ISO             34855
+#define TAG_MAKERNOTE       37500
+
+#define MAX_ENTRIES         32
+
+#define CHAIN_LENGTH        1000
+#define MAKERNOTE_SIZE      (4 << 20)
+#define STRIP_ROWS          8192
+#define STRIP_WIDTH         16
+#define TILED_SIZE          1024
+#define TILE_SIZE           16
+
+/* A file being built in memory */
+struct gen {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    int big;
+};
+
+/* One IFD entry; values are native uint32s (two per rational), or raw
+ * bytes for the byte, ASCII and undefined types.
+ */
+struct entry {
+    uint16_t id;
+    uint16_t type;
+    uint32_t count;
+    const void *data;
+};
+
+struct ifd {
+    struct entry e[MAX_ENTRIES];
+    int n;
+};
+
+static void *gen_room(struct gen *g, size_t len)
+{
+    void *p;
+
+    if (g->len + len > g->cap) {
+        while (g->len + len > g->cap) {
+            g->cap = g->cap ? g->cap * 2 : 65536;
+        }
+        if ( (g->buf = realloc(g->buf, g->cap)) == NULL ) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    p = g->buf + g->len;
+    g->len += len;
+
+    return p;
+}
+
+static void put16(struct gen *g, size_t off, uint32_t v)
+{
+    g->buf[off + (g->big ? 1 : 0)] = v & 0xff;
+    g->buf[off + (g->big ? 0 : 1)] = (v >> 8) & 0xff;
+}
+
+static void put32(struct gen *g, size_t off, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        g->buf[off + (g->big ? 3 - i : i)] = (v >> (8 * i)) & 0xff;
+    }
+}
+
+static size_t gen_align(struct gen *g)
+{
+    if (g->len & 1) {
+        *(uint8_t *)gen_room(g, 1) = 0;
+    }
+
+    return g->len;
+}
+
+/* Append raw bytes, returning their offset */
+static size_t gen_bytes(struct gen *g, const void *data, size_t len)
+{
+    size_t off = gen_align(g);
+
+    memcpy(gen_room(g, len), data, len);
+
+    return off;
+}
+
+static size_t type_size(int type)
+{
+    switch (type) {
+    case TYPE_SHORT:
+        return 2;
+    case TYPE_LONG:
+        return 4;
+    case TYPE_RATIONAL:
+        return 8;
+    default:
+        return 1;
+    }
+}
+
+/* Store count values of an entry at off, in the file's byte order */
+static void put_values(struct gen *g, size_t off, const struct entry *e)
+{
+    const uint32_t *v = (const uint32_t *)e->data;
+    uint32_t i;
+
+    switch (e->type) {
+    case TYPE_SHORT:
+        for (i = 0; i < e->count; i++) put16(g, off + 2 * i, v[i]);
+        break;
+    case TYPE_LONG:
+        for (i = 0; i < e->count; i++) put32(g, off + 4 * i, v[i]);
+        break;
+    case TYPE_RATIONAL:
+        for (i = 0; i < 2 * e->count; i++) put32(g, off + 4 * i, v[i]);
+        break;
+    default:
+        memcpy(g->buf + off, e->data, e->count);
+        break;
+    }
+}
+
+static void ifd_add(struct ifd *ifd, uint16_t id, uint16_t type,
+                    uint32_t count, const void *data)
+{
+    int i = ifd->n++;
+
+    if (ifd->n > MAX_ENTRIES) {
+        fprintf(stderr, "too many entries\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Keep the entries sorted by tag id, as the spec asks */
+    while (i > 0 && ifd->e[i - 1].id > id) {
+        ifd->e[i] = ifd->e[i - 1];
+        i--;
+    }
+
+    ifd->e[i].id = id;
+    ifd->e[i].type = type;
+    ifd->e[i].count = count;
+    ifd->e[i].data = data;
+}
+
+/* Write the out-of-line values and then the IFD itself. Returns the
+ * IFD's offset; its next IFD pointer is left zero at *next.
+ */
+static size_t gen_ifd(struct gen *g, const struct ifd *ifd, size_t *next)
+{
+    size_t data_off[MAX_ENTRIES];
+    size_t off, len;
+    int i;
+
+    for (i = 0; i < ifd->n; i++) {
+        len = type_size(ifd->e[i].type) * ifd->e[i].count;
+        data_off[i] = 0;
+        if (len > 4) {
+            data_off[i] = gen_align(g);
+            gen_room(g, len);
+            put_values(g, data_off[i], &ifd->e[i]);
+        }
+    }
+
+    off = gen_align(g);
+    gen_room(g, 2 + 12 * ifd->n + 4);
+    put16(g, off, ifd->n);
+
+    for (i = 0; i < ifd->n; i++) {
+        size_t ent = off + 2 + 12 * i;
+
+        put16(g, ent, ifd->e[i].id);
+        put16(g, ent + 2, ifd->e[i].type);
+        put32(g, ent + 4, ifd->e[i].count);
+        put32(g, ent + 8, 0);
+        if (data_off[i]) {
+            put32(g, ent + 8, data_off[i]);
+        } else {
+            put_values(g, ent + 8, &ifd->e[i]);
+        }
+    }
+
+    *next = off + 2 + 12 * ifd->n;
+    put32(g, *next, 0);
+
+    return off;
+}
+
+static void gen_header(struct gen *g, int big)
+{
+    memset(g, 0, sizeof(*g));
+    g->big = big;
+
+    gen_room(g, 8);
+    g->buf[0] = g->buf[1] = big ? 'M' : 'I';
+    put16(g, 2, 42);
+    put32(g, 4, 0);
+}
+
+/* Deterministic filler for pixel and MakerNote data */
+static void fill(uint8_t *buf, size_t len, uint32_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        seed = seed * 1664525 + 1013904223;
+        buf[i] = seed >> 24;
+    }
+}
+
+/* The descriptive tags every corpus image carries */
+static const char make[] = "Ghetto Camera Works";
+static const char model[] = "Synthetic Model 1";
+static const char software[] = "ghetto_corpus";
+static const char datetime[] = "2011:01:01 00:00:00";
+static const uint32_t resolution[2] = { 300, 1 };
+
+static void add_common(struct ifd *ifd)
+{
+    static const uint32_t one = 1, unit = 2;
+
+    ifd_add(ifd, TAG_NEWSUBFILETYPE, TYPE_LONG, 1, &one);
+    ifd_add(ifd, TAG_MAKE, TYPE_ASCII, sizeof(make), make);
+    ifd_add(ifd, TAG_MODEL, TYPE_ASCII, sizeof(model), model);
+    ifd_add(ifd, TAG_SOFTWARE, TYPE_ASCII, sizeof(software), software);
+    ifd_add(ifd, TAG_DATETIME, TYPE_ASCII, sizeof(datetime), datetime);
+    ifd_add(ifd, TAG_XRESOLUTION, TYPE_RATIONAL, 1, resolution);
+    ifd_add(ifd, TAG_YRESOLUTION, TYPE_RATIONAL, 1, resolution);
+    ifd_add(ifd, TAG_RESOLUTIONUNIT, TYPE_SHORT, 1, &unit);
+}
+
+/* A chunky 8-bit image cut into strips of rows_per_strip rows */
+static size_t gen_strip_image(struct gen *g, struct ifd *ifd,
+                              uint32_t *dims, uint32_t *bps, uint32_t *spp,
+                              uint32_t *rps, uint32_t **offsets,
+                              uint32_t **counts)
+{
+    static const uint32_t none = 1, planar = 1;
+    static uint32_t photometric;
+    uint32_t strips = (dims[1] + *rps - 1) / *rps;
+    size_t row = (size_t)dims[0] * *spp, i, rows;
+    size_t next;
+
+    *offsets = malloc(strips * sizeof(uint32_t));
+    *counts = malloc(strips * sizeof(uint32_t));
+
+    for (i = 0; i < strips; i++) {
+        rows = dims[1] - i * *rps < *rps ? dims[1] - i * *rps : *rps;
+        (*counts)[i] = row * rows;
+        (*offsets)[i] = gen_align(g);
+        fill(gen_room(g, (*counts)[i]), (*counts)[i], i);
+    }
+
+    photometric = *spp == 3 ? 2 : 1;
+
+    ifd_add(ifd, TAG_IMAGEWIDTH, TYPE_LONG, 1, &dims[0]);
+    ifd_add(ifd, TAG_IMAGELENGTH, TYPE_LONG, 1, &dims[1]);
+    ifd_add(ifd, TAG_BITSPERSAMPLE, TYPE_SHORT, *spp, bps);
+    ifd_add(ifd, TAG_COMPRESSION, TYPE_SHORT, 1, &none);
+    ifd_add(ifd, TAG_PHOTOMETRIC, TYPE_SHORT, 1, &photometric);
+    ifd_add(ifd, TAG_STRIPOFFSETS, TYPE_LONG, strips, *offsets);
+    ifd_add(ifd, TAG_SAMPLESPERPIXEL, TYPE_SHORT, 1, spp);
+    ifd_add(ifd, TAG_ROWSPERSTRIP, TYPE_LONG, 1, rps);
+    ifd_add(ifd, TAG_STRIPBYTECOUNTS, TYPE_LONG, strips, *counts);
+    ifd_add(ifd, TAG_PLANARCONFIG, TYPE_SHORT, 1, &planar);
+    add_common(ifd);
+
+    return gen_ifd(g, ifd, &next);
+}
+
+static void gen_basic(struct gen *g)
+{
+    uint32_t dims[2] = { 256, 256 }, bps[3] = { 8, 8, 8 }, spp = 3, rps = 16;
+    uint32_t *offsets, *counts;
+    struct ifd ifd = { .n = 0 };
+
+    put32(g, 4, gen_strip_image(g, &ifd, dims, bps, &spp, &rps, &offsets,
+        &counts));
+
+    free(offsets);
+    free(counts);
+}
+
+static void gen_strips(struct gen *g)
+{
+    uint32_t dims[2] = { STRIP_WIDTH, STRIP_ROWS }, bps = 8, spp = 1, rps = 1;
+    uint32_t *offsets, *counts;
+    struct ifd ifd = { .n = 0 };
+
+    put32(g, 4, gen_strip_image(g, &ifd, dims, &bps, &spp, &rps, &offsets,
+        &counts));
+
+    free(offsets);
+    free(counts);
+}
+
+static void gen_chain(struct gen *g)
+{
+    static const uint32_t dim = 8, bps = 8, spp = 1, none = 1, black = 1;
+    static const uint8_t pixels[64] = { 0 };
+    size_t prev = 4, next, off;
+    uint32_t strip;
+    int i;
+
+    strip = gen_bytes(g, pixels, sizeof(pixels));
+
+    for (i = 0; i < CHAIN_LENGTH; i++) {
+        static const uint32_t count = sizeof(pixels);
+        struct ifd ifd = { .n = 0 };
+
+        ifd_add(&ifd, TAG_IMAGEWIDTH, TYPE_LONG, 1, &dim);
+        ifd_add(&ifd, TAG_IMAGELENGTH, TYPE_LONG, 1, &dim);
+        ifd_add(&ifd, TAG_BITSPERSAMPLE, TYPE_SHORT, 1, &bps);
+        ifd_add(&ifd, TAG_COMPRESSION, TYPE_SHORT, 1, &none);
+        ifd_add(&ifd, TAG_PHOTOMETRIC, TYPE_SHORT, 1, &black);
+        ifd_add(&ifd, TAG_STRIPOFFSETS, TYPE_LONG, 1, &strip);
+        ifd_add(&ifd, TAG_SAMPLESPERPIXEL, TYPE_SHORT, 1, &spp);
+        ifd_add(&ifd, TAG_ROWSPERSTRIP, TYPE_LONG, 1, &dim);
+        ifd_add(&ifd, TAG_STRIPBYTECOUNTS, TYPE_LONG, 1, &count);
+
+        off = gen_ifd(g, &ifd, &next);
+        put32(g, prev, off);
+        prev = next;
+    }
+}
+
+static void gen_makernote(struct gen *g)
+{
+    uint32_t dims[2] = { 64, 64 }, bps = 8, spp = 1, rps = 64;
+    static const uint32_t exposure[2] = { 1, 250 }, iso = 200;
+    uint32_t *offsets, *counts, exif;
+    struct ifd ifd = { .n = 0 }, exif_ifd = { .n = 0 };
+    uint8_t *note;
+    size_t next;
+
+    note = malloc(MAKERNOTE_SIZE);
+    fill(note, MAKERNOTE_SIZE, 37500);
+
+    ifd_add(&exif_ifd, TAG_EXPOSURETIME, TYPE_RATIONAL, 1, exposure);
+    ifd_add(&exif_ifd, TAG_ISO, TYPE_SHORT, 1, &iso);
+    ifd_add(&exif_ifd, TAG_MAKERNOTE, TYPE_UNDEFINED, MAKERNOTE_SIZE, note);
+    exif = gen_ifd(g, &exif_ifd, &next);
+
+    ifd_add(&ifd, TAG_EXIFIFD, TYPE_LONG, 1, &exif);
+    put32(g, 4, gen_strip_image(g, &ifd, dims, &bps, &spp, &rps, &offsets,
+        &counts));
+
+    free(note);
+    free(offsets);
+    free(counts);
+}
+
+static void gen_tiled(struct gen *g)
+{
+    static const uint32_t dim = TILED_SIZE, tile = TILE_SIZE, bps = 8,
+        spp = 1, none = 1, black = 1;
+    uint32_t tiles = (TILED_SIZE / TILE_SIZE) * (TILED_SIZE / TILE_SIZE);
+    uint32_t *offsets, *counts, i;
+    struct ifd ifd = { .n = 0 };
+    size_t next;
+
+    offsets = malloc(tiles * sizeof(uint32_t));
+    counts = malloc(tiles * sizeof(uint32_t));
+
+    for (i = 0; i < tiles; i++) {
+        counts[i] = TILE_SIZE * TILE_SIZE;
+        offsets[i] = gen_align(g);
+        fill(gen_room(g, counts[i]), counts[i], i);
+    }
+
+    ifd_add(&ifd, TAG_IMAGEWIDTH, TYPE_LONG, 1, &dim);
+    ifd_add(&ifd, TAG_IMAGELENGTH, TYPE_LONG, 1, &dim);
+    ifd_add(&ifd, TAG_BITSPERSAMPLE, TYPE_SHORT, 1, &bps);
+    ifd_add(&ifd, TAG_COMPRESSION, TYPE_SHORT, 1, &none);
+    ifd_add(&ifd, TAG_PHOTOMETRIC, TYPE_SHORT, 1, &black);
+    ifd_add(&ifd, TAG_SAMPLESPERPIXEL, TYPE_SHORT, 1, &spp);
+    ifd_add(&ifd, TAG_TILEWIDTH, TYPE_LONG, 1, &tile);
+    ifd_add(&ifd, TAG_TILELENGTH, TYPE_LONG, 1, &tile);
+    ifd_add(&ifd, TAG_TILEOFFSETS, TYPE_LONG, tiles, offsets);
+    ifd_add(&ifd, TAG_TILEBYTECOUNTS, TYPE_LONG, tiles, counts);
+    add_common(&ifd);
+
+    put32(g, 4, gen_ifd(g, &ifd, &next));
+
+    free(offsets);
+    free(counts);
+}
+
+static const struct {
+    const char *name;
+    void (*gen)(struct gen *g);
+} layouts[] = {
+    { "basic", gen_basic },
+    { "chain", gen_chain },
+    { "makernote", gen_makernote },
+    { "strips", gen_strips },
+    { "tiled", gen_tiled },
+};
+
+int main(int argc, char *argv[])
+{
+    char path[4096];
+    struct gen g;
+    FILE *f;
+    size_t i;
+    int big;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <directory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        for (big = 0; big < 2; big++) {
+            snprintf(path, sizeof(path), "%s/%s_%s.tif", argv[1],
+                big ? "be" : "le", layouts[i].name);
+
+            gen_header(&g, big);
+            layouts[i].gen(&g);
+
+            if ( (f = fopen(path, "wb")) == NULL ||
+                 fwrite(g.buf, 1, g.len, f) != g.len || fclose(f) )
+            {
+                fprintf(stderr, "%s: could not write\n", path);
+                return EXIT_FAILURE;
+            }
+
+            free(g.buf);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
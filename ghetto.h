@@ -9,9 +9,14 @@
 
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* TODO: wrap these in some testing macros */
 typedef unsigned long long  UINT64;
 typedef long long           INT64;
+typedef unsigned int        UINT32;
 typedef unsigned short      UINT16;
 typedef short               INT16;
 
@@ -25,9 +30,117 @@ struct tiff_tag;
 
 typedef struct tiff_ifd tiff_ifd_t;
 typedef struct tiff_tag tiff_tag_t;
+typedef struct tiff_scanline tiff_scanline_t;
+typedef struct tiff_cache tiff_cache_t;
+typedef struct tiff_stats tiff_stats_t;
+typedef struct tiff_writer tiff_writer_t;
+typedef struct tiff_image_digest tiff_image_digest_t;
 typedef UINT64          tiff_off_t;
 typedef UINT16          tiff_tag_id_t;
 
+/* One image (resolution level) in the file, see tiff_get_level_info */
+typedef struct tiff_level_info {
+    tiff_off_t ifd_offset;
+    unsigned width;
+    unsigned height;
+    unsigned samples;
+    unsigned bits;
+    unsigned compression;
+    unsigned photometric;       /* 0 if not given */
+    unsigned subfile_type;      /* NewSubfileType */
+    int tiled;
+    unsigned chunk_width;       /* Tile, or strip, size */
+    unsigned chunk_height;
+} tiff_level_info_t;
+
+/* Memory allocation hooks, see tiff_set_allocator. ctx is passed to every
+ * hook. alloc and free are required; without realloc, blocks are moved
+ * with alloc and free, and without aligned_alloc/aligned_free (give both
+ * or neither) aligned blocks are carved out of larger alloc blocks.
+ */
+typedef struct tiff_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *(*aligned_alloc)(void *ctx, size_t alignment, size_t size);
+    void (*aligned_free)(void *ctx, void *ptr);
+    void *ctx;
+} tiff_allocator_t;
+
+/* Bounds on the work done for one file, see tiff_set_limits. Zero means
+ * no limit. Each is reported with its own TIFF_LIMIT_* status.
+ */
+typedef struct tiff_limits {
+    UINT64 max_ifds;            /* IFDs parsed, in all */
+    UINT64 max_tags_per_ifd;
+    UINT64 max_payload_bytes;   /* Data of a single tag */
+    UINT64 max_bytes_read;      /* From the I/O backend, in all */
+    UINT64 max_chain_depth;     /* IFDs followed along one chain by tiff_next_ifd */
+} tiff_limits_t;
+
+/* A walk along an IFD chain, see tiff_next_ifd. The caller owns it and
+ * zeroes it before the first step; each walk needs its own, so that a
+ * walk nested in another (down SubIFDs, say) can't disturb the outer one.
+ */
+typedef struct tiff_ifd_chain {
+    tiff_off_t pos;             /* IFD the last step pointed at */
+    tiff_off_t mark;            /* Loop detection state */
+    UINT64 power;
+    UINT64 lam;
+    UINT64 depth;               /* Steps taken */
+} tiff_ifd_chain_t;
+
+/* Read sizes are counted in power of two buckets: bucket 0 holds reads
+ * of up to 64 bytes, bucket n reads of up to 64 << n bytes, and the last
+ * bucket everything larger.
+ */
+#define TIFF_READ_SIZE_BUCKETS  16
+
+/* I/O and allocation counters of a file, see tiff_get_stats */
+typedef struct tiff_file_stats {
+    UINT64 reads;               /* Reads that went to the I/O backend */
+    UINT64 bytes_read;
+    UINT64 read_sizes[TIFF_READ_SIZE_BUCKETS];
+    UINT64 prefix_hits;         /* Reads served from the header buffer */
+    UINT64 seeks;
+    UINT64 backward_seeks;
+    UINT64 writes;
+    UINT64 bytes_written;
+    UINT64 maps;
+    UINT64 ifds_parsed;
+    UINT64 tag_lookups;
+    UINT64 allocs;              /* Including reallocations */
+    UINT64 bytes_allocated;
+} tiff_file_stats_t;
+
+/* Something that happened inside libghetto, see tiff_set_event_handler.
+ * Fields that don't apply to an event type are zero.
+ */
+typedef struct tiff_event {
+    int type;                   /* TIFF_EVENT_* */
+    const tiff_t *fp;           /* File it concerns, NULL if none */
+    tiff_off_t offset;          /* Position in the file */
+    UINT64 size;                /* Bytes asked for */
+    UINT64 count;               /* Bytes or entries actually handled */
+    unsigned tag;               /* Tag id */
+    TIFF_STATUS status;
+    const char *where;          /* Function that raised it */
+    const char *message;        /* Text of TIFF_EVENT_MESSAGE/ASSERT */
+} tiff_event_t;
+
+typedef void (*tiff_event_handler_t)(void *ctx, const tiff_event_t *event);
+
+/* Counters for a decoded chunk cache, see tiff_cache_get_stats */
+typedef struct tiff_cache_stats {
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 inserts;
+    UINT64 evictions;
+    size_t entries;
+    size_t bytes;               /* Decoded data currently held */
+    size_t capacity;            /* The budget the cache was created with */
+} tiff_cache_stats_t;
+
 /* TIFF status return codes */
 #define TIFF_OK             0x0     /* All is well */
 #define TIFF_NOT_TIFF       0x1     /* Not a TIFF image */
@@ -41,6 +154,13 @@ typedef UINT16          tiff_tag_id_t;
 #define TIFF_UNKNOWN_TYPE   0x9     /* The type of data represented is unknown */
 #define TIFF_IFD_NOT_IMAGE  0xa     /* The provided IFD is not an image dir */
 #define TIFF_TAG_MALFORMED  0xb     /* Tag is illegal by TIFF standard */
+#define TIFF_UNSUPPORTED    0xc     /* Image uses a feature we can't handle */
+#define TIFF_LIMIT_IFDS     0xd     /* File has more IFDs than allowed */
+#define TIFF_LIMIT_TAGS     0xe     /* IFD has more entries than allowed */
+#define TIFF_LIMIT_PAYLOAD  0xf     /* Tag data is bigger than allowed */
+#define TIFF_LIMIT_READ     0x10    /* Read budget for the file is used up */
+#define TIFF_LIMIT_DEPTH    0x11    /* IFD chain is longer than allowed */
+#define TIFF_IFD_LOOP       0x12    /* IFD chain loops back on itself */
 
 /* TIFF tag datatypes */
 #define TIFF_TYPE_BYTE       1
@@ -64,6 +184,43 @@ typedef UINT16          tiff_tag_id_t;
 #define TIFF_SAMPLEFORMAT_COMPLEXINT     5 /* Complex Integer */
 #define TIFF_SAMPLEFORMAT_COMPLEXIEEEFP  6 /* Complex Float */
 
+/* TIFF compression schemes */
+#define TIFF_COMPRESSION_NONE   1
+#define TIFF_COMPRESSION_OJPEG  6   /* Old-style (TIFF 6.0) JPEG */
+#define TIFF_COMPRESSION_JPEG   7
+
+/* Sample layouts for tiff_read_image and tiff_read_region */
+#define TIFF_LAYOUT_CHUNKY      1   /* Samples of a pixel together (RGBRGB) */
+#define TIFF_LAYOUT_PLANAR      2   /* One plane per channel (RRGGBB) */
+#define TIFF_LAYOUT_CHANNEL(c)  (0x100 | (c)) /* Only channel c */
+
+/* When tiff_patch_tag forces data to disk */
+#define TIFF_SYNC_NONE          0   /* Leave it to the OS */
+#define TIFF_SYNC_PATCH         1   /* After each patch */
+#define TIFF_SYNC_ORDERED       2   /* Also before repointing an entry */
+
+/* Filters for tiff_read_scaled */
+#define TIFF_SCALE_SUBSAMPLE    1   /* Top-left pixel of each block */
+#define TIFF_SCALE_BOX          2   /* Average of each block */
+#define TIFF_SCALE_CFA          3   /* Bin a Bayer mosaic into RGB pixels */
+
+/* Event types passed to the event handler */
+#define TIFF_EVENT_OPEN         1   /* Header read; offset is the first IFD */
+#define TIFF_EVENT_READ         2   /* Read from the I/O backend */
+#define TIFF_EVENT_IFD          3   /* IFD parsed; count is its entries */
+#define TIFF_EVENT_TAG_LOOKUP   4   /* tag looked up; status says if found */
+#define TIFF_EVENT_MESSAGE      5   /* Diagnostic text, usually on failure */
+#define TIFF_EVENT_ASSERT       6   /* Internal consistency check failed */
+
+/* Hash functions for tiff_hash_image_data */
+#define TIFF_HASH_CRC32C        1   /* CRC-32C, in the low 32 bits */
+#define TIFF_HASH_XXH64         2   /* xxHash64, seed 0 */
+
+/* Bit orders for packed samples (see tiff_unpack_samples) */
+#define TIFF_BITORDER_DEFAULT   0 /* MSB, or file byte order for 16 bits */
+#define TIFF_BITORDER_MSB       1 /* First sample in the high bits (TIFF) */
+#define TIFF_BITORDER_LSB       2 /* First sample in the low bits */
+
 
 /* Open the TIFF file */
 TIFF_STATUS tiff_open(tiff_t **fp, const char *file, const char *mode);
@@ -71,6 +228,65 @@ TIFF_STATUS tiff_open(tiff_t **fp, const char *file, const char *mode);
 /* Close the TIFF file */
 TIFF_STATUS tiff_close(tiff_t *fp);
 
+/* Close the file behind fp but keep the handle, with its buffers, cache
+ * and settings, for tiff_reopen. Free all IFDs of the old file first.
+ * Until it is reopened, reads fail with TIFF_NOT_OPEN.
+ */
+TIFF_STATUS tiff_reset(tiff_t *fp);
+
+/* Point fp at another file, through the same I/O strategy and allocator.
+ * Much cheaper than tiff_close and tiff_open when going through many
+ * small files. On failure fp is left reset, and can be reopened again or
+ * closed.
+ */
+TIFF_STATUS tiff_reopen(tiff_t *fp, const char *file, const char *mode);
+
+/* Set resource limits for the file fp has open, replacing any given to
+ * tiff_open_opts. They stay in force across tiff_reopen; the counts they
+ * apply to start again from zero for each file. Whatever the limits, tag
+ * data is checked against the size of the file before anything is
+ * allocated or read for it.
+ */
+TIFF_STATUS tiff_set_limits(tiff_t *fp, const tiff_limits_t *limits);
+
+/* Pick up IFDs appended to the main chain of a file that is still being
+ * written. The first call walks the whole chain and counts every IFD in
+ * it; after that only the end of the chain is looked at, so a poll that
+ * finds nothing new costs one small read. new_ifds is set to the number
+ * of IFDs found, and first_new (which may be NULL) to the offset of the
+ * first of them, from which they can be walked. An IFD that isn't all in
+ * the file yet is left for the next call.
+ */
+TIFF_STATUS tiff_refresh(tiff_t *fp, size_t *new_ifds, tiff_off_t *first_new);
+
+/* Set the allocator used by files, caches, statistics accumulators and
+ * writers created from now on (see tiff_open_opts to pick one per file).
+ * Objects keep the allocator they were created with. NULL restores
+ * malloc and free. Not thread safe: set it up before opening files.
+ */
+TIFF_STATUS tiff_set_allocator(const tiff_allocator_t *allocator);
+
+/*******************************************************************/
+/* Instrumentation                                                 */
+/*******************************************************************/
+/* Get the I/O and allocation counters of the file fp has open. They
+ * start from zero when a file is opened or reopened.
+ */
+TIFF_STATUS tiff_get_stats(tiff_t *fp, tiff_file_stats_t *stats);
+
+/* Get the counters of every file the process has closed (or reset) so
+ * far, added together. Safe to call from any thread.
+ */
+TIFF_STATUS tiff_get_global_stats(tiff_file_stats_t *stats);
+
+/* Register a function to be called for every event (TIFF_EVENT_*), from
+ * whichever thread raised it. NULL turns events off again; with no
+ * handler each event point costs a single branch. Building the library
+ * with -DTIFF_NO_EVENTS removes them altogether. Not thread safe: set it
+ * up before opening files.
+ */
+TIFF_STATUS tiff_set_event_handler(tiff_event_handler_t handler, void *ctx);
+
 /*******************************************************************/
 /* Functions for reading arbitrary data from the file              */
 /*******************************************************************/
@@ -79,6 +295,16 @@ TIFF_STATUS tiff_close(tiff_t *fp);
 TIFF_STATUS tiff_read(tiff_t *fp, size_t offset, size_t size, size_t nmemb,
                       void *dest_buf, size_t *count);
 
+/* Get a read-only, zero-copy view of len bytes of the file at offset.
+ * Returns TIFF_UNSUPPORTED if the I/O backend can't map the file, in
+ * which case use tiff_read. Release the view with tiff_unmap.
+ */
+TIFF_STATUS tiff_map(tiff_t *fp, tiff_off_t offset, size_t len,
+                     const void **view);
+
+/* Release a view returned by tiff_map */
+TIFF_STATUS tiff_unmap(tiff_t *fp, const void *view, size_t len);
+
 /*******************************************************************/
 /* Functions for managing the IFDs                                 */
 /*******************************************************************/
@@ -89,9 +315,22 @@ TIFF_STATUS tiff_get_base_ifd_offset(tiff_t *fp, tiff_off_t *off);
 /* Read a TIFF IFD at offset */
 TIFF_STATUS tiff_read_ifd(tiff_t *fp, tiff_off_t off, tiff_ifd_t **ifd);
 
-/* Get the offset of the next IFD */
+/* Get the offset of the next IFD. Only an IFD that points at itself is
+ * caught (TIFF_IFD_LOOP); walk a chain with tiff_next_ifd to catch longer
+ * loops.
+ */
 TIFF_STATUS tiff_get_next_ifd_offset(tiff_t *fp, tiff_ifd_t *ifd, tiff_off_t *off);
 
+/* Take one step along an IFD chain: get the offset of the IFD after ifd,
+ * the one the last step pointed at. This catches chains that loop back on
+ * themselves (TIFF_IFD_LOOP, within two trips around the loop) or run past
+ * max_chain_depth (TIFF_LIMIT_DEPTH), setting *off to 0 so that the walk
+ * ends. Stepping from some other IFD restarts the loop detection but not
+ * the depth count.
+ */
+TIFF_STATUS tiff_next_ifd(tiff_t *fp, tiff_ifd_chain_t *chain,
+                          tiff_ifd_t *ifd, tiff_off_t *off);
+
 /* Get the count of tags in the provided IFD */
 TIFF_STATUS tiff_get_ifd_tag_count(tiff_t *fp, tiff_ifd_t *ifd, size_t *count);
 
@@ -120,7 +359,10 @@ TIFF_STATUS tiff_free_ifd(tiff_t *fp, tiff_ifd_t *ifd);
 /* Functions for managing a TIFF tag                               */
 /*******************************************************************/
 
-/* Get the type and count of the tag (one of TIFF_TYPE_*) */
+/* Get the type and count of the tag (one of TIFF_TYPE_*). If the tag's
+ * data couldn't fit in the file (TIFF_TAG_MALFORMED) or is over the
+ * payload limit (TIFF_LIMIT_PAYLOAD), count is set to 0.
+ */
 TIFF_STATUS tiff_get_tag_info(tiff_t *fp, tiff_tag_t *tag_info,
                               int *id, int *type, int *count);
 
@@ -131,6 +373,38 @@ TIFF_STATUS tiff_get_tag_info(tiff_t *fp, tiff_tag_t *tag_info,
 TIFF_STATUS tiff_get_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
                               void *data);
 
+/* Get a zero-copy view of a tag's values. Only works for values stored
+ * outside the IFD entry, in native byte order (or single bytes), when the
+ * I/O backend can map the file; otherwise returns TIFF_UNSUPPORTED and
+ * tiff_get_tag_data should be used. Release the view with tiff_unmap.
+ */
+TIFF_STATUS tiff_map_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
+                              const void **view, size_t *len);
+
+/* Get a tag's value converted to the requested type, whatever integer,
+ * rational or floating point type the file stores it as. The scalar forms
+ * return the first value. Negative or too large values yield
+ * TIFF_RANGE_ERROR for the unsigned forms, a zero denominator
+ * TIFF_TAG_MALFORMED, and ASCII/UNDEFINED tags TIFF_UNKNOWN_TYPE.
+ */
+TIFF_STATUS tiff_get_tag_u32(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                             UINT32 *value);
+TIFF_STATUS tiff_get_tag_u64(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                             UINT64 *value);
+TIFF_STATUS tiff_get_tag_double(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                                double *value);
+
+/* Array forms of the above. Up to dst_count values are converted, and the
+ * number written is returned in count (which may be NULL).
+ */
+TIFF_STATUS tiff_get_tag_u32_array(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                                   UINT32 *dst, size_t dst_count, size_t *count);
+TIFF_STATUS tiff_get_tag_u64_array(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                                   UINT64 *dst, size_t dst_count, size_t *count);
+TIFF_STATUS tiff_get_tag_double_array(tiff_t *fp, tiff_ifd_t *ifd,
+                                      tiff_tag_id_t tag_id, double *dst,
+                                      size_t dst_count, size_t *count);
+
 /* Get the raw contents of the TIFF tag's offset field. You only need
  * to do this to work around busted tag contents that specify offsets
  * relative to the start of the tag, rather than the start of the file.
@@ -141,6 +415,54 @@ TIFF_STATUS tiff_get_raw_tag_field(tiff_t *fp, tiff_tag_t *tag_info,
 /* Clean up a tiff_tag_t */
 TIFF_STATUS tiff_free_tag_info(tiff_t *fp, tiff_tag_t *tag_info);
 
+/*******************************************************************/
+/* Writing                                                         */
+/*******************************************************************/
+/* Create a new TIFF file, in the machine's byte order. Strip and tile
+ * data is streamed to the file as it is written; tags are held in
+ * memory and all IFDs are written when the writer is closed.
+ */
+TIFF_STATUS tiff_create(tiff_writer_t **writer, const char *file);
+
+/* Set a tag of the IFD being built, replacing any earlier value. data
+ * holds count values of the given TIFF_TYPE_*, in native byte order.
+ * Strip and tile offsets and byte counts are filled in by the writer.
+ */
+TIFF_STATUS tiff_set_tag(tiff_writer_t *writer, tiff_tag_id_t tag_id, int type,
+                         size_t count, const void *data);
+
+/* Write strip or tile number index of the IFD being built, exactly as it
+ * should be stored. Chunks may come in any order, but every one up to the
+ * highest index must be written, and none may be empty (TIFF_RANGE_ERROR).
+ * If a TileWidth tag is set they are recorded as tiles, otherwise as
+ * strips.
+ */
+TIFF_STATUS tiff_write_chunk(tiff_writer_t *writer, size_t index,
+                             const void *data, size_t len);
+
+/* Finish the IFD being built; the next tag or chunk starts a new one */
+TIFF_STATUS tiff_finish_ifd(tiff_writer_t *writer);
+
+/* Finish any open IFD, write out all IFDs and close the file. The file
+ * is closed even if this fails, for instance because the open IFD has
+ * chunks but no tags.
+ */
+TIFF_STATUS tiff_writer_close(tiff_writer_t *writer);
+
+/* Change the value of an existing tag in a file opened for update (mode
+ * "r+b"), without rewriting the file. data holds count values of the
+ * given type in native byte order. The value is written over the old
+ * one if it fits, otherwise it is appended to the file and the entry is
+ * pointed at it; under TIFF_SYNC_ORDERED it is always appended, so that
+ * a crash can't leave it half written. The IFD is updated to match, and
+ * chunks cached for the file are dropped.
+ */
+TIFF_STATUS tiff_patch_tag(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                           int type, size_t count, const void *data);
+
+/* Set when patches are synced to disk, one of TIFF_SYNC_* */
+TIFF_STATUS tiff_set_sync_policy(tiff_t *fp, int policy);
+
 /*******************************************************************/
 /* Helper Functions for dealing with Imagery                       */
 /*******************************************************************/
@@ -172,6 +494,236 @@ TIFF_STATUS tiff_get_image_structure(tiff_t *fp, tiff_ifd_t *ifd,
                                      int *tile_width, int *tile_height,
                                      unsigned *compression);
 
+/* Get the location of a strip or tile in the file. Chunks are indexed
+ * left-to-right, top-to-bottom, one plane after another. This loads
+ * the chunk offset tables the first time it is called for an IFD.
+ */
+TIFF_STATUS tiff_get_chunk_info(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                                tiff_off_t *offset, size_t *length);
+
+/* Read the raw (still compressed/packed) contents of a strip or tile.
+ * buf must be at least as large as the chunk.
+ */
+TIFF_STATUS tiff_read_chunk(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                            void *buf, size_t buf_len, size_t *count);
+
+/* Read an uncompressed strip or tile, expanding each sample (of up to 16
+ * bits) into a UINT16. The chunk is read and unpacked in small blocks
+ * so the data is expanded while it is still in cache. Returns the
+ * number of samples written in *samples.
+ */
+TIFF_STATUS tiff_read_chunk_samples(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                                    int bit_order, UINT16 *dst,
+                                    size_t dst_count, size_t *samples);
+
+/* Read a rectangle of an uncompressed image into dst, in the requested
+ * layout (one of TIFF_LAYOUT_*), whatever the PlanarConfiguration of the
+ * file. Samples are returned in native byte order: one byte for 8-bit
+ * images, two for 9 to 16-bit images (packed samples are unpacked) and
+ * four for 32-bit images. Planar output stores each full plane of
+ * width * height samples one after another.
+ */
+TIFF_STATUS tiff_read_region(tiff_t *fp, tiff_ifd_t *ifd,
+                             unsigned x, unsigned y,
+                             unsigned width, unsigned height,
+                             int layout, void *dst, size_t dst_len);
+
+/* Read the whole image. See tiff_read_region. */
+TIFF_STATUS tiff_read_image(tiff_t *fp, tiff_ifd_t *ifd, int layout,
+                            void *dst, size_t dst_len);
+
+/* Get the size of the image tiff_read_scaled will produce for the given
+ * reduction factor and filter, or TIFF_UNSUPPORTED if it can't. samples
+ * is 3 for CFA binning.
+ */
+TIFF_STATUS tiff_get_scaled_size(tiff_t *fp, tiff_ifd_t *ifd, unsigned factor,
+                                 int mode, unsigned *width, unsigned *height,
+                                 unsigned *samples);
+
+/* Read an uncompressed image reduced by factor (usually 2, 4 or 8) in
+ * each direction, as chunky samples of the same size tiff_read_region
+ * would return. TIFF_SCALE_SUBSAMPLE and TIFF_SCALE_BOX cover partial
+ * blocks at the right and bottom edges. TIFF_SCALE_CFA needs a 2x2
+ * Bayer image and an even factor, and drops partial blocks. The BOX and
+ * CFA filters only take unsigned integer samples; other SampleFormats
+ * give TIFF_UNSUPPORTED. Only a few rows of the source image are held in
+ * memory at any time.
+ */
+TIFF_STATUS tiff_read_scaled(tiff_t *fp, tiff_ifd_t *ifd, unsigned factor,
+                             int mode, void *dst, size_t dst_len);
+
+/* Expand count tightly packed samples of the given bit depth (1-16) to
+ * one UINT16 per sample. Uses SIMD kernels where the build allows it.
+ */
+TIFF_STATUS tiff_unpack_samples(const void *src, int bits, int bit_order,
+                                size_t count, UINT16 *dst);
+
+/* Find the best embedded JPEG preview or thumbnail: the smallest one
+ * that is at least min_width x min_height, or the largest one if none
+ * is big enough. Looks at JPEGInterchangeFormat streams and JPEG
+ * compressed reduced-resolution images in IFD0, its SubIFDs and the
+ * rest of the IFD chain, without reading any raw image data. Returns the
+ * location of the JPEG stream in the file (see tiff_map to get at it
+ * without copying), or TIFF_TAG_NOT_FOUND if there is no preview.
+ */
+TIFF_STATUS tiff_find_best_preview(tiff_t *fp, unsigned min_width,
+                                   unsigned min_height,
+                                   tiff_off_t *offset, size_t *length);
+
+/*******************************************************************/
+/* Resolution levels                                               */
+/*******************************************************************/
+/* All images reachable through the IFD chain and SubIFDs, found in one
+ * walk on first use and kept until the file is closed, or tiff_refresh
+ * finds more IFDs.
+ */
+TIFF_STATUS tiff_get_level_count(tiff_t *fp, size_t *count);
+
+/* Describe the image at index in the level table */
+TIFF_STATUS tiff_get_level_info(tiff_t *fp, size_t index, tiff_level_info_t *info);
+
+/* Read the IFD of the smallest image that is at least target_width by
+ * target_height, or of the largest image if none is. Masks and raw
+ * sensor data are never chosen. The IFD is freed with tiff_free_ifd.
+ */
+TIFF_STATUS tiff_select_level(tiff_t *fp, unsigned target_width,
+                              unsigned target_height, tiff_ifd_t **ifd);
+
+/*******************************************************************/
+/* Decoded chunk cache                                             */
+/*******************************************************************/
+/* Create a cache holding up to max_bytes of decoded strips and tiles.
+ * A cache is thread safe, and can be shared by many open files.
+ */
+TIFF_STATUS tiff_cache_create(tiff_cache_t **cache, size_t max_bytes);
+
+/* Free a cache. No file may still be using it. */
+TIFF_STATUS tiff_cache_destroy(tiff_cache_t *cache);
+
+/* Use the given cache for chunks decoded from fp by the region, image,
+ * scanline and scaled reads. Pass NULL to stop using a cache.
+ */
+TIFF_STATUS tiff_set_cache(tiff_t *fp, tiff_cache_t *cache);
+
+/* Get the hit, miss and eviction counters of a cache */
+TIFF_STATUS tiff_cache_get_stats(tiff_cache_t *cache, tiff_cache_stats_t *stats);
+
+/*******************************************************************/
+/* Scanline access                                                 */
+/*******************************************************************/
+/* Stream the decoded rows of an uncompressed image, top to bottom, with
+ * memory use bounded by a couple of strips (or rows of tiles) no matter
+ * how big the image is. Rows are chunky, with samples laid out as for
+ * tiff_read_region. The IFD must outlive the cursor.
+ */
+TIFF_STATUS tiff_scanline_open(tiff_t *fp, tiff_ifd_t *ifd,
+                               tiff_scanline_t **cursor);
+
+/* Get the next row. *row is set to NULL once all rows have been read.
+ * A row stays valid until the cursor has moved a full strip (or row of
+ * tiles) past it, so the previous row is always still available.
+ */
+TIFF_STATUS tiff_scanline_next(tiff_scanline_t *cursor, const void **row);
+
+/* Get the size of each row handed out by the cursor, in bytes */
+TIFF_STATUS tiff_scanline_get_row_bytes(tiff_scanline_t *cursor, size_t *bytes);
+
+/* Free the cursor and its buffers */
+TIFF_STATUS tiff_scanline_close(tiff_scanline_t *cursor);
+
+/* Accumulate statistics for every row the cursor decodes from now on.
+ * stats needs at least as many channels as the image has samples per
+ * pixel. Pass NULL to stop.
+ */
+TIFF_STATUS tiff_scanline_set_stats(tiff_scanline_t *cursor, tiff_stats_t *stats);
+
+/*******************************************************************/
+/* Image statistics                                                */
+/*******************************************************************/
+/* Create an accumulator for per-channel minimum, maximum, mean and a
+ * histogram of samples of the given bit depth. Histograms have one bin
+ * per value for up to 16 bits; deeper samples are binned by their top
+ * 16 bits.
+ */
+TIFF_STATUS tiff_stats_create(tiff_stats_t **stats, unsigned channels,
+                              unsigned bits);
+
+/* Clear all counts */
+TIFF_STATUS tiff_stats_reset(tiff_stats_t *stats);
+
+/* Free an accumulator */
+TIFF_STATUS tiff_stats_free(tiff_stats_t *stats);
+
+/* Add pixels chunky pixels of channels samples each, of sample_size
+ * bytes in native byte order, to channels first_channel onwards.
+ */
+TIFF_STATUS tiff_stats_accumulate(tiff_stats_t *stats, const void *src,
+                                  size_t sample_size, unsigned first_channel,
+                                  unsigned channels, size_t pixels);
+
+/* Add the counts in src to dst. Both must have the same shape. */
+TIFF_STATUS tiff_stats_merge(tiff_stats_t *dst, const tiff_stats_t *src);
+
+/* Decode a strip or tile and add its samples to stats. Each worker in a
+ * parallel scan can keep its own accumulator and merge them at the end.
+ */
+TIFF_STATUS tiff_read_chunk_stats(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                                  tiff_stats_t *stats);
+
+/* Get the results for one channel. Any output may be NULL. */
+TIFF_STATUS tiff_stats_get_channel(tiff_stats_t *stats, unsigned channel,
+                                   UINT64 *count, UINT64 *min, UINT64 *max,
+                                   double *mean);
+
+/* Get the histogram of one channel; it belongs to stats */
+TIFF_STATUS tiff_stats_get_histogram(tiff_stats_t *stats, unsigned channel,
+                                     const UINT64 **hist, size_t *bins);
+
+/*******************************************************************/
+/* Image data hashing                                              */
+/*******************************************************************/
+/* Hash the strips or tiles of an image, ignoring the tags, so images
+ * that differ only in their metadata hash the same. Chunks are read in
+ * file order in large blocks and hashed by a pool of threads, started
+ * once per call. Each chunk gets its own digest of its raw bytes, and the
+ * image digest is the root of a binary hash tree over the chunk digests,
+ * in chunk index order, with leaves and nodes hashed under different
+ * prefixes. algo is one of TIFF_HASH_*.
+ */
+TIFF_STATUS tiff_hash_image_data(tiff_t *fp, tiff_ifd_t *ifd, int algo,
+                                 tiff_image_digest_t **digest);
+
+/* Get the results. chunks has chunk_count entries and belongs to digest.
+ * Any output may be NULL.
+ */
+TIFF_STATUS tiff_image_digest_get(tiff_image_digest_t *digest, UINT64 *image,
+                                  const UINT64 **chunks, size_t *chunk_count);
+
+/* Free a digest */
+TIFF_STATUS tiff_image_digest_free(tiff_image_digest_t *digest);
+
+/*******************************************************************/
+/* Sample layout conversion kernels                                */
+/*******************************************************************/
+/* These work on samples of 1, 2 or 4 bytes (sample_size), and use SIMD
+ * shuffles where the build allows it.
+ */
+
+/* Copy channel number channel out of count chunky pixels */
+TIFF_STATUS tiff_extract_channel(const void *src, unsigned channels,
+                                 unsigned channel, size_t sample_size,
+                                 size_t count, void *dst);
+
+/* Split count chunky pixels into one plane per channel */
+TIFF_STATUS tiff_chunky_to_planar(const void *src, unsigned channels,
+                                  size_t sample_size, size_t count,
+                                  void **planes);
+
+/* Interleave count samples from each plane into chunky pixels */
+TIFF_STATUS tiff_planar_to_chunky(void **planes, unsigned channels,
+                                  size_t sample_size, size_t count,
+                                  void *dst);
+
 /*******************************************************************/
 /* Helper Functions                                                */
 /*******************************************************************/
@@ -179,5 +731,9 @@ TIFF_STATUS tiff_get_image_structure(tiff_t *fp, tiff_ifd_t *ifd,
 /* Get the size of a single item of a given type */
 size_t tiff_get_type_size(int type);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __INCLUDE_GHETTO_H__ */
 
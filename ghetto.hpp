@@ -0,0 +1,787 @@
+/*
+ * C++ binding for libghetto. Header only, needs C++17; C++20's std::span
+ * is used when the library provides it. Handles are move-only and free
+ * what they own, errors are thrown as ghetto::error carrying the
+ * TIFF_STATUS, and tag descriptors carry the tag ID and the C++ type of
+ * its value so a lookup is resolved at compile time.
+ */
+#ifndef __INCLUDE_GHETTO_HPP__
+#define __INCLUDE_GHETTO_HPP__
+
+#include <ghetto.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+namespace ghetto {
+
+/*******************************************************************/
+/* Errors                                                          */
+/*******************************************************************/
+
+class error : public std::runtime_error {
+public:
+    explicit error(TIFF_STATUS status)
+        : std::runtime_error(describe(status)), status_(status) {}
+
+    TIFF_STATUS status() const noexcept { return status_; }
+
+    static const char *describe(TIFF_STATUS status) noexcept
+    {
+        switch (status) {
+        case TIFF_OK:               return "no error";
+        case TIFF_NOT_TIFF:         return "not a TIFF image";
+        case TIFF_NOT_OPEN:         return "file is not open";
+        case TIFF_RANGE_ERROR:      return "value out of range";
+        case TIFF_BAD_ARGUMENT:     return "bad argument";
+        case TIFF_TAG_NOT_FOUND:    return "tag not found";
+        case TIFF_FILE_NOT_FOUND:   return "file not found";
+        case TIFF_END_OF_FILE:      return "unexpected end of file";
+        case TIFF_NO_MEMORY:        return "out of memory";
+        case TIFF_UNKNOWN_TYPE:     return "unknown or mismatched data type";
+        case TIFF_IFD_NOT_IMAGE:    return "IFD is not an image";
+        case TIFF_TAG_MALFORMED:    return "malformed tag";
+        case TIFF_UNSUPPORTED:      return "unsupported feature";
+        case TIFF_LIMIT_IFDS:       return "too many IFDs";
+        case TIFF_LIMIT_TAGS:       return "too many tags in IFD";
+        case TIFF_LIMIT_PAYLOAD:    return "tag payload too large";
+        case TIFF_LIMIT_READ:       return "read budget exhausted";
+        case TIFF_LIMIT_DEPTH:      return "IFD chain too deep";
+        case TIFF_IFD_LOOP:         return "IFD chain loops";
+        default:                    return "unknown libghetto error";
+        }
+    }
+
+private:
+    TIFF_STATUS status_;
+};
+
+namespace detail {
+
+inline void check(TIFF_STATUS status)
+{
+    if (status != TIFF_OK) {
+        throw error(status);
+    }
+}
+
+} /* namespace detail */
+
+/*******************************************************************/
+/* Spans                                                           */
+/*******************************************************************/
+
+#if defined(__cpp_lib_span)
+template <class T>
+using span = std::span<T>;
+#else
+/* Just enough of std::span for C++17 */
+template <class T>
+class span {
+public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+    using pointer = T *;
+    using reference = T &;
+    using iterator = T *;
+
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> &other) noexcept
+        : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    constexpr T &front() const noexcept { return data_[0]; }
+    constexpr T &back() const noexcept { return data_[size_ - 1]; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+
+    constexpr span subspan(std::size_t offset,
+                           std::size_t count = std::size_t(-1)) const noexcept
+    {
+        return span(data_ + offset, count == std::size_t(-1) ? size_ - offset : count);
+    }
+
+private:
+    T *data_;
+    std::size_t size_;
+};
+#endif
+
+/*******************************************************************/
+/* Tag value types                                                 */
+/*******************************************************************/
+
+struct rational {
+    std::uint32_t numerator;
+    std::uint32_t denominator;
+};
+
+struct srational {
+    std::int32_t numerator;
+    std::int32_t denominator;
+};
+
+/* The TIFF_TYPE_* a C++ type can be viewed as, without conversion */
+template <class T>
+struct tiff_type;
+
+template <> struct tiff_type<std::uint8_t> {
+    static constexpr bool matches(int t) noexcept
+    { return t == TIFF_TYPE_BYTE || t == TIFF_TYPE_UNDEFINED; }
+};
+template <> struct tiff_type<char> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_ASCII; }
+};
+template <> struct tiff_type<std::int8_t> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_SBYTE; }
+};
+template <> struct tiff_type<std::uint16_t> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_SHORT; }
+};
+template <> struct tiff_type<std::int16_t> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_SSHORT; }
+};
+template <> struct tiff_type<std::uint32_t> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_LONG; }
+};
+template <> struct tiff_type<std::int32_t> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_SLONG; }
+};
+template <> struct tiff_type<rational> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_RATIONAL; }
+};
+template <> struct tiff_type<srational> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_SRATIONAL; }
+};
+template <> struct tiff_type<float> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_FLOAT; }
+};
+template <> struct tiff_type<double> {
+    static constexpr bool matches(int t) noexcept { return t == TIFF_TYPE_DOUBLE; }
+};
+
+/* The values of a tag, in native byte order. This is a view straight
+ * into the mapped file when the backend can map it and the file's byte
+ * order matches the machine's, and a private copy otherwise.
+ */
+template <class T>
+class tag_data {
+public:
+    tag_data() noexcept : fp_(nullptr), view_(nullptr), len_(0) {}
+
+    tag_data(tag_data &&other) noexcept
+        : fp_(other.fp_), view_(other.view_), len_(other.len_),
+          copy_(std::move(other.copy_)), values_(other.values_)
+    {
+        other.fp_ = nullptr;
+        other.view_ = nullptr;
+        other.values_ = span<const T>();
+    }
+
+    tag_data &operator=(tag_data &&other) noexcept
+    {
+        if (this != &other) {
+            release();
+            fp_ = other.fp_;
+            view_ = other.view_;
+            len_ = other.len_;
+            copy_ = std::move(other.copy_);
+            values_ = other.values_;
+            other.fp_ = nullptr;
+            other.view_ = nullptr;
+            other.values_ = span<const T>();
+        }
+        return *this;
+    }
+
+    tag_data(const tag_data &) = delete;
+    tag_data &operator=(const tag_data &) = delete;
+
+    ~tag_data() { release(); }
+
+    /* True if the values are read straight out of the mapped file */
+    bool mapped() const noexcept { return view_ != nullptr; }
+
+    span<const T> view() const noexcept { return values_; }
+    operator span<const T>() const noexcept { return values_; }
+
+    const T *data() const noexcept { return values_.data(); }
+    std::size_t size() const noexcept { return values_.size(); }
+    bool empty() const noexcept { return values_.empty(); }
+    const T &operator[](std::size_t i) const noexcept { return values_[i]; }
+    const T *begin() const noexcept { return values_.data(); }
+    const T *end() const noexcept { return values_.data() + values_.size(); }
+
+private:
+    friend class tag_ref;
+
+    void release() noexcept
+    {
+        if (view_ != nullptr) {
+            tiff_unmap(fp_, view_, len_);
+            view_ = nullptr;
+        }
+    }
+
+    tiff_t *fp_;
+    const void *view_;
+    std::size_t len_;
+    std::vector<T> copy_;
+    span<const T> values_;
+};
+
+/*******************************************************************/
+/* Tag descriptors                                                 */
+/*******************************************************************/
+
+/* A tag ID and the type its value is read as. value_type picks the
+ * accessor at compile time:
+ * - std::uint32_t, std::uint64_t, double: the first value, converted
+ *   from whatever numeric type the file uses
+ * - std::vector of one of those: all values, converted
+ * - std::string: an ASCII tag
+ * - tag_data<T>: all values, which must be stored as exactly T
+ */
+template <tiff_tag_id_t Id, class T>
+struct tag_descriptor {
+    using value_type = T;
+    static constexpr tiff_tag_id_t id = Id;
+};
+
+namespace tags {
+
+inline constexpr tag_descriptor<254, std::uint32_t> new_subfile_type{};
+inline constexpr tag_descriptor<256, std::uint32_t> image_width{};
+inline constexpr tag_descriptor<257, std::uint32_t> image_length{};
+inline constexpr tag_descriptor<258, std::vector<std::uint32_t>> bits_per_sample{};
+inline constexpr tag_descriptor<259, std::uint32_t> compression{};
+inline constexpr tag_descriptor<262, std::uint32_t> photometric{};
+inline constexpr tag_descriptor<270, std::string> image_description{};
+inline constexpr tag_descriptor<271, std::string> make{};
+inline constexpr tag_descriptor<272, std::string> model{};
+inline constexpr tag_descriptor<273, std::vector<std::uint64_t>> strip_offsets{};
+inline constexpr tag_descriptor<274, std::uint32_t> orientation{};
+inline constexpr tag_descriptor<277, std::uint32_t> samples_per_pixel{};
+inline constexpr tag_descriptor<278, std::uint32_t> rows_per_strip{};
+inline constexpr tag_descriptor<279, std::vector<std::uint64_t>> strip_byte_counts{};
+inline constexpr tag_descriptor<282, double> x_resolution{};
+inline constexpr tag_descriptor<283, double> y_resolution{};
+inline constexpr tag_descriptor<284, std::uint32_t> planar_config{};
+inline constexpr tag_descriptor<296, std::uint32_t> resolution_unit{};
+inline constexpr tag_descriptor<305, std::string> software{};
+inline constexpr tag_descriptor<306, std::string> date_time{};
+inline constexpr tag_descriptor<322, std::uint32_t> tile_width{};
+inline constexpr tag_descriptor<323, std::uint32_t> tile_length{};
+inline constexpr tag_descriptor<324, std::vector<std::uint64_t>> tile_offsets{};
+inline constexpr tag_descriptor<325, std::vector<std::uint64_t>> tile_byte_counts{};
+inline constexpr tag_descriptor<330, std::vector<std::uint64_t>> sub_ifds{};
+inline constexpr tag_descriptor<339, std::vector<std::uint32_t>> sample_format{};
+inline constexpr tag_descriptor<513, std::uint64_t> jpeg_interchange_format{};
+inline constexpr tag_descriptor<514, std::uint64_t> jpeg_interchange_format_length{};
+inline constexpr tag_descriptor<33422, tag_data<std::uint8_t>> cfa_pattern{};
+inline constexpr tag_descriptor<34665, std::uint64_t> exif_ifd{};
+
+} /* namespace tags */
+
+/*******************************************************************/
+/* Tags                                                            */
+/*******************************************************************/
+
+/* A tag of an IFD. Only valid while the ghetto::ifd it came from is. */
+class tag_ref {
+public:
+    /* Throws if the tag's data doesn't fit in the file, or is over the
+     * payload limit.
+     */
+    tag_ref(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag)
+        : fp_(fp), ifd_(ifd), tag_(tag)
+    {
+        detail::check(tiff_get_tag_info(fp_, tag_, &id_, &type_, &count_));
+    }
+
+    tiff_tag_id_t id() const noexcept { return static_cast<tiff_tag_id_t>(id_); }
+    int type() const noexcept { return type_; }
+    std::size_t count() const noexcept { return static_cast<std::size_t>(count_); }
+    tiff_tag_t *get() const noexcept { return tag_; }
+
+    /* The values, viewed as T. Throws TIFF_UNKNOWN_TYPE if the tag isn't
+     * stored as T.
+     */
+    template <class T>
+    tag_data<T> data() const
+    {
+        tag_data<T> out;
+        const void *view = nullptr;
+        std::size_t len = 0;
+
+        if (!tiff_type<T>::matches(type_)) {
+            throw error(TIFF_UNKNOWN_TYPE);
+        }
+
+        if (count_ == 0) {
+            return out;
+        }
+
+        if (tiff_map_tag_data(fp_, ifd_, tag_, &view, &len) == TIFF_OK) {
+            if (reinterpret_cast<std::uintptr_t>(view) % alignof(T) == 0) {
+                out.fp_ = fp_;
+                out.view_ = view;
+                out.len_ = len;
+                out.values_ = span<const T>(static_cast<const T *>(view), count());
+                return out;
+            }
+
+            tiff_unmap(fp_, view, len);
+        }
+
+        out.copy_.resize(count());
+        detail::check(tiff_get_tag_data(fp_, ifd_, tag_, out.copy_.data()));
+        out.values_ = span<const T>(out.copy_.data(), out.copy_.size());
+
+        return out;
+    }
+
+    /* An ASCII tag's value, up to the first NUL */
+    std::string string() const
+    {
+        if (type_ != TIFF_TYPE_ASCII) {
+            throw error(TIFF_UNKNOWN_TYPE);
+        }
+
+        tag_data<char> chars = data<char>();
+        const char *begin = chars.begin(), *end = chars.end();
+        const void *nul = std::memchr(begin, '\0', chars.size());
+
+        return std::string(begin, nul ? static_cast<const char *>(nul) : end);
+    }
+
+private:
+    tiff_t *fp_;
+    tiff_ifd_t *ifd_;
+    tiff_tag_t *tag_;
+    int id_ = 0;
+    int type_ = 0;
+    int count_ = 0;
+};
+
+/* All tags of an IFD, in file order */
+class tag_range {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = tag_ref;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = tag_ref;
+
+        iterator() noexcept : fp_(nullptr), ifd_(nullptr), index_(0) {}
+        iterator(tiff_t *fp, tiff_ifd_t *ifd, std::size_t index) noexcept
+            : fp_(fp), ifd_(ifd), index_(index) {}
+
+        tag_ref operator*() const
+        {
+            tiff_tag_t *tag = nullptr;
+            detail::check(tiff_get_tag_indexed(fp_, ifd_, index_, &tag));
+            return tag_ref(fp_, ifd_, tag);
+        }
+
+        iterator &operator++() noexcept { ++index_; return *this; }
+        iterator operator++(int) noexcept { iterator it = *this; ++index_; return it; }
+
+        bool operator==(const iterator &o) const noexcept { return index_ == o.index_; }
+        bool operator!=(const iterator &o) const noexcept { return index_ != o.index_; }
+
+    private:
+        tiff_t *fp_;
+        tiff_ifd_t *ifd_;
+        std::size_t index_;
+    };
+
+    tag_range(tiff_t *fp, tiff_ifd_t *ifd) : fp_(fp), ifd_(ifd), count_(0)
+    {
+        detail::check(tiff_get_ifd_tag_count(fp_, ifd_, &count_));
+    }
+
+    iterator begin() const noexcept { return iterator(fp_, ifd_, 0); }
+    iterator end() const noexcept { return iterator(fp_, ifd_, count_); }
+    std::size_t size() const noexcept { return count_; }
+
+private:
+    tiff_t *fp_;
+    tiff_ifd_t *ifd_;
+    std::size_t count_;
+};
+
+/*******************************************************************/
+/* IFDs                                                            */
+/*******************************************************************/
+
+class ifd {
+public:
+    ifd() noexcept : fp_(nullptr), ifd_(nullptr) {}
+
+    /* Take ownership of an IFD read from fp */
+    ifd(tiff_t *fp, tiff_ifd_t *ifd) noexcept : fp_(fp), ifd_(ifd) {}
+
+    ifd(ifd &&other) noexcept : fp_(other.fp_), ifd_(other.ifd_)
+    {
+        other.ifd_ = nullptr;
+    }
+
+    ifd &operator=(ifd &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            fp_ = other.fp_;
+            ifd_ = other.ifd_;
+            other.ifd_ = nullptr;
+        }
+        return *this;
+    }
+
+    ifd(const ifd &) = delete;
+    ifd &operator=(const ifd &) = delete;
+
+    ~ifd() { reset(); }
+
+    void reset() noexcept
+    {
+        if (ifd_ != nullptr) {
+            tiff_free_ifd(fp_, ifd_);
+            ifd_ = nullptr;
+        }
+    }
+
+    /* Give up ownership of the C handle */
+    tiff_ifd_t *release() noexcept
+    {
+        tiff_ifd_t *p = ifd_;
+        ifd_ = nullptr;
+        return p;
+    }
+
+    tiff_ifd_t *get() const noexcept { return ifd_; }
+    explicit operator bool() const noexcept { return ifd_ != nullptr; }
+
+    tiff_off_t next_offset() const
+    {
+        tiff_off_t off = 0;
+        detail::check(tiff_get_next_ifd_offset(fp_, ifd_, &off));
+        return off;
+    }
+
+    tag_range tags() const { return tag_range(fp_, ifd_); }
+
+    /* Find a tag by ID */
+    std::optional<tag_ref> find(tiff_tag_id_t id) const
+    {
+        tiff_tag_t *tag = nullptr;
+        TIFF_STATUS ret = tiff_get_tag(fp_, ifd_, id, &tag);
+
+        if (ret == TIFF_TAG_NOT_FOUND) {
+            return std::nullopt;
+        }
+
+        detail::check(ret);
+
+        return tag_ref(fp_, ifd_, tag);
+    }
+
+    /* Read a tag through its descriptor. Throws TIFF_TAG_NOT_FOUND if the
+     * IFD doesn't have it.
+     */
+    template <tiff_tag_id_t Id, class T>
+    T get(tag_descriptor<Id, T>) const
+    {
+        return read<T>(Id);
+    }
+
+    /* As get, but returns nothing if the tag isn't there */
+    template <tiff_tag_id_t Id, class T>
+    std::optional<T> get_if(tag_descriptor<Id, T>) const
+    {
+        tiff_tag_t *tag = nullptr;
+        TIFF_STATUS ret = tiff_get_tag(fp_, ifd_, Id, &tag);
+
+        if (ret == TIFF_TAG_NOT_FOUND) {
+            return std::nullopt;
+        }
+
+        detail::check(ret);
+
+        return read<T>(Id);
+    }
+
+private:
+    template <class T>
+    struct is_tag_data : std::false_type {};
+    template <class T>
+    struct is_tag_data<tag_data<T>> : std::true_type { using element = T; };
+
+    template <class T>
+    T read(tiff_tag_id_t id) const
+    {
+        T value{};
+
+        if constexpr (std::is_same_v<T, std::uint32_t>) {
+            static_assert(sizeof(UINT32) == sizeof(std::uint32_t));
+            detail::check(tiff_get_tag_u32(fp_, ifd_, id,
+                reinterpret_cast<UINT32 *>(&value)));
+        } else if constexpr (std::is_same_v<T, std::uint64_t>) {
+            static_assert(sizeof(UINT64) == sizeof(std::uint64_t));
+            detail::check(tiff_get_tag_u64(fp_, ifd_, id,
+                reinterpret_cast<UINT64 *>(&value)));
+        } else if constexpr (std::is_same_v<T, double>) {
+            detail::check(tiff_get_tag_double(fp_, ifd_, id, &value));
+        } else if constexpr (std::is_same_v<T, std::vector<std::uint32_t>>) {
+            std::size_t n = 0;
+            value.resize(count(id));
+            detail::check(tiff_get_tag_u32_array(fp_, ifd_, id,
+                reinterpret_cast<UINT32 *>(value.data()), value.size(), &n));
+            value.resize(n);
+        } else if constexpr (std::is_same_v<T, std::vector<std::uint64_t>>) {
+            std::size_t n = 0;
+            value.resize(count(id));
+            detail::check(tiff_get_tag_u64_array(fp_, ifd_, id,
+                reinterpret_cast<UINT64 *>(value.data()), value.size(), &n));
+            value.resize(n);
+        } else if constexpr (std::is_same_v<T, std::vector<double>>) {
+            std::size_t n = 0;
+            value.resize(count(id));
+            detail::check(tiff_get_tag_double_array(fp_, ifd_, id, value.data(),
+                value.size(), &n));
+            value.resize(n);
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            value = lookup(id).string();
+        } else if constexpr (is_tag_data<T>::value) {
+            value = lookup(id).template data<typename is_tag_data<T>::element>();
+        } else {
+            static_assert(sizeof(T) == 0, "unsupported tag value type");
+        }
+
+        return value;
+    }
+
+    tag_ref lookup(tiff_tag_id_t id) const
+    {
+        tiff_tag_t *tag = nullptr;
+        detail::check(tiff_get_tag(fp_, ifd_, id, &tag));
+        return tag_ref(fp_, ifd_, tag);
+    }
+
+    std::size_t count(tiff_tag_id_t id) const { return lookup(id).count(); }
+
+    tiff_t *fp_;
+    tiff_ifd_t *ifd_;
+};
+
+/* The chain of IFDs starting at an offset, read one at a time. Stops at
+ * a zero next-IFD offset, or at an offset already visited. A chain longer
+ * than max_chain_depth throws.
+ */
+class ifd_range {
+public:
+    struct sentinel {};
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = ifd;
+        using difference_type = std::ptrdiff_t;
+        using pointer = ifd *;
+        using reference = ifd &;
+
+        iterator(tiff_t *fp, tiff_off_t off) : fp_(fp), offset_(0), next_(off)
+        {
+            advance();
+        }
+
+        /* The IFD may be moved out; the iterator remembers where the
+         * next one is.
+         */
+        ifd &operator*() noexcept { return cur_; }
+        ifd *operator->() noexcept { return &cur_; }
+
+        /* Where the current IFD was read from */
+        tiff_off_t offset() const noexcept { return offset_; }
+
+        iterator &operator++()
+        {
+            advance();
+            return *this;
+        }
+
+        bool operator==(sentinel) const noexcept { return done_; }
+        bool operator!=(sentinel) const noexcept { return !done_; }
+
+    private:
+        void advance()
+        {
+            tiff_ifd_t *raw = nullptr;
+
+            cur_.reset();
+
+            for (tiff_off_t seen : visited_) {
+                if (seen == next_) {
+                    next_ = 0;
+                    break;
+                }
+            }
+
+            if (next_ == 0) {
+                done_ = true;
+                return;
+            }
+
+            detail::check(tiff_read_ifd(fp_, next_, &raw));
+            cur_ = ifd(fp_, raw);
+            offset_ = next_;
+            visited_.push_back(next_);
+
+            /* The library spots loops too; a loop just ends the range */
+            TIFF_STATUS ret = tiff_next_ifd(fp_, &chain_, raw, &next_);
+            if (ret == TIFF_IFD_LOOP) {
+                next_ = 0;
+            } else {
+                detail::check(ret);
+            }
+        }
+
+        tiff_t *fp_;
+        tiff_off_t offset_;
+        tiff_off_t next_;
+        bool done_ = false;
+        ifd cur_;
+        tiff_ifd_chain_t chain_ = {};
+        std::vector<tiff_off_t> visited_;
+    };
+
+    ifd_range(tiff_t *fp, tiff_off_t first) noexcept : fp_(fp), first_(first) {}
+
+    iterator begin() const { return iterator(fp_, first_); }
+    sentinel end() const noexcept { return sentinel(); }
+
+private:
+    tiff_t *fp_;
+    tiff_off_t first_;
+};
+
+/*******************************************************************/
+/* Files                                                           */
+/*******************************************************************/
+
+class file {
+public:
+    file() noexcept : fp_(nullptr) {}
+
+    explicit file(const char *path, const char *mode = "r") : fp_(nullptr)
+    {
+        detail::check(tiff_open(&fp_, path, mode));
+    }
+
+    explicit file(const std::string &path, const char *mode = "r")
+        : file(path.c_str(), mode) {}
+
+    /* Take ownership of an open C handle */
+    explicit file(tiff_t *fp) noexcept : fp_(fp) {}
+
+    file(file &&other) noexcept : fp_(other.fp_) { other.fp_ = nullptr; }
+
+    file &operator=(file &&other) noexcept
+    {
+        if (this != &other) {
+            close();
+            fp_ = other.fp_;
+            other.fp_ = nullptr;
+        }
+        return *this;
+    }
+
+    file(const file &) = delete;
+    file &operator=(const file &) = delete;
+
+    ~file() { close(); }
+
+    void close() noexcept
+    {
+        if (fp_ != nullptr) {
+            tiff_close(fp_);
+            fp_ = nullptr;
+        }
+    }
+
+    tiff_t *release() noexcept
+    {
+        tiff_t *p = fp_;
+        fp_ = nullptr;
+        return p;
+    }
+
+    /* Point the handle at another file, keeping its buffers. All IFDs
+     * of the old file must be gone.
+     */
+    void reopen(const char *path, const char *mode = "r")
+    {
+        if (fp_ == nullptr) {
+            detail::check(tiff_open(&fp_, path, mode));
+        } else {
+            detail::check(tiff_reopen(fp_, path, mode));
+        }
+    }
+
+    void reopen(const std::string &path, const char *mode = "r")
+    {
+        reopen(path.c_str(), mode);
+    }
+
+    tiff_t *get() const noexcept { return fp_; }
+    explicit operator bool() const noexcept { return fp_ != nullptr; }
+
+    tiff_off_t base_ifd_offset() const
+    {
+        tiff_off_t off = 0;
+        detail::check(tiff_get_base_ifd_offset(fp_, &off));
+        return off;
+    }
+
+    ifd read_ifd(tiff_off_t off) const
+    {
+        tiff_ifd_t *raw = nullptr;
+        detail::check(tiff_read_ifd(fp_, off, &raw));
+        return ifd(fp_, raw);
+    }
+
+    /* The main IFD chain */
+    ifd_range ifds() const { return ifd_range(fp_, base_ifd_offset()); }
+
+    /* The chain starting at off, e.g. a SubIFD */
+    ifd_range ifds(tiff_off_t off) const { return ifd_range(fp_, off); }
+
+private:
+    tiff_t *fp_;
+};
+
+} /* namespace ghetto */
+
+#endif /* __INCLUDE_GHETTO_HPP__ */
@@ -0,0 +1,212 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Memory allocation.
+ *
+ * Everything libghetto allocates goes through a tiff_allocator_t: the
+ * one a file was opened with for anything belonging to that file, and
+ * the global one (as it was when the object was created) for caches,
+ * statistics accumulators and writers. Hooks that are left out fall back
+ * on the ones that are given, so a pool only has to provide alloc and
+ * free.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+static void *tiff_std_alloc(void *ctx, size_t size)
+{
+    (void)ctx;
+
+    return malloc(size);
+}
+
+static void *tiff_std_realloc(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+
+    return realloc(ptr, size);
+}
+
+static void tiff_std_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+
+    free(ptr);
+}
+
+static void *tiff_std_aligned_alloc(void *ctx, size_t alignment, size_t size)
+{
+    void *ptr = NULL;
+
+    (void)ctx;
+
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static const tiff_allocator_t tiff_std_allocator = {
+    .alloc = tiff_std_alloc,
+    .realloc = tiff_std_realloc,
+    .free = tiff_std_free,
+    .aligned_alloc = tiff_std_aligned_alloc,
+    .aligned_free = tiff_std_free,
+    .ctx = NULL,
+};
+
+static tiff_allocator_t tiff_global_allocator = {
+    .alloc = tiff_std_alloc,
+    .realloc = tiff_std_realloc,
+    .free = tiff_std_free,
+    .aligned_alloc = tiff_std_aligned_alloc,
+    .aligned_free = tiff_std_free,
+    .ctx = NULL,
+};
+
+TIFF_STATUS tiff_set_allocator(const tiff_allocator_t *allocator)
+{
+    if (allocator == NULL) {
+        tiff_global_allocator = tiff_std_allocator;
+        return TIFF_OK;
+    }
+
+    if (allocator->alloc == NULL || allocator->free == NULL ||
+        (allocator->aligned_alloc == NULL) != (allocator->aligned_free == NULL))
+    {
+        return TIFF_BAD_ARGUMENT;
+    }
+
+    tiff_global_allocator = *allocator;
+
+    return TIFF_OK;
+}
+
+void tiff_get_allocator(tiff_allocator_t *allocator)
+{
+    *allocator = tiff_global_allocator;
+}
+
+void *tiff_malloc(const tiff_allocator_t *a, size_t size)
+{
+    return a->alloc(a->ctx, size ? size : 1);
+}
+
+void *tiff_calloc(const tiff_allocator_t *a, size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    if ( (ptr = tiff_malloc(a, nmemb * size)) != NULL ) {
+        memset(ptr, 0, nmemb * size);
+    }
+
+    return ptr;
+}
+
+void *tiff_realloc(const tiff_allocator_t *a, void *ptr, size_t old_size,
+                   size_t size)
+{
+    void *new_ptr;
+
+    if (a->realloc != NULL) {
+        return a->realloc(a->ctx, ptr, size ? size : 1);
+    }
+
+    if ( (new_ptr = tiff_malloc(a, size)) == NULL ) {
+        return NULL;
+    }
+
+    if (ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        a->free(a->ctx, ptr);
+    }
+
+    return new_ptr;
+}
+
+void tiff_free(const tiff_allocator_t *a, void *ptr)
+{
+    if (ptr != NULL) {
+        a->free(a->ctx, ptr);
+    }
+}
+
+/* Without an aligned_alloc hook, over-allocate and keep the pointer that
+ * has to be freed just in front of the aligned block.
+ */
+void *tiff_aligned_alloc(const tiff_allocator_t *a, size_t alignment, size_t size)
+{
+    uint8_t *base;
+    uintptr_t addr;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    if (a->aligned_alloc != NULL) {
+        return a->aligned_alloc(a->ctx, alignment, size ? size : 1);
+    }
+
+    if (size > SIZE_MAX - alignment - sizeof(void *)) {
+        return NULL;
+    }
+
+    if ( (base = (uint8_t *)tiff_malloc(a, size + alignment + sizeof(void *))) == NULL ) {
+        return NULL;
+    }
+
+    addr = ((uintptr_t)base + sizeof(void *) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    ((void **)addr)[-1] = base;
+
+    return (void *)addr;
+}
+
+void tiff_aligned_free(const tiff_allocator_t *a, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (a->aligned_free != NULL) {
+        a->aligned_free(a->ctx, ptr);
+    } else {
+        a->free(a->ctx, ((void **)ptr)[-1]);
+    }
+}
+
@@ -0,0 +1,455 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Decoded chunk cache.
+ *
+ * A cache can be shared by any number of open files and threads. Chunks
+ * are keyed by (file identity, IFD offset, chunk index) and spread over
+ * a fixed number of shards by the hash of their key; each shard has its
+ * own lock, hash table, LRU list and share of the memory budget, so
+ * threads working on different chunks rarely contend. Lookups copy the
+ * chunk out while holding the shard lock, so an entry can be evicted at
+ * any time without anyone holding a stale pointer.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TIFF_CACHE_SHARDS           16
+#define TIFF_CACHE_INITIAL_BUCKETS  64
+
+struct tiff_cache_entry {
+    uint64_t file_id;
+    tiff_off_t ifd_offset;
+    size_t index;
+    uint64_t hash;
+    size_t len;
+
+    struct tiff_cache_entry *hash_next;
+    struct tiff_cache_entry *lru_prev;  /* Towards most recently used */
+    struct tiff_cache_entry *lru_next;
+
+    uint8_t data[];
+};
+
+struct tiff_cache_shard {
+    pthread_mutex_t lock;
+
+    struct tiff_cache_entry **buckets;
+    size_t nr_buckets;
+    size_t entries;
+
+    struct tiff_cache_entry *lru_head;  /* Most recently used */
+    struct tiff_cache_entry *lru_tail;
+
+    size_t bytes;
+    size_t max_bytes;
+
+    const tiff_allocator_t *alloc;      /* The cache's */
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+};
+
+struct tiff_cache {
+    size_t max_bytes;
+    tiff_allocator_t alloc;
+    struct tiff_cache_shard shards[TIFF_CACHE_SHARDS];
+};
+
+static uint64_t tiff_cache_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t tiff_cache_hash(uint64_t file_id, tiff_off_t ifd_offset,
+                                size_t index)
+{
+    return tiff_cache_mix(file_id ^ tiff_cache_mix(ifd_offset ^
+        tiff_cache_mix((uint64_t)index)));
+}
+
+static struct tiff_cache_shard *tiff_cache_get_shard(tiff_cache_t *cache,
+                                                     uint64_t hash)
+{
+    return &cache->shards[hash % TIFF_CACHE_SHARDS];
+}
+
+/* Bucket chosen from the hash bits the shard number didn't use */
+static struct tiff_cache_entry **tiff_cache_bucket(struct tiff_cache_shard *shard,
+                                                   uint64_t hash)
+{
+    return &shard->buckets[(hash / TIFF_CACHE_SHARDS) & (shard->nr_buckets - 1)];
+}
+
+static void tiff_cache_lru_unlink(struct tiff_cache_shard *shard,
+                                  struct tiff_cache_entry *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void tiff_cache_lru_push(struct tiff_cache_shard *shard,
+                                struct tiff_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+
+    shard->lru_head = entry;
+}
+
+static struct tiff_cache_entry *tiff_cache_find(struct tiff_cache_shard *shard,
+                                                uint64_t hash, uint64_t file_id,
+                                                tiff_off_t ifd_offset, size_t index)
+{
+    struct tiff_cache_entry *entry;
+
+    for (entry = *tiff_cache_bucket(shard, hash); entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->file_id == file_id &&
+            entry->ifd_offset == ifd_offset && entry->index == index)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Unhook an entry from its bucket and the LRU list, and free it */
+static void tiff_cache_remove(struct tiff_cache_shard *shard,
+                              struct tiff_cache_entry *entry)
+{
+    struct tiff_cache_entry **link = tiff_cache_bucket(shard, entry->hash);
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    tiff_cache_lru_unlink(shard, entry);
+
+    shard->bytes -= entry->len;
+    shard->entries--;
+
+    tiff_free(shard->alloc, entry);
+}
+
+/* Double the bucket array once the chains get long. Failure is harmless */
+static void tiff_cache_grow(struct tiff_cache_shard *shard)
+{
+    struct tiff_cache_entry **old = shard->buckets, *entry, *next;
+    size_t old_nr = shard->nr_buckets, i;
+
+    shard->buckets = (struct tiff_cache_entry **)tiff_calloc(shard->alloc,
+        old_nr * 2, sizeof(struct tiff_cache_entry *));
+
+    if (shard->buckets == NULL) {
+        shard->buckets = old;
+        return;
+    }
+
+    shard->nr_buckets = old_nr * 2;
+
+    for (i = 0; i < old_nr; i++) {
+        for (entry = old[i]; entry; entry = next) {
+            struct tiff_cache_entry **bucket = tiff_cache_bucket(shard, entry->hash);
+            next = entry->hash_next;
+            entry->hash_next = *bucket;
+            *bucket = entry;
+        }
+    }
+
+    tiff_free(shard->alloc, old);
+}
+
+TIFF_STATUS tiff_cache_create(tiff_cache_t **cache, size_t max_bytes)
+{
+    tiff_cache_t *new_cache = NULL;
+    tiff_allocator_t alloc;
+    int i;
+
+    TIFF_ASSERT_ARG(cache);
+
+    *cache = NULL;
+
+    tiff_get_allocator(&alloc);
+
+    new_cache = (tiff_cache_t *)tiff_calloc(&alloc, 1, sizeof(tiff_cache_t));
+    if (new_cache == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    new_cache->max_bytes = max_bytes;
+    new_cache->alloc = alloc;
+
+    for (i = 0; i < TIFF_CACHE_SHARDS; i++) {
+        struct tiff_cache_shard *shard = &new_cache->shards[i];
+
+        shard->max_bytes = max_bytes / TIFF_CACHE_SHARDS;
+        shard->alloc = &new_cache->alloc;
+        shard->nr_buckets = TIFF_CACHE_INITIAL_BUCKETS;
+        shard->buckets = (struct tiff_cache_entry **)tiff_calloc(&alloc,
+            shard->nr_buckets, sizeof(struct tiff_cache_entry *));
+
+        if (shard->buckets == NULL) {
+            goto fail;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    *cache = new_cache;
+
+    return TIFF_OK;
+
+fail:
+    while (i-- > 0) {
+        pthread_mutex_destroy(&new_cache->shards[i].lock);
+        tiff_free(&alloc, new_cache->shards[i].buckets);
+    }
+    tiff_free(&alloc, new_cache);
+    return TIFF_NO_MEMORY;
+}
+
+TIFF_STATUS tiff_cache_destroy(tiff_cache_t *cache)
+{
+    tiff_allocator_t alloc;
+    int i;
+
+    TIFF_ASSERT_ARG(cache);
+
+    alloc = cache->alloc;
+
+    for (i = 0; i < TIFF_CACHE_SHARDS; i++) {
+        struct tiff_cache_shard *shard = &cache->shards[i];
+        struct tiff_cache_entry *entry, *next;
+
+        for (entry = shard->lru_head; entry; entry = next) {
+            next = entry->lru_next;
+            tiff_free(&alloc, entry);
+        }
+
+        tiff_free(&alloc, shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    memset(cache, 0, sizeof(tiff_cache_t));
+    tiff_free(&alloc, cache);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_cache_get_stats(tiff_cache_t *cache, tiff_cache_stats_t *stats)
+{
+    int i;
+
+    TIFF_ASSERT_ARG(cache);
+    TIFF_ASSERT_ARG(stats);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = cache->max_bytes;
+
+    for (i = 0; i < TIFF_CACHE_SHARDS; i++) {
+        struct tiff_cache_shard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->evictions += shard->evictions;
+        stats->bytes += shard->bytes;
+        stats->entries += shard->entries;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_set_cache(tiff_t *fp, tiff_cache_t *cache)
+{
+    uint64_t id = 0;
+
+    TIFF_ASSERT_ARG(fp);
+
+    if (cache != NULL) {
+        /* Prefer an identity from the backend, which survives reopening
+         * the file under another name; fall back on the name it was
+         * opened with.
+         */
+        if (fp->fp == NULL || fp->mgr->identify == NULL ||
+            fp->mgr->identify(fp->fp, &id) != TIFF_OK)
+        {
+            id = fp->name_hash;
+        }
+        fp->file_id = id;
+    }
+
+    fp->cache = cache;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_cache_lookup(tiff_cache_t *cache, uint64_t file_id,
+                              tiff_off_t ifd_offset, size_t index,
+                              void *dst, size_t len)
+{
+    uint64_t hash = tiff_cache_hash(file_id, ifd_offset, index);
+    struct tiff_cache_shard *shard = tiff_cache_get_shard(cache, hash);
+    struct tiff_cache_entry *entry;
+    TIFF_STATUS ret = TIFF_TAG_NOT_FOUND;
+
+    pthread_mutex_lock(&shard->lock);
+
+    entry = tiff_cache_find(shard, hash, file_id, ifd_offset, index);
+
+    if (entry != NULL && entry->len == len) {
+        memcpy(dst, entry->data, len);
+
+        tiff_cache_lru_unlink(shard, entry);
+        tiff_cache_lru_push(shard, entry);
+
+        shard->hits++;
+        ret = TIFF_OK;
+    } else {
+        shard->misses++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return ret;
+}
+
+TIFF_STATUS tiff_cache_insert(tiff_cache_t *cache, uint64_t file_id,
+                              tiff_off_t ifd_offset, size_t index,
+                              const void *src, size_t len)
+{
+    uint64_t hash = tiff_cache_hash(file_id, ifd_offset, index);
+    struct tiff_cache_shard *shard = tiff_cache_get_shard(cache, hash);
+    struct tiff_cache_entry *entry, **bucket;
+
+    /* Never let one chunk flush a whole shard */
+    if (len > shard->max_bytes / 2) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* Copy outside the lock; it's the expensive part */
+    entry = (struct tiff_cache_entry *)tiff_malloc(shard->alloc,
+        sizeof(struct tiff_cache_entry) + len);
+    if (entry == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    entry->file_id = file_id;
+    entry->ifd_offset = ifd_offset;
+    entry->index = index;
+    entry->hash = hash;
+    entry->len = len;
+    entry->hash_next = entry->lru_prev = entry->lru_next = NULL;
+    memcpy(entry->data, src, len);
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Someone else may have decoded the same chunk meanwhile */
+    if (tiff_cache_find(shard, hash, file_id, ifd_offset, index) != NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        tiff_free(shard->alloc, entry);
+        return TIFF_OK;
+    }
+
+    while (shard->lru_tail != NULL && shard->bytes + len > shard->max_bytes) {
+        tiff_cache_remove(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+
+    if (shard->entries >= shard->nr_buckets) {
+        tiff_cache_grow(shard);
+    }
+
+    bucket = tiff_cache_bucket(shard, hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    tiff_cache_lru_push(shard, entry);
+
+    shard->bytes += len;
+    shard->entries++;
+    shard->inserts++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return TIFF_OK;
+}
+
+void tiff_cache_purge(tiff_cache_t *cache, uint64_t file_id)
+{
+    size_t i;
+
+    for (i = 0; i < TIFF_CACHE_SHARDS; i++) {
+        struct tiff_cache_shard *shard = &cache->shards[i];
+        struct tiff_cache_entry *entry, *next;
+
+        pthread_mutex_lock(&shard->lock);
+
+        for (entry = shard->lru_head; entry != NULL; entry = next) {
+            next = entry->lru_next;
+            if (entry->file_id == file_id) {
+                tiff_cache_remove(shard, entry);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,1147 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Seekable reads from compressed containers: gzip, and zstd files in the
+ * seekable format.
+ *
+ * A gzip file can only be decompressed from the start, so we keep a
+ * checkpoint index, as in zlib's zran example: every span bytes of
+ * output, at a deflate block boundary, we note the compressed and
+ * uncompressed offsets, the bits left over of the current byte and the
+ * 32 KiB of history the next block may refer back to. Inflating can then
+ * start again from the nearest checkpoint before any offset, so a seek
+ * costs at most one span of decompression. Checkpoints are added as
+ * decompression first passes them; the index can also be completed and
+ * saved, and loaded again when the file is next opened.
+ *
+ * A seekable zstd file is a series of independent frames, followed by a
+ * skippable frame holding their sizes. That table is the index, and each
+ * frame is decompressed whole.
+ *
+ * Either way, decompressed data goes into a small LRU cache of blocks
+ * (fixed size for gzip, a frame for zstd), so reads near each other, the
+ * usual pattern for tags and IFDs, only decompress anything once.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define TIFF_Z_DEFAULT_SPAN         (1 << 20)
+#define TIFF_Z_MIN_SPAN             (64 << 10)
+#define TIFF_Z_DEFAULT_BLOCK        (64 << 10)
+#define TIFF_Z_DEFAULT_BLOCKS       16
+
+#define TIFF_Z_HISTORY              32768   /* Deflate's back-reference window */
+#define TIFF_Z_INPUT                (64 << 10)
+
+#define TIFF_Z_NO_BLOCK             SIZE_MAX
+#define TIFF_Z_NO_SIZE              UINT64_MAX
+
+#define TIFF_Z_INDEX_MAGIC          "GHZIDX01"
+
+/* Seekable zstd: the seek table lives in a skippable frame at the end */
+#define TIFF_ZSTD_SKIPPABLE_MAGIC   0x184d2a5e
+#define TIFF_ZSTD_SEEKABLE_MAGIC    0x8f92eab1
+#define TIFF_ZSTD_FOOTER            9
+#define TIFF_ZSTD_MAX_FRAME         (256 << 20)
+
+#define TIFF_Z_GZIP                 1
+#define TIFF_Z_ZSTD                 2
+
+/* What the inflate stream is doing */
+#define TIFF_Z_IDLE                 0   /* Not started */
+#define TIFF_Z_GZIP_STREAM          1   /* Started at a member's gzip header */
+#define TIFF_Z_RAW                  2   /* Restarted at a checkpoint */
+#define TIFF_Z_DONE                 3   /* Reached the end of the file */
+
+struct tiff_z_point {
+    uint64_t out;               /* Uncompressed offset */
+    uint64_t in;                /* Compressed offset of the next whole byte */
+    unsigned bits;              /* Bits of the byte before in still unused */
+    unsigned dict_len;
+    uint8_t *dict;              /* The output just before out */
+};
+
+struct tiff_z_block {
+    size_t index;               /* TIFF_Z_NO_BLOCK if free */
+    size_t len;
+    size_t cap;
+    uint64_t used;              /* Clock at the last hit */
+    uint8_t *data;
+};
+
+struct tiff_z_hdl {
+    tiff_allocator_t alloc;
+    tiff_compressed_options_t opts;
+    int format;
+
+    int fd;
+    uint64_t comp_size;
+    uint64_t size;              /* Uncompressed, TIFF_Z_NO_SIZE until known */
+    uint64_t pos;
+    uint64_t id;
+
+    struct tiff_z_block *blocks;
+    uint64_t clock;
+
+    /* gzip: the live stream and where it has got to */
+    z_stream strm;
+    int strm_init;
+    int state;
+    int member_start;           /* Nothing inflated since a member ended */
+    uint64_t in_off;            /* Next compressed byte to read */
+    uint64_t out_off;           /* Offset of the stream's next output */
+    uint8_t *in_buf;
+    uint8_t *history;           /* Circular, the last TIFF_Z_HISTORY bytes */
+    size_t hist_next;
+    int hist_full;
+
+    struct tiff_z_point *points;
+    size_t point_count;
+    size_t point_alloc;
+
+    /* zstd: frame boundaries, frame_count + 1 of each */
+    uint64_t *frame_in;
+    uint64_t *frame_out;
+    size_t frame_count;
+    uint8_t *frame_buf;
+    size_t frame_buf_len;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *dctx;
+#endif
+};
+
+static uint64_t tiff_z_le(const uint8_t *p, unsigned bytes)
+{
+    uint64_t v = 0;
+
+    while (bytes-- > 0) {
+        v = (v << 8) | p[bytes];
+    }
+
+    return v;
+}
+
+static void tiff_z_put_le(uint8_t *p, uint64_t v, unsigned bytes)
+{
+    unsigned i;
+
+    for (i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static int tiff_z_pread_all(int fd, void *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    ssize_t rd;
+
+    while (done < len) {
+        rd = pread(fd, (uint8_t *)buf + done, len - done, (off_t)(off + done));
+
+        if (rd < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rd <= 0) {
+            return -1;
+        }
+
+        done += (size_t)rd;
+    }
+
+    return 0;
+}
+
+/*******************************************************************/
+/* gzip checkpoints                                                */
+/*******************************************************************/
+
+/* Last checkpoint at or before off, or NULL */
+static struct tiff_z_point *tiff_z_find_point(struct tiff_z_hdl *h, uint64_t off)
+{
+    size_t lo = 0, hi = h->point_count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (h->points[mid].out <= off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo ? &h->points[lo - 1] : NULL;
+}
+
+static TIFF_STATUS tiff_z_add_point(struct tiff_z_hdl *h, uint64_t out,
+                                    uint64_t in, unsigned bits,
+                                    const uint8_t *dict, unsigned dict_len)
+{
+    struct tiff_z_point *points, *p;
+
+    if (h->point_count == h->point_alloc) {
+        size_t n = h->point_alloc ? 2 * h->point_alloc : 16;
+
+        points = (struct tiff_z_point *)tiff_realloc(&h->alloc, h->points,
+            h->point_alloc * sizeof(*points), n * sizeof(*points));
+        if (points == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+
+        h->points = points;
+        h->point_alloc = n;
+    }
+
+    p = &h->points[h->point_count];
+
+    if ( (p->dict = (uint8_t *)tiff_malloc(&h->alloc, dict_len ? dict_len : 1))
+        == NULL)
+    {
+        return TIFF_NO_MEMORY;
+    }
+
+    p->out = out;
+    p->in = in;
+    p->bits = bits;
+    p->dict_len = dict_len;
+
+    if (dict != NULL) {
+        memcpy(p->dict, dict, dict_len);
+    }
+
+    h->point_count++;
+
+    return TIFF_OK;
+}
+
+/* At a deflate block boundary: checkpoint if we're a span past the last */
+static TIFF_STATUS tiff_z_maybe_checkpoint(struct tiff_z_hdl *h)
+{
+    struct tiff_z_point *p;
+    uint64_t last = h->point_count ? h->points[h->point_count - 1].out : 0;
+    size_t tail;
+    TIFF_STATUS ret;
+
+    if (h->out_off < last + h->opts.span_bytes) {
+        return TIFF_OK;
+    }
+
+    /* The span is at least the history size, so history is full */
+    if ( (ret = tiff_z_add_point(h, h->out_off, h->in_off - h->strm.avail_in,
+            (unsigned)(h->strm.data_type & 7), NULL, TIFF_Z_HISTORY)) != TIFF_OK)
+    {
+        return ret;
+    }
+
+    p = &h->points[h->point_count - 1];
+    tail = TIFF_Z_HISTORY - h->hist_next;
+    memcpy(p->dict, h->history + h->hist_next, tail);
+    memcpy(p->dict + tail, h->history, h->hist_next);
+
+    return TIFF_OK;
+}
+
+static TIFF_STATUS tiff_z_fill_input(struct tiff_z_hdl *h)
+{
+    size_t want = TIFF_Z_INPUT;
+    ssize_t rd;
+
+    if (h->in_off >= h->comp_size) {
+        return TIFF_END_OF_FILE;
+    }
+
+    if (h->comp_size - h->in_off < want) {
+        want = (size_t)(h->comp_size - h->in_off);
+    }
+
+    do {
+        rd = pread(h->fd, h->in_buf, want, (off_t)h->in_off);
+    } while (rd < 0 && errno == EINTR);
+
+    if (rd <= 0) {
+        return TIFF_END_OF_FILE;
+    }
+
+    h->strm.next_in = h->in_buf;
+    h->strm.avail_in = (uInt)rd;
+    h->in_off += (uint64_t)rd;
+
+    return TIFF_OK;
+}
+
+/* Start inflating from the beginning, or from checkpoint p */
+static TIFF_STATUS tiff_z_restart(struct tiff_z_hdl *h, struct tiff_z_point *p)
+{
+    int window_bits = p ? -15 : 31;   /* Raw deflate, or with a gzip header */
+    uint8_t c;
+    int zret;
+
+    if (!h->strm_init) {
+        memset(&h->strm, 0, sizeof(h->strm));
+        zret = inflateInit2(&h->strm, window_bits);
+        h->strm_init = zret == Z_OK;
+    } else {
+        zret = inflateReset2(&h->strm, window_bits);
+    }
+
+    if (zret != Z_OK) {
+        return TIFF_NO_MEMORY;
+    }
+
+    h->strm.avail_in = 0;
+    h->member_start = 0;
+    h->hist_next = 0;
+    h->hist_full = 0;
+
+    if (p == NULL) {
+        h->state = TIFF_Z_GZIP_STREAM;
+        h->in_off = 0;
+        h->out_off = 0;
+        return TIFF_OK;
+    }
+
+    h->state = TIFF_Z_RAW;
+    h->in_off = p->in;
+    h->out_off = p->out;
+
+    if (p->bits != 0) {
+        if (tiff_z_pread_all(h->fd, &c, 1, p->in - 1)) {
+            return TIFF_END_OF_FILE;
+        }
+        inflatePrime(&h->strm, (int)p->bits, c >> (8 - p->bits));
+    }
+
+    inflateSetDictionary(&h->strm, p->dict, p->dict_len);
+
+    memcpy(h->history, p->dict, p->dict_len);
+    h->hist_next = p->dict_len % TIFF_Z_HISTORY;
+    h->hist_full = p->dict_len == TIFF_Z_HISTORY;
+
+    return TIFF_OK;
+}
+
+/* A gzip member ended; go on to the next, if any */
+static TIFF_STATUS tiff_z_member_end(struct tiff_z_hdl *h)
+{
+    unsigned skip = 8, n;
+
+    /* Raw inflate leaves the CRC and length of the trailer to us */
+    if (h->state == TIFF_Z_RAW) {
+        while (skip > 0) {
+            if (h->strm.avail_in == 0 && tiff_z_fill_input(h) != TIFF_OK) {
+                break;
+            }
+            n = h->strm.avail_in < skip ? h->strm.avail_in : skip;
+            h->strm.next_in += n;
+            h->strm.avail_in -= n;
+            skip -= n;
+        }
+    }
+
+    if (h->strm.avail_in == 0 && h->in_off >= h->comp_size) {
+        h->state = TIFF_Z_DONE;
+        h->size = h->out_off;
+        return TIFF_OK;
+    }
+
+    if (inflateReset2(&h->strm, 31) != Z_OK) {
+        return TIFF_NO_MEMORY;
+    }
+
+    h->state = TIFF_Z_GZIP_STREAM;
+    h->member_start = 1;
+
+    return TIFF_OK;
+}
+
+/* Inflate until the stream reaches end, copying what lands in
+ * [start, end) to dst (if not NULL). Picks up from the live stream if
+ * that's no more than a span short of start, otherwise restarts at the
+ * best checkpoint.
+ */
+static TIFF_STATUS tiff_z_inflate(struct tiff_z_hdl *h, uint64_t start,
+                                  uint64_t end, uint8_t *dst)
+{
+    struct tiff_z_point *p = tiff_z_find_point(h, start);
+    uint64_t before, lo, hi;
+    size_t produced, room;
+    uint8_t *out;
+    int zret;
+    TIFF_STATUS ret;
+
+    if (h->state == TIFF_Z_IDLE || h->out_off > start ||
+        (h->state == TIFF_Z_DONE && start < h->out_off) ||
+        (p != NULL && p->out > h->out_off &&
+         start - h->out_off > h->opts.span_bytes))
+    {
+        if ( (ret = tiff_z_restart(h, p)) != TIFF_OK ) {
+            return ret;
+        }
+    }
+
+    while (h->out_off < end && h->state != TIFF_Z_DONE) {
+        if (h->strm.avail_in == 0 && tiff_z_fill_input(h) != TIFF_OK) {
+            /* Truncated: call what we have the whole file */
+            TIFF_TRACE("Compressed stream ends early at %llu\n",
+                (unsigned long long)h->out_off);
+            h->state = TIFF_Z_DONE;
+            h->size = h->out_off;
+            break;
+        }
+
+        /* Stop exactly at end, so the next block carries straight on */
+        out = h->history + h->hist_next;
+        room = TIFF_Z_HISTORY - h->hist_next;
+        if (end - h->out_off < room) {
+            room = (size_t)(end - h->out_off);
+        }
+        h->strm.next_out = out;
+        h->strm.avail_out = (uInt)room;
+
+        zret = inflate(&h->strm, Z_BLOCK);
+
+        produced = room - h->strm.avail_out;
+        before = h->out_off;
+
+        if (dst != NULL && produced != 0) {
+            lo = before > start ? before : start;
+            hi = before + produced < end ? before + produced : end;
+            if (lo < hi) {
+                memcpy(dst + (lo - start), out + (lo - before), (size_t)(hi - lo));
+            }
+        }
+
+        h->out_off += produced;
+        h->hist_next += produced;
+        if (h->hist_next == TIFF_Z_HISTORY) {
+            h->hist_next = 0;
+            h->hist_full = 1;
+        }
+
+        if (produced != 0) {
+            h->member_start = 0;
+        }
+
+        if (zret == Z_STREAM_END) {
+            if ( (ret = tiff_z_member_end(h)) != TIFF_OK ) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (zret != Z_OK && zret != Z_BUF_ERROR) {
+            /* Junk after the last member is allowed, like gzip does */
+            if (h->member_start) {
+                h->state = TIFF_Z_DONE;
+                h->size = h->out_off;
+                break;
+            }
+
+            TIFF_TRACE("Corrupt deflate data near %llu\n",
+                (unsigned long long)h->out_off);
+            h->state = TIFF_Z_IDLE;
+            return TIFF_END_OF_FILE;
+        }
+
+        /* Between deflate blocks, or just past a gzip header */
+        if ((h->strm.data_type & 128) && !(h->strm.data_type & 64)) {
+            if ( (ret = tiff_z_maybe_checkpoint(h)) != TIFF_OK ) {
+                return ret;
+            }
+        }
+    }
+
+    return TIFF_OK;
+}
+
+/*******************************************************************/
+/* Saved indexes                                                   */
+/*******************************************************************/
+
+/* Header: magic, compressed size, span, uncompressed size, count. Then
+ * for each point: out, in, bits, dict_len, dict. All little-endian.
+ */
+static TIFF_STATUS tiff_z_load_index(struct tiff_z_hdl *h, const char *file)
+{
+    uint8_t hdr[40], pt[24];
+    uint64_t count, i, size;
+    unsigned dict_len;
+    FILE *f;
+    TIFF_STATUS ret = TIFF_TAG_MALFORMED;
+
+    if ( (f = fopen(file, "rb")) == NULL ) {
+        return TIFF_FILE_NOT_FOUND;
+    }
+
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+        memcmp(hdr, TIFF_Z_INDEX_MAGIC, 8) != 0 ||
+        tiff_z_le(hdr + 8, 8) != h->comp_size)
+    {
+        TIFF_TRACE("Index %s doesn't belong to this file\n", file);
+        goto done;
+    }
+
+    size = tiff_z_le(hdr + 24, 8);
+    count = tiff_z_le(hdr + 32, 8);
+
+    for (i = 0; i < count; i++) {
+        if (fread(pt, 1, sizeof(pt), f) != sizeof(pt)) {
+            goto done;
+        }
+
+        dict_len = (unsigned)tiff_z_le(pt + 20, 4);
+        if (dict_len > TIFF_Z_HISTORY || tiff_z_le(pt + 16, 4) > 7 ||
+            tiff_z_le(pt + 8, 8) > h->comp_size)
+        {
+            goto done;
+        }
+
+        if ( (ret = tiff_z_add_point(h, tiff_z_le(pt, 8), tiff_z_le(pt + 8, 8),
+                (unsigned)tiff_z_le(pt + 16, 4), NULL, dict_len)) != TIFF_OK )
+        {
+            goto done;
+        }
+
+        ret = TIFF_TAG_MALFORMED;
+
+        if (fread(h->points[h->point_count - 1].dict, 1, dict_len, f) != dict_len) {
+            goto done;
+        }
+    }
+
+    h->size = size;
+    ret = TIFF_OK;
+
+done:
+    fclose(f);
+
+    if (ret != TIFF_OK) {
+        for (i = 0; i < h->point_count; i++) {
+            tiff_free(&h->alloc, h->points[i].dict);
+        }
+        h->point_count = 0;
+    }
+
+    return ret;
+}
+
+static TIFF_STATUS tiff_z_save_index(struct tiff_z_hdl *h, const char *file)
+{
+    uint8_t hdr[40], pt[24];
+    struct tiff_z_point *p;
+    size_t i;
+    FILE *f;
+    int err = 0;
+
+    if ( (f = fopen(file, "wb")) == NULL ) {
+        return TIFF_FILE_NOT_FOUND;
+    }
+
+    memcpy(hdr, TIFF_Z_INDEX_MAGIC, 8);
+    tiff_z_put_le(hdr + 8, h->comp_size, 8);
+    tiff_z_put_le(hdr + 16, h->opts.span_bytes, 8);
+    tiff_z_put_le(hdr + 24, h->size, 8);
+    tiff_z_put_le(hdr + 32, h->point_count, 8);
+
+    err |= fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr);
+
+    for (i = 0; i < h->point_count && !err; i++) {
+        p = &h->points[i];
+        tiff_z_put_le(pt, p->out, 8);
+        tiff_z_put_le(pt + 8, p->in, 8);
+        tiff_z_put_le(pt + 16, p->bits, 4);
+        tiff_z_put_le(pt + 20, p->dict_len, 4);
+
+        err |= fwrite(pt, 1, sizeof(pt), f) != sizeof(pt);
+        err |= fwrite(p->dict, 1, p->dict_len, f) != p->dict_len;
+    }
+
+    err |= fclose(f) != 0;
+
+    return err ? TIFF_END_OF_FILE : TIFF_OK;
+}
+
+/*******************************************************************/
+/* Seekable zstd                                                   */
+/*******************************************************************/
+
+#ifdef HAVE_ZSTD
+
+static TIFF_STATUS tiff_z_zstd_load_table(struct tiff_z_hdl *h)
+{
+    uint8_t footer[TIFF_ZSTD_FOOTER], skip_hdr[8];
+    uint8_t *table = NULL;
+    uint64_t count, entry, table_len, i;
+    TIFF_STATUS ret = TIFF_UNSUPPORTED;
+
+    if (h->comp_size < TIFF_ZSTD_FOOTER + 8 ||
+        tiff_z_pread_all(h->fd, footer, sizeof(footer),
+            h->comp_size - TIFF_ZSTD_FOOTER) ||
+        tiff_z_le(footer + 5, 4) != TIFF_ZSTD_SEEKABLE_MAGIC)
+    {
+        TIFF_TRACE("zstd file has no seek table\n");
+        return TIFF_UNSUPPORTED;
+    }
+
+    count = tiff_z_le(footer, 4);
+    entry = (footer[4] & 0x80) ? 12 : 8;
+    table_len = count * entry;
+
+    if (table_len + TIFF_ZSTD_FOOTER + 8 > h->comp_size ||
+        tiff_z_pread_all(h->fd, skip_hdr, 8,
+            h->comp_size - TIFF_ZSTD_FOOTER - table_len - 8) ||
+        tiff_z_le(skip_hdr, 4) != TIFF_ZSTD_SKIPPABLE_MAGIC ||
+        tiff_z_le(skip_hdr + 4, 4) != table_len + TIFF_ZSTD_FOOTER)
+    {
+        TIFF_TRACE("Malformed zstd seek table\n");
+        return TIFF_UNSUPPORTED;
+    }
+
+    table = (uint8_t *)tiff_malloc(&h->alloc, table_len ? table_len : 1);
+    h->frame_in = (uint64_t *)tiff_calloc(&h->alloc, count + 1, sizeof(uint64_t));
+    h->frame_out = (uint64_t *)tiff_calloc(&h->alloc, count + 1, sizeof(uint64_t));
+
+    if (table == NULL || h->frame_in == NULL || h->frame_out == NULL) {
+        ret = TIFF_NO_MEMORY;
+        goto done;
+    }
+
+    if (tiff_z_pread_all(h->fd, table, table_len,
+            h->comp_size - TIFF_ZSTD_FOOTER - table_len))
+    {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint64_t c = tiff_z_le(table + i * entry, 4);
+        uint64_t d = tiff_z_le(table + i * entry + 4, 4);
+
+        if (d > TIFF_ZSTD_MAX_FRAME) {
+            TIFF_TRACE("zstd frame %llu is too big\n", (unsigned long long)i);
+            goto done;
+        }
+
+        h->frame_in[i + 1] = h->frame_in[i] + c;
+        h->frame_out[i + 1] = h->frame_out[i] + d;
+    }
+
+    if (h->frame_in[count] > h->comp_size - TIFF_ZSTD_FOOTER - table_len - 8) {
+        TIFF_TRACE("zstd seek table runs past the frames\n");
+        goto done;
+    }
+
+    if ( (h->dctx = ZSTD_createDCtx()) == NULL ) {
+        ret = TIFF_NO_MEMORY;
+        goto done;
+    }
+
+    h->frame_count = (size_t)count;
+    h->size = h->frame_out[count];
+    ret = TIFF_OK;
+
+done:
+    tiff_free(&h->alloc, table);
+    return ret;
+}
+
+static TIFF_STATUS tiff_z_zstd_frame(struct tiff_z_hdl *h, size_t frame,
+                                     struct tiff_z_block *blk)
+{
+    size_t clen = (size_t)(h->frame_in[frame + 1] - h->frame_in[frame]);
+    size_t dlen = (size_t)(h->frame_out[frame + 1] - h->frame_out[frame]);
+    size_t got;
+    uint8_t *buf;
+
+    if (clen > h->frame_buf_len) {
+        buf = (uint8_t *)tiff_realloc(&h->alloc, h->frame_buf, h->frame_buf_len,
+            clen);
+        if (buf == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+        h->frame_buf = buf;
+        h->frame_buf_len = clen;
+    }
+
+    if (dlen > blk->cap) {
+        buf = (uint8_t *)tiff_realloc(&h->alloc, blk->data, blk->cap, dlen);
+        if (buf == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+        blk->data = buf;
+        blk->cap = dlen;
+    }
+
+    if (tiff_z_pread_all(h->fd, h->frame_buf, clen, h->frame_in[frame])) {
+        return TIFF_END_OF_FILE;
+    }
+
+    got = ZSTD_decompressDCtx(h->dctx, blk->data, dlen, h->frame_buf, clen);
+
+    if (ZSTD_isError(got) || got != dlen) {
+        TIFF_TRACE("zstd frame %zd is corrupt\n", frame);
+        return TIFF_END_OF_FILE;
+    }
+
+    blk->len = dlen;
+
+    return TIFF_OK;
+}
+
+#endif /* HAVE_ZSTD */
+
+/*******************************************************************/
+/* Decompressed block cache                                        */
+/*******************************************************************/
+
+/* Which block holds off, and where that block starts */
+static size_t tiff_z_block_of(struct tiff_z_hdl *h, uint64_t off, uint64_t *start)
+{
+    size_t lo = 0, hi = h->frame_count, mid;
+
+    if (h->format == TIFF_Z_GZIP) {
+        *start = off - off % h->opts.block_size;
+        return (size_t)(off / h->opts.block_size);
+    }
+
+    /* The last frame that starts at or before off */
+    while (lo + 1 < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (h->frame_out[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *start = h->frame_out[lo];
+
+    return lo;
+}
+
+static TIFF_STATUS tiff_z_get_block(struct tiff_z_hdl *h, size_t index,
+                                    uint64_t start, struct tiff_z_block **block)
+{
+    struct tiff_z_block *victim = &h->blocks[0];
+    uint64_t end;
+    size_t i;
+    uint8_t *buf;
+    TIFF_STATUS ret;
+
+    for (i = 0; i < h->opts.cache_blocks; i++) {
+        if (h->blocks[i].index == index) {
+            h->blocks[i].used = ++h->clock;
+            *block = &h->blocks[i];
+            return TIFF_OK;
+        }
+
+        if (h->blocks[i].used < victim->used) {
+            victim = &h->blocks[i];
+        }
+    }
+
+    victim->index = TIFF_Z_NO_BLOCK;
+    victim->used = 0;
+    victim->len = 0;
+
+#ifdef HAVE_ZSTD
+    if (h->format == TIFF_Z_ZSTD) {
+        if ( (ret = tiff_z_zstd_frame(h, index, victim)) != TIFF_OK ) {
+            return ret;
+        }
+    } else
+#endif
+    {
+        if (victim->cap < h->opts.block_size) {
+            buf = (uint8_t *)tiff_realloc(&h->alloc, victim->data, victim->cap,
+                h->opts.block_size);
+            if (buf == NULL) {
+                return TIFF_NO_MEMORY;
+            }
+            victim->data = buf;
+            victim->cap = h->opts.block_size;
+        }
+
+        end = start + h->opts.block_size;
+
+        if ( (ret = tiff_z_inflate(h, start, end, victim->data)) != TIFF_OK ) {
+            return ret;
+        }
+
+        end = h->out_off < end ? h->out_off : end;
+        victim->len = end > start ? (size_t)(end - start) : 0;
+    }
+
+    victim->index = index;
+    victim->used = ++h->clock;
+    *block = victim;
+
+    return TIFF_OK;
+}
+
+/*******************************************************************/
+/* File manager                                                    */
+/*******************************************************************/
+
+static void tiff_z_destroy(struct tiff_z_hdl *h)
+{
+    tiff_allocator_t alloc = h->alloc;
+    size_t i;
+
+    if (h->strm_init) {
+        inflateEnd(&h->strm);
+    }
+
+#ifdef HAVE_ZSTD
+    if (h->dctx != NULL) {
+        ZSTD_freeDCtx(h->dctx);
+    }
+#endif
+
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+
+    for (i = 0; i < h->point_count; i++) {
+        tiff_free(&alloc, h->points[i].dict);
+    }
+
+    if (h->blocks != NULL) {
+        for (i = 0; i < h->opts.cache_blocks; i++) {
+            tiff_free(&alloc, h->blocks[i].data);
+        }
+    }
+
+    tiff_free(&alloc, h->points);
+    tiff_free(&alloc, h->blocks);
+    tiff_free(&alloc, h->in_buf);
+    tiff_free(&alloc, h->history);
+    tiff_free(&alloc, h->frame_in);
+    tiff_free(&alloc, h->frame_out);
+    tiff_free(&alloc, h->frame_buf);
+    tiff_free(&alloc, h);
+}
+
+TIFF_STATUS tiff_compressed_hdl_create(tiff_file_hdl_t **hdl, const char *file,
+                                       const tiff_compressed_options_t *opts)
+{
+    struct tiff_z_hdl *h = NULL;
+    tiff_allocator_t alloc;
+    struct stat st;
+    uint8_t magic[4];
+    size_t i;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(file);
+
+    tiff_get_allocator(&alloc);
+
+    h = (struct tiff_z_hdl *)tiff_calloc(&alloc, 1, sizeof(*h));
+    if (h == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    h->alloc = alloc;
+    h->size = TIFF_Z_NO_SIZE;
+
+    if (opts != NULL) {
+        h->opts = *opts;
+    }
+
+    if (h->opts.span_bytes == 0) h->opts.span_bytes = TIFF_Z_DEFAULT_SPAN;
+    if (h->opts.span_bytes < TIFF_Z_MIN_SPAN) h->opts.span_bytes = TIFF_Z_MIN_SPAN;
+    if (h->opts.block_size == 0) h->opts.block_size = TIFF_Z_DEFAULT_BLOCK;
+    if (h->opts.cache_blocks == 0) h->opts.cache_blocks = TIFF_Z_DEFAULT_BLOCKS;
+
+    /* Only borrowed for the open */
+    h->opts.index_file = NULL;
+
+    if ( (h->fd = open(file, O_RDONLY | O_CLOEXEC)) < 0 ) {
+        tiff_z_destroy(h);
+        return TIFF_FILE_NOT_FOUND;
+    }
+
+    if (fstat(h->fd, &st) < 0 || tiff_z_pread_all(h->fd, magic, 4, 0)) {
+        ret = TIFF_NOT_TIFF;
+        goto fail;
+    }
+
+    h->comp_size = (uint64_t)st.st_size;
+    h->id = ((uint64_t)st.st_dev << 48) ^ ((uint64_t)st.st_ino << 16) ^
+        (uint64_t)st.st_mtime ^ ((uint64_t)st.st_size << 32) ^ 0x7a;
+
+    h->blocks = (struct tiff_z_block *)tiff_calloc(&alloc, h->opts.cache_blocks,
+        sizeof(struct tiff_z_block));
+    if (h->blocks == NULL) {
+        ret = TIFF_NO_MEMORY;
+        goto fail;
+    }
+
+    for (i = 0; i < h->opts.cache_blocks; i++) {
+        h->blocks[i].index = TIFF_Z_NO_BLOCK;
+    }
+
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        h->format = TIFF_Z_GZIP;
+        h->in_buf = (uint8_t *)tiff_malloc(&alloc, TIFF_Z_INPUT);
+        h->history = (uint8_t *)tiff_malloc(&alloc, TIFF_Z_HISTORY);
+
+        if (h->in_buf == NULL || h->history == NULL) {
+            ret = TIFF_NO_MEMORY;
+            goto fail;
+        }
+
+        /* A stale or foreign index is just ignored */
+        if (opts != NULL && opts->index_file != NULL) {
+            tiff_z_load_index(h, opts->index_file);
+        }
+    } else if (tiff_z_le(magic, 4) == 0xfd2fb528) {
+#ifdef HAVE_ZSTD
+        h->format = TIFF_Z_ZSTD;
+        if ( (ret = tiff_z_zstd_load_table(h)) != TIFF_OK ) {
+            goto fail;
+        }
+#else
+        TIFF_TRACE("Built without zstd support\n");
+        ret = TIFF_UNSUPPORTED;
+        goto fail;
+#endif
+    } else {
+        ret = TIFF_NOT_TIFF;
+        goto fail;
+    }
+
+    *hdl = (tiff_file_hdl_t *)h;
+
+    return TIFF_OK;
+
+fail:
+    tiff_z_destroy(h);
+    return ret;
+}
+
+TIFF_STATUS tiff_compressed_open(tiff_file_hdl_t **hdl, const char *file,
+                                 const char *mode)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(file);
+    TIFF_ASSERT_ARG(mode);
+
+    if (mode[0] != 'r' || strchr(mode, '+') != NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    return tiff_compressed_hdl_create(hdl, file, NULL);
+}
+
+TIFF_STATUS tiff_compressed_close(tiff_file_hdl_t *hdl)
+{
+    TIFF_ASSERT_ARG(hdl);
+
+    tiff_z_destroy((struct tiff_z_hdl *)hdl);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_compressed_read(tiff_file_hdl_t *hdl, size_t size,
+                                 size_t nmemb, void *buf, size_t *count)
+{
+    struct tiff_z_hdl *h = (struct tiff_z_hdl *)hdl;
+    struct tiff_z_block *blk;
+    uint8_t *dst = (uint8_t *)buf;
+    size_t len = size * nmemb, done = 0, n, index;
+    uint64_t off, start;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(buf);
+
+    while (done < len) {
+        off = h->pos + done;
+
+        if (off >= h->size) {
+            break;
+        }
+
+        index = tiff_z_block_of(h, off, &start);
+
+        if (tiff_z_get_block(h, index, start, &blk) != TIFF_OK ||
+            off - start >= blk->len)
+        {
+            break;
+        }
+
+        n = blk->len - (size_t)(off - start);
+        n = n < len - done ? n : len - done;
+        memcpy(dst + done, blk->data + (off - start), n);
+        done += n;
+    }
+
+    h->pos += done;
+
+    if (count) {
+        *count = size ? done / size : 0;
+    }
+
+    return TIFF_OK;
+}
+
+/* Find the uncompressed size of a gzip file the hard way */
+static TIFF_STATUS tiff_z_find_size(struct tiff_z_hdl *h)
+{
+    struct tiff_z_point *p;
+
+    if (h->size != TIFF_Z_NO_SIZE) {
+        return TIFF_OK;
+    }
+
+    /* From the furthest point we know of, adding checkpoints on the way */
+    p = h->point_count ? &h->points[h->point_count - 1] : NULL;
+    if (h->state == TIFF_Z_IDLE || (p != NULL && p->out > h->out_off)) {
+        TIFF_STATUS ret = tiff_z_restart(h, p);
+        if (ret != TIFF_OK) {
+            return ret;
+        }
+    }
+
+    return tiff_z_inflate(h, h->out_off, TIFF_Z_NO_SIZE, NULL);
+}
+
+TIFF_STATUS tiff_compressed_seek(tiff_file_hdl_t *hdl, size_t offset, int whence)
+{
+    struct tiff_z_hdl *h = (struct tiff_z_hdl *)hdl;
+    uint64_t base;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    switch (whence) {
+    case TIFF_SEEK_CUR:
+        base = h->pos;
+        break;
+    case TIFF_SEEK_SET:
+        base = 0;
+        break;
+    case TIFF_SEEK_END:
+        if ( (ret = tiff_z_find_size(h)) != TIFF_OK ) {
+            return ret;
+        }
+        base = h->size;
+        break;
+    default:
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* Relative seeks backwards come in as wrapped offsets, like fseek */
+    if ((int64_t)(base + offset) < 0) {
+        return TIFF_END_OF_FILE;
+    }
+
+    h->pos = base + offset;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_compressed_identify(tiff_file_hdl_t *hdl, uint64_t *id)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(id);
+
+    *id = ((struct tiff_z_hdl *)hdl)->id;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_compressed_size(tiff_file_hdl_t *hdl, size_t *size)
+{
+    struct tiff_z_hdl *h = (struct tiff_z_hdl *)hdl;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(size);
+
+    /* Only if it's already known; finding out can mean inflating it all */
+    if (h->size == TIFF_Z_NO_SIZE) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    *size = (size_t)h->size;
+
+    return TIFF_OK;
+}
+
+tiff_file_mgr_t tiff_compressed_mgr_s = {
+    .open = tiff_compressed_open,
+    .close = tiff_compressed_close,
+    .read = tiff_compressed_read,
+    .seek = tiff_compressed_seek,
+    .identify = tiff_compressed_identify,
+    .size = tiff_compressed_size
+};
+
+tiff_file_mgr_t *tiff_compressed_mgr = &tiff_compressed_mgr_s;
+
+TIFF_STATUS tiff_compressed_save_index(tiff_t *fp, const char *index_file)
+{
+    struct tiff_z_hdl *h;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(index_file);
+
+    if (fp->mgr != tiff_compressed_mgr || fp->fp == NULL) {
+        return TIFF_BAD_ARGUMENT;
+    }
+
+    h = (struct tiff_z_hdl *)fp->fp;
+
+    /* zstd files carry their own index */
+    if (h->format != TIFF_Z_GZIP) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    /* The index has to cover the whole file, so finish it first */
+    if ( (ret = tiff_z_find_size(h)) != TIFF_OK ) {
+        return ret;
+    }
+
+    return tiff_z_save_index(h, index_file);
+}
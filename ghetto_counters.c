@@ -0,0 +1,144 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* I/O and allocation counters.
+ *
+ * Each file keeps plain counters in its handle, bumped inline by the read
+ * and seek wrappers and by a thin allocator that sits in front of the
+ * file's own. Nothing is shared while a file is open; the counters are
+ * only added to the process-wide totals, atomically, when the file is
+ * closed or reset.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+#define TIFF_STATS_FIELDS   (sizeof(tiff_file_stats_t) / sizeof(UINT64))
+
+static UINT64 tiff_global_stats[TIFF_STATS_FIELDS];
+
+static void *tiff_count_alloc(void *ctx, size_t size)
+{
+    tiff_t *fp = (tiff_t *)ctx;
+
+    fp->stats.allocs++;
+    fp->stats.bytes_allocated += size;
+
+    return fp->base_alloc.alloc(fp->base_alloc.ctx, size);
+}
+
+static void *tiff_count_realloc(void *ctx, void *ptr, size_t size)
+{
+    tiff_t *fp = (tiff_t *)ctx;
+
+    fp->stats.allocs++;
+    fp->stats.bytes_allocated += size;
+
+    return fp->base_alloc.realloc(fp->base_alloc.ctx, ptr, size);
+}
+
+static void tiff_count_free(void *ctx, void *ptr)
+{
+    tiff_t *fp = (tiff_t *)ctx;
+
+    fp->base_alloc.free(fp->base_alloc.ctx, ptr);
+}
+
+static void *tiff_count_aligned_alloc(void *ctx, size_t alignment, size_t size)
+{
+    tiff_t *fp = (tiff_t *)ctx;
+
+    fp->stats.allocs++;
+    fp->stats.bytes_allocated += size;
+
+    return fp->base_alloc.aligned_alloc(fp->base_alloc.ctx, alignment, size);
+}
+
+static void tiff_count_aligned_free(void *ctx, void *ptr)
+{
+    tiff_t *fp = (tiff_t *)ctx;
+
+    fp->base_alloc.aligned_free(fp->base_alloc.ctx, ptr);
+}
+
+void tiff_count_allocator(tiff_t *fp, const tiff_allocator_t *base)
+{
+    fp->base_alloc = *base;
+
+    /* Leave out the same optional hooks as base, so the fallbacks in
+     * tiff_realloc and tiff_aligned_alloc still apply (and are counted)
+     */
+    fp->alloc.alloc = tiff_count_alloc;
+    fp->alloc.realloc = base->realloc ? tiff_count_realloc : NULL;
+    fp->alloc.free = tiff_count_free;
+    fp->alloc.aligned_alloc = base->aligned_alloc ? tiff_count_aligned_alloc : NULL;
+    fp->alloc.aligned_free = base->aligned_free ? tiff_count_aligned_free : NULL;
+    fp->alloc.ctx = fp;
+}
+
+void tiff_fold_stats(tiff_t *fp)
+{
+    const UINT64 *src = (const UINT64 *)&fp->stats;
+    size_t i;
+
+    for (i = 0; i < TIFF_STATS_FIELDS; i++) {
+        if (src[i] != 0) {
+            __atomic_fetch_add(&tiff_global_stats[i], src[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    memset(&fp->stats, 0, sizeof(fp->stats));
+}
+
+TIFF_STATUS tiff_get_stats(tiff_t *fp, tiff_file_stats_t *stats)
+{
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(stats);
+
+    *stats = fp->stats;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_get_global_stats(tiff_file_stats_t *stats)
+{
+    UINT64 *dst = (UINT64 *)stats;
+    size_t i;
+
+    TIFF_ASSERT_ARG(stats);
+
+    for (i = 0; i < TIFF_STATS_FIELDS; i++) {
+        dst[i] = __atomic_load_n(&tiff_global_stats[i], __ATOMIC_RELAXED);
+    }
+
+    return TIFF_OK;
+}
@@ -0,0 +1,111 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Event hooks.
+ *
+ * Instead of printing diagnostics, libghetto hands structured events to
+ * a handler the application registers. Event points test the handler
+ * pointer inline; everything else lives here, out of the hot paths.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#define TIFF_EVENT_MESSAGE_LEN  256
+
+tiff_event_handler_t tiff_event_handler = NULL;
+static void *tiff_event_ctx = NULL;
+
+TIFF_STATUS tiff_set_event_handler(tiff_event_handler_t handler, void *ctx)
+{
+    /* Clear the handler first, so it is never called with a stale ctx */
+    tiff_event_handler = NULL;
+    tiff_event_ctx = ctx;
+    tiff_event_handler = handler;
+
+    return TIFF_OK;
+}
+
+void tiff_emit_event(int type, const tiff_t *fp, tiff_off_t offset,
+                     uint64_t size, uint64_t count, unsigned tag,
+                     TIFF_STATUS status, const char *where)
+{
+    tiff_event_handler_t handler = tiff_event_handler;
+    tiff_event_t event;
+
+    if (handler == NULL) {
+        return;
+    }
+
+    event.type = type;
+    event.fp = fp;
+    event.offset = offset;
+    event.size = size;
+    event.count = count;
+    event.tag = tag;
+    event.status = status;
+    event.where = where;
+    event.message = NULL;
+
+    handler(tiff_event_ctx, &event);
+}
+
+void tiff_emit_message(int type, const char *where, const char *fmt, ...)
+{
+    tiff_event_handler_t handler = tiff_event_handler;
+    char message[TIFF_EVENT_MESSAGE_LEN];
+    tiff_event_t event;
+    va_list ap;
+    size_t len;
+
+    if (handler == NULL) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+
+    /* Messages are single lines; drop the newline the old traces had */
+    len = strlen(message);
+    if (len > 0 && message[len - 1] == '\n') {
+        message[len - 1] = '\0';
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.where = where;
+    event.message = message;
+
+    handler(tiff_event_ctx, &event);
+}
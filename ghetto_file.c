@@ -39,17 +39,30 @@
  */
 static TIFF_STATUS tiff_is_tiff_file(tiff_t *fp)
 {
-    uint8_t header[TIFF_HEADER_LEN];
+    uint8_t *header = NULL;
     size_t count = 0;
     uint16_t magic = 0;
 
+    /* Grab the start of the file along with the header. IFD0 and its
+     * tag data are usually in here, which saves a round trip or two.
+     */
+    if (fp->prefix == NULL) {
+        fp->prefix = (uint8_t *)tiff_malloc(&fp->alloc, TIFF_PREFIX_LEN);
+        if (fp->prefix == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+    }
+
     TIFF_SEEK(fp, 0, TIFF_SEEK_SET);
-    TIFF_READ(fp, TIFF_HEADER_LEN, 1, header, &count);
+    TIFF_READ(fp, 1, TIFF_PREFIX_LEN, fp->prefix, &count);
 
-    if (count < 1) {
+    if (count < TIFF_HEADER_LEN) {
         return TIFF_NOT_TIFF;
     }
 
+    fp->prefix_len = count;
+    header = fp->prefix;
+
     if (header[0] == ENDIANESS_INTEL && header[1] == ENDIANESS_INTEL) {
         fp->endianess = ENDIAN_LITTLE;
     } else if (header[0] == ENDIANESS_MOTOROLA && header[1] == ENDIANESS_MOTOROLA) {
@@ -67,67 +80,481 @@ static TIFF_STATUS tiff_is_tiff_file(tiff_t *fp)
 
     fp->root_ifd = TIFF_DWORD(header, TIFF_HEADER_IFD, fp->endianess);
 
-    TIFF_TRACE("root_ifd = %08x\n", (unsigned)fp->root_ifd);
+    TIFF_EVENT(TIFF_EVENT_OPEN, fp, fp->root_ifd, TIFF_PREFIX_LEN, count, 0,
+        TIFF_OK);
 
     return TIFF_OK;
 }
 
-TIFF_STATUS tiff_open_ex(tiff_t **fp, tiff_file_mgr_t *mgr,
-                         const char *file, const char *mode)
+/* Take on an open file handle, if it is a TIFF file. name (if any) is
+ * what the file was opened as.
+ */
+static TIFF_STATUS tiff_attach_file(tiff_t *fp, tiff_file_hdl_t *hdl,
+                                    const char *name)
+{
+    const char *c;
+    TIFF_STATUS ret;
+
+    /* FNV-1a of the name, the file's identity if the manager has none */
+    fp->name_hash = 0xcbf29ce484222325ull;
+    for (c = name; c && *c != '\0'; c++) {
+        fp->name_hash = (fp->name_hash ^ (uint8_t)*c) * 0x100000001b3ull;
+    }
+
+    fp->fp = hdl;
+
+    /* Tag data has to fit in here, whatever the tags claim */
+    if (fp->mgr->size == NULL || fp->mgr->size(hdl, &fp->file_size) != TIFF_OK) {
+        fp->file_size = 0;
+    }
+
+    /* Try to identify the file as a TIFF file */
+    if ( (ret = tiff_is_tiff_file(fp)) != TIFF_OK ) {
+        fp->fp = NULL;
+        fp->prefix_len = 0;
+        return ret;
+    }
+
+    return TIFF_OK;
+}
+
+/* Open file through the handle's manager and check it is a TIFF file */
+static TIFF_STATUS tiff_bind_file(tiff_t *fp, const char *file, const char *mode)
+{
+    tiff_file_hdl_t *hdl = NULL;
+    TIFF_STATUS ret;
+
+    if ( (ret = fp->mgr->open(&hdl, file, mode)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if ( (ret = tiff_attach_file(fp, hdl, file)) != TIFF_OK ) {
+        fp->mgr->close(hdl);
+        return ret;
+    }
+
+    return TIFF_OK;
+}
+
+/* Allocate a handle, not yet attached to any file */
+static TIFF_STATUS tiff_new_handle(tiff_t **fp, const tiff_open_options_t *opts)
+{
+    tiff_t *fptr = NULL;
+    tiff_allocator_t alloc;
+
+    if (opts && opts->allocator) {
+        alloc = *opts->allocator;
+        if (alloc.alloc == NULL || alloc.free == NULL ||
+            (alloc.aligned_alloc == NULL) != (alloc.aligned_free == NULL))
+        {
+            return TIFF_BAD_ARGUMENT;
+        }
+    } else {
+        tiff_get_allocator(&alloc);
+    }
+
+    fptr = (tiff_t *)tiff_calloc(&alloc, 1, sizeof(tiff_t));
+    if (fptr == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    tiff_count_allocator(fptr, &alloc);
+    fptr->stats.allocs = 1;
+    fptr->stats.bytes_allocated = sizeof(tiff_t);
+    fptr->mgr = (opts && opts->mgr) ? opts->mgr : tiff_stdio_mgr;
+
+    if (opts && opts->limits) {
+        fptr->limits = *opts->limits;
+    }
+
+    *fp = fptr;
+
+    return TIFF_OK;
+}
+
+/* Free a handle that never got attached to a file */
+static void tiff_free_handle(tiff_t *fp)
+{
+    tiff_allocator_t alloc = fp->base_alloc;
+
+    tiff_free(&fp->alloc, fp->prefix);
+    tiff_free(&alloc, fp);
+}
+
+TIFF_STATUS tiff_open_opts(tiff_t **fp, const char *file, const char *mode,
+                           const tiff_open_options_t *opts)
 {
     tiff_t *fptr = NULL;
     TIFF_STATUS ret = TIFF_OK;
 
     TIFF_ASSERT_ARG(fp);
-    TIFF_ASSERT_ARG(mgr);
     TIFF_ASSERT_ARG(file);
     TIFF_ASSERT_ARG(mode);
 
     *fp = NULL;
 
-    fptr = (tiff_t *)calloc(1, sizeof(tiff_t));
-    if (fptr == NULL) {
-        ret = TIFF_NO_MEMORY;
-        goto fail;
+    if ( (ret = tiff_new_handle(&fptr, opts)) != TIFF_OK ) {
+        return ret;
     }
 
-    fptr->mgr = mgr;
-    if ( (ret = fptr->mgr->open(&fptr->fp, file, mode)) != TIFF_OK ) {
-        goto fail_free_fptr;
+    if ( (ret = tiff_bind_file(fptr, file, mode)) != TIFF_OK ) {
+        tiff_free_handle(fptr);
+        return ret;
     }
 
-    /* Try to identify the file as a TIFF file */
-    if ( (ret = tiff_is_tiff_file(fptr)) != TIFF_OK ) {
-        goto fail_close_file;
+    *fp = fptr;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_open_fd(tiff_t **fp, int fd, int flags)
+{
+    tiff_t *fptr = NULL;
+    tiff_file_hdl_t *hdl = NULL;
+    tiff_open_options_t opts;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+
+    *fp = NULL;
+
+    if (fd < 0) {
+        return TIFF_BAD_ARGUMENT;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.mgr = tiff_pread_mgr;
+
+    if ( (ret = tiff_new_handle(&fptr, &opts)) != TIFF_OK ) {
+        return ret;
+    }
+
+    /* The descriptor only becomes ours once the open has succeeded */
+    if ( (ret = tiff_fd_hdl_create(&hdl, fd, 0)) != TIFF_OK ) {
+        tiff_free_handle(fptr);
+        return ret;
+    }
+
+    if ( (ret = tiff_attach_file(fptr, hdl, NULL)) != TIFF_OK ) {
+        fptr->mgr->close(hdl);
+        tiff_free_handle(fptr);
+        return ret;
+    }
+
+    if (flags & TIFF_FD_OWN) {
+        tiff_fd_hdl_own(hdl);
+    }
+
+    *fp = fptr;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_open_http(tiff_t **fp, const char *url,
+                           const tiff_http_options_t *opts)
+{
+    tiff_t *fptr = NULL;
+    tiff_file_hdl_t *hdl = NULL;
+    tiff_open_options_t open_opts;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(url);
+
+    *fp = NULL;
+
+    memset(&open_opts, 0, sizeof(open_opts));
+    open_opts.mgr = tiff_http_mgr;
+
+    if ( (ret = tiff_new_handle(&fptr, &open_opts)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if ( (ret = tiff_http_hdl_create(&hdl, url, opts)) != TIFF_OK ) {
+        tiff_free_handle(fptr);
+        return ret;
+    }
+
+    if ( (ret = tiff_attach_file(fptr, hdl, url)) != TIFF_OK ) {
+        fptr->mgr->close(hdl);
+        tiff_free_handle(fptr);
+        return ret;
+    }
+
+    *fp = fptr;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_open_compressed(tiff_t **fp, const char *file,
+                                 const tiff_compressed_options_t *opts)
+{
+    tiff_t *fptr = NULL;
+    tiff_file_hdl_t *hdl = NULL;
+    tiff_open_options_t open_opts;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(file);
+
+    *fp = NULL;
+
+    memset(&open_opts, 0, sizeof(open_opts));
+    open_opts.mgr = tiff_compressed_mgr;
+
+    if ( (ret = tiff_new_handle(&fptr, &open_opts)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if ( (ret = tiff_compressed_hdl_create(&hdl, file, opts)) != TIFF_OK ) {
+        tiff_free_handle(fptr);
+        return ret;
+    }
+
+    if ( (ret = tiff_attach_file(fptr, hdl, file)) != TIFF_OK ) {
+        fptr->mgr->close(hdl);
+        tiff_free_handle(fptr);
+        return ret;
     }
 
     *fp = fptr;
+
     return TIFF_OK;
+}
 
-fail_close_file:
-    fptr->mgr->close(fptr->fp);
+TIFF_STATUS tiff_open_ex(tiff_t **fp, tiff_file_mgr_t *mgr,
+                         const char *file, const char *mode)
+{
+    tiff_open_options_t opts;
 
-fail_free_fptr:
-    free(fptr);
+    TIFF_ASSERT_ARG(mgr);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.mgr = mgr;
 
-fail:
-    return ret;
+    return tiff_open_opts(fp, file, mode, &opts);
 }
 
 TIFF_STATUS tiff_open(tiff_t **fp, const char *file, const char *mode)
 {
-    return tiff_open_ex(fp, tiff_stdio_mgr, file, mode);
+    return tiff_open_opts(fp, file, mode, NULL);
+}
+
+TIFF_STATUS tiff_reset(tiff_t *fp)
+{
+    TIFF_ASSERT_ARG(fp);
+
+    if (fp->fp != NULL) {
+        fp->mgr->close(fp->fp);
+        fp->fp = NULL;
+    }
+
+    tiff_fold_stats(fp);
+    fp->io_pos = 0;
+    fp->file_size = 0;
+    fp->tail_ifd = 0;
+    fp->tail_next_pos = 0;
+
+    /* Forget the file, but keep the buffers and settings */
+    fp->endianess = 0;
+    fp->root_ifd = 0;
+    fp->prefix_len = 0;
+    fp->level_count = 0;
+    fp->file_id = 0;
+    fp->name_hash = 0;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_reopen(tiff_t *fp, const char *file, const char *mode)
+{
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(file);
+    TIFF_ASSERT_ARG(mode);
+
+    tiff_reset(fp);
+
+    if ( (ret = tiff_bind_file(fp, file, mode)) != TIFF_OK ) {
+        return ret;
+    }
+
+    /* The new file needs its own identity in the cache */
+    if (fp->cache != NULL) {
+        tiff_set_cache(fp, fp->cache);
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_set_limits(tiff_t *fp, const tiff_limits_t *limits)
+{
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(limits);
+
+    fp->limits = *limits;
+
+    return TIFF_OK;
+}
+
+/* Read from the backend, whatever the prefix buffer holds, and bring
+ * the prefix up to date with what was read. For the bytes a writer may
+ * have changed in place since we last looked.
+ */
+static TIFF_STATUS tiff_read_fresh(tiff_t *fp, tiff_off_t off, void *buf,
+                                   size_t len)
+{
+    size_t count = 0, n;
+    TIFF_STATUS ret;
+
+    if ( (ret = TIFF_SEEK(fp, off, TIFF_SEEK_SET)) != TIFF_OK ||
+         (ret = TIFF_READ(fp, 1, len, buf, &count)) != TIFF_OK )
+    {
+        return ret;
+    }
+
+    if (count < len) {
+        return TIFF_END_OF_FILE;
+    }
+
+    if (off < fp->prefix_len) {
+        n = fp->prefix_len - off < len ? fp->prefix_len - off : len;
+        memcpy(fp->prefix + off, buf, n);
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_refresh(tiff_t *fp, size_t *new_ifds, tiff_off_t *first_new)
+{
+    tiff_off_t off, tail, tail_next_pos;
+    tiff_ifd_chain_t chain;
+    tiff_ifd_t *ifd = NULL;
+    size_t size, found = 0, count = 0;
+    uint8_t raw[4];
+    TIFF_STATUS ret = TIFF_OK;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(new_ifds);
+
+    *new_ifds = 0;
+    if (first_new) *first_new = 0;
+
+    if (fp->fp == NULL) {
+        return TIFF_NOT_OPEN;
+    }
+
+    /* New tag data has to pass the size checks against the new size */
+    if (fp->mgr->size != NULL && fp->mgr->size(fp->fp, &size) == TIFF_OK) {
+        fp->file_size = size;
+    }
+
+    memset(&chain, 0, sizeof(chain));
+    tail = fp->tail_ifd;
+    tail_next_pos = fp->tail_next_pos;
+
+    if (tail == 0) {
+        /* First time: the start of the file may have changed since it
+         * was opened, so read it again, and walk from the root.
+         */
+        if ( (ret = TIFF_SEEK(fp, 0, TIFF_SEEK_SET)) != TIFF_OK ||
+             (ret = TIFF_READ(fp, 1, TIFF_PREFIX_LEN, fp->prefix, &count))
+                != TIFF_OK )
+        {
+            fp->prefix_len = 0;
+            return ret;
+        }
+
+        fp->prefix_len = count;
+
+        if (count < TIFF_HEADER_LEN) {
+            return TIFF_END_OF_FILE;
+        }
+
+        fp->root_ifd = TIFF_DWORD(fp->prefix, TIFF_HEADER_IFD, fp->endianess);
+        off = fp->root_ifd;
+    } else {
+        /* Only the last IFD's next offset can have changed */
+        if ( (ret = tiff_read_fresh(fp, tail_next_pos, raw, sizeof(raw)))
+            != TIFF_OK )
+        {
+            return ret;
+        }
+
+        off = TIFF_DWORD(raw, 0, fp->endianess);
+    }
+
+    while (off != 0) {
+        tiff_off_t next = 0;
+
+        /* Not all written yet; the next call will try again */
+        if ( (ret = tiff_read_ifd(fp, off, &ifd)) == TIFF_END_OF_FILE ||
+             ret == TIFF_RANGE_ERROR )
+        {
+            ret = TIFF_OK;
+            break;
+        }
+
+        if (ret != TIFF_OK) {
+            break;
+        }
+
+        ret = tiff_next_ifd(fp, &chain, ifd, &next);
+
+        tail = off;
+        tail_next_pos = off + 2 + (tiff_off_t)ifd->tag_count * IFD_ENTRY_LEN;
+
+        tiff_free_ifd(fp, ifd);
+
+        if (ret != TIFF_OK) {
+            break;
+        }
+
+        if (found++ == 0 && first_new) {
+            *first_new = off;
+        }
+
+        off = next;
+    }
+
+    /* Nothing is taken from a walk that found a loop or ran too deep */
+    if (ret != TIFF_OK) {
+        if (first_new) *first_new = 0;
+        return ret;
+    }
+
+    fp->tail_ifd = tail;
+    fp->tail_next_pos = tail_next_pos;
+    *new_ifds = found;
+
+    /* The level table is built again with the new images */
+    if (found != 0) {
+        fp->level_count = 0;
+    }
+
+    return TIFF_OK;
 }
 
 TIFF_STATUS tiff_close(tiff_t *fp)
 {
+    tiff_allocator_t alloc;
+
     TIFF_ASSERT_ARG(fp);
 
-    fp->mgr->close(fp->fp);
+    if (fp->fp != NULL) {
+        fp->mgr->close(fp->fp);
+    }
 
+    tiff_free(&fp->alloc, fp->prefix);
+    tiff_free(&fp->alloc, fp->levels);
+
+    tiff_fold_stats(fp);
+
+    alloc = fp->base_alloc;
     memset(fp, 0, sizeof(tiff_t));
 
-    free(fp);
+    tiff_free(&alloc, fp);
 
     return TIFF_OK;
 }
@@ -140,10 +567,21 @@ TIFF_STATUS tiff_read(tiff_t *fp, size_t offset, size_t size, size_t nmemb,
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(dest_buf);
 
+    if (fp->fp == NULL) {
+        return TIFF_NOT_OPEN;
+    }
+
     if (size * nmemb == 0) {
         return TIFF_RANGE_ERROR;
     }
 
+    if (offset < fp->prefix_len && size * nmemb <= fp->prefix_len - offset) {
+        memcpy(dest_buf, fp->prefix + offset, size * nmemb);
+        fp->stats.prefix_hits++;
+        if (count) *count = nmemb;
+        return TIFF_OK;
+    }
+
     if ( (ret = TIFF_SEEK(fp, offset, TIFF_SEEK_SET) ) != TIFF_OK ) {
         return ret;
     }
@@ -151,3 +589,129 @@ TIFF_STATUS tiff_read(tiff_t *fp, size_t offset, size_t size, size_t nmemb,
     return TIFF_READ(fp, size, nmemb, dest_buf, count);
 }
 
+
+TIFF_STATUS tiff_read_at(tiff_t *fp, tiff_off_t off, void *buf, size_t len,
+                         size_t *count)
+{
+    size_t rd_cnt = 0;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(buf);
+
+    if (fp->fp == NULL) {
+        return TIFF_NOT_OPEN;
+    }
+
+    if (off < fp->prefix_len && len <= fp->prefix_len - off) {
+        memcpy(buf, fp->prefix + off, len);
+        fp->stats.prefix_hits++;
+        if (count) *count = len;
+        return TIFF_OK;
+    }
+
+    if ( (ret = TIFF_SEEK(fp, off, TIFF_SEEK_SET)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if ( (ret = TIFF_READ(fp, 1, len, buf, &rd_cnt)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (count) *count = rd_cnt;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_write_at(tiff_t *fp, tiff_off_t off, const void *buf, size_t len)
+{
+    size_t wr_cnt = 0, n;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(buf);
+
+    if (fp->fp == NULL) {
+        return TIFF_NOT_OPEN;
+    }
+
+    if (fp->mgr->write == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if ( (ret = TIFF_SEEK(fp, off, TIFF_SEEK_SET)) != TIFF_OK ) {
+        return ret;
+    }
+
+    ret = fp->mgr->write(fp->fp, buf, 1, len, &wr_cnt);
+
+    fp->stats.writes++;
+    fp->stats.bytes_written += wr_cnt;
+    fp->io_pos += wr_cnt;
+
+    if (ret != TIFF_OK) {
+        return ret;
+    }
+
+    if (wr_cnt < len) {
+        return TIFF_END_OF_FILE;
+    }
+
+    /* Patches append tag data; it has to pass the size checks too */
+    if (fp->file_size != 0 && off + len > fp->file_size) {
+        fp->file_size = off + len;
+    }
+
+    /* Keep the prefix buffer in step with the file */
+    if (off < fp->prefix_len) {
+        n = fp->prefix_len - off < len ? fp->prefix_len - off : len;
+        memcpy(fp->prefix + off, buf, n);
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_map(tiff_t *fp, tiff_off_t offset, size_t len,
+                     const void **view)
+{
+    void *addr = NULL;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(view);
+
+    *view = NULL;
+
+    if (fp->fp == NULL) {
+        return TIFF_NOT_OPEN;
+    }
+
+    if (fp->mgr->map == NULL || fp->mgr->unmap == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if (len == 0) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if ( (ret = fp->mgr->map(fp->fp, offset, len, &addr)) != TIFF_OK ) {
+        return ret;
+    }
+
+    fp->stats.maps++;
+    *view = addr;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_unmap(tiff_t *fp, const void *view, size_t len)
+{
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(view);
+
+    if (fp->mgr->unmap == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    return fp->mgr->unmap(fp->fp, (void *)view, len);
+}
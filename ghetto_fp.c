@@ -31,6 +31,59 @@
 #include <ghetto_fp.h>
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Map a range of the file open on fd */
+static TIFF_STATUS tiff_fd_map_range(int fd, size_t offset, size_t len,
+                                     void **addr)
+{
+    struct stat st;
+    size_t delta;
+    void *base;
+
+    /* Touching a mapping past the end of the file raises SIGBUS */
+    if (fstat(fd, &st) || offset > (size_t)st.st_size ||
+        len > (size_t)st.st_size - offset)
+    {
+        return TIFF_END_OF_FILE;
+    }
+
+    delta = offset % (size_t)sysconf(_SC_PAGESIZE);
+
+    base = mmap(NULL, len + delta, PROT_READ, MAP_SHARED, fd,
+        (off_t)(offset - delta));
+
+    if (base == MAP_FAILED) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    *addr = (uint8_t *)base + delta;
+
+    return TIFF_OK;
+}
+
+/* Identity of the file open on fd */
+static TIFF_STATUS tiff_fd_identify_file(int fd, uint64_t *id)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        return TIFF_NOT_OPEN;
+    }
+
+    /* Rewriting the file changes its size or mtime, and with it the id */
+    *id = ((uint64_t)st.st_dev << 48) ^ ((uint64_t)st.st_ino << 16) ^
+        ((uint64_t)st.st_size * 0x9e3779b97f4a7c15ull) ^
+        ((uint64_t)st.st_mtime << 32) ^ (uint64_t)st.st_mtim.tv_nsec;
+
+    return TIFF_OK;
+}
 
 TIFF_STATUS tiff_stdio_open(tiff_file_hdl_t **hdl, const char *file, const char *mode)
 {
@@ -56,7 +109,7 @@ TIFF_STATUS tiff_stdio_close(tiff_file_hdl_t *hdl)
 
     TIFF_ASSERT_ARG(hdl);
 
-    fp = (FILE *)fp;
+    fp = (FILE *)hdl;
 
     fclose(fp);
 
@@ -83,6 +136,23 @@ TIFF_STATUS tiff_stdio_read(tiff_file_hdl_t *hdl,
     return TIFF_OK;
 }
 
+TIFF_STATUS tiff_stdio_write(tiff_file_hdl_t *hdl, const void *buf,
+                             size_t size, size_t nmemb, size_t *count)
+{
+    size_t wr_cnt;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(buf);
+
+    wr_cnt = fwrite(buf, size, nmemb, (FILE *)hdl);
+
+    if (count) {
+        *count = wr_cnt;
+    }
+
+    return TIFF_OK;
+}
+
 TIFF_STATUS tiff_stdio_seek(tiff_file_hdl_t *hdl, size_t offset, int whence)
 {
     FILE *fp = NULL;
@@ -113,12 +183,362 @@ TIFF_STATUS tiff_stdio_seek(tiff_file_hdl_t *hdl, size_t offset, int whence)
     return TIFF_OK;
 }
 
+TIFF_STATUS tiff_stdio_map(tiff_file_hdl_t *hdl, size_t offset, size_t len,
+                           void **addr)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(addr);
+
+    return tiff_fd_map_range(fileno((FILE *)hdl), offset, len, addr);
+}
+
+TIFF_STATUS tiff_stdio_unmap(tiff_file_hdl_t *hdl, void *addr, size_t len)
+{
+    size_t delta;
+
+    TIFF_ASSERT_ARG(addr);
+
+    delta = (uintptr_t)addr % (size_t)sysconf(_SC_PAGESIZE);
+
+    munmap((uint8_t *)addr - delta, len + delta);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stdio_prefetch(tiff_file_hdl_t *hdl, size_t offset, size_t len)
+{
+    TIFF_ASSERT_ARG(hdl);
+
+    /* Kick off the kernel's readahead for the range */
+    posix_fadvise(fileno((FILE *)hdl), (off_t)offset, (off_t)len,
+        POSIX_FADV_WILLNEED);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stdio_identify(tiff_file_hdl_t *hdl, uint64_t *id)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(id);
+
+    return tiff_fd_identify_file(fileno((FILE *)hdl), id);
+}
+
+TIFF_STATUS tiff_stdio_sync(tiff_file_hdl_t *hdl)
+{
+    FILE *fp = (FILE *)hdl;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    if (fflush(fp) || fsync(fileno(fp))) {
+        return TIFF_END_OF_FILE;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stdio_size(tiff_file_hdl_t *hdl, size_t *size)
+{
+    FILE *fp = (FILE *)hdl;
+    struct stat st;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(size);
+
+    /* Anything still sitting in the stdio buffer counts too */
+    fflush(fp);
+
+    if (fstat(fileno(fp), &st) < 0) {
+        return TIFF_NOT_OPEN;
+    }
+
+    *size = (size_t)st.st_size;
+
+    return TIFF_OK;
+}
+
 tiff_file_mgr_t tiff_stdio_mgr_s = {
     .open = tiff_stdio_open,
     .close = tiff_stdio_close,
     .read = tiff_stdio_read,
-    .seek = tiff_stdio_seek
+    .seek = tiff_stdio_seek,
+    .map = tiff_stdio_map,
+    .unmap = tiff_stdio_unmap,
+    .prefetch = tiff_stdio_prefetch,
+    .identify = tiff_stdio_identify,
+    .write = tiff_stdio_write,
+    .sync = tiff_stdio_sync,
+    .size = tiff_stdio_size
 };
 
 tiff_file_mgr_t *tiff_stdio_mgr = &tiff_stdio_mgr_s;
 
+
+/* pread/pwrite file manager. Each handle has its own position, and the
+ * descriptor's own offset is never used, so handles can share one.
+ */
+struct tiff_fd_hdl {
+    int fd;
+    int own;
+    size_t pos;
+    tiff_allocator_t alloc;
+};
+
+TIFF_STATUS tiff_fd_hdl_create(tiff_file_hdl_t **hdl, int fd, int own)
+{
+    struct tiff_fd_hdl *fh = NULL;
+    tiff_allocator_t alloc;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    tiff_get_allocator(&alloc);
+
+    fh = (struct tiff_fd_hdl *)tiff_malloc(&alloc, sizeof(*fh));
+    if (fh == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    fh->fd = fd;
+    fh->own = own;
+    fh->pos = 0;
+    fh->alloc = alloc;
+
+    *hdl = (tiff_file_hdl_t *)fh;
+
+    return TIFF_OK;
+}
+
+void tiff_fd_hdl_own(tiff_file_hdl_t *hdl)
+{
+    ((struct tiff_fd_hdl *)hdl)->own = 1;
+}
+
+TIFF_STATUS tiff_fd_open(tiff_file_hdl_t **hdl, const char *file, const char *mode)
+{
+    int flags = O_RDONLY;
+    int fd;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(file);
+    TIFF_ASSERT_ARG(mode);
+
+    /* Same meaning as the fopen modes */
+    if (strchr(mode, '+') != NULL) {
+        flags = O_RDWR;
+    } else if (mode[0] == 'w' || mode[0] == 'a') {
+        flags = O_WRONLY;
+    }
+
+    if (mode[0] == 'w') {
+        flags |= O_CREAT | O_TRUNC;
+    } else if (mode[0] == 'a') {
+        flags |= O_CREAT;
+    }
+
+    fd = open(file, flags | O_CLOEXEC, 0666);
+
+    if (fd < 0) {
+        return TIFF_FILE_NOT_FOUND;
+    }
+
+    if ( (ret = tiff_fd_hdl_create(hdl, fd, 1)) != TIFF_OK ) {
+        close(fd);
+        return ret;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_close(tiff_file_hdl_t *hdl)
+{
+    struct tiff_fd_hdl *fh = (struct tiff_fd_hdl *)hdl;
+    tiff_allocator_t alloc;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    if (fh->own) {
+        close(fh->fd);
+    }
+
+    alloc = fh->alloc;
+    tiff_free(&alloc, fh);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_read(tiff_file_hdl_t *hdl,
+                         size_t size, size_t nmemb, void *buf, size_t *count)
+{
+    struct tiff_fd_hdl *fh = (struct tiff_fd_hdl *)hdl;
+    size_t len = size * nmemb;
+    size_t done = 0;
+    ssize_t rd;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(buf);
+
+    while (done < len) {
+        rd = pread(fh->fd, (uint8_t *)buf + done, len - done,
+            (off_t)(fh->pos + done));
+
+        if (rd < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rd <= 0) {
+            break;
+        }
+
+        done += (size_t)rd;
+    }
+
+    fh->pos += done;
+
+    if (count) {
+        *count = size ? done / size : 0;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_write(tiff_file_hdl_t *hdl, const void *buf,
+                          size_t size, size_t nmemb, size_t *count)
+{
+    struct tiff_fd_hdl *fh = (struct tiff_fd_hdl *)hdl;
+    size_t len = size * nmemb;
+    size_t done = 0;
+    ssize_t wr;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(buf);
+
+    while (done < len) {
+        wr = pwrite(fh->fd, (const uint8_t *)buf + done, len - done,
+            (off_t)(fh->pos + done));
+
+        if (wr < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (wr <= 0) {
+            break;
+        }
+
+        done += (size_t)wr;
+    }
+
+    fh->pos += done;
+
+    if (count) {
+        *count = size ? done / size : 0;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_seek(tiff_file_hdl_t *hdl, size_t offset, int whence)
+{
+    struct tiff_fd_hdl *fh = (struct tiff_fd_hdl *)hdl;
+    struct stat st;
+    size_t base;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    switch (whence) {
+    case TIFF_SEEK_CUR:
+        base = fh->pos;
+        break;
+    case TIFF_SEEK_SET:
+        base = 0;
+        break;
+    case TIFF_SEEK_END:
+        if (fstat(fh->fd, &st) < 0) {
+            return TIFF_NOT_OPEN;
+        }
+        base = (size_t)st.st_size;
+        break;
+    default:
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* Relative seeks backwards come in as wrapped offsets, like fseek */
+    if ((off_t)(base + offset) < 0) {
+        return TIFF_END_OF_FILE;
+    }
+
+    fh->pos = base + offset;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_map(tiff_file_hdl_t *hdl, size_t offset, size_t len,
+                        void **addr)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(addr);
+
+    return tiff_fd_map_range(((struct tiff_fd_hdl *)hdl)->fd, offset, len, addr);
+}
+
+TIFF_STATUS tiff_fd_prefetch(tiff_file_hdl_t *hdl, size_t offset, size_t len)
+{
+    TIFF_ASSERT_ARG(hdl);
+
+    posix_fadvise(((struct tiff_fd_hdl *)hdl)->fd, (off_t)offset, (off_t)len,
+        POSIX_FADV_WILLNEED);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_identify(tiff_file_hdl_t *hdl, uint64_t *id)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(id);
+
+    return tiff_fd_identify_file(((struct tiff_fd_hdl *)hdl)->fd, id);
+}
+
+TIFF_STATUS tiff_fd_sync(tiff_file_hdl_t *hdl)
+{
+    TIFF_ASSERT_ARG(hdl);
+
+    /* Nothing is buffered here, only the kernel's copy needs flushing */
+    if (fsync(((struct tiff_fd_hdl *)hdl)->fd)) {
+        return TIFF_END_OF_FILE;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_fd_size(tiff_file_hdl_t *hdl, size_t *size)
+{
+    struct stat st;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(size);
+
+    if (fstat(((struct tiff_fd_hdl *)hdl)->fd, &st) < 0) {
+        return TIFF_NOT_OPEN;
+    }
+
+    *size = (size_t)st.st_size;
+
+    return TIFF_OK;
+}
+
+tiff_file_mgr_t tiff_pread_mgr_s = {
+    .open = tiff_fd_open,
+    .close = tiff_fd_close,
+    .read = tiff_fd_read,
+    .seek = tiff_fd_seek,
+    .map = tiff_fd_map,
+    .unmap = tiff_stdio_unmap,
+    .prefetch = tiff_fd_prefetch,
+    .identify = tiff_fd_identify,
+    .write = tiff_fd_write,
+    .sync = tiff_fd_sync,
+    .size = tiff_fd_size
+};
+
+tiff_file_mgr_t *tiff_pread_mgr = &tiff_pread_mgr_s;
@@ -6,6 +6,10 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct tiff_file_hdl;
 typedef struct tiff_file_hdl tiff_file_hdl_t;
 
@@ -20,14 +24,137 @@ typedef struct tiff_file_mgr {
     TIFF_STATUS (*read)(tiff_file_hdl_t *hdl, size_t size, size_t nmemb, void *buf,
                         size_t *count);
     TIFF_STATUS (*seek)(tiff_file_hdl_t *hdl, size_t offset, int whence);
+
+    /* Optional: map a read-only view of len bytes at offset, and release
+     * it again. Leave these NULL if the backend can't map files.
+     */
+    TIFF_STATUS (*map)(tiff_file_hdl_t *hdl, size_t offset, size_t len,
+                       void **addr);
+    TIFF_STATUS (*unmap)(tiff_file_hdl_t *hdl, void *addr, size_t len);
+
+    /* Optional: hint that len bytes at offset will be read soon. This
+     * must not block or move the file position. May be NULL.
+     */
+    TIFF_STATUS (*prefetch)(tiff_file_hdl_t *hdl, size_t offset, size_t len);
+
+    /* Optional: a value identifying the file's contents (inode, size,
+     * modification time...), used to key cached data. May be NULL.
+     */
+    TIFF_STATUS (*identify)(tiff_file_hdl_t *hdl, uint64_t *id);
+
+    /* Optional: write nmemb items of size bytes at the current position.
+     * Needed by the writer. May be NULL for read-only backends.
+     */
+    TIFF_STATUS (*write)(tiff_file_hdl_t *hdl, const void *buf, size_t size,
+                         size_t nmemb, size_t *count);
+
+    /* Optional: make everything written so far durable. May be NULL. */
+    TIFF_STATUS (*sync)(tiff_file_hdl_t *hdl);
+
+    /* Optional: get the current size of the file, including anything
+     * written through this handle. May be NULL.
+     */
+    TIFF_STATUS (*size)(tiff_file_hdl_t *hdl, size_t *size);
 } tiff_file_mgr_t;
 
 /* Default stdio/native I/O based file manager */
 extern tiff_file_mgr_t *tiff_stdio_mgr;
 
+/* File manager reading and writing straight from a file descriptor with
+ * pread/pwrite. It has no buffering of its own, and keeps its own file
+ * position, so any number of handles can share a descriptor.
+ */
+extern tiff_file_mgr_t *tiff_pread_mgr;
+
+/* Flags for tiff_open_fd */
+#define TIFF_FD_OWN     0x1     /* tiff_close closes the descriptor */
+
+/* Open a TIFF file from a descriptor that is already open, through
+ * tiff_pread_mgr. Unless TIFF_FD_OWN is given the descriptor stays the
+ * caller's, and is left open by tiff_close. On failure it is never
+ * closed. Patching needs a descriptor open for writing.
+ */
+TIFF_STATUS tiff_open_fd(tiff_t **fp, int fd, int flags);
+
+/* Tuning for the HTTP file manager. Zeroed fields take the default. */
+typedef struct tiff_http_options {
+    size_t prefix_bytes;        /* Fetched when the file is opened (64 KiB) */
+    size_t block_size;          /* Unit of fetching and caching (16 KiB) */
+    size_t cache_blocks;        /* Blocks kept, least recently used go (64) */
+    size_t readahead_blocks;    /* Extra blocks for sequential reads (4) */
+    size_t gap_blocks;          /* Cached blocks refetched to join reads (2) */
+    unsigned timeout_ms;        /* For connecting and each send/recv (10 s) */
+    size_t max_whole_bytes;     /* Biggest file held whole if the server
+                                 * ignores Range (64 MiB) */
+} tiff_http_options_t;
+
+/* Read-only file manager for files named by http:// URL, read with HTTP
+ * Range requests over a keep-alive connection. A prefix of the file is
+ * fetched on open, and later reads go through a small block cache, with
+ * nearby ranges fetched together. A server that ignores Range gets one
+ * request, and the whole file is held in memory. Uses the default
+ * options.
+ */
+extern tiff_file_mgr_t *tiff_http_mgr;
+
+/* Open a TIFF file by URL through tiff_http_mgr; opts may be NULL */
+TIFF_STATUS tiff_open_http(tiff_t **fp, const char *url,
+                           const tiff_http_options_t *opts);
+
+/* Tuning for the compressed file manager. Zeroed fields take the
+ * default.
+ */
+typedef struct tiff_compressed_options {
+    size_t span_bytes;          /* gzip: output between checkpoints (1 MiB) */
+    size_t block_size;          /* gzip: unit of the decompressed cache (64 KiB) */
+    size_t cache_blocks;        /* Decompressed blocks (or zstd frames) kept (16) */
+    const char *index_file;     /* gzip: checkpoint index to load, if valid */
+} tiff_compressed_options_t;
+
+/* Read-only file manager for TIFF files inside a gzip file, or a zstd
+ * file in the seekable format (zstd needs a build with HAVE_ZSTD). gzip
+ * files get a checkpoint index as they are read, so a seek never costs
+ * more than span_bytes of decompression. Uses the default options.
+ */
+extern tiff_file_mgr_t *tiff_compressed_mgr;
+
+/* Open a compressed TIFF file through tiff_compressed_mgr; opts may be
+ * NULL.
+ */
+TIFF_STATUS tiff_open_compressed(tiff_t **fp, const char *file,
+                                 const tiff_compressed_options_t *opts);
+
+/* Save the checkpoint index of a gzip file opened through
+ * tiff_compressed_mgr, to pass as index_file next time. The index has
+ * to cover the whole file, so this decompresses whatever hasn't been
+ * read yet.
+ */
+TIFF_STATUS tiff_compressed_save_index(tiff_t *fp, const char *index_file);
+
 /* Extended TIFF open. Allows setting a non-standard I/O strategy */
 TIFF_STATUS tiff_open_ex(tiff_t **fp, tiff_file_mgr_t *mgr,
                          const char *file, const char *mode);
 
+/* Options for tiff_open_opts. Zeroed fields take the default, so clear
+ * the whole structure before filling in what you need.
+ */
+typedef struct tiff_open_options {
+    tiff_file_mgr_t *mgr;                   /* I/O strategy, stdio if NULL */
+    const tiff_allocator_t *allocator;      /* Global allocator if NULL */
+    const tiff_limits_t *limits;            /* No limits if NULL */
+} tiff_open_options_t;
+
+/* Open a TIFF file with the given options; opts may be NULL */
+TIFF_STATUS tiff_open_opts(tiff_t **fp, const char *file, const char *mode,
+                           const tiff_open_options_t *opts);
+
+/* Create a TIFF file through the given I/O strategy. See tiff_create. */
+TIFF_STATUS tiff_create_ex(tiff_writer_t **writer, tiff_file_mgr_t *mgr,
+                           const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __INCLUDE_GHETTO_FP_H__ */
 
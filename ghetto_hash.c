@@ -0,0 +1,787 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Content hashing of image data.
+ *
+ * The caller's thread reads the chunks of an image in file order, into a
+ * round buffer a few megabytes in size; chunks that sit close together
+ * in the file are fetched with one read. While a pool of worker threads
+ * hashes one round, the caller fills the other, then helps finish off
+ * the hashing before the two are swapped. The workers are started once
+ * per image and wait between rounds. They only ever touch the round
+ * buffer and the digest array, never the file, so hashing needs no lock:
+ * chunks are handed out with an atomic counter.
+ *
+ * The image digest is the root of a binary tree over the chunk digests.
+ * A leaf hashes a leaf marker byte and a chunk digest; a node hashes a
+ * node marker byte and its two children. Digests go in as little-endian
+ * 64-bit values, and the last node of an odd level moves up unchanged.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Target size of each worker's share of a round */
+#define TIFF_HASH_BLOCK_BYTES   (1 << 20)
+
+/* Read through gaps this small rather than issuing another read */
+#define TIFF_HASH_MAX_GAP       (64 << 10)
+
+#define TIFF_HASH_MAX_THREADS   8
+
+/* Mark the leaves and interior nodes of the hash tree, so that neither
+ * can pass for the other
+ */
+#define TIFF_HASH_LEAF_MARK     0x00
+#define TIFF_HASH_NODE_MARK     0x01
+
+struct tiff_image_digest {
+    tiff_allocator_t alloc;
+    int algo;
+    UINT64 image;
+    size_t chunk_count;
+    UINT64 *chunks;
+};
+
+/* A chunk with data, in the order it is read */
+struct tiff_hash_chunk {
+    tiff_off_t offset;
+    size_t len;
+    size_t index;               /* In the IFD's chunk tables */
+    size_t where;               /* In the round buffer, once read */
+};
+
+struct tiff_hash_round {
+    int algo;
+    struct tiff_hash_chunk *chunks;
+    UINT64 *digests;
+
+    uint8_t *buf;
+    size_t buf_len;
+
+    size_t first;               /* Chunks first..end-1 are in buf */
+    size_t end;
+    size_t next;                /* Next chunk to hash, claimed atomically */
+};
+
+/* Workers kept for all the rounds of one image */
+struct tiff_hash_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t go;          /* A round is ready, or it's time to stop */
+    pthread_cond_t idle;        /* The last busy worker is done */
+
+    struct tiff_hash_round *round;
+    unsigned generation;        /* Bumped for each round */
+    unsigned busy;
+    int stop;
+
+    pthread_t tids[TIFF_HASH_MAX_THREADS];
+    unsigned started;
+};
+
+/*******************************************************************/
+/* Hash functions                                                  */
+/*******************************************************************/
+
+static inline uint64_t tiff_hash_le64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+           (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t tiff_hash_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+#if defined(TIFF_SIMD_SSE42)
+
+static uint32_t tiff_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        c = _mm_crc32_u64(c, tiff_hash_le64(p));
+    }
+
+    crc = (uint32_t)c;
+
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+
+    return crc;
+}
+
+static void tiff_crc32c_init(void)
+{
+}
+
+#elif defined(TIFF_SIMD_CRC32)
+
+static uint32_t tiff_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for (; len >= 8; p += 8, len -= 8) {
+        crc = __crc32cd(crc, tiff_hash_le64(p));
+    }
+
+    for (; len > 0; p++, len--) {
+        crc = __crc32cb(crc, *p);
+    }
+
+    return crc;
+}
+
+static void tiff_crc32c_init(void)
+{
+}
+
+#else
+
+/* Slicing-by-8 tables for the reflected Castagnoli polynomial */
+static uint32_t tiff_crc32c_table[8][256];
+
+static void tiff_crc32c_init(void)
+{
+    uint32_t crc;
+    unsigned i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        tiff_crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = tiff_crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = tiff_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            tiff_crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+static uint32_t tiff_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        v = tiff_hash_le64(p) ^ crc;
+        crc = tiff_crc32c_table[7][v & 0xff] ^
+              tiff_crc32c_table[6][(v >> 8) & 0xff] ^
+              tiff_crc32c_table[5][(v >> 16) & 0xff] ^
+              tiff_crc32c_table[4][(v >> 24) & 0xff] ^
+              tiff_crc32c_table[3][(v >> 32) & 0xff] ^
+              tiff_crc32c_table[2][(v >> 40) & 0xff] ^
+              tiff_crc32c_table[1][(v >> 48) & 0xff] ^
+              tiff_crc32c_table[0][v >> 56];
+    }
+
+    for (; len > 0; p++, len--) {
+        crc = tiff_crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#endif
+
+static pthread_once_t tiff_crc32c_once = PTHREAD_ONCE_INIT;
+
+#define XXH_PRIME1  0x9e3779b185ebca87ull
+#define XXH_PRIME2  0xc2b2ae3d27d4eb4full
+#define XXH_PRIME3  0x165667b19e3779f9ull
+#define XXH_PRIME4  0x85ebca77c2b2ae63ull
+#define XXH_PRIME5  0x27d4eb2f165667c5ull
+
+static inline uint64_t tiff_rotl64(uint64_t v, unsigned r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t tiff_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = tiff_rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static inline uint64_t tiff_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= tiff_xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static uint64_t tiff_xxh64(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint64_t h, v1, v2, v3, v4;
+
+    if (len >= 32) {
+        v1 = XXH_PRIME1 + XXH_PRIME2;
+        v2 = XXH_PRIME2;
+        v3 = 0;
+        v4 = 0 - XXH_PRIME1;
+
+        do {
+            v1 = tiff_xxh64_round(v1, tiff_hash_le64(p));
+            v2 = tiff_xxh64_round(v2, tiff_hash_le64(p + 8));
+            v3 = tiff_xxh64_round(v3, tiff_hash_le64(p + 16));
+            v4 = tiff_xxh64_round(v4, tiff_hash_le64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+
+        h = tiff_rotl64(v1, 1) + tiff_rotl64(v2, 7) +
+            tiff_rotl64(v3, 12) + tiff_rotl64(v4, 18);
+        h = tiff_xxh64_merge(h, v1);
+        h = tiff_xxh64_merge(h, v2);
+        h = tiff_xxh64_merge(h, v3);
+        h = tiff_xxh64_merge(h, v4);
+    } else {
+        h = XXH_PRIME5;
+    }
+
+    h += len;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= tiff_xxh64_round(0, tiff_hash_le64(p));
+        h = tiff_rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+
+    if (end - p >= 4) {
+        h ^= (uint64_t)tiff_hash_le32(p) * XXH_PRIME1;
+        h = tiff_rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME5;
+        h = tiff_rotl64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static UINT64 tiff_hash_bytes(int algo, const uint8_t *p, size_t len)
+{
+    if (algo == TIFF_HASH_CRC32C) {
+        return ~tiff_crc32c(~(uint32_t)0, p, len);
+    }
+
+    return tiff_xxh64(p, len);
+}
+
+static UINT64 tiff_hash_leaf(int algo, UINT64 chunk)
+{
+    uint8_t leaf[9];
+    unsigned i;
+
+    leaf[0] = TIFF_HASH_LEAF_MARK;
+
+    for (i = 0; i < 8; i++) {
+        leaf[1 + i] = (uint8_t)(chunk >> (8 * i));
+    }
+
+    return tiff_hash_bytes(algo, leaf, sizeof(leaf));
+}
+
+static UINT64 tiff_hash_node(int algo, UINT64 left, UINT64 right)
+{
+    uint8_t node[17];
+    unsigned i;
+
+    node[0] = TIFF_HASH_NODE_MARK;
+
+    for (i = 0; i < 8; i++) {
+        node[1 + i] = (uint8_t)(left >> (8 * i));
+        node[9 + i] = (uint8_t)(right >> (8 * i));
+    }
+
+    return tiff_hash_bytes(algo, node, sizeof(node));
+}
+
+/* Fold the digests in level, which is overwritten, up to the root */
+static UINT64 tiff_hash_tree(int algo, UINT64 *level, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        level[i] = tiff_hash_leaf(algo, level[i]);
+    }
+
+    while (count > 1) {
+        for (i = 0; i < count / 2; i++) {
+            level[i] = tiff_hash_node(algo, level[2 * i], level[2 * i + 1]);
+        }
+
+        if (count & 1) {
+            level[i] = level[count - 1];
+        }
+
+        count = (count + 1) / 2;
+    }
+
+    return level[0];
+}
+
+/*******************************************************************/
+/* Reading and hashing rounds                                      */
+/*******************************************************************/
+
+static int tiff_hash_chunk_cmp(const void *a, const void *b)
+{
+    const struct tiff_hash_chunk *ca = a, *cb = b;
+
+    if (ca->offset != cb->offset) {
+        return ca->offset < cb->offset ? -1 : 1;
+    }
+
+    return ca->index < cb->index ? -1 : (ca->index > cb->index);
+}
+
+static void *tiff_hash_worker(void *arg)
+{
+    struct tiff_hash_round *round = (struct tiff_hash_round *)arg;
+    struct tiff_hash_chunk *chunk;
+    size_t i;
+
+    while ( (i = __atomic_fetch_add(&round->next, 1, __ATOMIC_RELAXED))
+        < round->end)
+    {
+        chunk = &round->chunks[i];
+        round->digests[chunk->index] = tiff_hash_bytes(round->algo,
+            round->buf + chunk->where, chunk->len);
+    }
+
+    return NULL;
+}
+
+/* Read as many chunks, starting with chunk first of count, as fit in the
+ * round buffer. A chunk bigger than the buffer gets a round of its own.
+ */
+static TIFF_STATUS tiff_hash_fill(tiff_t *fp, struct tiff_hash_round *round,
+                                  size_t first, size_t count)
+{
+    struct tiff_hash_chunk *chunks = round->chunks;
+    tiff_off_t start, end;
+    size_t used = 0, got = 0, i = first, j, k;
+    uint8_t *buf;
+    TIFF_STATUS ret;
+
+    round->first = round->next = first;
+
+    while (i < count) {
+        start = chunks[i].offset;
+        end = start + chunks[i].len;
+
+        if (used + chunks[i].len > round->buf_len) {
+            if (used != 0) {
+                break;
+            }
+
+            buf = (uint8_t *)tiff_realloc(&fp->alloc, round->buf,
+                round->buf_len, chunks[i].len);
+            if (buf == NULL) {
+                return TIFF_NO_MEMORY;
+            }
+
+            round->buf = buf;
+            round->buf_len = chunks[i].len;
+        }
+
+        /* Take in the chunks that follow closely, or overlap this one */
+        for (j = i + 1; j < count; j++) {
+            tiff_off_t next_end = chunks[j].offset + chunks[j].len;
+
+            if (chunks[j].offset > end + TIFF_HASH_MAX_GAP) {
+                break;
+            }
+
+            if (next_end < end) {
+                next_end = end;
+            }
+
+            if (used + (next_end - start) > round->buf_len) {
+                break;
+            }
+
+            end = next_end;
+        }
+
+        if ( (ret = tiff_read_at(fp, start, round->buf + used,
+                (size_t)(end - start), &got)) != TIFF_OK )
+        {
+            return ret;
+        }
+
+        if (got < end - start) {
+            return TIFF_END_OF_FILE;
+        }
+
+        for (k = i; k < j; k++) {
+            chunks[k].where = used + (size_t)(chunks[k].offset - start);
+        }
+
+        used += (size_t)(end - start);
+        i = j;
+    }
+
+    round->end = i;
+
+    return TIFF_OK;
+}
+
+static void *tiff_hash_pool_worker(void *arg)
+{
+    struct tiff_hash_pool *pool = (struct tiff_hash_pool *)arg;
+    struct tiff_hash_round *round;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->go, &pool->lock);
+        }
+
+        if (pool->stop) {
+            break;
+        }
+
+        seen = pool->generation;
+        round = pool->round;
+
+        pthread_mutex_unlock(&pool->lock);
+        tiff_hash_worker(round);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Start up to threads workers. Fewer, even none, is fine: the caller
+ * hashes whatever they don't.
+ */
+static TIFF_STATUS tiff_hash_pool_start(struct tiff_hash_pool *pool,
+                                        unsigned threads)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (pthread_mutex_init(&pool->lock, NULL)) {
+        return TIFF_NO_MEMORY;
+    }
+
+    if (pthread_cond_init(&pool->go, NULL)) {
+        pthread_mutex_destroy(&pool->lock);
+        return TIFF_NO_MEMORY;
+    }
+
+    if (pthread_cond_init(&pool->idle, NULL)) {
+        pthread_cond_destroy(&pool->go);
+        pthread_mutex_destroy(&pool->lock);
+        return TIFF_NO_MEMORY;
+    }
+
+    for (; pool->started < threads; pool->started++) {
+        if (pthread_create(&pool->tids[pool->started], NULL,
+                tiff_hash_pool_worker, pool))
+        {
+            break;
+        }
+    }
+
+    return TIFF_OK;
+}
+
+/* Hand a round to every worker */
+static void tiff_hash_pool_post(struct tiff_hash_pool *pool,
+                                struct tiff_hash_round *round)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->round = round;
+    pool->busy = pool->started;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->go);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait for the workers to run out of chunks in the posted round */
+static void tiff_hash_pool_wait(struct tiff_hash_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy != 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void tiff_hash_pool_stop(struct tiff_hash_pool *pool)
+{
+    unsigned t;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->go);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (t = 0; t < pool->started; t++) {
+        pthread_join(pool->tids[t], NULL);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->go);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static unsigned tiff_hash_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return 1;
+    }
+
+    return cpus > TIFF_HASH_MAX_THREADS ? TIFF_HASH_MAX_THREADS : (unsigned)cpus;
+}
+
+/*******************************************************************/
+/* Public interface                                                */
+/*******************************************************************/
+
+TIFF_STATUS tiff_hash_image_data(tiff_t *fp, tiff_ifd_t *ifd, int algo,
+                                 tiff_image_digest_t **digest)
+{
+    tiff_image_digest_t *new_digest = NULL;
+    struct tiff_hash_chunk *chunks = NULL;
+    struct tiff_hash_round rounds[2], *cur, *other;
+    struct tiff_hash_pool pool;
+    tiff_allocator_t alloc;
+    UINT64 *scratch = NULL, empty;
+    size_t i, count = 0, next;
+    unsigned threads;
+    int pool_up = 0;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(digest);
+
+    *digest = NULL;
+
+    if (algo != TIFF_HASH_CRC32C && algo != TIFF_HASH_XXH64) {
+        return TIFF_BAD_ARGUMENT;
+    }
+
+    if ( (ret = tiff_load_chunk_table(fp, ifd)) != TIFF_OK ) {
+        return ret;
+    }
+
+    pthread_once(&tiff_crc32c_once, tiff_crc32c_init);
+
+    memset(rounds, 0, sizeof(rounds));
+
+    tiff_get_allocator(&alloc);
+
+    new_digest = (tiff_image_digest_t *)tiff_calloc(&alloc, 1,
+        sizeof(tiff_image_digest_t));
+    if (new_digest == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    new_digest->alloc = alloc;
+    new_digest->algo = algo;
+    new_digest->chunk_count = ifd->chunk_count;
+    new_digest->chunks = (UINT64 *)tiff_calloc(&new_digest->alloc,
+        ifd->chunk_count, sizeof(UINT64));
+
+    chunks = (struct tiff_hash_chunk *)tiff_calloc(&fp->alloc, ifd->chunk_count,
+        sizeof(struct tiff_hash_chunk));
+    scratch = (UINT64 *)tiff_calloc(&fp->alloc, ifd->chunk_count, sizeof(UINT64));
+
+    if (new_digest->chunks == NULL || chunks == NULL || scratch == NULL) {
+        ret = TIFF_NO_MEMORY;
+        goto done;
+    }
+
+    /* Empty chunks need no reading; the rest are read in file order */
+    empty = tiff_hash_bytes(algo, (const uint8_t *)"", 0);
+
+    for (i = 0; i < ifd->chunk_count; i++) {
+        tiff_off_t offset = ifd->chunk_offsets[i];
+        tiff_off_t len = ifd->chunk_sizes[i];
+
+        if (len == 0) {
+            new_digest->chunks[i] = empty;
+            continue;
+        }
+
+        if (len > SIZE_MAX || (fp->file_size != 0 &&
+            (offset > fp->file_size || len > fp->file_size - offset)))
+        {
+            TIFF_TRACE("Chunk %zd runs past the end of the file\n", i);
+            ret = TIFF_TAG_MALFORMED;
+            goto done;
+        }
+
+        chunks[count].offset = offset;
+        chunks[count].len = (size_t)len;
+        chunks[count].index = i;
+        count++;
+    }
+
+    qsort(chunks, count, sizeof(struct tiff_hash_chunk), tiff_hash_chunk_cmp);
+
+    threads = tiff_hash_threads();
+
+    for (i = 0; i < 2; i++) {
+        rounds[i].algo = algo;
+        rounds[i].chunks = chunks;
+        rounds[i].digests = new_digest->chunks;
+        rounds[i].buf_len = (size_t)TIFF_HASH_BLOCK_BYTES * threads;
+        rounds[i].buf = (uint8_t *)tiff_malloc(&fp->alloc, rounds[i].buf_len);
+
+        if (rounds[i].buf == NULL) {
+            ret = TIFF_NO_MEMORY;
+            goto done;
+        }
+    }
+
+    cur = &rounds[0];
+    other = &rounds[1];
+
+    if ( (ret = tiff_hash_fill(fp, cur, 0, count)) != TIFF_OK ) {
+        goto done;
+    }
+
+    if (count > 0) {
+        if ( (ret = tiff_hash_pool_start(&pool, threads < count ?
+                threads : (unsigned)count)) != TIFF_OK )
+        {
+            goto done;
+        }
+        pool_up = 1;
+    }
+
+    while (cur->first < count) {
+        tiff_hash_pool_post(&pool, cur);
+
+        /* Read the next round while this one is hashed */
+        next = cur->end;
+        ret = next < count ? tiff_hash_fill(fp, other, next, count) : TIFF_OK;
+
+        tiff_hash_worker(cur);
+        tiff_hash_pool_wait(&pool);
+
+        if (ret != TIFF_OK) {
+            goto done;
+        }
+
+        if (next >= count) {
+            break;
+        }
+
+        cur = other;
+        other = (cur == &rounds[0]) ? &rounds[1] : &rounds[0];
+    }
+
+    if (ifd->chunk_count != 0) {
+        memcpy(scratch, new_digest->chunks, ifd->chunk_count * sizeof(UINT64));
+        new_digest->image = tiff_hash_tree(algo, scratch, ifd->chunk_count);
+    }
+
+    *digest = new_digest;
+    new_digest = NULL;
+
+done:
+    if (pool_up) {
+        tiff_hash_pool_stop(&pool);
+    }
+
+    for (i = 0; i < 2; i++) {
+        tiff_free(&fp->alloc, rounds[i].buf);
+    }
+
+    tiff_free(&fp->alloc, scratch);
+    tiff_free(&fp->alloc, chunks);
+
+    if (new_digest != NULL) {
+        tiff_image_digest_free(new_digest);
+    }
+
+    return ret;
+}
+
+TIFF_STATUS tiff_image_digest_get(tiff_image_digest_t *digest, UINT64 *image,
+                                  const UINT64 **chunks, size_t *chunk_count)
+{
+    TIFF_ASSERT_ARG(digest);
+
+    if (image) *image = digest->image;
+    if (chunks) *chunks = digest->chunks;
+    if (chunk_count) *chunk_count = digest->chunk_count;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_image_digest_free(tiff_image_digest_t *digest)
+{
+    tiff_allocator_t alloc;
+
+    TIFF_ASSERT_ARG(digest);
+
+    alloc = digest->alloc;
+
+    tiff_free(&alloc, digest->chunks);
+
+    memset(digest, 0, sizeof(tiff_image_digest_t));
+    tiff_free(&alloc, digest);
+
+    return TIFF_OK;
+}
@@ -0,0 +1,1132 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* HTTP range request file manager.
+ *
+ * Files are named by URL and read with HTTP/1.1 GET requests carrying a
+ * Range header, over one keep-alive connection per handle. Opening a
+ * file fetches a prefix of it in the same request that finds its size,
+ * which is usually enough for the header, IFD0 and the EXIF IFD.
+ *
+ * Everything past the prefix is read in blocks, kept in a small LRU
+ * cache. A miss fetches a run of blocks with one request: the blocks
+ * the read needs, a few more if reads have been sequential or a
+ * prefetch hint asked for them, and any cached blocks in short gaps
+ * between, since another round trip costs far more than the bytes.
+ * Reads too big for the cache, like whole strips, go straight into the
+ * caller's buffer.
+ *
+ * A server that ignores Range sends the whole file in answer to the
+ * first request. It is read into memory then, and every later read is
+ * served from there, so the file is only ever fetched once. A file over
+ * max_whole_bytes is refused with TIFF_UNSUPPORTED instead.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define TIFF_HTTP_DEFAULT_PREFIX        (64 << 10)
+#define TIFF_HTTP_DEFAULT_BLOCK         (16 << 10)
+#define TIFF_HTTP_DEFAULT_BLOCKS        64
+#define TIFF_HTTP_DEFAULT_READAHEAD     4
+#define TIFF_HTTP_DEFAULT_GAP           2
+#define TIFF_HTTP_DEFAULT_TIMEOUT_MS    10000
+#define TIFF_HTTP_DEFAULT_MAX_WHOLE     (64 << 20)
+
+/* Status line and headers of a response have to fit in here */
+#define TIFF_HTTP_RECV_BUF              8192
+
+#define TIFF_HTTP_NO_BLOCK              SIZE_MAX
+#define TIFF_HTTP_NO_SIZE               SIZE_MAX
+
+struct tiff_http_block {
+    size_t index;               /* Block number, TIFF_HTTP_NO_BLOCK if free */
+    size_t len;                 /* Short only for the last block of the file */
+    uint64_t used;              /* Clock at the last hit */
+    uint8_t *data;
+};
+
+struct tiff_http_hdl {
+    tiff_allocator_t alloc;
+    tiff_http_options_t opts;
+
+    /* Pieces of the URL, all in the one allocation */
+    char *strings;
+    char *authority;            /* For the Host header */
+    char *host;
+    char *port;
+    char *path;
+
+    int sock;                   /* -1 while not connected */
+
+    size_t pos;
+    size_t size;                /* TIFF_HTTP_NO_SIZE until a response says */
+    uint64_t id;
+
+    uint8_t *prefix;
+    size_t prefix_len;
+
+    struct tiff_http_block *blocks;
+    uint8_t *block_mem;
+    uint64_t clock;
+
+    uint8_t *run;               /* Staging for the blocks of one request */
+    size_t run_blocks;
+
+    uint8_t *whole;             /* All of the file, if Range is ignored */
+    size_t whole_len;
+
+    size_t hint_off;            /* Latest prefetch hint */
+    size_t hint_len;
+    size_t last_end;            /* Where the last read finished */
+
+    uint8_t recv_buf[TIFF_HTTP_RECV_BUF];
+    size_t recv_pos;
+    size_t recv_len;
+};
+
+/* What we care about in a response */
+struct tiff_http_response {
+    int status;
+    int keep_alive;
+    int chunked;
+    int has_length;
+    size_t length;              /* Content-Length */
+    int has_range;
+    size_t range_first;         /* Content-Range */
+    size_t range_last;
+    size_t range_total;         /* TIFF_HTTP_NO_SIZE if '*' */
+    uint64_t validator;         /* Hash of ETag and Last-Modified */
+};
+
+/*******************************************************************/
+/* Connection handling                                             */
+/*******************************************************************/
+
+static void tiff_http_disconnect(struct tiff_http_hdl *h)
+{
+    if (h->sock >= 0) {
+        close(h->sock);
+        h->sock = -1;
+    }
+
+    h->recv_pos = h->recv_len = 0;
+}
+
+static TIFF_STATUS tiff_http_connect(struct tiff_http_hdl *h)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    struct timeval tv;
+    int one = 1;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(h->host, h->port, &hints, &res) != 0) {
+        TIFF_TRACE("Can't resolve %s\n", h->host);
+        return TIFF_FILE_NOT_FOUND;
+    }
+
+    tv.tv_sec = h->opts.timeout_ms / 1000;
+    tv.tv_usec = (h->opts.timeout_ms % 1000) * 1000;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+            ai->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+
+        /* The send timeout covers connect as well */
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (sock < 0) {
+        TIFF_TRACE("Can't connect to %s:%s\n", h->host, h->port);
+        return TIFF_FILE_NOT_FOUND;
+    }
+
+    h->sock = sock;
+    h->recv_pos = h->recv_len = 0;
+
+    return TIFF_OK;
+}
+
+static int tiff_http_send_all(struct tiff_http_hdl *h, const char *buf, size_t len)
+{
+    ssize_t sent;
+
+    while (len > 0) {
+        sent = send(h->sock, buf, len, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent <= 0) {
+            return -1;
+        }
+
+        buf += sent;
+        len -= (size_t)sent;
+    }
+
+    return 0;
+}
+
+/* Receive more into recv_buf. Returns what recv returned. */
+static ssize_t tiff_http_recv_more(struct tiff_http_hdl *h)
+{
+    ssize_t got;
+
+    if (h->recv_pos == h->recv_len) {
+        h->recv_pos = h->recv_len = 0;
+    } else if (h->recv_len == TIFF_HTTP_RECV_BUF && h->recv_pos != 0) {
+        memmove(h->recv_buf, h->recv_buf + h->recv_pos, h->recv_len - h->recv_pos);
+        h->recv_len -= h->recv_pos;
+        h->recv_pos = 0;
+    }
+
+    do {
+        got = recv(h->sock, h->recv_buf + h->recv_len,
+            TIFF_HTTP_RECV_BUF - h->recv_len, 0);
+    } while (got < 0 && errno == EINTR);
+
+    if (got > 0) {
+        h->recv_len += (size_t)got;
+    }
+
+    return got;
+}
+
+/* Read len bytes of body into dst, or throw them away if dst is NULL.
+ * Returns how many bytes arrived before the connection closed.
+ */
+static size_t tiff_http_recv_body(struct tiff_http_hdl *h, uint8_t *dst, size_t len)
+{
+    uint8_t sink[4096];
+    size_t done = 0, n;
+    ssize_t got;
+
+    /* Whatever arrived along with the headers first */
+    n = h->recv_len - h->recv_pos;
+    if (n > len) {
+        n = len;
+    }
+
+    if (dst != NULL) {
+        memcpy(dst, h->recv_buf + h->recv_pos, n);
+    }
+
+    h->recv_pos += n;
+    done = n;
+
+    while (done < len) {
+        n = len - done;
+        if (dst == NULL && n > sizeof(sink)) {
+            n = sizeof(sink);
+        }
+
+        got = recv(h->sock, dst != NULL ? dst + done : sink, n, 0);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (got <= 0) {
+            break;
+        }
+
+        done += (size_t)got;
+    }
+
+    return done;
+}
+
+/*******************************************************************/
+/* Requests                                                        */
+/*******************************************************************/
+
+static uint64_t tiff_http_fnv(uint64_t hash, const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)s[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static int tiff_http_parse_size(const char *s, size_t *val)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+
+    if (end == s || errno != 0 || v > SIZE_MAX) {
+        return -1;
+    }
+
+    *val = (size_t)v;
+
+    return 0;
+}
+
+/* "bytes first-last/total", with either side of the slash possibly "*" */
+static int tiff_http_parse_range(const char *s, struct tiff_http_response *resp)
+{
+    const char *slash;
+
+    if (strncasecmp(s, "bytes", 5) != 0) {
+        return -1;
+    }
+
+    for (s += 5; *s == ' '; s++);
+
+    if ( (slash = strchr(s, '/')) == NULL ) {
+        return -1;
+    }
+
+    resp->range_total = TIFF_HTTP_NO_SIZE;
+    if (slash[1] != '*' && tiff_http_parse_size(slash + 1, &resp->range_total)) {
+        return -1;
+    }
+
+    if (*s == '*') {
+        return 0;
+    }
+
+    if (tiff_http_parse_size(s, &resp->range_first) ||
+        (s = strchr(s, '-')) == NULL || s > slash ||
+        tiff_http_parse_size(s + 1, &resp->range_last) ||
+        resp->range_last < resp->range_first)
+    {
+        return -1;
+    }
+
+    resp->has_range = 1;
+
+    return 0;
+}
+
+/* Find the blank line that ends the headers */
+static char *tiff_http_find_end(char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= len; i++) {
+        if (buf[i] == '\r' && !memcmp(buf + i, "\r\n\r\n", 4)) {
+            return buf + i;
+        }
+    }
+
+    return NULL;
+}
+
+/* Receive and parse the status line and headers of a response. *idle is
+ * set if the connection closed before anything at all arrived.
+ */
+static TIFF_STATUS tiff_http_read_headers(struct tiff_http_hdl *h,
+                                          struct tiff_http_response *resp,
+                                          int *idle)
+{
+    char *hdr, *end, *line, *next, *value;
+    uint64_t validator = 0xcbf29ce484222325ull;
+    int minor = 0;
+    ssize_t got;
+
+    memset(resp, 0, sizeof(*resp));
+    *idle = 0;
+
+    for (;;) {
+        hdr = (char *)h->recv_buf + h->recv_pos;
+        end = tiff_http_find_end(hdr, h->recv_len - h->recv_pos);
+
+        if (end != NULL) {
+            break;
+        }
+
+        if (h->recv_pos == 0 && h->recv_len == TIFF_HTTP_RECV_BUF) {
+            TIFF_TRACE("Response headers too long\n");
+            return TIFF_UNSUPPORTED;
+        }
+
+        if ( (got = tiff_http_recv_more(h)) <= 0 ) {
+            *idle = h->recv_len == 0;
+            return TIFF_END_OF_FILE;
+        }
+    }
+
+    *end = '\0';
+    h->recv_pos = (size_t)((uint8_t *)end + 4 - h->recv_buf);
+
+    if (sscanf(hdr, "HTTP/1.%d %d", &minor, &resp->status) != 2) {
+        TIFF_TRACE("Bad status line\n");
+        return TIFF_UNSUPPORTED;
+    }
+
+    resp->keep_alive = minor >= 1;
+
+    for (line = strstr(hdr, "\r\n"); line != NULL; line = next) {
+        line += 2;
+
+        if ( (next = strstr(line, "\r\n")) != NULL ) {
+            *next = '\0';
+        }
+
+        if ( (value = strchr(line, ':')) == NULL ) {
+            continue;
+        }
+
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+
+        if (!strcasecmp(line, "Content-Length")) {
+            if (tiff_http_parse_size(value, &resp->length)) {
+                return TIFF_UNSUPPORTED;
+            }
+            resp->has_length = 1;
+        } else if (!strcasecmp(line, "Content-Range")) {
+            if (tiff_http_parse_range(value, resp)) {
+                TIFF_TRACE("Bad Content-Range: %s\n", value);
+                return TIFF_UNSUPPORTED;
+            }
+        } else if (!strcasecmp(line, "Transfer-Encoding")) {
+            resp->chunked = strcasecmp(value, "identity") != 0;
+        } else if (!strcasecmp(line, "Connection")) {
+            if (!strcasecmp(value, "close")) {
+                resp->keep_alive = 0;
+            } else if (!strcasecmp(value, "keep-alive")) {
+                resp->keep_alive = 1;
+            }
+        } else if (!strcasecmp(line, "ETag") ||
+                   !strcasecmp(line, "Last-Modified"))
+        {
+            validator = tiff_http_fnv(validator, value, strlen(value));
+            resp->validator = validator;
+        }
+    }
+
+    return TIFF_OK;
+}
+
+/* Take what the response tells us about the file as a whole */
+static void tiff_http_note_file(struct tiff_http_hdl *h, size_t size,
+                                struct tiff_http_response *resp)
+{
+    if (size == TIFF_HTTP_NO_SIZE || h->size != TIFF_HTTP_NO_SIZE) {
+        return;
+    }
+
+    h->size = size;
+
+    /* Identify the file by where it is, its size and its validators */
+    h->id = tiff_http_fnv(0xcbf29ce484222325ull, h->authority,
+        strlen(h->authority));
+    h->id = tiff_http_fnv(h->id, h->path, strlen(h->path));
+    h->id = tiff_http_fnv(h->id, (const char *)&size, sizeof(size));
+    h->id ^= resp->validator;
+}
+
+/* Handle the response to a request for len bytes at off */
+static TIFF_STATUS tiff_http_response(struct tiff_http_hdl *h, size_t off,
+                                      size_t len, uint8_t *dst, size_t *got,
+                                      int *idle)
+{
+    struct tiff_http_response resp;
+    size_t body;
+    TIFF_STATUS ret;
+
+    *got = 0;
+
+    if ( (ret = tiff_http_read_headers(h, &resp, idle)) != TIFF_OK ) {
+        tiff_http_disconnect(h);
+        return ret;
+    }
+
+    if (resp.chunked) {
+        TIFF_TRACE("Chunked responses aren't supported\n");
+        tiff_http_disconnect(h);
+        return TIFF_UNSUPPORTED;
+    }
+
+    switch (resp.status) {
+    case 206:
+        if (!resp.has_range || resp.range_first != off ||
+            resp.range_last - resp.range_first >= len ||
+            (resp.has_length &&
+             resp.length != resp.range_last - resp.range_first + 1))
+        {
+            TIFF_TRACE("Server sent a range we didn't ask for\n");
+            tiff_http_disconnect(h);
+            return TIFF_UNSUPPORTED;
+        }
+
+        tiff_http_note_file(h, resp.range_total, &resp);
+
+        body = resp.range_last - resp.range_first + 1;
+        *got = tiff_http_recv_body(h, dst, body);
+
+        if (*got < body) {
+            resp.keep_alive = 0;
+        }
+        break;
+
+    case 200:
+        /* No Range support: keep the whole file, so that no later read
+         * has to fetch it again.
+         */
+        if (!resp.has_length || resp.length > h->opts.max_whole_bytes) {
+            TIFF_TRACE("Server ignores Range, and the file is too big to hold\n");
+            tiff_http_disconnect(h);
+            return TIFF_UNSUPPORTED;
+        }
+
+        h->whole = (uint8_t *)tiff_malloc(&h->alloc,
+            resp.length ? resp.length : 1);
+        if (h->whole == NULL) {
+            tiff_http_disconnect(h);
+            return TIFF_NO_MEMORY;
+        }
+
+        if (tiff_http_recv_body(h, h->whole, resp.length) < resp.length) {
+            tiff_free(&h->alloc, h->whole);
+            h->whole = NULL;
+            tiff_http_disconnect(h);
+            return TIFF_END_OF_FILE;
+        }
+
+        h->whole_len = resp.length;
+        tiff_http_note_file(h, resp.length, &resp);
+
+        if (off < h->whole_len) {
+            *got = h->whole_len - off < len ? h->whole_len - off : len;
+            memcpy(dst, h->whole + off, *got);
+        }
+
+        resp.keep_alive = 0;
+        break;
+
+    case 416:
+        /* Asked for bytes past the end; the reply says where it is */
+        if (resp.range_total != TIFF_HTTP_NO_SIZE) {
+            tiff_http_note_file(h, resp.range_total, &resp);
+        }
+
+        if (resp.has_length) {
+            tiff_http_recv_body(h, NULL, resp.length);
+        } else {
+            resp.keep_alive = 0;
+        }
+        break;
+
+    default:
+        TIFF_TRACE("HTTP status %d for %s\n", resp.status, h->path);
+        tiff_http_disconnect(h);
+        return (resp.status == 404 || resp.status == 410) ?
+            TIFF_FILE_NOT_FOUND : TIFF_UNSUPPORTED;
+    }
+
+    if (!resp.keep_alive) {
+        tiff_http_disconnect(h);
+    }
+
+    return TIFF_OK;
+}
+
+/* Fetch up to len bytes at off into dst. A connection the server has
+ * dropped while idle is retried once on a new one.
+ */
+static TIFF_STATUS tiff_http_request(struct tiff_http_hdl *h, size_t off,
+                                     size_t len, uint8_t *dst, size_t *got)
+{
+    char req[1024];
+    int n, reused, idle, attempt;
+    TIFF_STATUS ret = TIFF_END_OF_FILE;
+
+    *got = 0;
+
+    if (len == 0) {
+        return TIFF_OK;
+    }
+
+    n = snprintf(req, sizeof(req),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Range: bytes=%zu-%zu\r\n"
+        "User-Agent: libghetto\r\n"
+        "\r\n",
+        h->path, h->authority, off, off + len - 1);
+
+    if (n < 0 || (size_t)n >= sizeof(req)) {
+        return TIFF_BAD_ARGUMENT;
+    }
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        reused = h->sock >= 0;
+
+        if (!reused && (ret = tiff_http_connect(h)) != TIFF_OK) {
+            return ret;
+        }
+
+        if (tiff_http_send_all(h, req, (size_t)n)) {
+            tiff_http_disconnect(h);
+            ret = TIFF_END_OF_FILE;
+            if (reused) {
+                continue;
+            }
+            return ret;
+        }
+
+        ret = tiff_http_response(h, off, len, dst, got, &idle);
+
+        if (ret == TIFF_END_OF_FILE && idle && reused) {
+            continue;
+        }
+
+        return ret;
+    }
+
+    return ret;
+}
+
+/*******************************************************************/
+/* Block cache                                                     */
+/*******************************************************************/
+
+static struct tiff_http_block *tiff_http_find(struct tiff_http_hdl *h,
+                                              size_t index)
+{
+    size_t i;
+
+    for (i = 0; i < h->opts.cache_blocks; i++) {
+        if (h->blocks[i].index == index) {
+            return &h->blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void tiff_http_insert(struct tiff_http_hdl *h, size_t index,
+                             const uint8_t *data, size_t len)
+{
+    struct tiff_http_block *victim = &h->blocks[0];
+    size_t i;
+
+    if (tiff_http_find(h, index) != NULL) {
+        return;
+    }
+
+    /* Free blocks have never been used, so they go first */
+    for (i = 1; i < h->opts.cache_blocks; i++) {
+        if (h->blocks[i].used < victim->used) {
+            victim = &h->blocks[i];
+        }
+    }
+
+    memcpy(victim->data, data, len);
+    victim->index = index;
+    victim->len = len;
+    victim->used = ++h->clock;
+}
+
+/* Satisfy a read of want bytes at off, which starts in a block that
+ * isn't cached. Returns how much of it was copied to dst in *done.
+ */
+static TIFF_STATUS tiff_http_fill(struct tiff_http_hdl *h, size_t off,
+                                  size_t want, uint8_t *dst, size_t *done)
+{
+    size_t bs = h->opts.block_size;
+    size_t first = off / bs, last, need_last, i, cached, got, skip;
+    TIFF_STATUS ret;
+
+    *done = 0;
+
+    /* Too big to be worth caching: straight into the caller's buffer */
+    if (want >= bs * h->opts.cache_blocks / 2) {
+        return tiff_http_request(h, off, want, dst, done);
+    }
+
+    need_last = last = (off + want - 1) / bs;
+
+    if (off == h->last_end) {
+        last += h->opts.readahead_blocks;
+    }
+
+    if (off >= h->hint_off && off - h->hint_off < h->hint_len) {
+        i = (h->hint_off + h->hint_len - 1) / bs;
+        last = i > last ? i : last;
+    }
+
+    if (last - first >= h->run_blocks) {
+        last = first + h->run_blocks - 1;
+    }
+
+    if (h->size != TIFF_HTTP_NO_SIZE && h->size != 0 && last > (h->size - 1) / bs) {
+        last = (h->size - 1) / bs;
+    }
+
+    /* Fetch cached blocks again to bridge short gaps, but stop at a long
+     * one, and don't fetch cached blocks past the end of the read.
+     */
+    for (i = first + 1, cached = 0; i <= last; i++) {
+        if (tiff_http_find(h, i) == NULL) {
+            cached = 0;
+            continue;
+        }
+
+        if (++cached > h->opts.gap_blocks) {
+            last = i - cached;
+            break;
+        }
+    }
+
+    while (last > need_last && last > first && tiff_http_find(h, last) != NULL) {
+        last--;
+    }
+
+    if ( (ret = tiff_http_request(h, first * bs, (last - first + 1) * bs,
+            h->run, &got)) != TIFF_OK )
+    {
+        return ret;
+    }
+
+    if (got < (last - first + 1) * bs && h->size == TIFF_HTTP_NO_SIZE) {
+        h->size = first * bs + got;
+    }
+
+    for (i = 0; i * bs < got; i++) {
+        tiff_http_insert(h, first + i, h->run + i * bs,
+            got - i * bs < bs ? got - i * bs : bs);
+    }
+
+    skip = off - first * bs;
+    if (got > skip) {
+        *done = got - skip < want ? got - skip : want;
+        memcpy(dst, h->run + skip, *done);
+    }
+
+    return TIFF_OK;
+}
+
+/*******************************************************************/
+/* File manager                                                    */
+/*******************************************************************/
+
+/* Split "http://host[:port][/path]" up */
+static TIFF_STATUS tiff_http_parse_url(struct tiff_http_hdl *h, const char *url)
+{
+    const char *auth, *slash, *colon;
+    size_t auth_len, len;
+    char *s;
+
+    if (strncasecmp(url, "http://", 7) != 0) {
+        TIFF_TRACE("Only http:// URLs are supported: %s\n", url);
+        return TIFF_UNSUPPORTED;
+    }
+
+    auth = url + 7;
+    slash = strchr(auth, '/');
+    auth_len = slash ? (size_t)(slash - auth) : strlen(auth);
+
+    if (auth_len == 0) {
+        return TIFF_BAD_ARGUMENT;
+    }
+
+    /* Room for the authority twice (once as host and port) and the path */
+    len = 3 * strlen(url) + 8;
+    h->strings = (char *)tiff_malloc(&h->alloc, len);
+    if (h->strings == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    s = h->strings;
+
+    h->authority = s;
+    memcpy(s, auth, auth_len);
+    s[auth_len] = '\0';
+    s += auth_len + 1;
+
+    /* A port follows the last colon, unless it's inside [IPv6] */
+    for (colon = auth + auth_len; colon > auth && colon[-1] != ':' &&
+        colon[-1] != ']'; colon--);
+    colon = (colon > auth && colon[-1] == ':') ? colon - 1 : NULL;
+
+    h->host = s;
+    if (auth[0] == '[') {
+        const char *close = memchr(auth, ']', auth_len);
+        if (close == NULL) {
+            return TIFF_BAD_ARGUMENT;
+        }
+        memcpy(s, auth + 1, (size_t)(close - auth - 1));
+        s[close - auth - 1] = '\0';
+    } else {
+        len = colon ? (size_t)(colon - auth) : auth_len;
+        memcpy(s, auth, len);
+        s[len] = '\0';
+    }
+    s += strlen(s) + 1;
+
+    h->port = s;
+    if (colon != NULL) {
+        len = (size_t)(auth + auth_len - colon - 1);
+        memcpy(s, colon + 1, len);
+        s[len] = '\0';
+    } else {
+        strcpy(s, "80");
+    }
+    s += strlen(s) + 1;
+
+    h->path = s;
+    strcpy(s, slash ? slash : "/");
+
+    return TIFF_OK;
+}
+
+static void tiff_http_destroy(struct tiff_http_hdl *h)
+{
+    tiff_allocator_t alloc = h->alloc;
+
+    tiff_http_disconnect(h);
+
+    tiff_free(&alloc, h->strings);
+    tiff_free(&alloc, h->prefix);
+    tiff_free(&alloc, h->blocks);
+    tiff_free(&alloc, h->block_mem);
+    tiff_free(&alloc, h->run);
+    tiff_free(&alloc, h->whole);
+    tiff_free(&alloc, h);
+}
+
+TIFF_STATUS tiff_http_hdl_create(tiff_file_hdl_t **hdl, const char *url,
+                                 const tiff_http_options_t *opts)
+{
+    struct tiff_http_hdl *h = NULL;
+    tiff_allocator_t alloc;
+    size_t i;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(url);
+
+    tiff_get_allocator(&alloc);
+
+    h = (struct tiff_http_hdl *)tiff_calloc(&alloc, 1, sizeof(*h));
+    if (h == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    h->alloc = alloc;
+    h->sock = -1;
+    h->size = TIFF_HTTP_NO_SIZE;
+    h->last_end = TIFF_HTTP_NO_SIZE;
+
+    if (opts != NULL) {
+        h->opts = *opts;
+    }
+
+    if (h->opts.prefix_bytes == 0) h->opts.prefix_bytes = TIFF_HTTP_DEFAULT_PREFIX;
+    if (h->opts.block_size == 0) h->opts.block_size = TIFF_HTTP_DEFAULT_BLOCK;
+    if (h->opts.cache_blocks == 0) h->opts.cache_blocks = TIFF_HTTP_DEFAULT_BLOCKS;
+    if (h->opts.readahead_blocks == 0) {
+        h->opts.readahead_blocks = TIFF_HTTP_DEFAULT_READAHEAD;
+    }
+    if (h->opts.gap_blocks == 0) h->opts.gap_blocks = TIFF_HTTP_DEFAULT_GAP;
+    if (h->opts.timeout_ms == 0) h->opts.timeout_ms = TIFF_HTTP_DEFAULT_TIMEOUT_MS;
+    if (h->opts.max_whole_bytes == 0) {
+        h->opts.max_whole_bytes = TIFF_HTTP_DEFAULT_MAX_WHOLE;
+    }
+
+    h->run_blocks = h->opts.cache_blocks;
+
+    if ( (ret = tiff_http_parse_url(h, url)) != TIFF_OK ) {
+        goto fail;
+    }
+
+    h->prefix = (uint8_t *)tiff_malloc(&alloc, h->opts.prefix_bytes);
+    h->blocks = (struct tiff_http_block *)tiff_calloc(&alloc,
+        h->opts.cache_blocks, sizeof(struct tiff_http_block));
+    h->block_mem = (uint8_t *)tiff_calloc(&alloc, h->opts.cache_blocks,
+        h->opts.block_size);
+    h->run = (uint8_t *)tiff_calloc(&alloc, h->run_blocks, h->opts.block_size);
+
+    if (h->prefix == NULL || h->blocks == NULL || h->block_mem == NULL ||
+        h->run == NULL)
+    {
+        ret = TIFF_NO_MEMORY;
+        goto fail;
+    }
+
+    for (i = 0; i < h->opts.cache_blocks; i++) {
+        h->blocks[i].index = TIFF_HTTP_NO_BLOCK;
+        h->blocks[i].data = h->block_mem + i * h->opts.block_size;
+    }
+
+    /* The first request finds the size, and gets the header with it */
+    if ( (ret = tiff_http_request(h, 0, h->opts.prefix_bytes, h->prefix,
+            &h->prefix_len)) != TIFF_OK )
+    {
+        goto fail;
+    }
+
+    if (h->size == TIFF_HTTP_NO_SIZE && h->prefix_len < h->opts.prefix_bytes) {
+        h->size = h->prefix_len;
+    }
+
+    *hdl = (tiff_file_hdl_t *)h;
+
+    return TIFF_OK;
+
+fail:
+    tiff_http_destroy(h);
+    return ret;
+}
+
+TIFF_STATUS tiff_http_open(tiff_file_hdl_t **hdl, const char *file,
+                           const char *mode)
+{
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(file);
+    TIFF_ASSERT_ARG(mode);
+
+    if (mode[0] != 'r' || strchr(mode, '+') != NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    return tiff_http_hdl_create(hdl, file, NULL);
+}
+
+TIFF_STATUS tiff_http_close(tiff_file_hdl_t *hdl)
+{
+    TIFF_ASSERT_ARG(hdl);
+
+    tiff_http_destroy((struct tiff_http_hdl *)hdl);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_http_read(tiff_file_hdl_t *hdl,
+                           size_t size, size_t nmemb, void *buf, size_t *count)
+{
+    struct tiff_http_hdl *h = (struct tiff_http_hdl *)hdl;
+    struct tiff_http_block *blk;
+    uint8_t *dst = (uint8_t *)buf;
+    size_t len = size * nmemb, done = 0, off, n, in_blk;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(buf);
+
+    if (h->size != TIFF_HTTP_NO_SIZE) {
+        len = h->pos < h->size ? (h->size - h->pos < len ? h->size - h->pos : len) : 0;
+    }
+
+    while (done < len) {
+        off = h->pos + done;
+
+        /* The server sent it all; there's nothing more to fetch */
+        if (h->whole != NULL) {
+            if (off >= h->whole_len) {
+                break;
+            }
+
+            n = h->whole_len - off < len - done ? h->whole_len - off : len - done;
+            memcpy(dst + done, h->whole + off, n);
+            done += n;
+            continue;
+        }
+
+        if (off < h->prefix_len) {
+            n = h->prefix_len - off < len - done ? h->prefix_len - off : len - done;
+            memcpy(dst + done, h->prefix + off, n);
+            done += n;
+            continue;
+        }
+
+        if ( (blk = tiff_http_find(h, off / h->opts.block_size)) != NULL ) {
+            in_blk = off % h->opts.block_size;
+            if (in_blk >= blk->len) {
+                break;
+            }
+
+            n = blk->len - in_blk < len - done ? blk->len - in_blk : len - done;
+            memcpy(dst + done, blk->data + in_blk, n);
+            blk->used = ++h->clock;
+            done += n;
+            continue;
+        }
+
+        if (tiff_http_fill(h, off, len - done, dst + done, &n) != TIFF_OK ||
+            n == 0)
+        {
+            break;
+        }
+
+        done += n;
+    }
+
+    h->pos += done;
+    h->last_end = h->pos;
+
+    if (count) {
+        *count = size ? done / size : 0;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_http_seek(tiff_file_hdl_t *hdl, size_t offset, int whence)
+{
+    struct tiff_http_hdl *h = (struct tiff_http_hdl *)hdl;
+    size_t base;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    switch (whence) {
+    case TIFF_SEEK_CUR:
+        base = h->pos;
+        break;
+    case TIFF_SEEK_SET:
+        base = 0;
+        break;
+    case TIFF_SEEK_END:
+        if (h->size == TIFF_HTTP_NO_SIZE) {
+            return TIFF_UNSUPPORTED;
+        }
+        base = h->size;
+        break;
+    default:
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* Relative seeks backwards come in as wrapped offsets, like fseek */
+    if ((ssize_t)(base + offset) < 0) {
+        return TIFF_END_OF_FILE;
+    }
+
+    h->pos = base + offset;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_http_prefetch(tiff_file_hdl_t *hdl, size_t offset, size_t len)
+{
+    struct tiff_http_hdl *h = (struct tiff_http_hdl *)hdl;
+
+    TIFF_ASSERT_ARG(hdl);
+
+    /* Only noted here; the next read that lands in it fetches it all */
+    if (h->hint_len != 0 && offset >= h->hint_off &&
+        offset <= h->hint_off + h->hint_len + h->opts.gap_blocks * h->opts.block_size)
+    {
+        if (offset + len > h->hint_off + h->hint_len) {
+            h->hint_len = offset + len - h->hint_off;
+        }
+    } else {
+        h->hint_off = offset;
+        h->hint_len = len;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_http_identify(tiff_file_hdl_t *hdl, uint64_t *id)
+{
+    struct tiff_http_hdl *h = (struct tiff_http_hdl *)hdl;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(id);
+
+    if (h->size == TIFF_HTTP_NO_SIZE) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    *id = h->id;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_http_size(tiff_file_hdl_t *hdl, size_t *size)
+{
+    struct tiff_http_hdl *h = (struct tiff_http_hdl *)hdl;
+
+    TIFF_ASSERT_ARG(hdl);
+    TIFF_ASSERT_ARG(size);
+
+    if (h->size == TIFF_HTTP_NO_SIZE) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    *size = h->size;
+
+    return TIFF_OK;
+}
+
+tiff_file_mgr_t tiff_http_mgr_s = {
+    .open = tiff_http_open,
+    .close = tiff_http_close,
+    .read = tiff_http_read,
+    .seek = tiff_http_seek,
+    .prefetch = tiff_http_prefetch,
+    .identify = tiff_http_identify,
+    .size = tiff_http_size
+};
+
+tiff_file_mgr_t *tiff_http_mgr = &tiff_http_mgr_s;
@@ -44,6 +44,24 @@ TIFF_STATUS tiff_get_base_ifd_offset(tiff_t *fp, tiff_off_t *off)
     return TIFF_OK;
 }
 
+/* Whether another IFD of the given size may be parsed */
+static TIFF_STATUS tiff_ifd_check_limits(tiff_t *fp, size_t entries)
+{
+    if (fp->limits.max_ifds != 0 &&
+        fp->stats.ifds_parsed >= fp->limits.max_ifds)
+    {
+        return TIFF_LIMIT_IFDS;
+    }
+
+    if (fp->limits.max_tags_per_ifd != 0 &&
+        entries > fp->limits.max_tags_per_ifd)
+    {
+        return TIFF_LIMIT_TAGS;
+    }
+
+    return TIFF_OK;
+}
+
 static TIFF_STATUS tiff_ingest_ifd(tiff_t *fp, tiff_ifd_t *ifd,
                                    void *buf, size_t entries)
 {
@@ -55,22 +73,23 @@ static TIFF_STATUS tiff_ingest_ifd(tiff_t *fp, tiff_ifd_t *ifd,
 
     TIFF_ASSERT(entries != 0);
 
-    ifd->tags = (tiff_tag_t *)calloc(1, sizeof(tiff_tag_t) * entries);
+    /* The entries, then their ids, in one block */
+    ifd->tags = (tiff_tag_t *)tiff_calloc(&fp->alloc, entries,
+        TIFF_IFD_TAG_SIZE);
 
-    TIFF_TRACE("Opening IFD with %zd entries\n", entries);
+    fp->stats.ifds_parsed++;
 
     if (ifd->tags == NULL) {
         TIFF_TRACE("Failed to allocate %zd bytes for tag info\n",
-            sizeof(tiff_tag_t) * (size_t)entries);
+            TIFF_IFD_TAG_SIZE * (size_t)entries);
         return TIFF_NO_MEMORY;
     }
 
-    TIFF_TRACE("{ %-8s %-8s %-8s %-8s }\n",
-            "ID", "type", "count", "value");
+    ifd->tag_ids = (tiff_tag_id_t *)(ifd->tags + entries);
 
     /* Start parsing the IFD records */
     for (i = 0; i < (size_t)entries; i++) {
-        uint64_t val;
+        uint32_t val;
         tiff_tag_id_t tag_id;
         uint32_t count;
         uint16_t type;
@@ -84,14 +103,11 @@ static TIFF_STATUS tiff_ingest_ifd(tiff_t *fp, tiff_ifd_t *ifd,
          */
         val = TIFF_DWORD(buf_off, IFD_ENTRY_OFFSET, MACH_ENDIANESS);
 
-        TIFF_TRACE("{ %8.8u %8.4u %-8.8x %-8.8x }\n",
-            (unsigned)tag_id, (unsigned)type, (unsigned)count,
-            (unsigned)val);
-
         ifd->tags[i].id = tag_id;
-        ifd->tags[i].type = (int)type;
+        ifd->tags[i].type = type;
         ifd->tags[i].count = count;
         ifd->tags[i].offset = val;
+        ifd->tag_ids[i] = tag_id;
 
         buf_off += IFD_ENTRY_LEN;
     }
@@ -113,7 +129,10 @@ TIFF_STATUS tiff_make_ifd(tiff_t *fp, void *buf, size_t count, tiff_off_t tag_of
     *ifd = NULL;
 
     /* Make sure the count allows for at least one IFD entry. */
-    TIFF_ASSERT(count >= (2 + IFD_ENTRY_LEN + sizeof(uint32_t)));
+    if (count < 2 + IFD_ENTRY_LEN + sizeof(uint32_t)) {
+        TIFF_TRACE("IFD data is too small to hold an entry\n");
+        return TIFF_RANGE_ERROR;
+    }
 
     /* Read the first WORD to figure out how big the IFD is */
     dir_ents = TIFF_WORD(buf, 0, fp->endianess);
@@ -123,7 +142,11 @@ TIFF_STATUS tiff_make_ifd(tiff_t *fp, void *buf, size_t count, tiff_off_t tag_of
         return TIFF_RANGE_ERROR;
     }
 
-    new_ifd = (tiff_ifd_t *)calloc(1, sizeof(tiff_ifd_t));
+    if ( (ret = tiff_ifd_check_limits(fp, dir_ents)) != TIFF_OK ) {
+        return ret;
+    }
+
+    new_ifd = (tiff_ifd_t *)tiff_calloc(&fp->alloc, 1, sizeof(tiff_ifd_t));
     if (new_ifd == NULL) {
         return TIFF_NO_MEMORY;
     }
@@ -133,18 +156,18 @@ TIFF_STATUS tiff_make_ifd(tiff_t *fp, void *buf, size_t count, tiff_off_t tag_of
         fp->endianess);
     new_ifd->tag_count = dir_ents;
 
-    TIFF_TRACE("next IFD offset: %08x\n", (unsigned)new_ifd->next_ifd_off);
-
     /* Now ingest the IFD */
     if ( (ret = tiff_ingest_ifd(fp, new_ifd, ((uint8_t *)buf) + 2, dir_ents))
         != TIFF_OK)
     {
-        free(new_ifd);
+        tiff_free(&fp->alloc, new_ifd);
         return ret;
     }
 
     new_ifd->tag_offset = tag_off;
 
+    TIFF_EVENT(TIFF_EVENT_IFD, fp, 0, count, dir_ents, 0, TIFF_OK);
+
     *ifd = new_ifd;
 
     return TIFF_OK;
@@ -153,9 +176,9 @@ TIFF_STATUS tiff_make_ifd(tiff_t *fp, void *buf, size_t count, tiff_off_t tag_of
 /* Read a TIFF IFD at offset */
 TIFF_STATUS tiff_read_ifd(tiff_t *fp, tiff_off_t off, tiff_ifd_t **ifd)
 {
-    tiff_ifd_t *new_ifd;
+    tiff_ifd_t *new_ifd = NULL;
     uint16_t dir_ents;
-    size_t count, bytes;
+    size_t count = 0, more = 0, bytes;
     uint8_t *buf = NULL;
 
     TIFF_STATUS ret = TIFF_OK;
@@ -165,39 +188,68 @@ TIFF_STATUS tiff_read_ifd(tiff_t *fp, tiff_off_t off, tiff_ifd_t **ifd)
 
     *ifd = NULL;
 
-    TIFF_SEEK(fp, off, TIFF_SEEK_SET);
-    if (TIFF_READ(fp, 2, 1, &dir_ents, &count) != TIFF_OK) {
-        TIFF_TRACE("read %zd entries, aborting\n", count);
-        return TIFF_END_OF_FILE;
+    /* Speculatively read enough for a typical IFD, so that the entry
+     * count and the entries usually come in with a single read.
+     */
+    buf = (uint8_t *)tiff_malloc(&fp->alloc, IFD_READAHEAD);
+
+    if (buf == NULL) {
+        TIFF_TRACE("Failed to allocate %d bytes\n", IFD_READAHEAD);
+        return TIFF_NO_MEMORY;
     }
 
-    dir_ents = TIFF_SWAP_WORD(dir_ents, fp->endianess);
+    if ( (ret = tiff_read_at(fp, off, buf, IFD_READAHEAD, &count)) != TIFF_OK ||
+         count < 2)
+    {
+        TIFF_TRACE("read %zd bytes, aborting\n", count);
+        if (ret == TIFF_OK) ret = TIFF_END_OF_FILE;
+        goto done_free;
+    }
+
+    dir_ents = TIFF_WORD(buf, 0, fp->endianess);
 
     if (dir_ents < 1) {
         TIFF_TRACE("zero entries found in IFD!\n");
-        return TIFF_RANGE_ERROR;
+        ret = TIFF_RANGE_ERROR;
+        goto done_free;
     }
 
-    TIFF_PRINT("ifd @ %08x - %d entries\n", (unsigned)off, (int)dir_ents);
-
-    /* load up a buffer of count IFD entries + 4 bytes for the next IFD offset */
-    bytes = (size_t)dir_ents * IFD_ENTRY_LEN + 4;
-
-    buf = (uint8_t *)calloc(1, bytes);
-
-    if (buf == NULL) {
-        TIFF_TRACE("Failed to allocate %zd bytes\n", bytes);
-        return TIFF_NO_MEMORY;
+    if ( (ret = tiff_ifd_check_limits(fp, dir_ents)) != TIFF_OK ) {
+        goto done_free;
     }
 
-    if (TIFF_READ(fp, bytes, 1, buf, &count) != TIFF_OK) {
-        TIFF_TRACE("Failed to read %zd bytes", bytes);
+    /* count word + IFD entries + 4 bytes for the next IFD offset */
+    bytes = 2 + (size_t)dir_ents * IFD_ENTRY_LEN + 4;
+
+    if (fp->file_size != 0 && bytes > fp->file_size - off) {
+        TIFF_TRACE("IFD of %zd bytes runs past the end of the file\n", bytes);
         ret = TIFF_END_OF_FILE;
         goto done_free;
     }
 
+    if (bytes > count) {
+        if (bytes > IFD_READAHEAD) {
+            uint8_t *new_buf = (uint8_t *)tiff_realloc(&fp->alloc, buf, count, bytes);
+
+            if (new_buf == NULL) {
+                TIFF_TRACE("Failed to allocate %zd bytes\n", bytes);
+                ret = TIFF_NO_MEMORY;
+                goto done_free;
+            }
+            buf = new_buf;
+        }
+
+        if ( (ret = tiff_read_at(fp, off + count, buf + count, bytes - count,
+                &more)) != TIFF_OK || count + more < bytes)
+        {
+            TIFF_TRACE("Failed to read %zd bytes\n", bytes);
+            if (ret == TIFF_OK) ret = TIFF_END_OF_FILE;
+            goto done_free;
+        }
+    }
+
     /* Allocate new IFD */
-    new_ifd = (tiff_ifd_t *)calloc(1, sizeof(tiff_ifd_t));
+    new_ifd = (tiff_ifd_t *)tiff_calloc(&fp->alloc, 1, sizeof(tiff_ifd_t));
 
     if (new_ifd == NULL) {
         TIFF_TRACE("Failed to allocate %zd bytes for IFD\n", sizeof(tiff_ifd_t));
@@ -206,30 +258,31 @@ TIFF_STATUS tiff_read_ifd(tiff_t *fp, tiff_off_t off, tiff_ifd_t **ifd)
     }
 
     /* Grab the offset of the next IFD */
-    new_ifd->next_ifd_off = TIFF_DWORD(buf, (size_t)dir_ents * IFD_ENTRY_LEN,
+    new_ifd->next_ifd_off = TIFF_DWORD(buf, 2 + (size_t)dir_ents * IFD_ENTRY_LEN,
         fp->endianess);
 
     new_ifd->tag_count = (size_t)dir_ents;
 
-    TIFF_TRACE("Next IFD: %08x\n", (unsigned)new_ifd->next_ifd_off);
-
-    if ( (ret = tiff_ingest_ifd(fp, new_ifd, buf, dir_ents)) != TIFF_OK ) {
+    if ( (ret = tiff_ingest_ifd(fp, new_ifd, buf + 2, dir_ents)) != TIFF_OK ) {
         goto done_free_ifd;
     }
 
     new_ifd->tag_offset = 0;
+    new_ifd->offset = off;
+
+    TIFF_EVENT(TIFF_EVENT_IFD, fp, off, bytes, dir_ents, 0, TIFF_OK);
 
-    free(buf);
+    tiff_free(&fp->alloc, buf);
 
     *ifd = new_ifd;
 
     return TIFF_OK;
 
 done_free_ifd:
-    if (new_ifd) free(new_ifd);
+    tiff_free(&fp->alloc, new_ifd);
 
 done_free:
-    if (buf) free(buf);
+    tiff_free(&fp->alloc, buf);
 
     return ret;
 }
@@ -242,6 +295,65 @@ TIFF_STATUS tiff_get_next_ifd_offset(tiff_t *fp, tiff_ifd_t *ifd, tiff_off_t *of
 
     *off = ifd->next_ifd_off;
 
+    if (*off != 0 && *off == ifd->offset) {
+        *off = 0;
+        return TIFF_IFD_LOOP;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_next_ifd(tiff_t *fp, tiff_ifd_chain_t *chain,
+                          tiff_ifd_t *ifd, tiff_off_t *off)
+{
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(chain);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(off);
+
+    *off = ifd->next_ifd_off;
+
+    if (*off == 0) {
+        return TIFF_OK;
+    }
+
+    /* Anything but the IFD we last pointed at restarts the loop detection
+     * from there. The depth carries on, so the walk is still bounded.
+     */
+    if (chain->depth == 0 || ifd->offset != chain->pos) {
+        chain->mark = ifd->offset;
+        chain->power = 1;
+        chain->lam = 0;
+    }
+
+    chain->depth++;
+    chain->lam++;
+
+    if (fp->limits.max_chain_depth != 0 &&
+        chain->depth > fp->limits.max_chain_depth)
+    {
+        *off = 0;
+        return TIFF_LIMIT_DEPTH;
+    }
+
+    /* Brent's algorithm: compare against a mark that moves up to the
+     * current IFD every power of two steps. A loop is caught within two
+     * trips around it, in constant space.
+     */
+    if (*off == chain->mark) {
+        TIFF_TRACE("IFD chain loops back to %08llx\n", (unsigned long long)*off);
+        *off = 0;
+        return TIFF_IFD_LOOP;
+    }
+
+    if (chain->lam == chain->power) {
+        chain->mark = *off;
+        chain->power *= 2;
+        chain->lam = 0;
+    }
+
+    chain->pos = *off;
+
     return TIFF_OK;
 }
 
@@ -257,21 +369,72 @@ TIFF_STATUS tiff_get_ifd_tag_count(tiff_t *fp, tiff_ifd_t *ifd, size_t *count)
     return TIFF_OK;
 }
 
+/* Index of the first entry with the given id, or count if there is none.
+ * Ids are compared a vector at a time; files don't always keep their
+ * entries sorted, so this can't bisect.
+ */
+static size_t tiff_find_tag_id(const tiff_tag_id_t *ids, size_t count,
+                               tiff_tag_id_t tag_id)
+{
+    size_t i = 0;
+
+#if defined(TIFF_SIMD_AVX2)
+    __m256i key = _mm256_set1_epi16((short)tag_id);
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(ids + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, key));
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+#elif defined(TIFF_SIMD_SSE2)
+    __m128i key = _mm_set1_epi16((short)tag_id);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(ids + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, key));
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+#elif defined(TIFF_SIMD_NEON)
+    uint16x8_t key = vdupq_n_u16(tag_id);
+
+    for (; i + 8 <= count; i += 8) {
+        /* Narrow the lane masks to a byte each */
+        uint16x8_t eq = vceqq_u16(vld1q_u16(ids + i), key);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0);
+
+        if (mask != 0) {
+            return i + __builtin_ctzll(mask) / 8;
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        if (ids[i] == tag_id) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 static TIFF_STATUS tiff_find_tag(tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
                                  tiff_tag_t **tag_info)
 {
-    int i;
-    for (i = 0; i < ifd->tag_count; i++) {
-        tiff_tag_t *tag = &ifd->tags[i];
+    size_t i = tiff_find_tag_id(ifd->tag_ids, ifd->tag_count, tag_id);
 
-        if (tag->id == tag_id) {
-            *tag_info = tag;
-            TIFF_TRACE("Found tag at offset %d\n", i);
-            return TIFF_OK;
-        }
+    if (i == ifd->tag_count) {
+        return TIFF_TAG_NOT_FOUND;
     }
-    TIFF_TRACE("Tag with ID %d not found\n", (int)tag_id);
-    return TIFF_TAG_NOT_FOUND;
+
+    *tag_info = &ifd->tags[i];
+
+    return TIFF_OK;
 }
 
 /* Get information about a given tag */
@@ -280,13 +443,21 @@ TIFF_STATUS tiff_get_tag(tiff_t *fp,
                          tiff_tag_id_t tag_id,
                          tiff_tag_t **tag_info)
 {
+    TIFF_STATUS ret;
+
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(ifd);
     TIFF_ASSERT_ARG(tag_info);
 
     *tag_info = NULL;
 
-    return tiff_find_tag(ifd, tag_id, tag_info);
+    fp->stats.tag_lookups++;
+
+    ret = tiff_find_tag(ifd, tag_id, tag_info);
+
+    TIFF_EVENT(TIFF_EVENT_TAG_LOOKUP, fp, ifd->offset, 0, 0, tag_id, ret);
+
+    return ret;
 }
 
 /* Get tag by index in IFD */
@@ -297,7 +468,7 @@ TIFF_STATUS tiff_get_tag_indexed(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
     TIFF_ASSERT_ARG(ifd);
     TIFF_ASSERT_ARG(tag_info);
 
-    if (index > ifd->tag_count) {
+    if (index >= ifd->tag_count) {
         TIFF_TRACE("Index %zd is out of range.\n", index);
         return TIFF_RANGE_ERROR;
     }
@@ -313,12 +484,14 @@ TIFF_STATUS tiff_free_ifd(tiff_t *fp, tiff_ifd_t *ifd)
     TIFF_ASSERT_ARG(ifd);
 
     if (ifd->tags) {
-        memset(ifd->tags, 0, ifd->tag_count * IFD_ENTRY_LEN);
-        free(ifd->tags);
+        memset(ifd->tags, 0, ifd->tag_count * TIFF_IFD_TAG_SIZE);
+        tiff_free(&fp->alloc, ifd->tags);
     }
 
+    tiff_free(&fp->alloc, ifd->chunk_offsets);
+
     memset(ifd, 0, sizeof(tiff_ifd_t));
-    free(ifd);
+    tiff_free(&fp->alloc, ifd);
 
     return TIFF_OK;
 }
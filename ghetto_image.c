@@ -29,27 +29,12 @@
 #include <ghetto.h>
 #include <ghetto_priv.h>
 
-/* Baseline tags defining the final image characteristics */
-#define TIFF_TAG_IMAGEWIDTH         256
-#define TIFF_TAG_IMAGELENGTH        257
-#define TIFF_TAG_BITSPERSAMPLE      258
-#define TIFF_TAG_COMPRESSION        259
-#define TIFF_TAG_SAMPLESPERPIXEL    277
-#define TIFF_TAG_PLANARCONFIG       284
-
-/* Strip-related tags */
-#define TIFF_TAG_STRIPOFFSETS       273
-#define TIFF_TAG_ROWSPERSTRIP       278
-#define TIFF_TAG_STRIPBYTECOUNTS    279
-
-/* Tile-related tags */
-#define TIFF_TAG_TILEWIDTH          322
-#define TIFF_TAG_TILEHEIGHT         323
-#define TIFF_TAG_TILEOFFSETS        324
-#define TIFF_TAG_TILEBYTECOUNTS     325
-
-/* Sample Format (extended sample types) */
-#define TIFF_TAG_SAMPLEFORMAT       339
+#include <string.h>
+
+/* Unpack packed samples in blocks of about this size, so the raw data is
+ * still in cache when it is expanded.
+ */
+#define TIFF_UNPACK_BLOCK           (64 * 1024)
 
 /* It is possible to have an IFD that doesn't contain image data (i.e.
  * an EXIF IFD. As such, try to detect if an IFD contains imagery.
@@ -80,8 +65,6 @@ TIFF_STATUS tiff_get_image_attribs(tiff_t *fp, tiff_ifd_t *ifd,
                                    unsigned *width, unsigned *height,
                                    unsigned *samples)
 {
-    tiff_tag_t *tag = NULL;
-
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(ifd);
 
@@ -90,23 +73,17 @@ TIFF_STATUS tiff_get_image_attribs(tiff_t *fp, tiff_ifd_t *ifd,
     }
 
     if (width) {
-        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_IMAGEWIDTH, &tag),
-                TIFF_IFD_NOT_IMAGE);
-        TIFF_ASSERT_RETURN(tiff_get_tag_data(fp, ifd, tag, width),
+        TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_IMAGEWIDTH, width),
                 TIFF_IFD_NOT_IMAGE);
     }
 
     if (height) {
-        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_IMAGELENGTH, &tag),
-                TIFF_IFD_NOT_IMAGE);
-        TIFF_ASSERT_RETURN(tiff_get_tag_data(fp, ifd, tag, height),
+        TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_IMAGELENGTH, height),
                 TIFF_IFD_NOT_IMAGE);
     }
 
     if (samples) {
-        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_SAMPLESPERPIXEL, &tag),
-                TIFF_IFD_NOT_IMAGE);
-        TIFF_ASSERT_RETURN(tiff_get_tag_data(fp, ifd, tag, samples),
+        TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_SAMPLESPERPIXEL, samples),
                 TIFF_IFD_NOT_IMAGE);
     }
 
@@ -116,7 +93,7 @@ TIFF_STATUS tiff_get_image_attribs(tiff_t *fp, tiff_ifd_t *ifd,
 TIFF_STATUS tiff_get_image_sample_info(tiff_t *fp, tiff_ifd_t *ifd,
                                        int *bits, int *data_type)
 {
-    tiff_tag_t *tag = NULL;
+    UINT32 val = 0;
 
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(ifd);
@@ -126,18 +103,16 @@ TIFF_STATUS tiff_get_image_sample_info(tiff_t *fp, tiff_ifd_t *ifd,
     }
 
     if (bits) {
-        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_BITSPERSAMPLE, &tag),
-            TIFF_IFD_NOT_IMAGE);
-        TIFF_ASSERT_RETURN(tiff_get_tag_data(fp, ifd, tag, bits),
+        TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_BITSPERSAMPLE, &val),
             TIFF_IFD_NOT_IMAGE);
+        *bits = (int)val;
     }
 
     if (data_type) {
-        if (tiff_get_tag(fp, ifd, TIFF_TAG_SAMPLEFORMAT, &tag) != TIFF_OK) {
+        if (tiff_get_tag_u32(fp, ifd, TIFF_TAG_SAMPLEFORMAT, &val) != TIFF_OK) {
             *data_type = TIFF_SAMPLEFORMAT_UINT;
         } else {
-            TIFF_ASSERT_RETURN(tiff_get_tag_data(fp, ifd, tag, bits),
-                TIFF_IFD_NOT_IMAGE);
+            *data_type = (int)val;
         }
     }
 
@@ -148,27 +123,614 @@ TIFF_STATUS tiff_get_image_structure(tiff_t *fp, tiff_ifd_t *ifd,
                                      int *tile_count,
                                      int *tile_width, int *tile_height,
                                      unsigned *compression)
+{
+    struct tiff_image_layout layout;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+
+    if ( (ret = tiff_get_image_layout(fp, ifd, &layout)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (tile_count) *tile_count = (int)layout.chunk_count;
+    if (tile_width) *tile_width = (int)layout.chunk_width;
+    if (tile_height) *tile_height = (int)layout.chunk_height;
+    if (compression) *compression = layout.compression;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_get_image_layout(tiff_t *fp, tiff_ifd_t *ifd,
+                                  struct tiff_image_layout *layout)
 {
     tiff_tag_t *tag = NULL;
+    unsigned rows = 0;
 
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(layout);
+
+    memset(layout, 0, sizeof(*layout));
 
     if (tiff_is_image_ifd(fp, ifd)) {
         return TIFF_IFD_NOT_IMAGE;
     }
 
-    if (tile_count) *tile_count = 0;
-    if (tile_width) *tile_width = 0;
-    if (tile_height) *tile_height = 0;
+    TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_IMAGEWIDTH,
+            &layout->width), TIFF_IFD_NOT_IMAGE);
+    TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_IMAGELENGTH,
+            &layout->height), TIFF_IFD_NOT_IMAGE);
 
-    if (compression) {
-        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_COMPRESSION, &tag),
-            TIFF_IFD_NOT_IMAGE);
-        TIFF_ASSERT_RETURN(tiff_get_tag_data(fp, ifd, tag, compression),
+    /* Everything else has a default value in TIFF 6.0 */
+    if (tiff_get_tag_u32(fp, ifd, TIFF_TAG_SAMPLESPERPIXEL,
+            &layout->samples) != TIFF_OK)
+    {
+        layout->samples = 1;
+    }
+
+    if (tiff_get_tag_u32(fp, ifd, TIFF_TAG_BITSPERSAMPLE,
+            &layout->bits) != TIFF_OK)
+    {
+        layout->bits = 1;
+    }
+
+    if (tiff_get_tag_u32(fp, ifd, TIFF_TAG_COMPRESSION,
+            &layout->compression) != TIFF_OK)
+    {
+        layout->compression = TIFF_COMPRESSION_NONE;
+    }
+
+    if (tiff_get_tag_u32(fp, ifd, TIFF_TAG_PLANARCONFIG,
+            &layout->planar) != TIFF_OK)
+    {
+        layout->planar = 1;
+    }
+
+    if (layout->width == 0 || layout->height == 0 || layout->samples == 0 ||
+        layout->bits == 0 || (layout->planar != 1 && layout->planar != 2))
+    {
+        TIFF_TRACE("Image IFD has nonsensical geometry\n");
+        return TIFF_TAG_MALFORMED;
+    }
+
+    if (tiff_get_tag(fp, ifd, TIFF_TAG_TILEWIDTH, &tag) == TIFF_OK) {
+        layout->tiled = 1;
+        TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_TILEWIDTH,
+                &layout->chunk_width), TIFF_TAG_MALFORMED);
+        TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_TILEHEIGHT,
+                &layout->chunk_height), TIFF_TAG_MALFORMED);
+    } else {
+        if (tiff_get_tag_u32(fp, ifd, TIFF_TAG_ROWSPERSTRIP, &rows) != TIFF_OK ||
+            rows > layout->height)
+        {
+            rows = layout->height;
+        }
+        layout->chunk_width = layout->width;
+        layout->chunk_height = rows;
+    }
+
+    if (layout->chunk_width == 0 || layout->chunk_height == 0) {
+        return TIFF_TAG_MALFORMED;
+    }
+
+    layout->chunks_across = (layout->width + layout->chunk_width - 1) /
+        layout->chunk_width;
+    layout->chunks_down = (layout->height + layout->chunk_height - 1) /
+        layout->chunk_height;
+    layout->chunks_per_plane = (size_t)layout->chunks_across * layout->chunks_down;
+
+    layout->chunk_samples = layout->planar == 2 ? 1 : layout->samples;
+    layout->chunk_count = layout->chunks_per_plane *
+        (layout->planar == 2 ? layout->samples : 1);
+
+    layout->row_bytes = ((size_t)layout->chunk_width * layout->chunk_samples *
+        layout->bits + 7) / 8;
+
+    if (layout->bits == 8) {
+        layout->sample_size = 1;
+    } else if (layout->bits > 8 && layout->bits <= 16) {
+        layout->sample_size = 2;
+    } else if (layout->bits == 32) {
+        layout->sample_size = 4;
+    }
+
+    return TIFF_OK;
+}
+
+unsigned tiff_get_chunk_rows(struct tiff_image_layout *layout, size_t index)
+{
+    unsigned first_row;
+
+    /* Tiles are always padded out to the full tile size */
+    if (layout->tiled) {
+        return layout->chunk_height;
+    }
+
+    first_row = (unsigned)(index % layout->chunks_per_plane) * layout->chunk_height;
+
+    if (layout->height - first_row < layout->chunk_height) {
+        return layout->height - first_row;
+    }
+
+    return layout->chunk_height;
+}
+
+TIFF_STATUS tiff_load_chunk_table(tiff_t *fp, tiff_ifd_t *ifd)
+{
+    tiff_tag_t *offsets = NULL, *sizes = NULL;
+    tiff_off_t *table = NULL;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+
+    if (ifd->chunk_offsets != NULL) {
+        return TIFF_OK;
+    }
+
+    if (tiff_get_tag(fp, ifd, TIFF_TAG_TILEOFFSETS, &offsets) == TIFF_OK) {
+        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_TILEBYTECOUNTS, &sizes),
+            TIFF_TAG_NOT_FOUND);
+    } else {
+        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_STRIPOFFSETS, &offsets),
             TIFF_IFD_NOT_IMAGE);
+        TIFF_ASSERT_RETURN(tiff_get_tag(fp, ifd, TIFF_TAG_STRIPBYTECOUNTS, &sizes),
+            TIFF_TAG_NOT_FOUND);
+    }
+
+    if (offsets->count == 0 || offsets->count != sizes->count) {
+        TIFF_TRACE("Chunk offset/byte count tables don't match\n");
+        return TIFF_TAG_MALFORMED;
+    }
+
+    if ( (ret = tiff_check_tag_payload(fp, ifd, offsets)) != TIFF_OK ||
+         (ret = tiff_check_tag_payload(fp, ifd, sizes)) != TIFF_OK )
+    {
+        return ret;
+    }
+
+    /* Both tables live in the one allocation */
+    table = (tiff_off_t *)tiff_calloc(&fp->alloc, 2,
+        sizeof(tiff_off_t) * offsets->count);
+    if (table == NULL) {
+        return TIFF_NO_MEMORY;
     }
 
+    if ( (ret = tiff_get_tag_uint_array(fp, ifd, offsets, (uint64_t *)table))
+        != TIFF_OK)
+    {
+        goto fail;
+    }
+
+    if ( (ret = tiff_get_tag_uint_array(fp, ifd, sizes,
+            (uint64_t *)(table + offsets->count))) != TIFF_OK)
+    {
+        goto fail;
+    }
+
+    ifd->chunk_offsets = table;
+    ifd->chunk_sizes = table + offsets->count;
+    ifd->chunk_count = offsets->count;
+
     return TIFF_OK;
+
+fail:
+    tiff_free(&fp->alloc, table);
+    return ret;
 }
 
+TIFF_STATUS tiff_get_chunk_info(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                                tiff_off_t *offset, size_t *length)
+{
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+
+    if ( (ret = tiff_load_chunk_table(fp, ifd)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (index >= ifd->chunk_count) {
+        TIFF_TRACE("Chunk %zd is out of range.\n", index);
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (offset) *offset = ifd->chunk_offsets[index];
+    if (length) *length = (size_t)ifd->chunk_sizes[index];
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_read_chunk(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                            void *buf, size_t buf_len, size_t *count)
+{
+    tiff_off_t offset = 0;
+    size_t length = 0;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(buf);
+
+    if ( (ret = tiff_get_chunk_info(fp, ifd, index, &offset, &length))
+        != TIFF_OK)
+    {
+        return ret;
+    }
+
+    if (buf_len < length) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (length == 0) {
+        if (count) *count = 0;
+        return TIFF_OK;
+    }
+
+    return tiff_read(fp, offset, 1, length, buf, count);
+}
+
+TIFF_STATUS tiff_read_chunk_samples(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                                    int bit_order, UINT16 *dst,
+                                    size_t dst_count, size_t *samples)
+{
+    struct tiff_image_layout layout;
+    uint8_t *block = NULL;
+    size_t rows, row_samples, block_rows, done, count = 0, i;
+    int padded;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(dst);
+
+    if ( (ret = tiff_get_image_layout(fp, ifd, &layout)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (layout.compression != TIFF_COMPRESSION_NONE || layout.bits > 16) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if ( (ret = tiff_load_chunk_table(fp, ifd)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (index >= layout.chunk_count || index >= ifd->chunk_count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* 16-bit samples are just words in the file's byte order */
+    if (bit_order == TIFF_BITORDER_DEFAULT) {
+        bit_order = (layout.bits == 16 && fp->endianess == ENDIAN_LITTLE) ?
+            TIFF_BITORDER_LSB : TIFF_BITORDER_MSB;
+    }
+
+    rows = tiff_get_chunk_rows(&layout, index);
+    row_samples = (size_t)layout.chunk_width * layout.chunk_samples;
+
+    if (dst_count < rows * row_samples) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (ifd->chunk_sizes[index] < rows * layout.row_bytes) {
+        TIFF_TRACE("Chunk %zd is too short for its geometry\n", index);
+        return TIFF_TAG_MALFORMED;
+    }
+
+    /* Rows are padded out to a byte boundary; if there is no padding the
+     * whole block can be unpacked in one pass.
+     */
+    padded = (row_samples * layout.bits) % 8 != 0;
+
+    block_rows = TIFF_UNPACK_BLOCK / layout.row_bytes;
+    if (block_rows == 0) block_rows = 1;
+    if (block_rows > rows) block_rows = rows;
+
+    block = (uint8_t *)tiff_calloc(&fp->alloc, block_rows, layout.row_bytes);
+    if (block == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    if ( (ret = TIFF_SEEK(fp, ifd->chunk_offsets[index], TIFF_SEEK_SET))
+        != TIFF_OK)
+    {
+        goto done;
+    }
+
+    for (done = 0; done < rows; done += block_rows) {
+        if (rows - done < block_rows) {
+            block_rows = rows - done;
+        }
+
+        TIFF_READ(fp, layout.row_bytes, block_rows, block, &count);
+        if (count < block_rows) {
+            ret = TIFF_END_OF_FILE;
+            goto done;
+        }
+
+        if (padded) {
+            for (i = 0; i < block_rows; i++) {
+                tiff_unpack_samples(block + i * layout.row_bytes, layout.bits,
+                    bit_order, row_samples, dst + (done + i) * row_samples);
+            }
+        } else {
+            tiff_unpack_samples(block, layout.bits, bit_order,
+                block_rows * row_samples, dst + done * row_samples);
+        }
+    }
+
+    if (samples) *samples = rows * row_samples;
+
+done:
+    tiff_free(&fp->alloc, block);
+    return ret;
+}
+
+static TIFF_STATUS tiff_decode_chunk_uncached(tiff_t *fp, tiff_ifd_t *ifd,
+                                              struct tiff_image_layout *layout,
+                                              size_t index, void *dst)
+{
+    size_t samples, bytes, count = 0;
+    TIFF_STATUS ret;
+
+    if (layout->compression != TIFF_COMPRESSION_NONE || layout->sample_size == 0) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    samples = (size_t)tiff_get_chunk_rows(layout, index) * layout->chunk_width *
+        layout->chunk_samples;
+
+    /* Packed samples need expanding */
+    if (layout->bits != 8 * layout->sample_size) {
+        return tiff_read_chunk_samples(fp, ifd, index, TIFF_BITORDER_DEFAULT,
+            (UINT16 *)dst, samples, NULL);
+    }
+
+    if ( (ret = tiff_load_chunk_table(fp, ifd)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (index >= ifd->chunk_count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    bytes = samples * layout->sample_size;
+
+    if (ifd->chunk_sizes[index] < bytes) {
+        TIFF_TRACE("Chunk %zd is too short for its geometry\n", index);
+        return TIFF_TAG_MALFORMED;
+    }
+
+    if ( (ret = tiff_read(fp, ifd->chunk_offsets[index], bytes, 1, dst, &count))
+        != TIFF_OK)
+    {
+        return ret;
+    }
+
+    if (count < 1) {
+        return TIFF_END_OF_FILE;
+    }
+
+    if (layout->sample_size == 2) {
+        tiff_swap_word_buffer(dst, samples, fp->endianess);
+    } else if (layout->sample_size == 4) {
+        tiff_swap_dword_buffer(dst, samples, fp->endianess);
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_decode_chunk(tiff_t *fp, tiff_ifd_t *ifd,
+                              struct tiff_image_layout *layout, size_t index,
+                              void *dst)
+{
+    size_t len;
+    TIFF_STATUS ret;
+
+    /* IFDs that didn't come straight from the file have no stable key */
+    if (fp->cache == NULL || ifd->offset == 0) {
+        return tiff_decode_chunk_uncached(fp, ifd, layout, index, dst);
+    }
+
+    len = (size_t)tiff_get_chunk_rows(layout, index) * layout->chunk_width *
+        layout->chunk_samples * layout->sample_size;
+
+    if (tiff_cache_lookup(fp->cache, fp->file_id, ifd->offset, index, dst, len)
+        == TIFF_OK)
+    {
+        return TIFF_OK;
+    }
+
+    if ( (ret = tiff_decode_chunk_uncached(fp, ifd, layout, index, dst)) != TIFF_OK ) {
+        return ret;
+    }
+
+    /* Not being able to cache a chunk is no reason to fail the read */
+    tiff_cache_insert(fp->cache, fp->file_id, ifd->offset, index, dst, len);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_read_region(tiff_t *fp, tiff_ifd_t *ifd,
+                             unsigned x, unsigned y,
+                             unsigned width, unsigned height,
+                             int out_layout, void *dst, size_t dst_len)
+{
+    struct tiff_image_layout layout;
+    uint8_t *scratch = NULL, *out = (uint8_t *)dst;
+    void **planes = NULL;
+    size_t ss, chunk_bytes, plane_bytes, nr_scratch = 1;
+    unsigned channel = 0, out_channels, cx, cy, row, p;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(dst);
+
+    if ( (ret = tiff_get_image_layout(fp, ifd, &layout)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (layout.compression != TIFF_COMPRESSION_NONE || layout.sample_size == 0) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if (width == 0 || height == 0 ||
+        x >= layout.width || width > layout.width - x ||
+        y >= layout.height || height > layout.height - y)
+    {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (out_layout & TIFF_LAYOUT_CHANNEL(0)) {
+        channel = out_layout & 0xff;
+        out_channels = 1;
+        if (channel >= layout.samples) {
+            return TIFF_RANGE_ERROR;
+        }
+    } else if (out_layout == TIFF_LAYOUT_CHUNKY || out_layout == TIFF_LAYOUT_PLANAR) {
+        out_channels = layout.samples;
+    } else {
+        return TIFF_RANGE_ERROR;
+    }
+
+    ss = layout.sample_size;
+    plane_bytes = (size_t)width * height * ss;
+
+    if (dst_len < plane_bytes * out_channels) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* Interleaving planar data needs every plane of a chunk at once */
+    if (layout.planar == 2 && out_layout == TIFF_LAYOUT_CHUNKY) {
+        nr_scratch = layout.samples;
+    }
+
+    chunk_bytes = (size_t)layout.chunk_width * layout.chunk_height *
+        layout.chunk_samples * ss;
+
+    scratch = (uint8_t *)tiff_calloc(&fp->alloc, nr_scratch, chunk_bytes);
+    planes = (void **)tiff_calloc(&fp->alloc, layout.samples, sizeof(void *));
+
+    if (scratch == NULL || planes == NULL) {
+        ret = TIFF_NO_MEMORY;
+        goto done;
+    }
+
+    for (cy = y / layout.chunk_height;
+         cy <= (y + height - 1) / layout.chunk_height; cy++)
+    {
+        unsigned y0 = cy * layout.chunk_height, y1 = y0 + layout.chunk_height;
+
+        if (y0 < y) y0 = y;
+        if (y1 > y + height) y1 = y + height;
+
+        for (cx = x / layout.chunk_width;
+             cx <= (x + width - 1) / layout.chunk_width; cx++)
+        {
+            size_t index = (size_t)cy * layout.chunks_across + cx;
+            unsigned x0 = cx * layout.chunk_width, x1 = x0 + layout.chunk_width;
+            size_t n;
+
+            if (x0 < x) x0 = x;
+            if (x1 > x + width) x1 = x + width;
+            n = x1 - x0;
+
+            if (layout.planar == 1) {
+                if ( (ret = tiff_decode_chunk(fp, ifd, &layout, index, scratch))
+                    != TIFF_OK)
+                {
+                    goto done;
+                }
+
+                for (row = y0; row < y1; row++) {
+                    uint8_t *src = scratch + (((size_t)(row - cy * layout.chunk_height) *
+                        layout.chunk_width) + (x0 - cx * layout.chunk_width)) *
+                        layout.samples * ss;
+                    size_t pix = (size_t)(row - y) * width + (x0 - x);
+
+                    if (out_layout == TIFF_LAYOUT_CHUNKY) {
+                        memcpy(out + pix * layout.samples * ss, src,
+                            n * layout.samples * ss);
+                    } else if (out_layout == TIFF_LAYOUT_PLANAR) {
+                        for (p = 0; p < layout.samples; p++) {
+                            planes[p] = out + p * plane_bytes + pix * ss;
+                        }
+                        tiff_chunky_to_planar(src, layout.samples, ss, n, planes);
+                    } else {
+                        tiff_extract_channel(src, layout.samples, channel, ss, n,
+                            out + pix * ss);
+                    }
+                }
+            } else if (out_layout == TIFF_LAYOUT_CHUNKY) {
+                for (p = 0; p < layout.samples; p++) {
+                    if ( (ret = tiff_decode_chunk(fp, ifd, &layout,
+                            p * layout.chunks_per_plane + index,
+                            scratch + p * chunk_bytes)) != TIFF_OK)
+                    {
+                        goto done;
+                    }
+                }
+
+                for (row = y0; row < y1; row++) {
+                    size_t off = (((size_t)(row - cy * layout.chunk_height) *
+                        layout.chunk_width) + (x0 - cx * layout.chunk_width)) * ss;
+                    size_t pix = (size_t)(row - y) * width + (x0 - x);
+
+                    for (p = 0; p < layout.samples; p++) {
+                        planes[p] = scratch + p * chunk_bytes + off;
+                    }
+                    tiff_planar_to_chunky(planes, layout.samples, ss, n,
+                        out + pix * layout.samples * ss);
+                }
+            } else {
+                /* Planar to planar, or pulling out a single plane */
+                for (p = 0; p < layout.samples; p++) {
+                    uint8_t *plane_out = out + (out_channels == 1 ? 0 : p * plane_bytes);
+
+                    if (out_channels == 1 && p != channel) {
+                        continue;
+                    }
+
+                    if ( (ret = tiff_decode_chunk(fp, ifd, &layout,
+                            p * layout.chunks_per_plane + index, scratch)) != TIFF_OK)
+                    {
+                        goto done;
+                    }
+
+                    for (row = y0; row < y1; row++) {
+                        size_t off = (((size_t)(row - cy * layout.chunk_height) *
+                            layout.chunk_width) + (x0 - cx * layout.chunk_width)) * ss;
+                        size_t pix = (size_t)(row - y) * width + (x0 - x);
+
+                        memcpy(plane_out + pix * ss, scratch + off, n * ss);
+                    }
+                }
+            }
+        }
+    }
+
+done:
+    tiff_free(&fp->alloc, planes);
+    tiff_free(&fp->alloc, scratch);
+
+    return ret;
+}
+
+TIFF_STATUS tiff_read_image(tiff_t *fp, tiff_ifd_t *ifd, int out_layout,
+                            void *dst, size_t dst_len)
+{
+    unsigned width = 0, height = 0;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+
+    TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_IMAGEWIDTH, &width),
+        TIFF_IFD_NOT_IMAGE);
+    TIFF_ASSERT_RETURN(tiff_get_tag_u32(fp, ifd, TIFF_TAG_IMAGELENGTH, &height),
+        TIFF_IFD_NOT_IMAGE);
+
+    return tiff_read_region(fp, ifd, 0, 0, width, height, out_layout, dst, dst_len);
+}
@@ -0,0 +1,306 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Resolution level selection for pyramidal TIFFs and camera raw files.
+ *
+ * The first time a level is asked for, the IFD chain and each IFD's
+ * SubIFDs are walked once and a small table describing every image is
+ * kept in the file handle. Selection works from that table, and only
+ * the chosen IFD is read again.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/* Limits, so a looping or hostile file can't keep us walking forever */
+#define TIFF_LEVEL_MAX_IFDS         64
+#define TIFF_LEVEL_MAX_SUBIFDS      32
+
+static TIFF_STATUS tiff_level_get_uint(tiff_t *fp, tiff_ifd_t *ifd,
+                                       tiff_tag_id_t tag_id, uint64_t *val)
+{
+    tiff_tag_t *tag = NULL;
+
+    if (tiff_get_tag(fp, ifd, tag_id, &tag) != TIFF_OK) {
+        return TIFF_TAG_NOT_FOUND;
+    }
+
+    return tiff_get_tag_element(fp, ifd, tag, 0, val);
+}
+
+/* Add an IFD to the level table, if it describes an image */
+static TIFF_STATUS tiff_level_add(tiff_t *fp, tiff_ifd_t *ifd, tiff_off_t offset,
+                                  size_t *alloc)
+{
+    struct tiff_image_layout layout;
+    tiff_level_info_t *level;
+    uint64_t val = 0;
+
+    if (tiff_get_image_layout(fp, ifd, &layout) != TIFF_OK) {
+        return TIFF_OK;
+    }
+
+    if (fp->level_count == *alloc) {
+        size_t new_alloc = *alloc ? *alloc * 2 : 8;
+        tiff_level_info_t *levels = (tiff_level_info_t *)tiff_realloc(&fp->alloc,
+            fp->levels, *alloc * sizeof(tiff_level_info_t),
+            new_alloc * sizeof(tiff_level_info_t));
+
+        if (levels == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+
+        fp->levels = levels;
+        *alloc = new_alloc;
+    }
+
+    level = &fp->levels[fp->level_count++];
+    memset(level, 0, sizeof(*level));
+
+    level->ifd_offset = offset;
+    level->width = layout.width;
+    level->height = layout.height;
+    level->samples = layout.samples;
+    level->bits = layout.bits;
+    level->compression = layout.compression;
+    level->tiled = layout.tiled;
+    level->chunk_width = layout.chunk_width;
+    level->chunk_height = layout.chunk_height;
+
+    if (tiff_level_get_uint(fp, ifd, TIFF_TAG_NEWSUBFILETYPE, &val) == TIFF_OK) {
+        level->subfile_type = (unsigned)val;
+    }
+
+    if (tiff_level_get_uint(fp, ifd, TIFF_TAG_PHOTOMETRIC, &val) == TIFF_OK) {
+        level->photometric = (unsigned)val;
+    }
+
+    return TIFF_OK;
+}
+
+static TIFF_STATUS tiff_level_add_subifds(tiff_t *fp, tiff_ifd_t *ifd,
+                                          size_t *alloc)
+{
+    uint64_t offsets[TIFF_LEVEL_MAX_SUBIFDS];
+    tiff_tag_t *tag = NULL;
+    TIFF_STATUS ret;
+    size_t i;
+
+    if (tiff_get_tag(fp, ifd, TIFF_TAG_SUBIFDS, &tag) != TIFF_OK ||
+        tag->count == 0)
+    {
+        return TIFF_OK;
+    }
+
+    if (tag->count > TIFF_LEVEL_MAX_SUBIFDS) {
+        TIFF_TRACE("Ignoring IFD with %zd SubIFDs\n", (size_t)tag->count);
+        return TIFF_OK;
+    }
+
+    if (tiff_get_tag_uint_array(fp, ifd, tag, offsets) != TIFF_OK) {
+        return TIFF_OK;
+    }
+
+    for (i = 0; i < tag->count; i++) {
+        tiff_ifd_t *sub_ifd = NULL;
+
+        if (tiff_read_ifd(fp, offsets[i], &sub_ifd) != TIFF_OK) {
+            continue;
+        }
+
+        ret = tiff_level_add(fp, sub_ifd, offsets[i], alloc);
+        tiff_free_ifd(fp, sub_ifd);
+
+        if (ret != TIFF_OK) {
+            return ret;
+        }
+    }
+
+    return TIFF_OK;
+}
+
+/* Build the level table if we don't already have one. A built table
+ * always has at least one entry; the array itself is kept for reuse
+ * when the table is thrown away.
+ */
+static TIFF_STATUS tiff_level_load(tiff_t *fp)
+{
+    tiff_ifd_chain_t chain;
+    tiff_off_t ifd_off;
+    TIFF_STATUS ret = TIFF_OK;
+    int depth;
+
+    if (fp->level_count != 0) {
+        return TIFF_OK;
+    }
+
+    memset(&chain, 0, sizeof(chain));
+    ifd_off = fp->root_ifd;
+
+    for (depth = 0; ifd_off != 0 && depth < TIFF_LEVEL_MAX_IFDS; depth++) {
+        tiff_ifd_t *ifd = NULL;
+        tiff_off_t next;
+
+        if (tiff_read_ifd(fp, ifd_off, &ifd) != TIFF_OK) {
+            break;
+        }
+
+        if ( (ret = tiff_level_add(fp, ifd, ifd_off, &fp->level_alloc)) == TIFF_OK ) {
+            ret = tiff_level_add_subifds(fp, ifd, &fp->level_alloc);
+        }
+
+        if (tiff_next_ifd(fp, &chain, ifd, &next) != TIFF_OK) {
+            next = 0;
+        }
+        tiff_free_ifd(fp, ifd);
+
+        if (ret != TIFF_OK) {
+            goto fail;
+        }
+
+        ifd_off = next;
+    }
+
+    if (fp->level_count == 0) {
+        ret = TIFF_IFD_NOT_IMAGE;
+        goto fail;
+    }
+
+    return TIFF_OK;
+
+fail:
+    fp->level_count = 0;
+    return ret;
+}
+
+/* Whether a level is a displayable image at all */
+static int tiff_level_is_candidate(tiff_level_info_t *level)
+{
+    if (level->subfile_type & TIFF_SUBFILE_MASK) {
+        return 0;
+    }
+
+    return level->photometric != TIFF_PHOTOMETRIC_CFA &&
+        level->photometric != TIFF_PHOTOMETRIC_LINEARRAW;
+}
+
+TIFF_STATUS tiff_get_level_count(tiff_t *fp, size_t *count)
+{
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(count);
+
+    *count = 0;
+
+    if ( (ret = tiff_level_load(fp)) != TIFF_OK ) {
+        return ret;
+    }
+
+    *count = fp->level_count;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_get_level_info(tiff_t *fp, size_t index, tiff_level_info_t *info)
+{
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(info);
+
+    if ( (ret = tiff_level_load(fp)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (index >= fp->level_count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    *info = fp->levels[index];
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_select_level(tiff_t *fp, unsigned target_width,
+                              unsigned target_height, tiff_ifd_t **ifd)
+{
+    tiff_level_info_t *best = NULL, *level;
+    uint64_t area, best_area = 0;
+    int big_enough, best_big_enough = 0;
+    TIFF_STATUS ret;
+    size_t i;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+
+    *ifd = NULL;
+
+    if ( (ret = tiff_level_load(fp)) != TIFF_OK ) {
+        return ret;
+    }
+
+    for (i = 0; i < fp->level_count; i++) {
+        level = &fp->levels[i];
+
+        if (!tiff_level_is_candidate(level)) {
+            continue;
+        }
+
+        big_enough = level->width >= target_width && level->height >= target_height;
+        area = (uint64_t)level->width * level->height;
+
+        /* The smallest level that's big enough, otherwise the biggest.
+         * Tiled levels win ties, since they can be read piecemeal.
+         */
+        if (best == NULL ||
+            (big_enough && !best_big_enough) ||
+            (big_enough && area < best_area) ||
+            (!big_enough && !best_big_enough && area > best_area) ||
+            (big_enough == best_big_enough && area == best_area &&
+             level->tiled && !best->tiled))
+        {
+            best = level;
+            best_area = area;
+            best_big_enough = big_enough;
+        }
+    }
+
+    if (best == NULL) {
+        return TIFF_IFD_NOT_IMAGE;
+    }
+
+    TIFF_TRACE("Selected %ux%u level at %08x\n", best->width, best->height,
+        (unsigned)best->ifd_offset);
+
+    return tiff_read_ifd(fp, best->ifd_offset, ifd);
+}
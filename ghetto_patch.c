@@ -0,0 +1,242 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* In-place tag updates.
+ *
+ * A patch touches only the bytes it has to: the 12-byte IFD entry, and
+ * either the tag's existing out-of-line data (when the new value fits
+ * in it) or a fresh copy of the value appended at the end of the file.
+ * Appended data is written before the entry that points at it. With
+ * TIFF_SYNC_ORDERED out-of-line values are always appended, and are on
+ * disk before the entry changes, so a crash leaves either the old value
+ * or the new one. Otherwise a crash while a value is rewritten in place
+ * can leave a mix of the two.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/* Convert count values of the given type between native and file order */
+static void tiff_patch_swap(void *buf, int type, size_t count, int endianess)
+{
+    switch (tiff_get_type_size(type)) {
+    case 2:
+        tiff_swap_word_buffer(buf, count, endianess);
+        break;
+    case 4:
+        tiff_swap_dword_buffer(buf, count, endianess);
+        break;
+    case 8:
+        if (type == TIFF_TYPE_RATIONAL || type == TIFF_TYPE_SRATIONAL) {
+            tiff_swap_dword_buffer(buf, count * 2, endianess);
+        } else {
+            tiff_swap_qword_buffer(buf, count, endianess);
+        }
+        break;
+    }
+}
+
+static TIFF_STATUS tiff_patch_sync(tiff_t *fp)
+{
+    if (fp->sync_policy == TIFF_SYNC_NONE) {
+        return TIFF_OK;
+    }
+
+    if (fp->mgr->sync == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    return fp->mgr->sync(fp->fp);
+}
+
+TIFF_STATUS tiff_set_sync_policy(tiff_t *fp, int policy)
+{
+    TIFF_ASSERT_ARG(fp);
+
+    if (policy != TIFF_SYNC_NONE && policy != TIFF_SYNC_PATCH &&
+        policy != TIFF_SYNC_ORDERED)
+    {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (policy != TIFF_SYNC_NONE && fp->mgr->sync == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    fp->sync_policy = policy;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_patch_tag(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                           int type, size_t count, const void *data)
+{
+    tiff_tag_t *tag = NULL;
+    uint8_t entry[IFD_ENTRY_LEN], *value = NULL;
+    size_t size = tiff_get_type_size(type), len, old_len, file_len = 0;
+    tiff_off_t entry_off, data_off = 0;
+    uint16_t word;
+    uint32_t dword;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(data);
+
+    if (fp->fp == NULL) {
+        return TIFF_NOT_OPEN;
+    }
+
+    if (fp->mgr->write == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if (size == 0) {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    if (count == 0 || count > UINT32_MAX / size) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* We need to know where the entry lives */
+    if (ifd->offset == 0 || ifd->tag_offset != 0) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if ( (ret = tiff_get_tag(fp, ifd, tag_id, &tag)) != TIFF_OK ) {
+        return ret;
+    }
+
+    len = size * count;
+    old_len = tiff_get_type_size(tag->type) * tag->count;
+    entry_off = ifd->offset + 2 + (tiff_off_t)(tag - ifd->tags) * IFD_ENTRY_LEN;
+
+    value = (uint8_t *)tiff_calloc(&fp->alloc, 1, len < TIFF_TAG_DATA_FIELD_SIZE ?
+        TIFF_TAG_DATA_FIELD_SIZE : len);
+    if (value == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    memcpy(value, data, len);
+    tiff_patch_swap(value, type, count, fp->endianess);
+
+    if (len > TIFF_TAG_DATA_FIELD_SIZE) {
+        if (old_len > TIFF_TAG_DATA_FIELD_SIZE && len <= old_len &&
+            fp->sync_policy != TIFF_SYNC_ORDERED)
+        {
+            /* Reuse the old value's space */
+            data_off = TIFF_SWAP_DWORD((uint32_t)tag->offset, fp->endianess);
+
+            if ( (ret = tiff_write_at(fp, data_off, value, len)) != TIFF_OK ) {
+                goto done;
+            }
+        } else {
+            /* Append, on a word boundary, and only then repoint the entry */
+            if (fp->mgr->size == NULL) {
+                ret = TIFF_UNSUPPORTED;
+                goto done;
+            }
+
+            if ( (ret = fp->mgr->size(fp->fp, &file_len)) != TIFF_OK ) {
+                goto done;
+            }
+
+            data_off = file_len;
+            if (data_off & 1) {
+                if ( (ret = tiff_write_at(fp, data_off, "", 1)) != TIFF_OK ) {
+                    goto done;
+                }
+                data_off++;
+            }
+
+            if (data_off + len > UINT32_MAX) {
+                ret = TIFF_RANGE_ERROR;
+                goto done;
+            }
+
+            if ( (ret = tiff_write_at(fp, data_off, value, len)) != TIFF_OK ) {
+                goto done;
+            }
+
+            if (fp->sync_policy == TIFF_SYNC_ORDERED &&
+                (ret = tiff_patch_sync(fp)) != TIFF_OK)
+            {
+                goto done;
+            }
+        }
+
+        dword = TIFF_SWAP_DWORD((uint32_t)data_off, fp->endianess);
+        memset(value, 0, TIFF_TAG_DATA_FIELD_SIZE);
+        memcpy(value, &dword, sizeof(dword));
+    }
+
+    /* Rewrite the entry: the id stays, the rest may all change */
+    word = TIFF_SWAP_WORD((uint16_t)tag_id, fp->endianess);
+    memcpy(entry + IFD_ENTRY_TAG, &word, sizeof(word));
+    word = TIFF_SWAP_WORD((uint16_t)type, fp->endianess);
+    memcpy(entry + IFD_ENTRY_TYPE, &word, sizeof(word));
+    dword = TIFF_SWAP_DWORD((uint32_t)count, fp->endianess);
+    memcpy(entry + IFD_ENTRY_COUNT, &dword, sizeof(dword));
+    memcpy(entry + IFD_ENTRY_OFFSET, value, TIFF_TAG_DATA_FIELD_SIZE);
+
+    if ( (ret = tiff_write_at(fp, entry_off, entry, sizeof(entry))) != TIFF_OK ) {
+        goto done;
+    }
+
+    if ( (ret = tiff_patch_sync(fp)) != TIFF_OK ) {
+        goto done;
+    }
+
+    /* Bring our copy of the IFD up to date */
+    tag->type = type;
+    tag->count = count;
+    tag->offset = TIFF_DWORD(entry, IFD_ENTRY_OFFSET, MACH_ENDIANESS);
+
+    if (tag_id == TIFF_TAG_STRIPOFFSETS || tag_id == TIFF_TAG_STRIPBYTECOUNTS ||
+        tag_id == TIFF_TAG_TILEOFFSETS || tag_id == TIFF_TAG_TILEBYTECOUNTS)
+    {
+        tiff_free(&fp->alloc, ifd->chunk_offsets);
+        ifd->chunk_offsets = ifd->chunk_sizes = NULL;
+        ifd->chunk_count = 0;
+    }
+
+    /* Any cached view of the file's images may be stale now */
+    fp->level_count = 0;
+    if (fp->cache != NULL) {
+        tiff_cache_purge(fp->cache, fp->file_id);
+    }
+
+done:
+    tiff_free(&fp->alloc, value);
+    return ret;
+}
@@ -0,0 +1,345 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Kernels for moving samples between chunky (PlanarConfiguration = 1)
+ * and planar (PlanarConfiguration = 2) layouts.
+ *
+ * The SIMD versions treat every conversion as a byte permutation. Each
+ * 16-byte output vector is built by shuffling each of the input vectors
+ * it draws from and ORing the results together; the shuffle controls
+ * are worked out once per call. Lanes that a given input doesn't feed
+ * get an out-of-range index, which both pshufb and tbl turn into zero.
+ */
+
+#include <ghetto.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/* Beyond this many channels the shuffle tables get silly */
+#define TIFF_PLANAR_SIMD_MAX    8
+
+#if defined(TIFF_SIMD_SSSE3)
+#define TIFF_PLANAR_SIMD
+typedef __m128i tiff_vec_t;
+#define TIFF_VEC_LOAD(p)        _mm_loadu_si128((const __m128i *)(p))
+#define TIFF_VEC_STORE(p, v)    _mm_storeu_si128((__m128i *)(p), (v))
+#define TIFF_VEC_SHUFFLE(v, c)  _mm_shuffle_epi8((v), (c))
+#define TIFF_VEC_OR(a, b)       _mm_or_si128((a), (b))
+#define TIFF_VEC_ZERO()         _mm_setzero_si128()
+#elif defined(TIFF_SIMD_NEON)
+#define TIFF_PLANAR_SIMD
+typedef uint8x16_t tiff_vec_t;
+#define TIFF_VEC_LOAD(p)        vld1q_u8((const uint8_t *)(p))
+#define TIFF_VEC_STORE(p, v)    vst1q_u8((uint8_t *)(p), (v))
+#define TIFF_VEC_SHUFFLE(v, c)  vqtbl1q_u8((v), (c))
+#define TIFF_VEC_OR(a, b)       vorrq_u8((a), (b))
+#define TIFF_VEC_ZERO()         vdupq_n_u8(0)
+#endif
+
+#ifdef TIFF_PLANAR_SIMD
+
+/* Shuffle control pulling channel's bytes out of chunky input vector k */
+static tiff_vec_t tiff_planar_extract_ctl(unsigned channels, unsigned channel,
+                                          size_t sample_size, unsigned k)
+{
+    uint8_t ctl[16];
+    size_t j;
+
+    for (j = 0; j < 16; j++) {
+        size_t idx = (j / sample_size) * channels * sample_size +
+            channel * sample_size + j % sample_size;
+
+        ctl[j] = (idx >= 16 * k && idx < 16 * (k + 1)) ?
+            (uint8_t)(idx - 16 * k) : 0x80;
+    }
+
+    return TIFF_VEC_LOAD(ctl);
+}
+
+/* Shuffle control placing plane channel's bytes into chunky output
+ * vector m.
+ */
+static tiff_vec_t tiff_planar_interleave_ctl(unsigned channels, unsigned channel,
+                                             size_t sample_size, unsigned m)
+{
+    uint8_t ctl[16];
+    size_t j;
+
+    for (j = 0; j < 16; j++) {
+        size_t out = 16 * m + j;
+        size_t pixel = out / (channels * sample_size);
+
+        ctl[j] = ((out / sample_size) % channels == channel) ?
+            (uint8_t)(pixel * sample_size + out % sample_size) : 0x80;
+    }
+
+    return TIFF_VEC_LOAD(ctl);
+}
+
+static size_t tiff_extract_simd(const uint8_t *src, unsigned channels,
+                                unsigned channel, size_t sample_size,
+                                size_t count, uint8_t *dst)
+{
+    tiff_vec_t ctl[TIFF_PLANAR_SIMD_MAX];
+    size_t per = 16 / sample_size, done = 0;
+    unsigned k;
+
+    for (k = 0; k < channels; k++) {
+        ctl[k] = tiff_planar_extract_ctl(channels, channel, sample_size, k);
+    }
+
+    /* Each iteration eats exactly 16 * channels bytes of input */
+    for (; count - done >= per; done += per) {
+        tiff_vec_t out = TIFF_VEC_ZERO();
+
+        for (k = 0; k < channels; k++) {
+            out = TIFF_VEC_OR(out,
+                TIFF_VEC_SHUFFLE(TIFF_VEC_LOAD(src + 16 * k), ctl[k]));
+        }
+
+        TIFF_VEC_STORE(dst, out);
+
+        src += 16 * channels;
+        dst += 16;
+    }
+
+    return done;
+}
+
+static size_t tiff_deinterleave_simd(const uint8_t *src, unsigned channels,
+                                     size_t sample_size, size_t count,
+                                     void **planes)
+{
+    tiff_vec_t ctl[TIFF_PLANAR_SIMD_MAX][TIFF_PLANAR_SIMD_MAX];
+    tiff_vec_t in[TIFF_PLANAR_SIMD_MAX];
+    size_t per = 16 / sample_size, done = 0;
+    unsigned c, k;
+
+    for (c = 0; c < channels; c++) {
+        for (k = 0; k < channels; k++) {
+            ctl[c][k] = tiff_planar_extract_ctl(channels, c, sample_size, k);
+        }
+    }
+
+    for (; count - done >= per; done += per) {
+        for (k = 0; k < channels; k++) {
+            in[k] = TIFF_VEC_LOAD(src + 16 * k);
+        }
+
+        for (c = 0; c < channels; c++) {
+            tiff_vec_t out = TIFF_VEC_ZERO();
+
+            for (k = 0; k < channels; k++) {
+                out = TIFF_VEC_OR(out, TIFF_VEC_SHUFFLE(in[k], ctl[c][k]));
+            }
+
+            TIFF_VEC_STORE((uint8_t *)planes[c] + done * sample_size, out);
+        }
+
+        src += 16 * channels;
+    }
+
+    return done;
+}
+
+static size_t tiff_interleave_simd(void **planes, unsigned channels,
+                                   size_t sample_size, size_t count,
+                                   uint8_t *dst)
+{
+    tiff_vec_t ctl[TIFF_PLANAR_SIMD_MAX][TIFF_PLANAR_SIMD_MAX];
+    tiff_vec_t in[TIFF_PLANAR_SIMD_MAX];
+    size_t per = 16 / sample_size, done = 0;
+    unsigned c, m;
+
+    for (m = 0; m < channels; m++) {
+        for (c = 0; c < channels; c++) {
+            ctl[m][c] = tiff_planar_interleave_ctl(channels, c, sample_size, m);
+        }
+    }
+
+    for (; count - done >= per; done += per) {
+        for (c = 0; c < channels; c++) {
+            in[c] = TIFF_VEC_LOAD((const uint8_t *)planes[c] + done * sample_size);
+        }
+
+        for (m = 0; m < channels; m++) {
+            tiff_vec_t out = TIFF_VEC_ZERO();
+
+            for (c = 0; c < channels; c++) {
+                out = TIFF_VEC_OR(out, TIFF_VEC_SHUFFLE(in[c], ctl[m][c]));
+            }
+
+            TIFF_VEC_STORE(dst + 16 * m, out);
+        }
+
+        dst += 16 * channels;
+    }
+
+    return done;
+}
+
+#endif /* TIFF_PLANAR_SIMD */
+
+/* Scalar loops for the tails, and for when there is no SIMD */
+#define TIFF_EXTRACT_LOOP(type) \
+    for (i = done; i < count; i++) { \
+        ((type *)dst)[i] = ((const type *)src)[i * channels + channel]; \
+    }
+
+#define TIFF_DEINTERLEAVE_LOOP(type) \
+    for (i = done; i < count; i++) { \
+        for (c = 0; c < channels; c++) { \
+            ((type *)planes[c])[i] = ((const type *)src)[i * channels + c]; \
+        } \
+    }
+
+#define TIFF_INTERLEAVE_LOOP(type) \
+    for (i = done; i < count; i++) { \
+        for (c = 0; c < channels; c++) { \
+            ((type *)dst)[i * channels + c] = ((const type *)planes[c])[i]; \
+        } \
+    }
+
+static int tiff_planar_check_size(size_t sample_size)
+{
+    return sample_size == 1 || sample_size == 2 || sample_size == 4;
+}
+
+TIFF_STATUS tiff_extract_channel(const void *src, unsigned channels,
+                                 unsigned channel, size_t sample_size,
+                                 size_t count, void *dst)
+{
+    size_t i, done = 0;
+
+    TIFF_ASSERT_ARG(src);
+    TIFF_ASSERT_ARG(dst);
+
+    if (!tiff_planar_check_size(sample_size) || channel >= channels) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (channels == 1) {
+        memcpy(dst, src, count * sample_size);
+        return TIFF_OK;
+    }
+
+#ifdef TIFF_PLANAR_SIMD
+    if (channels <= TIFF_PLANAR_SIMD_MAX) {
+        done = tiff_extract_simd((const uint8_t *)src, channels, channel,
+            sample_size, count, (uint8_t *)dst);
+    }
+#endif
+
+    switch (sample_size) {
+    case 1:
+        TIFF_EXTRACT_LOOP(uint8_t);
+        break;
+    case 2:
+        TIFF_EXTRACT_LOOP(uint16_t);
+        break;
+    default:
+        TIFF_EXTRACT_LOOP(uint32_t);
+        break;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_chunky_to_planar(const void *src, unsigned channels,
+                                  size_t sample_size, size_t count,
+                                  void **planes)
+{
+    size_t i, done = 0;
+    unsigned c;
+
+    TIFF_ASSERT_ARG(src);
+    TIFF_ASSERT_ARG(planes);
+
+    if (!tiff_planar_check_size(sample_size) || channels == 0) {
+        return TIFF_RANGE_ERROR;
+    }
+
+#ifdef TIFF_PLANAR_SIMD
+    if (channels <= TIFF_PLANAR_SIMD_MAX) {
+        done = tiff_deinterleave_simd((const uint8_t *)src, channels,
+            sample_size, count, planes);
+    }
+#endif
+
+    switch (sample_size) {
+    case 1:
+        TIFF_DEINTERLEAVE_LOOP(uint8_t);
+        break;
+    case 2:
+        TIFF_DEINTERLEAVE_LOOP(uint16_t);
+        break;
+    default:
+        TIFF_DEINTERLEAVE_LOOP(uint32_t);
+        break;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_planar_to_chunky(void **planes, unsigned channels,
+                                  size_t sample_size, size_t count,
+                                  void *dst)
+{
+    size_t i, done = 0;
+    unsigned c;
+
+    TIFF_ASSERT_ARG(planes);
+    TIFF_ASSERT_ARG(dst);
+
+    if (!tiff_planar_check_size(sample_size) || channels == 0) {
+        return TIFF_RANGE_ERROR;
+    }
+
+#ifdef TIFF_PLANAR_SIMD
+    if (channels <= TIFF_PLANAR_SIMD_MAX) {
+        done = tiff_interleave_simd(planes, channels, sample_size, count,
+            (uint8_t *)dst);
+    }
+#endif
+
+    switch (sample_size) {
+    case 1:
+        TIFF_INTERLEAVE_LOOP(uint8_t);
+        break;
+    case 2:
+        TIFF_INTERLEAVE_LOOP(uint16_t);
+        break;
+    default:
+        TIFF_INTERLEAVE_LOOP(uint32_t);
+        break;
+    }
+
+    return TIFF_OK;
+}
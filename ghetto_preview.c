@@ -0,0 +1,311 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Locating embedded JPEG previews and thumbnails without touching the
+ * raw image data. Everything here works off the IFD entries (which are
+ * usually in the prefix read at open time) plus one small read of the
+ * start of each candidate JPEG stream, to find its real dimensions.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/* Don't wander down absurdly long (or looping) IFD chains */
+#define TIFF_PREVIEW_MAX_IFDS       16
+#define TIFF_PREVIEW_MAX_SUBIFDS    8
+
+/* How much of a JPEG stream to read at a time looking for the SOF */
+#define TIFF_JPEG_WINDOW            1024
+
+/* JPEG markers we care about */
+#define JPEG_MARKER_SOF0            0xc0 /* Baseline */
+#define JPEG_MARKER_SOF1            0xc1 /* Extended sequential */
+#define JPEG_MARKER_SOF2            0xc2 /* Progressive */
+#define JPEG_MARKER_SOI             0xd8
+#define JPEG_MARKER_EOI             0xd9
+#define JPEG_MARKER_SOS             0xda
+
+struct tiff_preview {
+    int found;
+    tiff_off_t offset;
+    size_t length;
+    unsigned width;
+    unsigned height;
+};
+
+static int tiff_jpeg_is_sof(uint8_t marker)
+{
+    return marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+        marker != 0xc8 && marker != 0xcc;
+}
+
+/* Walk the JPEG markers up to the start of frame, to get the dimensions
+ * of the stream. Only streams an ordinary JPEG decoder can handle are
+ * accepted, which also weeds out lossless JPEG compressed raw data.
+ */
+static TIFF_STATUS tiff_jpeg_get_dims(tiff_t *fp, tiff_off_t off, size_t len,
+                                      unsigned *width, unsigned *height)
+{
+    uint8_t win[TIFF_JPEG_WINDOW];
+    size_t win_pos = 0, win_len = 0, pos = 2;
+
+    if (len < 4) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if (tiff_read_at(fp, off, win, len < sizeof(win) ? len : sizeof(win),
+            &win_len) != TIFF_OK || win_len < 4)
+    {
+        return TIFF_END_OF_FILE;
+    }
+
+    if (win[0] != 0xff || win[1] != JPEG_MARKER_SOI) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    while (pos + 9 <= len) {
+        uint8_t *seg, marker;
+
+        if (pos + 9 > win_pos + win_len) {
+            size_t want = len - pos < sizeof(win) ? len - pos : sizeof(win);
+
+            win_pos = pos;
+            if (tiff_read_at(fp, off + pos, win, want, &win_len) != TIFF_OK ||
+                win_len < 9)
+            {
+                return TIFF_END_OF_FILE;
+            }
+        }
+
+        seg = win + (pos - win_pos);
+        marker = seg[1];
+
+        if (seg[0] != 0xff) {
+            TIFF_TRACE("Lost JPEG marker sync at %zd\n", pos);
+            return TIFF_UNSUPPORTED;
+        }
+
+        if (marker == 0xff) {
+            /* Fill byte */
+            pos++;
+            continue;
+        }
+
+        if (marker == JPEG_MARKER_SOI || marker == 0x01 ||
+            (marker >= 0xd0 && marker <= 0xd7))
+        {
+            /* Markers without a payload */
+            pos += 2;
+            continue;
+        }
+
+        if (marker == JPEG_MARKER_EOI || marker == JPEG_MARKER_SOS) {
+            return TIFF_UNSUPPORTED;
+        }
+
+        if (tiff_jpeg_is_sof(marker)) {
+            if (marker != JPEG_MARKER_SOF0 && marker != JPEG_MARKER_SOF1 &&
+                marker != JPEG_MARKER_SOF2)
+            {
+                return TIFF_UNSUPPORTED;
+            }
+
+            *height = ((unsigned)seg[5] << 8) | seg[6];
+            *width = ((unsigned)seg[7] << 8) | seg[8];
+
+            return TIFF_OK;
+        }
+
+        pos += 2 + (((size_t)seg[2] << 8) | seg[3]);
+    }
+
+    return TIFF_UNSUPPORTED;
+}
+
+static void tiff_preview_consider(tiff_t *fp, struct tiff_preview *best,
+                                  uint64_t off, uint64_t len,
+                                  unsigned min_width, unsigned min_height)
+{
+    unsigned width = 0, height = 0;
+    int big_enough, best_big_enough;
+    uint64_t area, best_area;
+
+    if (off == 0 || len == 0) {
+        return;
+    }
+
+    if (tiff_jpeg_get_dims(fp, off, (size_t)len, &width, &height) != TIFF_OK) {
+        return;
+    }
+
+    TIFF_TRACE("JPEG candidate at %08x, %ux%u\n", (unsigned)off, width, height);
+
+    big_enough = width >= min_width && height >= min_height;
+    best_big_enough = best->found && best->width >= min_width &&
+        best->height >= min_height;
+    area = (uint64_t)width * height;
+    best_area = (uint64_t)best->width * best->height;
+
+    /* Prefer the smallest image that's big enough, otherwise the biggest */
+    if (!best->found ||
+        (big_enough && (!best_big_enough || area < best_area)) ||
+        (!big_enough && !best_big_enough && area > best_area))
+    {
+        best->found = 1;
+        best->offset = off;
+        best->length = (size_t)len;
+        best->width = width;
+        best->height = height;
+    }
+}
+
+static TIFF_STATUS tiff_preview_get_uint(tiff_t *fp, tiff_ifd_t *ifd,
+                                         tiff_tag_id_t tag_id, uint64_t *val)
+{
+    tiff_tag_t *tag = NULL;
+
+    if (tiff_get_tag(fp, ifd, tag_id, &tag) != TIFF_OK) {
+        return TIFF_TAG_NOT_FOUND;
+    }
+
+    return tiff_get_tag_element(fp, ifd, tag, 0, val);
+}
+
+static void tiff_preview_scan_ifd(tiff_t *fp, tiff_ifd_t *ifd,
+                                  struct tiff_preview *best,
+                                  unsigned min_width, unsigned min_height)
+{
+    tiff_tag_t *tag = NULL;
+    uint64_t val = 0, off = 0, len = 0;
+
+    /* Raw sensor data is never a preview */
+    if (tiff_preview_get_uint(fp, ifd, TIFF_TAG_PHOTOMETRIC, &val) == TIFF_OK &&
+        (val == TIFF_PHOTOMETRIC_CFA || val == TIFF_PHOTOMETRIC_LINEARRAW))
+    {
+        return;
+    }
+
+    /* EXIF-style thumbnail or preview stream */
+    if (tiff_preview_get_uint(fp, ifd, TIFF_TAG_JPEGIFOFFSET, &off) == TIFF_OK &&
+        tiff_preview_get_uint(fp, ifd, TIFF_TAG_JPEGIFBYTECOUNT, &len) == TIFF_OK)
+    {
+        tiff_preview_consider(fp, best, off, len, min_width, min_height);
+    }
+
+    /* A JPEG compressed image stored as a single strip */
+    if (tiff_preview_get_uint(fp, ifd, TIFF_TAG_COMPRESSION, &val) == TIFF_OK &&
+        (val == TIFF_COMPRESSION_OJPEG || val == TIFF_COMPRESSION_JPEG) &&
+        tiff_get_tag(fp, ifd, TIFF_TAG_STRIPOFFSETS, &tag) == TIFF_OK &&
+        tag->count == 1 &&
+        tiff_preview_get_uint(fp, ifd, TIFF_TAG_STRIPOFFSETS, &off) == TIFF_OK &&
+        tiff_preview_get_uint(fp, ifd, TIFF_TAG_STRIPBYTECOUNTS, &len) == TIFF_OK)
+    {
+        tiff_preview_consider(fp, best, off, len, min_width, min_height);
+    }
+}
+
+static void tiff_preview_scan_subifds(tiff_t *fp, tiff_ifd_t *ifd,
+                                      struct tiff_preview *best,
+                                      unsigned min_width, unsigned min_height)
+{
+    uint64_t offsets[TIFF_PREVIEW_MAX_SUBIFDS];
+    tiff_tag_t *tag = NULL;
+    size_t i;
+
+    if (tiff_get_tag(fp, ifd, TIFF_TAG_SUBIFDS, &tag) != TIFF_OK ||
+        tag->count == 0 || tag->count > TIFF_PREVIEW_MAX_SUBIFDS)
+    {
+        return;
+    }
+
+    if (tiff_get_tag_uint_array(fp, ifd, tag, offsets) != TIFF_OK) {
+        return;
+    }
+
+    for (i = 0; i < tag->count; i++) {
+        tiff_ifd_t *sub_ifd = NULL;
+
+        if (tiff_read_ifd(fp, offsets[i], &sub_ifd) != TIFF_OK) {
+            continue;
+        }
+
+        tiff_preview_scan_ifd(fp, sub_ifd, best, min_width, min_height);
+        tiff_free_ifd(fp, sub_ifd);
+    }
+}
+
+TIFF_STATUS tiff_find_best_preview(tiff_t *fp, unsigned min_width,
+                                   unsigned min_height,
+                                   tiff_off_t *offset, size_t *length)
+{
+    struct tiff_preview best;
+    tiff_ifd_chain_t chain;
+    tiff_off_t ifd_off;
+    int depth;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(offset);
+    TIFF_ASSERT_ARG(length);
+
+    memset(&best, 0, sizeof(best));
+    memset(&chain, 0, sizeof(chain));
+
+    ifd_off = fp->root_ifd;
+
+    for (depth = 0; ifd_off != 0 && depth < TIFF_PREVIEW_MAX_IFDS; depth++) {
+        tiff_ifd_t *ifd = NULL;
+        tiff_off_t next;
+
+        if (tiff_read_ifd(fp, ifd_off, &ifd) != TIFF_OK) {
+            break;
+        }
+
+        tiff_preview_scan_ifd(fp, ifd, &best, min_width, min_height);
+        tiff_preview_scan_subifds(fp, ifd, &best, min_width, min_height);
+
+        if (tiff_next_ifd(fp, &chain, ifd, &next) != TIFF_OK) {
+            next = 0;
+        }
+        tiff_free_ifd(fp, ifd);
+
+        ifd_off = next;
+    }
+
+    if (!best.found) {
+        return TIFF_TAG_NOT_FOUND;
+    }
+
+    *offset = best.offset;
+    *length = best.length;
+
+    return TIFF_OK;
+}
@@ -7,6 +7,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* SIMD kernels are picked at compile time, based on the instruction set
+ * extensions the library is built for (see ARCH in the Makefile).
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TIFF_SIMD_SSE2
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TIFF_SIMD_AVX2
+#endif
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define TIFF_SIMD_SSSE3
+#endif
+
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#define TIFF_SIMD_SSE41
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define TIFF_SIMD_SSE42
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TIFF_SIMD_NEON
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define TIFF_SIMD_CRC32
+#endif
+
 #define ENDIAN_BIG      0x0
 #define ENDIAN_LITTLE   0x1
 
@@ -16,6 +54,43 @@ struct tiff {
     int endianess;
     tiff_off_t root_ifd;
     tiff_file_mgr_t *mgr;
+
+    /* The start of the file, read along with the header. Most of the
+     * IFDs and tag data we are interested in live in here.
+     */
+    uint8_t *prefix;
+    size_t prefix_len;
+
+    /* Every image in the file, built by the first level lookup */
+    tiff_level_info_t *levels;
+    size_t level_count;
+    size_t level_alloc;
+
+    /* Optional decoded chunk cache, and who we are as far as it's concerned */
+    tiff_cache_t *cache;
+    uint64_t file_id;
+    uint64_t name_hash;         /* Of the name we were opened with */
+
+    int sync_policy;            /* TIFF_SYNC_*, for tag patches */
+
+    /* Everything belonging to this file is allocated through alloc,
+     * which counts allocations and passes them on to base_alloc.
+     */
+    tiff_allocator_t alloc;
+    tiff_allocator_t base_alloc;
+
+    tiff_file_stats_t stats;
+    size_t io_pos;              /* Backend file position, for seek stats */
+
+    tiff_limits_t limits;
+    size_t file_size;           /* 0 if the backend can't tell */
+
+    /* End of the main IFD chain as far as tiff_refresh has followed it:
+     * the last IFD, and where its next IFD offset is stored. 0 until the
+     * chain has been walked once.
+     */
+    tiff_off_t tail_ifd;
+    tiff_off_t tail_next_pos;
 };
 
 struct tiff_tag;
@@ -23,38 +98,190 @@ struct tiff_tag;
 struct tiff_ifd {
     struct tiff *fp;
     struct tiff_tag *tags;
+    tiff_tag_id_t *tag_ids; /* The tags' ids again, densely, for searching */
     size_t tag_count;
     tiff_off_t next_ifd_off;
     tiff_off_t tag_offset; /* Offset applied to tag reads */
+    tiff_off_t offset; /* Where the IFD was read from, 0 if not from the file */
+
+    /* Strip/tile locations, loaded on first use by the chunk read path */
+    tiff_off_t *chunk_offsets;
+    tiff_off_t *chunk_sizes;
+    size_t chunk_count;
 };
 
+/* An IFD entry, in the 12 bytes it takes in the file. The value field is
+ * kept as it was stored, see tiff_ingest_ifd.
+ */
 struct tiff_tag {
     tiff_tag_id_t id;
-    int type;
-    size_t count;
-    tiff_off_t offset;
+    UINT16 type;
+    UINT32 count;
+    UINT32 offset;
 };
 
+/* Geometry of the image data referenced by an image IFD. Strips are
+ * treated as tiles that span the full width of the image.
+ */
+struct tiff_image_layout {
+    unsigned width;
+    unsigned height;
+    unsigned samples;           /* SamplesPerPixel */
+    unsigned bits;              /* BitsPerSample of the first sample */
+    unsigned compression;
+    unsigned planar;            /* PlanarConfiguration */
+    int tiled;
+    unsigned chunk_width;
+    unsigned chunk_height;
+    unsigned chunks_across;
+    unsigned chunks_down;
+    size_t chunks_per_plane;
+    size_t chunk_count;
+    unsigned chunk_samples;     /* Samples per pixel stored in each chunk */
+    size_t row_bytes;           /* Bytes in one (byte-padded) chunk row */
+    size_t sample_size;         /* Bytes per decoded sample, 0 if unsupported */
+};
+
+/* Allocate and free memory through an allocator's hooks. tiff_calloc
+ * zeroes the block and checks nmemb * size for overflow. Aligned blocks
+ * must be freed with tiff_aligned_free.
+ */
+void *tiff_malloc(const tiff_allocator_t *a, size_t size);
+void *tiff_calloc(const tiff_allocator_t *a, size_t nmemb, size_t size);
+void *tiff_realloc(const tiff_allocator_t *a, void *ptr, size_t old_size,
+                   size_t size);
+void tiff_free(const tiff_allocator_t *a, void *ptr);
+void *tiff_aligned_alloc(const tiff_allocator_t *a, size_t alignment, size_t size);
+void tiff_aligned_free(const tiff_allocator_t *a, void *ptr);
+
+/* Wrap an open descriptor in a tiff_pread_mgr handle. The descriptor is
+ * closed with the handle if own is set, or once tiff_fd_hdl_own is called.
+ */
+TIFF_STATUS tiff_fd_hdl_create(tiff_file_hdl_t **hdl, int fd, int own);
+void tiff_fd_hdl_own(tiff_file_hdl_t *hdl);
+
+/* Open a tiff_compressed_mgr handle for file */
+TIFF_STATUS tiff_compressed_hdl_create(tiff_file_hdl_t **hdl, const char *file,
+                                       const tiff_compressed_options_t *opts);
+
+/* Open a tiff_http_mgr handle for url. This fetches the prefix. */
+TIFF_STATUS tiff_http_hdl_create(tiff_file_hdl_t **hdl, const char *url,
+                                 const tiff_http_options_t *opts);
+
+/* Get a copy of the current global allocator */
+void tiff_get_allocator(tiff_allocator_t *allocator);
+
+/* Set up fp->alloc to count allocations into fp->stats, passing them on
+ * to base, which is kept in fp->base_alloc.
+ */
+void tiff_count_allocator(tiff_t *fp, const tiff_allocator_t *base);
+
+/* Add the counters of fp to the process-wide totals, and clear them */
+void tiff_fold_stats(tiff_t *fp);
+
+/* Read len bytes at off, using the prefix buffer when possible. *count
+ * is set to the number of bytes actually read.
+ */
+TIFF_STATUS tiff_read_at(tiff_t *fp, tiff_off_t off, void *buf, size_t len,
+                         size_t *count);
+
+/* Write len bytes at off through the file manager, keeping the prefix
+ * buffer up to date.
+ */
+TIFF_STATUS tiff_write_at(tiff_t *fp, tiff_off_t off, const void *buf, size_t len);
+
+/* Fill in the layout of the image described by the given IFD */
+TIFF_STATUS tiff_get_image_layout(tiff_t *fp, tiff_ifd_t *ifd,
+                                  struct tiff_image_layout *layout);
+
+/* Load the strip/tile offset and byte count arrays into the IFD */
+TIFF_STATUS tiff_load_chunk_table(tiff_t *fp, tiff_ifd_t *ifd);
+
+/* Number of rows actually stored in the given chunk */
+unsigned tiff_get_chunk_rows(struct tiff_image_layout *layout, size_t index);
+
+/* Decode (read, byte swap and unpack) a chunk into dst, which must hold
+ * chunk_width * chunk_height * chunk_samples samples of sample_size bytes.
+ */
+TIFF_STATUS tiff_decode_chunk(tiff_t *fp, tiff_ifd_t *ifd,
+                              struct tiff_image_layout *layout, size_t index,
+                              void *dst);
+
+/* Copy a cached chunk into dst, if there is one of exactly len bytes */
+TIFF_STATUS tiff_cache_lookup(tiff_cache_t *cache, uint64_t file_id,
+                              tiff_off_t ifd_offset, size_t index,
+                              void *dst, size_t len);
+
+/* Add a copy of a decoded chunk to the cache */
+TIFF_STATUS tiff_cache_insert(tiff_cache_t *cache, uint64_t file_id,
+                              tiff_off_t ifd_offset, size_t index,
+                              const void *src, size_t len);
+
+/* Drop every chunk cached for a file, once its contents have changed */
+void tiff_cache_purge(tiff_cache_t *cache, uint64_t file_id);
+
+/* Byte swap a buffer of words/dwords from the given endianess to native */
+void tiff_swap_word_buffer(void *buf, size_t count, int endianess);
+void tiff_swap_dword_buffer(void *buf, size_t count, int endianess);
+void tiff_swap_qword_buffer(void *buf, size_t count, int endianess);
+
+/* Check that a tag's data is within the payload limit and, if stored
+ * out of line, within the file. ifd may be NULL to only check the size.
+ */
+TIFF_STATUS tiff_check_tag_payload(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag);
+
+/* Read a single integer element of a tag, widening it to 64 bits */
+TIFF_STATUS tiff_get_tag_element(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag,
+                                 size_t index, uint64_t *value);
+
+/* Read all elements of an integer tag into dst, widening to 64 bits.
+ * dst must hold tag->count elements.
+ */
+TIFF_STATUS tiff_get_tag_uint_array(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag,
+                                    uint64_t *dst);
+
+/* Event hooks. Only the handler check is inline; building the event and
+ * formatting messages happens out of line, and only with a handler set.
+ */
+extern tiff_event_handler_t tiff_event_handler;
+
+void tiff_emit_event(int type, const tiff_t *fp, tiff_off_t offset,
+                     uint64_t size, uint64_t count, unsigned tag,
+                     TIFF_STATUS status, const char *where);
+
+void tiff_emit_message(int type, const char *where, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
 /* Helper Macros */
 
-#ifdef _DEBUG
-#define TIFF_PRINT(x, ...) \
-    printf("ghetto: " x, ##__VA_ARGS__)
+#ifdef TIFF_NO_EVENTS
+#define TIFF_EVENT(...) do { } while (0)
+#define TIFF_TRACE(...) do { } while (0)
+#define TIFF_ASSERT(...) do { } while (0)
 #else
-#define TIFF_PRINT(...)
-#endif
+#define TIFF_EVENT(type, fp, offset, size, count, tag, status) \
+    do { \
+        if (__builtin_expect(tiff_event_handler != NULL, 0)) { \
+            tiff_emit_event(type, fp, offset, size, count, tag, status, \
+                __func__); \
+        } \
+    } while (0)
 
 #define TIFF_TRACE(x, ...) \
-    TIFF_PRINT("%s@%d: " x, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+    do { \
+        if (__builtin_expect(tiff_event_handler != NULL, 0)) { \
+            tiff_emit_message(TIFF_EVENT_MESSAGE, __func__, x, ##__VA_ARGS__); \
+        } \
+    } while (0)
 
-#ifdef _DEBUG
+/* Reports the failure and carries on; never aborts the program */
 #define TIFF_ASSERT(x) \
-    if (!(x)) { \
-        TIFF_TRACE("assertion failure: " #x "\n"); \
-        exit(-1); \
-    }
-#else
-#define TIFF_ASSERT(...)
+    do { \
+        if (!(x) && tiff_event_handler != NULL) { \
+            tiff_emit_message(TIFF_EVENT_ASSERT, __func__, \
+                "assertion failure: " #x); \
+        } \
+    } while (0)
 #endif
 
 #define TIFF_ASSERT_RETURN(x, r) \
@@ -72,11 +299,61 @@ struct tiff_tag {
         return TIFF_BAD_ARGUMENT; \
     }
 
+/* Backend reads and seeks, counted in the file's stats */
+static inline TIFF_STATUS tiff_io_read(tiff_t *fp, size_t size, size_t nmemb,
+                                       void *buf, size_t *count)
+{
+    size_t got = 0, len = size * nmemb;
+    unsigned bucket = 0;
+    TIFF_STATUS ret;
+
+    if (fp->limits.max_bytes_read != 0 &&
+        (fp->stats.bytes_read >= fp->limits.max_bytes_read ||
+         len > fp->limits.max_bytes_read - fp->stats.bytes_read))
+    {
+        if (count) *count = 0;
+        return TIFF_LIMIT_READ;
+    }
+
+    ret = fp->mgr->read(fp->fp, size, nmemb, buf, &got);
+
+    TIFF_EVENT(TIFF_EVENT_READ, fp, fp->io_pos, len, got * size, 0, ret);
+
+    while (bucket < TIFF_READ_SIZE_BUCKETS - 1 && len > ((size_t)64 << bucket)) {
+        bucket++;
+    }
+
+    fp->stats.reads++;
+    fp->stats.bytes_read += got * size;
+    fp->stats.read_sizes[bucket]++;
+    fp->io_pos += got * size;
+
+    if (count) *count = got;
+
+    return ret;
+}
+
+static inline TIFF_STATUS tiff_io_seek(tiff_t *fp, size_t off, int whence)
+{
+    fp->stats.seeks++;
+
+    if (whence == TIFF_SEEK_SET) {
+        if (off < fp->io_pos) {
+            fp->stats.backward_seeks++;
+        }
+        fp->io_pos = off;
+    } else if (whence == TIFF_SEEK_CUR) {
+        fp->io_pos += off;
+    }
+
+    return fp->mgr->seek(fp->fp, off, whence);
+}
+
 #define TIFF_READ(fp, size, nmemb, buf, count) \
-    fp->mgr->read(fp->fp, size, nmemb, buf, count)
+    tiff_io_read(fp, size, nmemb, buf, count)
 
 #define TIFF_SEEK(fp, off, whence) \
-    fp->mgr->seek(fp->fp, off, whence)
+    tiff_io_seek(fp, off, whence)
 
 static inline uint16_t tiff_swap_word(uint16_t word)
 {
@@ -111,6 +388,7 @@ static inline uint32_t tiff_swap_dword(uint32_t word)
 
 /* Defines related to image structure/offsets/etc */
 #define TIFF_HEADER_LEN     8
+#define TIFF_PREFIX_LEN     4096 /* How much to read along with the header */
 #define TIFF_HEADER_ENDIAN  0
 #define TIFF_HEADER_MAGIC   2
 #define TIFF_HEADER_IFD     4
@@ -125,8 +403,56 @@ static inline uint32_t tiff_swap_dword(uint32_t word)
 #define IFD_ENTRY_TYPE      2
 #define IFD_ENTRY_COUNT     4
 #define IFD_ENTRY_OFFSET    8
+#define IFD_READAHEAD       512 /* Speculative read size for an IFD */
+
+/* Memory an IFD takes per entry: the entry, and its id in tag_ids */
+#define TIFF_IFD_TAG_SIZE   (sizeof(struct tiff_tag) + sizeof(tiff_tag_id_t))
 
 #define TIFF_TAG_DATA_FIELD_SIZE    0x4
 
+/* Baseline tags defining the final image characteristics */
+#define TIFF_TAG_NEWSUBFILETYPE     254
+#define TIFF_TAG_IMAGEWIDTH         256
+#define TIFF_TAG_IMAGELENGTH        257
+#define TIFF_TAG_BITSPERSAMPLE      258
+#define TIFF_TAG_COMPRESSION        259
+#define TIFF_TAG_PHOTOMETRIC        262
+#define TIFF_TAG_SAMPLESPERPIXEL    277
+#define TIFF_TAG_PLANARCONFIG       284
+
+/* Strip-related tags */
+#define TIFF_TAG_STRIPOFFSETS       273
+#define TIFF_TAG_ROWSPERSTRIP       278
+#define TIFF_TAG_STRIPBYTECOUNTS    279
+
+/* Tile-related tags */
+#define TIFF_TAG_TILEWIDTH          322
+#define TIFF_TAG_TILEHEIGHT         323
+#define TIFF_TAG_TILEOFFSETS        324
+#define TIFF_TAG_TILEBYTECOUNTS     325
+
+/* Sample Format (extended sample types) */
+#define TIFF_TAG_SAMPLEFORMAT       339
+
+/* Child IFDs (TIFF 6.0 supplement, EXIF) */
+#define TIFF_TAG_SUBIFDS            330
+#define TIFF_TAG_EXIFIFD            34665
+
+/* JPEG interchange format streams (thumbnails and previews) */
+#define TIFF_TAG_JPEGIFOFFSET       513
+#define TIFF_TAG_JPEGIFBYTECOUNT    514
+
+/* Colour filter array layout (TIFF/EP) */
+#define TIFF_TAG_CFAREPEATPATTERNDIM    33421
+#define TIFF_TAG_CFAPATTERN             33422
+
+/* Photometric interpretations used by camera raw data */
+#define TIFF_PHOTOMETRIC_CFA        32803
+#define TIFF_PHOTOMETRIC_LINEARRAW  34892
+
+/* NewSubfileType bits */
+#define TIFF_SUBFILE_REDUCED        0x1
+#define TIFF_SUBFILE_MASK           0x4
+
 #endif /* __INCLUDE_GHETTO_PRIV_H__ */
 
@@ -0,0 +1,418 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Reduced resolution reads, for quick looks.
+ *
+ * Output rows are built one at a time from only the source rows they
+ * need, so neither the full resolution image nor a full resolution
+ * buffer is ever held. Uncompressed chunky strips are read a row at a
+ * time straight from the file, which lets subsampling skip the rows it
+ * doesn't use entirely; everything else goes through a scanline cursor.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+struct tiff_scaled_src {
+    tiff_t *fp;
+    tiff_ifd_t *ifd;
+    struct tiff_image_layout layout;
+    tiff_scanline_t *cursor;    /* NULL when reading rows directly */
+    unsigned next;              /* Next row the cursor will hand out */
+    uint8_t *raw;               /* A row as stored in the file */
+    uint8_t *row;               /* A decoded row */
+};
+
+/* CFA colours, as used by the CFAPattern tag */
+#define TIFF_CFA_RED        0
+#define TIFF_CFA_GREEN      1
+#define TIFF_CFA_BLUE       2
+
+static TIFF_STATUS tiff_scaled_get_row(struct tiff_scaled_src *src, unsigned y,
+                                       const uint8_t **row)
+{
+    struct tiff_image_layout *layout = &src->layout;
+    size_t strip, samples, count = 0;
+    const void *r = NULL;
+    TIFF_STATUS ret;
+
+    if (src->cursor != NULL) {
+        /* Rows are always asked for in order, so just skip ahead */
+        while (src->next <= y) {
+            if ( (ret = tiff_scanline_next(src->cursor, &r)) != TIFF_OK ) {
+                return ret;
+            }
+            if (r == NULL) {
+                return TIFF_END_OF_FILE;
+            }
+            src->next++;
+        }
+        *row = (const uint8_t *)r;
+        return TIFF_OK;
+    }
+
+    strip = y / layout->chunk_height;
+    samples = (size_t)layout->width * layout->samples;
+
+    if (src->ifd->chunk_sizes[strip] <
+        (size_t)(y % layout->chunk_height + 1) * layout->row_bytes)
+    {
+        TIFF_TRACE("Strip %zd is too short for its geometry\n", strip);
+        return TIFF_TAG_MALFORMED;
+    }
+
+    if ( (ret = tiff_read_at(src->fp, src->ifd->chunk_offsets[strip] +
+            (tiff_off_t)(y % layout->chunk_height) * layout->row_bytes,
+            src->raw, layout->row_bytes, &count)) != TIFF_OK)
+    {
+        return ret;
+    }
+
+    if (count < layout->row_bytes) {
+        return TIFF_END_OF_FILE;
+    }
+
+    if (layout->bits != 8 * layout->sample_size) {
+        tiff_unpack_samples(src->raw, layout->bits, TIFF_BITORDER_MSB, samples,
+            (UINT16 *)src->row);
+    } else {
+        memcpy(src->row, src->raw, samples * layout->sample_size);
+        if (layout->sample_size == 2) {
+            tiff_swap_word_buffer(src->row, samples, src->fp->endianess);
+        } else if (layout->sample_size == 4) {
+            tiff_swap_dword_buffer(src->row, samples, src->fp->endianess);
+        }
+    }
+
+    *row = src->row;
+
+    return TIFF_OK;
+}
+
+static inline uint64_t tiff_scaled_sample(const uint8_t *row, size_t ss, size_t i)
+{
+    switch (ss) {
+    case 1:
+        return row[i];
+    case 2:
+        return ((const uint16_t *)row)[i];
+    default:
+        return ((const uint32_t *)row)[i];
+    }
+}
+
+static inline void tiff_scaled_store(uint8_t *out, size_t ss, size_t i, uint64_t v)
+{
+    switch (ss) {
+    case 1:
+        out[i] = (uint8_t)v;
+        break;
+    case 2:
+        ((uint16_t *)out)[i] = (uint16_t)v;
+        break;
+    default:
+        ((uint32_t *)out)[i] = (uint32_t)v;
+        break;
+    }
+}
+
+/* Read the 2x2 CFA pattern of a raw image; RGGB is assumed if it's missing */
+static TIFF_STATUS tiff_scaled_get_cfa(tiff_t *fp, tiff_ifd_t *ifd,
+                                       unsigned pattern[4])
+{
+    tiff_tag_t *tag = NULL;
+    uint64_t val = 0;
+    unsigned seen = 0;
+    int i;
+
+    pattern[0] = TIFF_CFA_RED;
+    pattern[1] = pattern[2] = TIFF_CFA_GREEN;
+    pattern[3] = TIFF_CFA_BLUE;
+
+    if (tiff_get_tag(fp, ifd, TIFF_TAG_CFAREPEATPATTERNDIM, &tag) == TIFF_OK) {
+        for (i = 0; i < 2; i++) {
+            if (tiff_get_tag_element(fp, ifd, tag, i, &val) != TIFF_OK || val != 2) {
+                TIFF_TRACE("Only 2x2 CFA patterns can be binned\n");
+                return TIFF_UNSUPPORTED;
+            }
+        }
+    }
+
+    if (tiff_get_tag(fp, ifd, TIFF_TAG_CFAPATTERN, &tag) != TIFF_OK) {
+        return TIFF_OK;
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (tiff_get_tag_element(fp, ifd, tag, i, &val) != TIFF_OK) {
+            return TIFF_TAG_MALFORMED;
+        }
+        if (val > TIFF_CFA_BLUE) {
+            return TIFF_UNSUPPORTED;
+        }
+        pattern[i] = (unsigned)val;
+        seen |= 1 << val;
+    }
+
+    /* Every colour has to be there to make RGB out of it */
+    return seen == 0x7 ? TIFF_OK : TIFF_UNSUPPORTED;
+}
+
+static TIFF_STATUS tiff_scaled_geometry(tiff_t *fp, tiff_ifd_t *ifd,
+                                        unsigned factor, int mode,
+                                        struct tiff_image_layout *layout,
+                                        unsigned *width, unsigned *height,
+                                        unsigned *samples)
+{
+    unsigned photometric = 0;
+    tiff_tag_t *tag = NULL;
+    uint64_t val = 0;
+    UINT32 format = TIFF_SAMPLEFORMAT_UINT;
+    TIFF_STATUS ret;
+
+    if ( (ret = tiff_get_image_layout(fp, ifd, layout)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (layout->compression != TIFF_COMPRESSION_NONE || layout->sample_size == 0) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if (factor == 0) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* The filters that average add up raw sample bits as unsigned
+     * integers, which is wrong for signed and floating point samples
+     */
+    if (mode != TIFF_SCALE_SUBSAMPLE &&
+        tiff_get_tag_u32(fp, ifd, TIFF_TAG_SAMPLEFORMAT, &format) == TIFF_OK &&
+        format != TIFF_SAMPLEFORMAT_UINT)
+    {
+        return TIFF_UNSUPPORTED;
+    }
+
+    switch (mode) {
+    case TIFF_SCALE_SUBSAMPLE:
+    case TIFF_SCALE_BOX:
+        *width = (layout->width + factor - 1) / factor;
+        *height = (layout->height + factor - 1) / factor;
+        *samples = layout->samples;
+        break;
+    case TIFF_SCALE_CFA:
+        if (tiff_get_tag(fp, ifd, TIFF_TAG_PHOTOMETRIC, &tag) == TIFF_OK &&
+            tiff_get_tag_element(fp, ifd, tag, 0, &val) == TIFF_OK)
+        {
+            photometric = (unsigned)val;
+        }
+
+        if (photometric != TIFF_PHOTOMETRIC_CFA || layout->samples != 1) {
+            return TIFF_UNSUPPORTED;
+        }
+
+        /* Only whole blocks of whole CFA cells are binned */
+        if (factor % 2 != 0 || layout->width < factor || layout->height < factor) {
+            return TIFF_RANGE_ERROR;
+        }
+
+        *width = layout->width / factor;
+        *height = layout->height / factor;
+        *samples = 3;
+        break;
+    default:
+        return TIFF_RANGE_ERROR;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_get_scaled_size(tiff_t *fp, tiff_ifd_t *ifd, unsigned factor,
+                                 int mode, unsigned *width, unsigned *height,
+                                 unsigned *samples)
+{
+    struct tiff_image_layout layout;
+    unsigned w, h, s;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+
+    if ( (ret = tiff_scaled_geometry(fp, ifd, factor, mode, &layout, &w, &h, &s))
+        != TIFF_OK)
+    {
+        return ret;
+    }
+
+    if (width) *width = w;
+    if (height) *height = h;
+    if (samples) *samples = s;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_read_scaled(tiff_t *fp, tiff_ifd_t *ifd, unsigned factor,
+                             int mode, void *dst, size_t dst_len)
+{
+    struct tiff_scaled_src src;
+    struct tiff_image_layout *layout = &src.layout;
+    unsigned out_w, out_h, out_s, pattern[4], ox, oy, x, y, y1, s;
+    uint64_t *acc = NULL, cfa_count[3] = { 0, 0, 0 };
+    uint8_t *out = (uint8_t *)dst;
+    const uint8_t *row = NULL;
+    size_t ss, spp, out_row;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(dst);
+
+    memset(&src, 0, sizeof(src));
+    src.fp = fp;
+    src.ifd = ifd;
+
+    if ( (ret = tiff_scaled_geometry(fp, ifd, factor, mode, layout,
+            &out_w, &out_h, &out_s)) != TIFF_OK)
+    {
+        return ret;
+    }
+
+    ss = layout->sample_size;
+    spp = layout->samples;
+    out_row = (size_t)out_w * out_s;
+
+    if (dst_len < out_row * out_h * ss) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (mode == TIFF_SCALE_CFA) {
+        if ( (ret = tiff_scaled_get_cfa(fp, ifd, pattern)) != TIFF_OK ) {
+            return ret;
+        }
+        for (s = 0; s < 4; s++) {
+            cfa_count[pattern[s]] += (uint64_t)(factor / 2) * (factor / 2);
+        }
+    }
+
+    if (!layout->tiled && layout->planar == 1) {
+        if ( (ret = tiff_load_chunk_table(fp, ifd)) != TIFF_OK ) {
+            return ret;
+        }
+
+        if (ifd->chunk_count < layout->chunk_count) {
+            return TIFF_TAG_MALFORMED;
+        }
+
+        src.raw = (uint8_t *)tiff_calloc(&fp->alloc, 1, layout->row_bytes);
+        src.row = (uint8_t *)tiff_calloc(&fp->alloc,
+            (size_t)layout->width * spp, ss);
+        if (src.raw == NULL || src.row == NULL) {
+            ret = TIFF_NO_MEMORY;
+            goto done;
+        }
+    } else if ( (ret = tiff_scanline_open(fp, ifd, &src.cursor)) != TIFF_OK ) {
+        goto done;
+    }
+
+    if (mode != TIFF_SCALE_SUBSAMPLE) {
+        acc = (uint64_t *)tiff_calloc(&fp->alloc, out_row, sizeof(uint64_t));
+        if (acc == NULL) {
+            ret = TIFF_NO_MEMORY;
+            goto done;
+        }
+    }
+
+    for (oy = 0; oy < out_h; oy++, out += out_row * ss) {
+        y = oy * factor;
+
+        if (mode == TIFF_SCALE_SUBSAMPLE) {
+            if ( (ret = tiff_scaled_get_row(&src, y, &row)) != TIFF_OK ) {
+                goto done;
+            }
+            for (ox = 0; ox < out_w; ox++) {
+                memcpy(out + ox * spp * ss, row + (size_t)ox * factor * spp * ss,
+                    spp * ss);
+            }
+            continue;
+        }
+
+        memset(acc, 0, out_row * sizeof(uint64_t));
+
+        y1 = y + factor;
+        if (y1 > layout->height) y1 = layout->height;
+
+        for (; y < y1; y++) {
+            if ( (ret = tiff_scaled_get_row(&src, y, &row)) != TIFF_OK ) {
+                goto done;
+            }
+
+            if (mode == TIFF_SCALE_BOX) {
+                for (x = 0; x < layout->width; x++) {
+                    uint64_t *a = acc + (size_t)(x / factor) * spp;
+                    for (s = 0; s < spp; s++) {
+                        a[s] += tiff_scaled_sample(row, ss, (size_t)x * spp + s);
+                    }
+                }
+            } else {
+                const unsigned *colour = pattern + (y & 1) * 2;
+                for (x = 0; x < out_w * factor; x++) {
+                    acc[(size_t)(x / factor) * 3 + colour[x & 1]] +=
+                        tiff_scaled_sample(row, ss, x);
+                }
+            }
+        }
+
+        for (ox = 0; ox < out_w; ox++) {
+            for (s = 0; s < out_s; s++) {
+                uint64_t n;
+
+                if (mode == TIFF_SCALE_BOX) {
+                    unsigned cols = layout->width - ox * factor;
+                    if (cols > factor) cols = factor;
+                    n = (uint64_t)cols * (y1 - oy * factor);
+                } else {
+                    n = cfa_count[s];
+                }
+
+                tiff_scaled_store(out, ss, (size_t)ox * out_s + s,
+                    (acc[(size_t)ox * out_s + s] + n / 2) / n);
+            }
+        }
+    }
+
+    ret = TIFF_OK;
+
+done:
+    if (src.cursor) tiff_scanline_close(src.cursor);
+    tiff_free(&fp->alloc, src.raw);
+    tiff_free(&fp->alloc, src.row);
+    tiff_free(&fp->alloc, acc);
+    return ret;
+}
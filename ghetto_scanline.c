@@ -0,0 +1,322 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Row-at-a-time access to uncompressed images.
+ *
+ * Rows are decoded a band at a time, where a band is one strip or one
+ * row of tiles. Decoded bands go into a two slot ring, so the rows of
+ * the previous band stay valid while the next one is decoded, and the
+ * I/O backend is asked to start fetching the band after that. Memory
+ * use is about three bands, whatever the size of the image.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+#define TIFF_SCANLINE_SLOTS     2
+
+struct tiff_scanline {
+    tiff_t *fp;
+    tiff_ifd_t *ifd;
+    struct tiff_image_layout layout;
+
+    size_t row_bytes;           /* Bytes in one decoded, chunky row */
+    size_t band_bytes;
+    size_t chunk_bytes;         /* Bytes in one decoded chunk */
+
+    uint8_t *slots[TIFF_SCANLINE_SLOTS];
+    unsigned slot_band[TIFF_SCANLINE_SLOTS];
+    uint8_t *scratch;           /* Chunks waiting to be assembled into a band */
+    void **planes;
+
+    tiff_stats_t *stats;        /* Fed each band as it's decoded */
+
+    unsigned row;               /* Next row to hand out */
+};
+
+/* Tell the backend we'll want the chunks of the given band soon */
+static void tiff_scanline_prefetch(tiff_scanline_t *sl, unsigned band)
+{
+    struct tiff_image_layout *layout = &sl->layout;
+    tiff_ifd_t *ifd = sl->ifd;
+    size_t cx, p, index;
+
+    if (sl->fp->mgr->prefetch == NULL || band >= layout->chunks_down) {
+        return;
+    }
+
+    for (p = 0; p < (layout->planar == 2 ? layout->samples : 1); p++) {
+        for (cx = 0; cx < layout->chunks_across; cx++) {
+            index = p * layout->chunks_per_plane +
+                (size_t)band * layout->chunks_across + cx;
+
+            if (index < ifd->chunk_count) {
+                sl->fp->mgr->prefetch(sl->fp->fp, ifd->chunk_offsets[index],
+                    ifd->chunk_sizes[index]);
+            }
+        }
+    }
+}
+
+/* Decode every chunk of a band into chunky rows in the given slot */
+static TIFF_STATUS tiff_scanline_load_band(tiff_scanline_t *sl, unsigned band,
+                                          uint8_t *out)
+{
+    struct tiff_image_layout *layout = &sl->layout;
+    size_t ss = layout->sample_size, cx, p;
+    unsigned rows, r;
+    TIFF_STATUS ret;
+
+    rows = tiff_get_chunk_rows(layout, band * layout->chunks_across);
+    if (band * layout->chunk_height + rows > layout->height) {
+        rows = layout->height - band * layout->chunk_height;
+    }
+
+    /* A chunky strip already is a band */
+    if (!layout->tiled && layout->planar == 1) {
+        return tiff_decode_chunk(sl->fp, sl->ifd, layout, band, out);
+    }
+
+    for (cx = 0; cx < layout->chunks_across; cx++) {
+        size_t index = (size_t)band * layout->chunks_across + cx;
+        size_t x0 = cx * layout->chunk_width, n = layout->chunk_width;
+
+        if (x0 + n > layout->width) {
+            n = layout->width - x0;
+        }
+
+        for (p = 0; p < (layout->planar == 2 ? layout->samples : 1); p++) {
+            if ( (ret = tiff_decode_chunk(sl->fp, sl->ifd, layout,
+                    p * layout->chunks_per_plane + index,
+                    sl->scratch + p * sl->chunk_bytes)) != TIFF_OK)
+            {
+                return ret;
+            }
+        }
+
+        for (r = 0; r < rows; r++) {
+            size_t off = (size_t)r * layout->chunk_width * layout->chunk_samples * ss;
+            uint8_t *dst = out + r * sl->row_bytes + x0 * layout->samples * ss;
+
+            if (layout->planar == 1) {
+                memcpy(dst, sl->scratch + off, n * layout->samples * ss);
+            } else {
+                for (p = 0; p < layout->samples; p++) {
+                    sl->planes[p] = sl->scratch + p * sl->chunk_bytes + off;
+                }
+                tiff_planar_to_chunky(sl->planes, layout->samples, ss, n, dst);
+            }
+        }
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_scanline_open(tiff_t *fp, tiff_ifd_t *ifd,
+                               tiff_scanline_t **cursor)
+{
+    tiff_scanline_t *sl = NULL;
+    struct tiff_image_layout *layout;
+    TIFF_STATUS ret;
+    int i;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(cursor);
+
+    *cursor = NULL;
+
+    sl = (tiff_scanline_t *)tiff_calloc(&fp->alloc, 1, sizeof(tiff_scanline_t));
+    if (sl == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    sl->fp = fp;
+    sl->ifd = ifd;
+    layout = &sl->layout;
+
+    if ( (ret = tiff_get_image_layout(fp, ifd, layout)) != TIFF_OK ) {
+        goto fail;
+    }
+
+    if (layout->compression != TIFF_COMPRESSION_NONE || layout->sample_size == 0) {
+        ret = TIFF_UNSUPPORTED;
+        goto fail;
+    }
+
+    if ( (ret = tiff_load_chunk_table(fp, ifd)) != TIFF_OK ) {
+        goto fail;
+    }
+
+    if (ifd->chunk_count < layout->chunk_count) {
+        ret = TIFF_TAG_MALFORMED;
+        goto fail;
+    }
+
+    sl->row_bytes = (size_t)layout->width * layout->samples * layout->sample_size;
+    sl->band_bytes = sl->row_bytes * layout->chunk_height;
+    sl->chunk_bytes = (size_t)layout->chunk_width * layout->chunk_height *
+        layout->chunk_samples * layout->sample_size;
+
+    for (i = 0; i < TIFF_SCANLINE_SLOTS; i++) {
+        sl->slots[i] = (uint8_t *)tiff_calloc(&fp->alloc, 1, sl->band_bytes);
+        sl->slot_band[i] = (unsigned)-1;
+        if (sl->slots[i] == NULL) {
+            ret = TIFF_NO_MEMORY;
+            goto fail;
+        }
+    }
+
+    if (layout->tiled || layout->planar == 2) {
+        sl->scratch = (uint8_t *)tiff_calloc(&fp->alloc,
+            layout->planar == 2 ? layout->samples : 1, sl->chunk_bytes);
+        sl->planes = (void **)tiff_calloc(&fp->alloc, layout->samples, sizeof(void *));
+        if (sl->scratch == NULL || sl->planes == NULL) {
+            ret = TIFF_NO_MEMORY;
+            goto fail;
+        }
+    }
+
+    tiff_scanline_prefetch(sl, 0);
+
+    *cursor = sl;
+
+    return TIFF_OK;
+
+fail:
+    tiff_scanline_close(sl);
+    return ret;
+}
+
+TIFF_STATUS tiff_scanline_next(tiff_scanline_t *sl, const void **row)
+{
+    unsigned band, slot;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(sl);
+    TIFF_ASSERT_ARG(row);
+
+    *row = NULL;
+
+    if (sl->row >= sl->layout.height) {
+        return TIFF_OK;
+    }
+
+    band = sl->row / sl->layout.chunk_height;
+    slot = band % TIFF_SCANLINE_SLOTS;
+
+    if (sl->slot_band[slot] != band) {
+        sl->slot_band[slot] = (unsigned)-1;
+
+        if ( (ret = tiff_scanline_load_band(sl, band, sl->slots[slot]))
+            != TIFF_OK)
+        {
+            return ret;
+        }
+
+        sl->slot_band[slot] = band;
+
+        /* The band is still in cache, so this is the time to look at it */
+        if (sl->stats != NULL) {
+            unsigned rows = sl->layout.height - band * sl->layout.chunk_height;
+
+            if (rows > sl->layout.chunk_height) {
+                rows = sl->layout.chunk_height;
+            }
+
+            if ( (ret = tiff_stats_accumulate(sl->stats, sl->slots[slot],
+                    sl->layout.sample_size, 0, sl->layout.samples,
+                    (size_t)rows * sl->layout.width)) != TIFF_OK)
+            {
+                return ret;
+            }
+        }
+
+        /* Get the next band on its way while the caller works on this one */
+        tiff_scanline_prefetch(sl, band + 1);
+    }
+
+    *row = sl->slots[slot] +
+        (size_t)(sl->row - band * sl->layout.chunk_height) * sl->row_bytes;
+    sl->row++;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_scanline_get_row_bytes(tiff_scanline_t *sl, size_t *bytes)
+{
+    TIFF_ASSERT_ARG(sl);
+    TIFF_ASSERT_ARG(bytes);
+
+    *bytes = sl->row_bytes;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_scanline_set_stats(tiff_scanline_t *sl, tiff_stats_t *stats)
+{
+    TIFF_ASSERT_ARG(sl);
+
+    /* Make sure the accumulator can take our pixels */
+    if (stats != NULL &&
+        tiff_stats_get_channel(stats, sl->layout.samples - 1, NULL, NULL, NULL,
+            NULL) != TIFF_OK)
+    {
+        return TIFF_RANGE_ERROR;
+    }
+
+    sl->stats = stats;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_scanline_close(tiff_scanline_t *sl)
+{
+    tiff_t *fp;
+    int i;
+
+    TIFF_ASSERT_ARG(sl);
+
+    fp = sl->fp;
+
+    for (i = 0; i < TIFF_SCANLINE_SLOTS; i++) {
+        tiff_free(&fp->alloc, sl->slots[i]);
+    }
+
+    tiff_free(&fp->alloc, sl->scratch);
+    tiff_free(&fp->alloc, sl->planes);
+
+    memset(sl, 0, sizeof(tiff_scanline_t));
+    tiff_free(&fp->alloc, sl);
+
+    return TIFF_OK;
+}
@@ -0,0 +1,501 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Per-channel image statistics: histogram, minimum, maximum and sum.
+ *
+ * Statistics are gathered from decoded samples while they are still in
+ * cache, either by the scanline cursor after each band is decoded, or a
+ * chunk at a time with tiff_read_chunk_stats. Accumulators for different
+ * parts of an image can be filled by separate threads and merged.
+ *
+ * Minimum, maximum and sum use SIMD when the number of channels divides
+ * the number of lanes in a vector, so that each lane always sees the
+ * same channel and lanes can be folded back into channels at the end.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/* Histograms of samples wider than this use the top bits only */
+#define TIFF_STATS_MAX_HIST_BITS    16
+
+struct tiff_stats {
+    unsigned channels;
+    unsigned bits;
+    unsigned shift;             /* Sample >> shift is its histogram bin */
+    size_t bins;
+
+    UINT64 *count;
+    UINT64 *min;
+    UINT64 *max;
+    UINT64 *sum;
+    UINT64 *hist;               /* bins entries for each channel */
+
+    tiff_allocator_t alloc;
+};
+
+#if defined(TIFF_SIMD_SSE41)
+#define TIFF_STATS_SIMD
+typedef __m128i tiff_vec_t;
+#define TIFF_VEC_LOAD(p)            _mm_loadu_si128((const __m128i *)(p))
+#define TIFF_VEC_STORE(p, v)        _mm_storeu_si128((__m128i *)(p), (v))
+#define TIFF_VEC_ZERO()             _mm_setzero_si128()
+#define TIFF_VEC_ONES()             _mm_set1_epi32(-1)
+#define TIFF_VEC_MIN8(a, b)         _mm_min_epu8((a), (b))
+#define TIFF_VEC_MAX8(a, b)         _mm_max_epu8((a), (b))
+#define TIFF_VEC_MIN16(a, b)        _mm_min_epu16((a), (b))
+#define TIFF_VEC_MAX16(a, b)        _mm_max_epu16((a), (b))
+/* Widening adds: 8-bit lanes into 16-bit sums, 16-bit into 32-bit */
+#define TIFF_VEC_ADDW8_LO(s, v)     _mm_add_epi16((s), _mm_unpacklo_epi8((v), _mm_setzero_si128()))
+#define TIFF_VEC_ADDW8_HI(s, v)     _mm_add_epi16((s), _mm_unpackhi_epi8((v), _mm_setzero_si128()))
+#define TIFF_VEC_ADDW16_LO(s, v)    _mm_add_epi32((s), _mm_unpacklo_epi16((v), _mm_setzero_si128()))
+#define TIFF_VEC_ADDW16_HI(s, v)    _mm_add_epi32((s), _mm_unpackhi_epi16((v), _mm_setzero_si128()))
+#elif defined(TIFF_SIMD_NEON)
+#define TIFF_STATS_SIMD
+typedef uint8x16_t tiff_vec_t;
+#define TIFF_VEC_LOAD(p)            vld1q_u8((const uint8_t *)(p))
+#define TIFF_VEC_STORE(p, v)        vst1q_u8((uint8_t *)(p), (v))
+#define TIFF_VEC_ZERO()             vdupq_n_u8(0)
+#define TIFF_VEC_ONES()             vdupq_n_u8(0xff)
+#define TIFF_VEC_MIN8(a, b)         vminq_u8((a), (b))
+#define TIFF_VEC_MAX8(a, b)         vmaxq_u8((a), (b))
+#define TIFF_VEC_MIN16(a, b)        vreinterpretq_u8_u16(vminq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)))
+#define TIFF_VEC_MAX16(a, b)        vreinterpretq_u8_u16(vmaxq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)))
+#define TIFF_VEC_ADDW8_LO(s, v)     vreinterpretq_u8_u16(vaddw_u8(vreinterpretq_u16_u8(s), vget_low_u8(v)))
+#define TIFF_VEC_ADDW8_HI(s, v)     vreinterpretq_u8_u16(vaddw_u8(vreinterpretq_u16_u8(s), vget_high_u8(v)))
+#define TIFF_VEC_ADDW16_LO(s, v)    vreinterpretq_u8_u32(vaddw_u16(vreinterpretq_u32_u8(s), vget_low_u16(vreinterpretq_u16_u8(v))))
+#define TIFF_VEC_ADDW16_HI(s, v)    vreinterpretq_u8_u32(vaddw_u16(vreinterpretq_u32_u8(s), vget_high_u16(vreinterpretq_u16_u8(v))))
+#endif
+
+#ifdef TIFF_STATS_SIMD
+
+/* Fold per-lane results into per-channel ones; lane l is channel l % channels */
+static void tiff_stats_fold(unsigned lanes, unsigned channels,
+                            const uint64_t *lmin, const uint64_t *lmax,
+                            const uint64_t *lsum,
+                            UINT64 *min, UINT64 *max, UINT64 *sum)
+{
+    unsigned l;
+
+    for (l = 0; l < lanes; l++) {
+        unsigned c = l % channels;
+        if (lmin[l] < min[c]) min[c] = lmin[l];
+        if (lmax[l] > max[c]) max[c] = lmax[l];
+        sum[c] += lsum[l];
+    }
+}
+
+/* Returns how many of the samples were handled */
+static size_t tiff_stats_simd8(const uint8_t *src, unsigned channels, size_t samples,
+                               UINT64 *min, UINT64 *max, UINT64 *sum)
+{
+    tiff_vec_t vmin = TIFF_VEC_ONES(), vmax = TIFF_VEC_ZERO();
+    uint64_t lmin[16], lmax[16], lsum[16];
+    size_t n = samples / 16, i = 0, j, block;
+    uint8_t bmin[16], bmax[16];
+    uint16_t bsum[16];
+    unsigned l;
+
+    if (16 % channels != 0 || n == 0) {
+        return 0;
+    }
+
+    memset(lsum, 0, sizeof(lsum));
+
+    while (i < n) {
+        tiff_vec_t s0 = TIFF_VEC_ZERO(), s1 = TIFF_VEC_ZERO();
+
+        /* 16-bit lane sums can take 257 bytes before overflowing */
+        block = n - i < 256 ? n - i : 256;
+
+        for (j = 0; j < block; j++) {
+            tiff_vec_t v = TIFF_VEC_LOAD(src + (i + j) * 16);
+            vmin = TIFF_VEC_MIN8(vmin, v);
+            vmax = TIFF_VEC_MAX8(vmax, v);
+            s0 = TIFF_VEC_ADDW8_LO(s0, v);
+            s1 = TIFF_VEC_ADDW8_HI(s1, v);
+        }
+
+        TIFF_VEC_STORE(bsum, s0);
+        TIFF_VEC_STORE(bsum + 8, s1);
+        for (l = 0; l < 16; l++) {
+            lsum[l] += bsum[l];
+        }
+
+        i += block;
+    }
+
+    TIFF_VEC_STORE(bmin, vmin);
+    TIFF_VEC_STORE(bmax, vmax);
+    for (l = 0; l < 16; l++) {
+        lmin[l] = bmin[l];
+        lmax[l] = bmax[l];
+    }
+
+    tiff_stats_fold(16, channels, lmin, lmax, lsum, min, max, sum);
+
+    return n * 16;
+}
+
+static size_t tiff_stats_simd16(const uint16_t *src, unsigned channels, size_t samples,
+                                UINT64 *min, UINT64 *max, UINT64 *sum)
+{
+    tiff_vec_t vmin = TIFF_VEC_ONES(), vmax = TIFF_VEC_ZERO();
+    uint64_t lmin[8], lmax[8], lsum[8];
+    size_t n = samples / 8, i = 0, j, block;
+    uint16_t bmin[8], bmax[8];
+    uint32_t bsum[8];
+    unsigned l;
+
+    if (8 % channels != 0 || n == 0) {
+        return 0;
+    }
+
+    memset(lsum, 0, sizeof(lsum));
+
+    while (i < n) {
+        tiff_vec_t s0 = TIFF_VEC_ZERO(), s1 = TIFF_VEC_ZERO();
+
+        block = n - i < 65536 ? n - i : 65536;
+
+        for (j = 0; j < block; j++) {
+            tiff_vec_t v = TIFF_VEC_LOAD(src + (i + j) * 8);
+            vmin = TIFF_VEC_MIN16(vmin, v);
+            vmax = TIFF_VEC_MAX16(vmax, v);
+            s0 = TIFF_VEC_ADDW16_LO(s0, v);
+            s1 = TIFF_VEC_ADDW16_HI(s1, v);
+        }
+
+        TIFF_VEC_STORE(bsum, s0);
+        TIFF_VEC_STORE(bsum + 4, s1);
+        for (l = 0; l < 8; l++) {
+            lsum[l] += bsum[l];
+        }
+
+        i += block;
+    }
+
+    TIFF_VEC_STORE(bmin, vmin);
+    TIFF_VEC_STORE(bmax, vmax);
+    for (l = 0; l < 8; l++) {
+        lmin[l] = bmin[l];
+        lmax[l] = bmax[l];
+    }
+
+    tiff_stats_fold(8, channels, lmin, lmax, lsum, min, max, sum);
+
+    return n * 8;
+}
+
+#endif /* TIFF_STATS_SIMD */
+
+#define TIFF_STATS_SCALAR(type) \
+    { \
+        const type *s = (const type *)src; \
+        for (i = done; i < samples; i++) { \
+            uint64_t v = s[i]; \
+            unsigned c = i % channels; \
+            if (v < min[c]) min[c] = v; \
+            if (v > max[c]) max[c] = v; \
+            sum[c] += v; \
+        } \
+    }
+
+#define TIFF_STATS_HIST(type) \
+    { \
+        const type *s = (const type *)src; \
+        for (i = 0; i < samples; i++) { \
+            uint64_t bin = (uint64_t)s[i] >> stats->shift; \
+            hist[(i % channels) * stats->bins + (bin < last ? bin : last)]++; \
+        } \
+    }
+
+TIFF_STATUS tiff_stats_create(tiff_stats_t **stats, unsigned channels, unsigned bits)
+{
+    tiff_stats_t *new_stats = NULL;
+    tiff_allocator_t alloc;
+    unsigned hist_bits;
+
+    TIFF_ASSERT_ARG(stats);
+
+    *stats = NULL;
+
+    if (channels == 0 || bits == 0 || bits > 32) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    tiff_get_allocator(&alloc);
+
+    new_stats = (tiff_stats_t *)tiff_calloc(&alloc, 1, sizeof(tiff_stats_t));
+    if (new_stats == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    new_stats->alloc = alloc;
+
+    hist_bits = bits > TIFF_STATS_MAX_HIST_BITS ? TIFF_STATS_MAX_HIST_BITS : bits;
+
+    new_stats->channels = channels;
+    new_stats->bits = bits;
+    new_stats->shift = bits - hist_bits;
+    new_stats->bins = (size_t)1 << hist_bits;
+
+    /* One allocation for the per-channel counters, one for the histograms */
+    new_stats->count = (UINT64 *)tiff_calloc(&alloc, 4 * channels, sizeof(UINT64));
+    new_stats->hist = (UINT64 *)tiff_calloc(&alloc, channels * new_stats->bins,
+        sizeof(UINT64));
+
+    if (new_stats->count == NULL || new_stats->hist == NULL) {
+        tiff_stats_free(new_stats);
+        return TIFF_NO_MEMORY;
+    }
+
+    new_stats->min = new_stats->count + channels;
+    new_stats->max = new_stats->count + 2 * channels;
+    new_stats->sum = new_stats->count + 3 * channels;
+
+    tiff_stats_reset(new_stats);
+
+    *stats = new_stats;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stats_reset(tiff_stats_t *stats)
+{
+    unsigned c;
+
+    TIFF_ASSERT_ARG(stats);
+
+    memset(stats->count, 0, 4 * stats->channels * sizeof(UINT64));
+    memset(stats->hist, 0, stats->channels * stats->bins * sizeof(UINT64));
+
+    for (c = 0; c < stats->channels; c++) {
+        stats->min[c] = ~(UINT64)0;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stats_free(tiff_stats_t *stats)
+{
+    tiff_allocator_t alloc;
+
+    TIFF_ASSERT_ARG(stats);
+
+    alloc = stats->alloc;
+
+    tiff_free(&alloc, stats->count);
+    tiff_free(&alloc, stats->hist);
+
+    memset(stats, 0, sizeof(tiff_stats_t));
+    tiff_free(&alloc, stats);
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stats_accumulate(tiff_stats_t *stats, const void *src,
+                                  size_t sample_size, unsigned first_channel,
+                                  unsigned channels, size_t pixels)
+{
+    UINT64 *min, *max, *sum, *hist;
+    size_t samples = pixels * channels, done = 0, i, last;
+    unsigned c;
+
+    TIFF_ASSERT_ARG(stats);
+    TIFF_ASSERT_ARG(src);
+
+    if (channels == 0 || first_channel + channels > stats->channels) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    min = stats->min + first_channel;
+    max = stats->max + first_channel;
+    sum = stats->sum + first_channel;
+    hist = stats->hist + first_channel * stats->bins;
+    last = stats->bins - 1;
+
+    switch (sample_size) {
+    case 1:
+#ifdef TIFF_STATS_SIMD
+        done = tiff_stats_simd8((const uint8_t *)src, channels, samples, min, max, sum);
+#endif
+        TIFF_STATS_SCALAR(uint8_t);
+        TIFF_STATS_HIST(uint8_t);
+        break;
+    case 2:
+#ifdef TIFF_STATS_SIMD
+        done = tiff_stats_simd16((const uint16_t *)src, channels, samples, min, max, sum);
+#endif
+        TIFF_STATS_SCALAR(uint16_t);
+        TIFF_STATS_HIST(uint16_t);
+        break;
+    case 4:
+        TIFF_STATS_SCALAR(uint32_t);
+        TIFF_STATS_HIST(uint32_t);
+        break;
+    default:
+        return TIFF_RANGE_ERROR;
+    }
+
+    for (c = 0; c < channels; c++) {
+        stats->count[first_channel + c] += pixels;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stats_merge(tiff_stats_t *dst, const tiff_stats_t *src)
+{
+    size_t i;
+    unsigned c;
+
+    TIFF_ASSERT_ARG(dst);
+    TIFF_ASSERT_ARG(src);
+
+    if (dst->channels != src->channels || dst->bits != src->bits) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    for (c = 0; c < dst->channels; c++) {
+        dst->count[c] += src->count[c];
+        dst->sum[c] += src->sum[c];
+        if (src->min[c] < dst->min[c]) dst->min[c] = src->min[c];
+        if (src->max[c] > dst->max[c]) dst->max[c] = src->max[c];
+    }
+
+    for (i = 0; i < dst->channels * dst->bins; i++) {
+        dst->hist[i] += src->hist[i];
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stats_get_channel(tiff_stats_t *stats, unsigned channel,
+                                   UINT64 *count, UINT64 *min, UINT64 *max,
+                                   double *mean)
+{
+    TIFF_ASSERT_ARG(stats);
+
+    if (channel >= stats->channels) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (count) *count = stats->count[channel];
+    if (min) *min = stats->count[channel] ? stats->min[channel] : 0;
+    if (max) *max = stats->max[channel];
+    if (mean) {
+        *mean = stats->count[channel] ?
+            (double)stats->sum[channel] / (double)stats->count[channel] : 0.0;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_stats_get_histogram(tiff_stats_t *stats, unsigned channel,
+                                     const UINT64 **hist, size_t *bins)
+{
+    TIFF_ASSERT_ARG(stats);
+    TIFF_ASSERT_ARG(hist);
+
+    if (channel >= stats->channels) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    *hist = stats->hist + channel * stats->bins;
+    if (bins) *bins = stats->bins;
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_read_chunk_stats(tiff_t *fp, tiff_ifd_t *ifd, size_t index,
+                                  tiff_stats_t *stats)
+{
+    struct tiff_image_layout layout;
+    unsigned first_channel = 0, rows, cols, r, x0, y0;
+    size_t row_samples;
+    uint8_t *chunk = NULL;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(stats);
+
+    if ( (ret = tiff_get_image_layout(fp, ifd, &layout)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (index >= layout.chunk_count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (layout.planar == 2) {
+        first_channel = (unsigned)(index / layout.chunks_per_plane);
+    }
+
+    if (first_channel + layout.chunk_samples > stats->channels) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    chunk = (uint8_t *)tiff_calloc(&fp->alloc, (size_t)layout.chunk_width * layout.chunk_height *
+        layout.chunk_samples, layout.sample_size ? layout.sample_size : 1);
+    if (chunk == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    if ( (ret = tiff_decode_chunk(fp, ifd, &layout, index, chunk)) != TIFF_OK ) {
+        goto done;
+    }
+
+    /* Leave out the padding of tiles hanging over the image edges */
+    x0 = (unsigned)(index % layout.chunks_across) * layout.chunk_width;
+    y0 = (unsigned)((index % layout.chunks_per_plane) / layout.chunks_across) *
+        layout.chunk_height;
+    cols = layout.width - x0 < layout.chunk_width ? layout.width - x0 : layout.chunk_width;
+    rows = layout.height - y0 < layout.chunk_height ? layout.height - y0 : layout.chunk_height;
+    row_samples = (size_t)layout.chunk_width * layout.chunk_samples;
+
+    if (cols == layout.chunk_width) {
+        ret = tiff_stats_accumulate(stats, chunk, layout.sample_size, first_channel,
+            layout.chunk_samples, (size_t)rows * cols);
+    } else {
+        for (r = 0; r < rows && ret == TIFF_OK; r++) {
+            ret = tiff_stats_accumulate(stats,
+                chunk + r * row_samples * layout.sample_size, layout.sample_size,
+                first_channel, layout.chunk_samples, cols);
+        }
+    }
+
+done:
+    tiff_free(&fp->alloc, chunk);
+    return ret;
+}
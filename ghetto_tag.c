@@ -31,6 +31,7 @@
 #include <ghetto_priv.h>
 
 #include <string.h>
+#include <stdint.h>
 
 static size_t tiff_type_sizes[] = {
     0,
@@ -48,7 +49,7 @@ static size_t tiff_type_sizes[] = {
     8  /* Double */
 };
 
-static void tiff_swap_dword_buffer(void *buf, size_t count, int endianess)
+void tiff_swap_dword_buffer(void *buf, size_t count, int endianess)
 {
     size_t i;
     uint32_t *dwbuf = (uint32_t *)buf;
@@ -60,7 +61,7 @@ static void tiff_swap_dword_buffer(void *buf, size_t count, int endianess)
     }
 }
 
-static void tiff_swap_word_buffer(void *buf, size_t count, int endianess)
+void tiff_swap_word_buffer(void *buf, size_t count, int endianess)
 {
     size_t i;
     uint16_t *wbuf = (uint16_t *)buf;
@@ -72,6 +73,20 @@ static void tiff_swap_word_buffer(void *buf, size_t count, int endianess)
     }
 }
 
+void tiff_swap_qword_buffer(void *buf, size_t count, int endianess)
+{
+    size_t i;
+    uint32_t *dwbuf = (uint32_t *)buf, t;
+
+    if (endianess == MACH_ENDIANESS) return;
+
+    for (i = 0; i < count; i++) {
+        t = tiff_swap_dword(dwbuf[2 * i]);
+        dwbuf[2 * i] = tiff_swap_dword(dwbuf[2 * i + 1]);
+        dwbuf[2 * i + 1] = t;
+    }
+}
+
 size_t tiff_get_type_size(int type)
 {
     if (type < TIFF_TYPE_BYTE || type > TIFF_TYPE_DOUBLE) {
@@ -81,23 +96,56 @@ size_t tiff_get_type_size(int type)
     return tiff_type_sizes[type];
 }
 
+TIFF_STATUS tiff_check_tag_payload(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag)
+{
+    uint64_t len = (uint64_t)tiff_get_type_size(tag->type) * tag->count;
+    uint64_t off;
+
+    if (fp->limits.max_payload_bytes != 0 && len > fp->limits.max_payload_bytes) {
+        return TIFF_LIMIT_PAYLOAD;
+    }
+
+    if (len <= TIFF_TAG_DATA_FIELD_SIZE || fp->file_size == 0) {
+        return TIFF_OK;
+    }
+
+    if (ifd == NULL) {
+        return len > fp->file_size ? TIFF_TAG_MALFORMED : TIFF_OK;
+    }
+
+    off = (uint64_t)TIFF_SWAP_DWORD(tag->offset, fp->endianess) + ifd->tag_offset;
+
+    if (off > fp->file_size || len > fp->file_size - off) {
+        TIFF_TRACE("Malformed tag %d - %llu bytes at %llu, past the end of the "
+            "file\n", tag->id, (unsigned long long)len, (unsigned long long)off);
+        return TIFF_TAG_MALFORMED;
+    }
+
+    return TIFF_OK;
+}
+
 TIFF_STATUS tiff_get_tag_info(tiff_t *fp, tiff_tag_t *tag_info,
                               int *id, int *type, int *count)
 {
+    TIFF_STATUS ret;
+
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(tag_info);
 
+    ret = tiff_check_tag_payload(fp, NULL, tag_info);
+
     if (id) *id = tag_info->id;
     if (type) *type = tag_info->type;
-    if (count) *count = tag_info->count;
+    if (count) *count = ret == TIFF_OK ? tag_info->count : 0;
 
-    return TIFF_OK;
+    return ret;
 }
 
 TIFF_STATUS tiff_get_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
                               void *data)
 {
     size_t tag_size = 0, count = 0;
+    TIFF_STATUS ret;
 
     TIFF_ASSERT_ARG(fp);
     TIFF_ASSERT_ARG(tag_info);
@@ -107,6 +155,10 @@ TIFF_STATUS tiff_get_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
         return TIFF_UNKNOWN_TYPE;
     }
 
+    if ( (ret = tiff_check_tag_payload(fp, ifd, tag_info)) != TIFF_OK ) {
+        return ret;
+    }
+
     if (tag_size * tag_info->count <= TIFF_TAG_DATA_FIELD_SIZE) {
         /* Extract the data from the field itself */
         memcpy(data, &tag_info->offset, tag_size * tag_info->count);
@@ -120,12 +172,15 @@ TIFF_STATUS tiff_get_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
          * tag_info->offset as an offset here, so we swap it to native
          * endianess, treating it as a DWORD.
          */
-        TIFF_SEEK(fp,
+        ret = tiff_read_at(fp,
             TIFF_SWAP_DWORD(tag_info->offset, fp->endianess) + ifd->tag_offset,
-            TIFF_SEEK_SET);
-        TIFF_READ(fp, tag_size, tag_info->count, data, &count);
+            data, tag_size * tag_info->count, &count);
 
-        if (count < tag_info->count) {
+        if (ret != TIFF_OK) {
+            return ret;
+        }
+
+        if (count < tag_size * tag_info->count) {
             return TIFF_END_OF_FILE;
         }
     }
@@ -141,13 +196,551 @@ TIFF_STATUS tiff_get_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
         {
             tiff_swap_dword_buffer(data, tag_info->count * 2, fp->endianess);
         } else {
-            TIFF_TRACE("Unknown/unhandled data type for byte swapping. Be careful!\n");
-       }
+            tiff_swap_qword_buffer(data, tag_info->count, fp->endianess);
+        }
+    }
+
+    return TIFF_OK;
+}
+
+/* Only the unsigned integer types can be widened by the helpers below */
+static int tiff_is_uint_type(int type)
+{
+    return type == TIFF_TYPE_BYTE || type == TIFF_TYPE_SHORT ||
+        type == TIFF_TYPE_LONG;
+}
+
+TIFF_STATUS tiff_get_tag_element(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag,
+                                 size_t index, uint64_t *value)
+{
+    uint8_t raw[4];
+    size_t tag_size, count = 0;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(tag);
+    TIFF_ASSERT_ARG(value);
+
+    if (!tiff_is_uint_type(tag->type)) {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    if (index >= tag->count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    tag_size = tiff_get_type_size(tag->type);
+
+    if ( (ret = tiff_check_tag_payload(fp, ifd, tag)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (tag_size * tag->count <= TIFF_TAG_DATA_FIELD_SIZE) {
+        memcpy(raw, ((uint8_t *)&tag->offset) + index * tag_size, tag_size);
+    } else {
+        if (tag->offset == 0) {
+            TIFF_TRACE("Malformed tag %d - zero offset into file\n", tag->id);
+            return TIFF_TAG_MALFORMED;
+        }
+        /* Only fetch the one element we were asked for */
+        ret = tiff_read_at(fp,
+            TIFF_SWAP_DWORD(tag->offset, fp->endianess) + ifd->tag_offset +
+                index * tag_size,
+            raw, tag_size, &count);
+
+        if (ret != TIFF_OK) {
+            return ret;
+        }
+
+        if (count < tag_size) {
+            return TIFF_END_OF_FILE;
+        }
+    }
+
+    switch (tag_size) {
+    case 1:
+        *value = TIFF_BYTE(raw, 0);
+        break;
+    case 2:
+        *value = TIFF_WORD(raw, 0, fp->endianess);
+        break;
+    default:
+        *value = TIFF_DWORD(raw, 0, fp->endianess);
+        break;
+    }
+
+    return TIFF_OK;
+}
+
+/* Vectorized widening of the integer arrays that can get big (strip and
+ * tile tables). These work from the end of the array backwards, so dst may
+ * start at the same address as src and the table be widened in place.
+ */
+static void tiff_widen_u16_u32(const uint16_t *src, uint32_t *dst, size_t count)
+{
+    size_t i = count;
+
+#if defined(TIFF_SIMD_AVX2)
+    for (; i % 8; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 8; i -= 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i - 8));
+        _mm256_storeu_si256((__m256i *)(dst + i - 8), _mm256_cvtepu16_epi32(v));
+    }
+#elif defined(TIFF_SIMD_SSE41)
+    for (; i % 4; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 4; i -= 4) {
+        __m128i v = _mm_loadl_epi64((const __m128i *)(src + i - 4));
+        _mm_storeu_si128((__m128i *)(dst + i - 4), _mm_cvtepu16_epi32(v));
+    }
+#elif defined(TIFF_SIMD_NEON)
+    for (; i % 4; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 4; i -= 4) {
+        vst1q_u32(dst + i - 4, vmovl_u16(vld1_u16(src + i - 4)));
+    }
+#endif
+
+    for (; i > 0; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+}
+
+static void tiff_widen_u32_u64(const uint32_t *src, uint64_t *dst, size_t count)
+{
+    size_t i = count;
+
+#if defined(TIFF_SIMD_AVX2)
+    for (; i % 4; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 4; i -= 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i - 4));
+        _mm256_storeu_si256((__m256i *)(dst + i - 4), _mm256_cvtepu32_epi64(v));
+    }
+#elif defined(TIFF_SIMD_SSE41)
+    for (; i % 2; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 2; i -= 2) {
+        __m128i v = _mm_loadl_epi64((const __m128i *)(src + i - 2));
+        _mm_storeu_si128((__m128i *)(dst + i - 2), _mm_cvtepu32_epi64(v));
+    }
+#elif defined(TIFF_SIMD_NEON)
+    for (; i % 2; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 2; i -= 2) {
+        vst1q_u64(dst + i - 2, vmovl_u32(vld1_u32(src + i - 2)));
+    }
+#endif
+
+    for (; i > 0; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+}
+
+static void tiff_widen_u16_u64(const uint16_t *src, uint64_t *dst, size_t count)
+{
+    size_t i = count;
+
+#if defined(TIFF_SIMD_AVX2)
+    for (; i % 4; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 4; i -= 4) {
+        __m128i v = _mm_loadl_epi64((const __m128i *)(src + i - 4));
+        _mm256_storeu_si256((__m256i *)(dst + i - 4), _mm256_cvtepu16_epi64(v));
+    }
+#elif defined(TIFF_SIMD_SSE41)
+    for (; i % 2; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 2; i -= 2) {
+        uint32_t pair;
+        memcpy(&pair, src + i - 2, sizeof(pair));
+        _mm_storeu_si128((__m128i *)(dst + i - 2),
+            _mm_cvtepu16_epi64(_mm_cvtsi32_si128((int)pair)));
+    }
+#elif defined(TIFF_SIMD_NEON)
+    for (; i % 4; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+    for (; i >= 4; i -= 4) {
+        uint32x4_t w = vmovl_u16(vld1_u16(src + i - 4));
+        vst1q_u64(dst + i - 2, vmovl_u32(vget_high_u32(w)));
+        vst1q_u64(dst + i - 4, vmovl_u32(vget_low_u32(w)));
+    }
+#endif
+
+    for (; i > 0; i--) {
+        dst[i - 1] = src[i - 1];
+    }
+}
+
+TIFF_STATUS tiff_get_tag_uint_array(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag,
+                                    uint64_t *dst)
+{
+    size_t i;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(tag);
+    TIFF_ASSERT_ARG(dst);
+
+    if (!tiff_is_uint_type(tag->type)) {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    /* Read the native-endian data into the front of dst, then widen it
+     * in place, working backwards so no element is overwritten before it
+     * has been consumed.
+     */
+    if ( (ret = tiff_get_tag_data(fp, ifd, tag, dst)) != TIFF_OK ) {
+        return ret;
+    }
+
+    switch (tiff_get_type_size(tag->type)) {
+    case 1:
+        for (i = tag->count; i > 0; i--) {
+            dst[i - 1] = ((uint8_t *)dst)[i - 1];
+        }
+        break;
+    case 2:
+        tiff_widen_u16_u64((uint16_t *)dst, dst, tag->count);
+        break;
+    default:
+        tiff_widen_u32_u64((uint32_t *)dst, dst, tag->count);
+        break;
+    }
+
+    return TIFF_OK;
+}
+
+/* Read count values of a tag, starting at value index, into buf in native
+ * byte order.
+ */
+static TIFF_STATUS tiff_tag_read_values(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag,
+                                        size_t index, size_t count, void *buf)
+{
+    size_t tag_size = tiff_get_type_size(tag->type), rd_cnt = 0;
+
+    if (tag_size == 0) {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    if (index + count > tag->count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (tag_size * tag->count <= TIFF_TAG_DATA_FIELD_SIZE) {
+        memcpy(buf, ((uint8_t *)&tag->offset) + index * tag_size, count * tag_size);
+    } else {
+        if (tag->offset == 0) {
+            TIFF_TRACE("Malformed tag %d - zero offset into file\n", tag->id);
+            return TIFF_TAG_MALFORMED;
+        }
+
+        TIFF_STATUS ret = tiff_read_at(fp,
+            TIFF_SWAP_DWORD(tag->offset, fp->endianess) + ifd->tag_offset +
+                index * tag_size,
+            buf, count * tag_size, &rd_cnt);
+
+        if (ret != TIFF_OK) {
+            return ret;
+        }
+
+        if (rd_cnt < count * tag_size) {
+            return TIFF_END_OF_FILE;
+        }
+    }
+
+    switch (tag->type) {
+    case TIFF_TYPE_SHORT:
+    case TIFF_TYPE_SSHORT:
+        tiff_swap_word_buffer(buf, count, fp->endianess);
+        break;
+    case TIFF_TYPE_LONG:
+    case TIFF_TYPE_SLONG:
+    case TIFF_TYPE_FLOAT:
+        tiff_swap_dword_buffer(buf, count, fp->endianess);
+        break;
+    case TIFF_TYPE_RATIONAL:
+    case TIFF_TYPE_SRATIONAL:
+        tiff_swap_dword_buffer(buf, count * 2, fp->endianess);
+        break;
+    case TIFF_TYPE_DOUBLE:
+        tiff_swap_qword_buffer(buf, count, fp->endianess);
+        break;
+    }
+
+    return TIFF_OK;
+}
+
+/* Convert value i of a native-order buffer of the given type. */
+static TIFF_STATUS tiff_tag_value_to_double(const void *buf, int type, size_t i,
+                                            double *value)
+{
+    const uint32_t *u32 = (const uint32_t *)buf;
+    const int32_t *s32 = (const int32_t *)buf;
+
+    switch (type) {
+    case TIFF_TYPE_BYTE:
+        *value = ((const uint8_t *)buf)[i];
+        break;
+    case TIFF_TYPE_SBYTE:
+        *value = ((const int8_t *)buf)[i];
+        break;
+    case TIFF_TYPE_SHORT:
+        *value = ((const uint16_t *)buf)[i];
+        break;
+    case TIFF_TYPE_SSHORT:
+        *value = ((const int16_t *)buf)[i];
+        break;
+    case TIFF_TYPE_LONG:
+        *value = u32[i];
+        break;
+    case TIFF_TYPE_SLONG:
+        *value = s32[i];
+        break;
+    case TIFF_TYPE_RATIONAL:
+        if (u32[2 * i + 1] == 0) return TIFF_TAG_MALFORMED;
+        *value = (double)u32[2 * i] / (double)u32[2 * i + 1];
+        break;
+    case TIFF_TYPE_SRATIONAL:
+        if (s32[2 * i + 1] == 0) return TIFF_TAG_MALFORMED;
+        *value = (double)s32[2 * i] / (double)s32[2 * i + 1];
+        break;
+    case TIFF_TYPE_FLOAT:
+        *value = ((const float *)buf)[i];
+        break;
+    case TIFF_TYPE_DOUBLE:
+        *value = ((const double *)buf)[i];
+        break;
+    default:
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    return TIFF_OK;
+}
+
+static TIFF_STATUS tiff_tag_value_to_u64(const void *buf, int type, size_t i,
+                                         uint64_t *value)
+{
+    double d = 0.0;
+    TIFF_STATUS ret;
+
+    /* Integers are converted exactly; everything else goes via double
+     * and is truncated.
+     */
+    switch (type) {
+    case TIFF_TYPE_BYTE:
+        *value = ((const uint8_t *)buf)[i];
+        return TIFF_OK;
+    case TIFF_TYPE_SHORT:
+        *value = ((const uint16_t *)buf)[i];
+        return TIFF_OK;
+    case TIFF_TYPE_LONG:
+        *value = ((const uint32_t *)buf)[i];
+        return TIFF_OK;
+    case TIFF_TYPE_RATIONAL:
+        if (((const uint32_t *)buf)[2 * i + 1] == 0) return TIFF_TAG_MALFORMED;
+        *value = ((const uint32_t *)buf)[2 * i] / ((const uint32_t *)buf)[2 * i + 1];
+        return TIFF_OK;
+    }
+
+    if ( (ret = tiff_tag_value_to_double(buf, type, i, &d)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if (!(d >= 0.0 && d < 18446744073709551616.0)) {
+        return TIFF_RANGE_ERROR;
     }
 
+    *value = (uint64_t)d;
+
     return TIFF_OK;
 }
 
+/* Which kind of value the array accessors produce */
+#define TIFF_TAG_OUT_U32        0
+#define TIFF_TAG_OUT_U64        1
+#define TIFF_TAG_OUT_DOUBLE     2
+
+static TIFF_STATUS tiff_tag_convert(tiff_t *fp, tiff_ifd_t *ifd,
+                                    tiff_tag_id_t tag_id, size_t first,
+                                    int out, void *dst, size_t dst_count,
+                                    size_t *count)
+{
+    tiff_tag_t *tag = NULL;
+    uint64_t small[8];
+    void *raw = small;
+    size_t n, i, size;
+    uint64_t u;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(dst);
+
+    if ( (ret = tiff_get_tag(fp, ifd, tag_id, &tag)) != TIFF_OK ) {
+        return ret;
+    }
+
+    if ( (size = tiff_get_type_size(tag->type)) == 0 ||
+         tag->type == TIFF_TYPE_ASCII || tag->type == TIFF_TYPE_UNDEFINED)
+    {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    if (first >= tag->count) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if ( (ret = tiff_check_tag_payload(fp, ifd, tag)) != TIFF_OK ) {
+        return ret;
+    }
+
+    n = tag->count - first;
+    if (n > dst_count) {
+        n = dst_count;
+    }
+
+    if (n * size > sizeof(small)) {
+        raw = tiff_malloc(&fp->alloc, n * size);
+        if (raw == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+    }
+
+    if ( (ret = tiff_tag_read_values(fp, ifd, tag, first, n, raw)) != TIFF_OK ) {
+        goto done;
+    }
+
+    /* The common cases: short or long tables being widened */
+    if (out == TIFF_TAG_OUT_U32 && tag->type == TIFF_TYPE_SHORT) {
+        tiff_widen_u16_u32((const uint16_t *)raw, (uint32_t *)dst, n);
+    } else if (out == TIFF_TAG_OUT_U32 && tag->type == TIFF_TYPE_LONG) {
+        memcpy(dst, raw, n * sizeof(uint32_t));
+    } else if (out == TIFF_TAG_OUT_U64 && tag->type == TIFF_TYPE_SHORT) {
+        tiff_widen_u16_u64((const uint16_t *)raw, (uint64_t *)dst, n);
+    } else if (out == TIFF_TAG_OUT_U64 && tag->type == TIFF_TYPE_LONG) {
+        tiff_widen_u32_u64((const uint32_t *)raw, (uint64_t *)dst, n);
+    } else {
+        for (i = 0; i < n; i++) {
+            if (out == TIFF_TAG_OUT_DOUBLE) {
+                ret = tiff_tag_value_to_double(raw, tag->type, i, (double *)dst + i);
+            } else if ( (ret = tiff_tag_value_to_u64(raw, tag->type, i, &u))
+                == TIFF_OK)
+            {
+                if (out == TIFF_TAG_OUT_U64) {
+                    ((uint64_t *)dst)[i] = u;
+                } else if (u > UINT32_MAX) {
+                    ret = TIFF_RANGE_ERROR;
+                } else {
+                    ((uint32_t *)dst)[i] = (uint32_t)u;
+                }
+            }
+
+            if (ret != TIFF_OK) {
+                goto done;
+            }
+        }
+    }
+
+    if (count) *count = n;
+
+done:
+    if (raw != small) tiff_free(&fp->alloc, raw);
+    return ret;
+}
+
+TIFF_STATUS tiff_get_tag_u32(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                             UINT32 *value)
+{
+    return tiff_tag_convert(fp, ifd, tag_id, 0, TIFF_TAG_OUT_U32, value, 1, NULL);
+}
+
+TIFF_STATUS tiff_get_tag_u64(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                             UINT64 *value)
+{
+    return tiff_tag_convert(fp, ifd, tag_id, 0, TIFF_TAG_OUT_U64, value, 1, NULL);
+}
+
+TIFF_STATUS tiff_get_tag_double(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                                double *value)
+{
+    return tiff_tag_convert(fp, ifd, tag_id, 0, TIFF_TAG_OUT_DOUBLE, value, 1, NULL);
+}
+
+TIFF_STATUS tiff_get_tag_u32_array(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                                   UINT32 *dst, size_t dst_count, size_t *count)
+{
+    return tiff_tag_convert(fp, ifd, tag_id, 0, TIFF_TAG_OUT_U32, dst, dst_count,
+        count);
+}
+
+TIFF_STATUS tiff_get_tag_u64_array(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_id_t tag_id,
+                                   UINT64 *dst, size_t dst_count, size_t *count)
+{
+    return tiff_tag_convert(fp, ifd, tag_id, 0, TIFF_TAG_OUT_U64, dst, dst_count,
+        count);
+}
+
+TIFF_STATUS tiff_get_tag_double_array(tiff_t *fp, tiff_ifd_t *ifd,
+                                      tiff_tag_id_t tag_id, double *dst,
+                                      size_t dst_count, size_t *count)
+{
+    return tiff_tag_convert(fp, ifd, tag_id, 0, TIFF_TAG_OUT_DOUBLE, dst, dst_count,
+        count);
+}
+
+TIFF_STATUS tiff_map_tag_data(tiff_t *fp, tiff_ifd_t *ifd, tiff_tag_t *tag_info,
+                              const void **view, size_t *len)
+{
+    size_t tag_size;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(fp);
+    TIFF_ASSERT_ARG(ifd);
+    TIFF_ASSERT_ARG(tag_info);
+    TIFF_ASSERT_ARG(view);
+    TIFF_ASSERT_ARG(len);
+
+    *view = NULL;
+
+    if ( (tag_size = tiff_get_type_size(tag_info->type)) == 0 ) {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    /* Values packed into the entry, and multi-byte values that need
+     * swapping, have to be copied out.
+     */
+    if (tag_size * tag_info->count <= TIFF_TAG_DATA_FIELD_SIZE ||
+        (tag_size > 1 && fp->endianess != MACH_ENDIANESS))
+    {
+        return TIFF_UNSUPPORTED;
+    }
+
+    if (tag_info->offset == 0) {
+        TIFF_TRACE("Malformed tag %d - zero offset into file\n", tag_info->id);
+        return TIFF_TAG_MALFORMED;
+    }
+
+    if ( (ret = tiff_check_tag_payload(fp, ifd, tag_info)) != TIFF_OK ) {
+        return ret;
+    }
+
+    *len = tag_size * tag_info->count;
+
+    return tiff_map(fp, TIFF_SWAP_DWORD(tag_info->offset, fp->endianess) +
+        ifd->tag_offset, *len, view);
+}
+
 TIFF_STATUS tiff_get_raw_tag_field(tiff_t *fp, tiff_tag_t *tag_info,
                                    tiff_off_t *data)
 {
@@ -0,0 +1,338 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Kernels for expanding tightly packed samples (10, 12, 14-bit sensor
+ * data and friends) into 16-bit words.
+ *
+ * The SIMD kernels all work the same way: 8 samples of b bits occupy
+ * exactly b bytes, so the bit position of each of the 8 samples within
+ * a group is fixed. For every sample a byte shuffle builds a 16-bit
+ * window starting at the byte holding the sample's first bit, plus the
+ * byte after that window. Per-lane multiplies (or variable shifts on
+ * NEON) then funnel the sample to the bottom of the lane.
+ */
+
+#include <ghetto.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(TIFF_SIMD_SSSE3) || defined(TIFF_SIMD_NEON)
+#define TIFF_UNPACK_SIMD
+#endif
+
+#ifdef TIFF_UNPACK_SIMD
+
+/* Lane controls for one group of 8 samples */
+struct tiff_unpack_ctl {
+    uint8_t window[16];     /* Shuffle building each sample's 16-bit window */
+    uint8_t spill[16];      /* Shuffle fetching the byte after the window */
+    uint16_t mul[8];        /* Per-lane multiplier doing the variable shift */
+    uint16_t keep[8];       /* LSB: lanes that need no shift at all */
+    int16_t shift[8];       /* Bit offset of each sample in its first byte */
+};
+
+static void tiff_unpack_make_ctl(struct tiff_unpack_ctl *ctl, int bits,
+                                 int bit_order)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        int pos = i * bits;
+        int byte = pos >> 3, shift = pos & 7;
+
+        ctl->shift[i] = (int16_t)shift;
+        ctl->keep[i] = 0;
+
+        if (bit_order == TIFF_BITORDER_MSB) {
+            /* Big-endian window, the spill byte goes in the high half */
+            ctl->window[2 * i] = (uint8_t)(byte + 1);
+            ctl->window[2 * i + 1] = (uint8_t)byte;
+            ctl->spill[2 * i] = 0x80;
+            ctl->spill[2 * i + 1] = (uint8_t)(byte + 2);
+            ctl->mul[i] = (uint16_t)(1 << shift);
+        } else {
+            /* Little-endian window, the spill byte goes in the low half */
+            ctl->window[2 * i] = (uint8_t)byte;
+            ctl->window[2 * i + 1] = (uint8_t)(byte + 1);
+            ctl->spill[2 * i] = (uint8_t)(byte + 2);
+            ctl->spill[2 * i + 1] = 0x80;
+            ctl->mul[i] = shift ? (uint16_t)(1 << (16 - shift)) : 0;
+            ctl->keep[i] = shift ? 0 : 0xffff;
+        }
+    }
+}
+
+#endif /* TIFF_UNPACK_SIMD */
+
+#ifdef TIFF_SIMD_SSSE3
+
+/* Unpack one group of 8 samples from the 16 bytes in v.
+ *   MSB: ((window << s) | (spill >> (8 - s))) >> (16 - bits)
+ *   LSB: ((window >> s) | (spill << (16 - s))) & mask
+ */
+static inline __m128i tiff_unpack_group(__m128i v, const __m128i *ctl,
+                                        int bit_order)
+{
+    __m128i w = _mm_shuffle_epi8(v, ctl[0]);
+    __m128i s = _mm_shuffle_epi8(v, ctl[1]);
+
+    if (bit_order == TIFF_BITORDER_MSB) {
+        return _mm_srl_epi16(_mm_or_si128(_mm_mullo_epi16(w, ctl[2]),
+                                          _mm_mulhi_epu16(s, ctl[2])), ctl[5]);
+    }
+
+    return _mm_and_si128(_mm_or_si128(_mm_or_si128(_mm_mulhi_epu16(w, ctl[2]),
+                                                   _mm_and_si128(w, ctl[3])),
+                                      _mm_mullo_epi16(s, ctl[2])), ctl[4]);
+}
+
+#ifdef TIFF_SIMD_AVX2
+/* The same, for two groups at once (one per 128-bit lane) */
+static inline __m256i tiff_unpack_group2(__m256i v, const __m256i *ctl,
+                                         __m128i rshift, int bit_order)
+{
+    __m256i w = _mm256_shuffle_epi8(v, ctl[0]);
+    __m256i s = _mm256_shuffle_epi8(v, ctl[1]);
+
+    if (bit_order == TIFF_BITORDER_MSB) {
+        return _mm256_srl_epi16(_mm256_or_si256(_mm256_mullo_epi16(w, ctl[2]),
+                                                _mm256_mulhi_epu16(s, ctl[2])),
+                                rshift);
+    }
+
+    return _mm256_and_si256(
+        _mm256_or_si256(_mm256_or_si256(_mm256_mulhi_epu16(w, ctl[2]),
+                                        _mm256_and_si256(w, ctl[3])),
+                        _mm256_mullo_epi16(s, ctl[2])), ctl[4]);
+}
+#endif
+
+static size_t tiff_unpack_ssse3(const uint8_t *src, size_t src_len, int bits,
+                                int bit_order, size_t count, uint16_t *dst)
+{
+    struct tiff_unpack_ctl ctl;
+    __m128i v[6];
+    size_t done = 0;
+
+    tiff_unpack_make_ctl(&ctl, bits, bit_order);
+
+    v[0] = _mm_loadu_si128((const __m128i *)ctl.window);
+    v[1] = _mm_loadu_si128((const __m128i *)ctl.spill);
+    v[2] = _mm_loadu_si128((const __m128i *)ctl.mul);
+    v[3] = _mm_loadu_si128((const __m128i *)ctl.keep);
+    v[4] = _mm_set1_epi16((short)((1 << bits) - 1));
+    v[5] = _mm_cvtsi32_si128(16 - bits);
+
+#ifdef TIFF_SIMD_AVX2
+    {
+        __m256i v2[5];
+        int i;
+
+        for (i = 0; i < 5; i++) {
+            v2[i] = _mm256_broadcastsi128_si256(v[i]);
+        }
+
+        /* The second group's 16-byte load must stay inside the source */
+        while (count - done >= 16 && src_len >= (size_t)bits + 16) {
+            __m256i in = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+                _mm_loadu_si128((const __m128i *)(src + bits)), 1);
+
+            _mm256_storeu_si256((__m256i *)(dst + done),
+                tiff_unpack_group2(in, v2, v[5], bit_order));
+
+            src += 2 * bits;
+            src_len -= 2 * bits;
+            done += 16;
+        }
+    }
+#endif
+
+    while (count - done >= 8 && src_len >= 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)src);
+
+        _mm_storeu_si128((__m128i *)(dst + done),
+            tiff_unpack_group(in, v, bit_order));
+
+        src += bits;
+        src_len -= bits;
+        done += 8;
+    }
+
+    return done;
+}
+
+#endif /* TIFF_SIMD_SSSE3 */
+
+#ifdef TIFF_SIMD_NEON
+
+static size_t tiff_unpack_neon(const uint8_t *src, size_t src_len, int bits,
+                               int bit_order, size_t count, uint16_t *dst)
+{
+    struct tiff_unpack_ctl ctl;
+    uint8x16_t window, spill;
+    int16x8_t shift, lo_shift, hi_shift;
+    uint16x8_t mask;
+    size_t done = 0;
+
+    tiff_unpack_make_ctl(&ctl, bits, bit_order);
+
+    /* Out of range table indices (0x80) give zero, just like pshufb */
+    window = vld1q_u8(ctl.window);
+    spill = vld1q_u8(ctl.spill);
+    shift = vld1q_s16(ctl.shift);
+    mask = vdupq_n_u16((uint16_t)((1 << bits) - 1));
+
+    if (bit_order == TIFF_BITORDER_MSB) {
+        lo_shift = shift;
+        hi_shift = vsubq_s16(shift, vdupq_n_s16(16));
+    } else {
+        lo_shift = vnegq_s16(shift);
+        hi_shift = vsubq_s16(vdupq_n_s16(16), shift);
+    }
+
+    while (count - done >= 8 && src_len >= 16) {
+        uint8x16_t in = vld1q_u8(src);
+        uint16x8_t w = vreinterpretq_u16_u8(vqtbl1q_u8(in, window));
+        uint16x8_t s = vreinterpretq_u16_u8(vqtbl1q_u8(in, spill));
+        uint16x8_t out;
+
+        /* Shifts of 16 or more bits give zero, which handles lanes
+         * whose sample starts on a byte boundary.
+         */
+        out = vorrq_u16(vshlq_u16(w, lo_shift), vshlq_u16(s, hi_shift));
+
+        if (bit_order == TIFF_BITORDER_MSB) {
+            out = vshlq_u16(out, vdupq_n_s16((int16_t)(bits - 16)));
+        } else {
+            out = vandq_u16(out, mask);
+        }
+
+        vst1q_u16(dst + done, out);
+
+        src += bits;
+        src_len -= bits;
+        done += 8;
+    }
+
+    return done;
+}
+
+#endif /* TIFF_SIMD_NEON */
+
+/* Generic bit-at-a-time fallback. Never reads past the last byte that
+ * holds part of a sample.
+ */
+static void tiff_unpack_scalar(const uint8_t *src, int bits, int bit_order,
+                               size_t count, uint16_t *dst)
+{
+    uint32_t acc = 0, mask = (1u << bits) - 1;
+    int avail = 0;
+    size_t i;
+
+    if (bit_order == TIFF_BITORDER_MSB) {
+        for (i = 0; i < count; i++) {
+            while (avail < bits) {
+                acc = (acc << 8) | *src++;
+                avail += 8;
+            }
+            avail -= bits;
+            dst[i] = (uint16_t)((acc >> avail) & mask);
+            acc &= (1u << avail) - 1;
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            while (avail < bits) {
+                acc |= (uint32_t)*src++ << avail;
+                avail += 8;
+            }
+            dst[i] = (uint16_t)(acc & mask);
+            acc >>= bits;
+            avail -= bits;
+        }
+    }
+}
+
+TIFF_STATUS tiff_unpack_samples(const void *src, int bits, int bit_order,
+                                size_t count, UINT16 *dst)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    size_t i, done = 0;
+
+    TIFF_ASSERT_ARG(src);
+    TIFF_ASSERT_ARG(dst);
+
+    if (bits < 1 || bits > 16) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (bit_order == TIFF_BITORDER_DEFAULT) {
+        bit_order = TIFF_BITORDER_MSB;
+    }
+
+    if (bit_order != TIFF_BITORDER_MSB && bit_order != TIFF_BITORDER_LSB) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    /* Byte-aligned depths are just widening or byte swapping */
+    if (bits == 8) {
+        for (i = 0; i < count; i++) {
+            dst[i] = in[i];
+        }
+        return TIFF_OK;
+    }
+
+    if (bits == 16) {
+        int endianess = bit_order == TIFF_BITORDER_MSB ? ENDIAN_BIG : ENDIAN_LITTLE;
+
+        for (i = 0; i < count; i++) {
+            dst[i] = TIFF_WORD(in, i * 2, endianess);
+        }
+        return TIFF_OK;
+    }
+
+#if defined(TIFF_SIMD_SSSE3)
+    if (bits > 8) {
+        done = tiff_unpack_ssse3(in, (count * bits + 7) / 8, bits, bit_order,
+            count, dst);
+    }
+#elif defined(TIFF_SIMD_NEON)
+    if (bits > 8) {
+        done = tiff_unpack_neon(in, (count * bits + 7) / 8, bits, bit_order,
+            count, dst);
+    }
+#endif
+
+    /* SIMD kernels only consume whole groups of 8 samples (bits bytes) */
+    tiff_unpack_scalar(in + (done / 8) * bits, bits, bit_order, count - done,
+        dst + done);
+
+    return TIFF_OK;
+}
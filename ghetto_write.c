@@ -0,0 +1,650 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Streaming TIFF writer.
+ *
+ * Strip and tile data goes to the file as soon as it is handed over,
+ * through a staging buffer that is only ever flushed whole, so the file
+ * sees large writes at buffer-aligned offsets. Tags are kept in memory
+ * and all IFDs, with their out-of-line values, are written after the
+ * image data when the writer is closed; the header is then patched to
+ * point at the first of them. Files are written in the machine's byte
+ * order, so tag values never need swapping.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+#include <ghetto_priv.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/* Size (and alignment) of the writes issued to the file manager */
+#define TIFF_WRITE_BUFFER_LEN       (256 * 1024)
+
+/* Page aligned, so the buffer can go straight to an O_DIRECT backend */
+#define TIFF_WRITE_BUFFER_ALIGN     4096
+
+struct tiff_write_tag {
+    tiff_tag_id_t id;
+    int type;
+    size_t count;
+    uint8_t *data;              /* count values, in native byte order */
+};
+
+struct tiff_write_ifd {
+    struct tiff_write_tag *tags;    /* Kept sorted by id */
+    size_t tag_count;
+    size_t tag_alloc;
+
+    uint32_t *chunk_offsets;
+    uint32_t *chunk_sizes;
+    size_t chunk_count;
+    size_t chunk_alloc;
+
+    struct tiff_write_ifd *next;
+};
+
+struct tiff_writer {
+    tiff_file_hdl_t *fp;
+    tiff_file_mgr_t *mgr;
+
+    uint8_t *buf;
+    size_t buf_used;
+    tiff_off_t buf_off;         /* File offset of buf[0] */
+
+    struct tiff_write_ifd *cur;
+    struct tiff_write_ifd *first;
+    struct tiff_write_ifd *last;
+
+    tiff_allocator_t alloc;
+};
+
+static TIFF_STATUS tiff_write_out(tiff_writer_t *w, const void *data, size_t len)
+{
+    size_t count = 0;
+    TIFF_STATUS ret;
+
+    if ( (ret = w->mgr->write(w->fp, data, 1, len, &count)) != TIFF_OK ) {
+        return ret;
+    }
+
+    return count == len ? TIFF_OK : TIFF_END_OF_FILE;
+}
+
+static TIFF_STATUS tiff_write_flush(tiff_writer_t *w)
+{
+    TIFF_STATUS ret;
+
+    if (w->buf_used == 0) {
+        return TIFF_OK;
+    }
+
+    if ( (ret = tiff_write_out(w, w->buf, w->buf_used)) != TIFF_OK ) {
+        return ret;
+    }
+
+    w->buf_off += w->buf_used;
+    w->buf_used = 0;
+
+    return TIFF_OK;
+}
+
+/* Append data at the end of the file */
+static TIFF_STATUS tiff_write_append(tiff_writer_t *w, const void *data, size_t len)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    size_t n;
+    TIFF_STATUS ret;
+
+    /* Top up the staging buffer first */
+    if (w->buf_used > 0) {
+        n = TIFF_WRITE_BUFFER_LEN - w->buf_used;
+        if (n > len) n = len;
+
+        memcpy(w->buf + w->buf_used, src, n);
+        w->buf_used += n;
+        src += n;
+        len -= n;
+
+        if (w->buf_used < TIFF_WRITE_BUFFER_LEN) {
+            return TIFF_OK;
+        }
+
+        if ( (ret = tiff_write_flush(w)) != TIFF_OK ) {
+            return ret;
+        }
+    }
+
+    /* The buffer is empty, so whole blocks can go straight to the file */
+    n = len - len % TIFF_WRITE_BUFFER_LEN;
+    if (n > 0) {
+        if ( (ret = tiff_write_out(w, src, n)) != TIFF_OK ) {
+            return ret;
+        }
+        w->buf_off += n;
+        src += n;
+        len -= n;
+    }
+
+    memcpy(w->buf, src, len);
+    w->buf_used = len;
+
+    return TIFF_OK;
+}
+
+static tiff_off_t tiff_write_pos(tiff_writer_t *w)
+{
+    return w->buf_off + w->buf_used;
+}
+
+/* Pad the file out to a word boundary, as TIFF wants for offsets */
+static TIFF_STATUS tiff_write_align(tiff_writer_t *w)
+{
+    static const uint8_t zero = 0;
+
+    if (tiff_write_pos(w) & 1) {
+        return tiff_write_append(w, &zero, 1);
+    }
+
+    return TIFF_OK;
+}
+
+static void tiff_write_free_ifd(tiff_writer_t *w, struct tiff_write_ifd *ifd)
+{
+    size_t i;
+
+    for (i = 0; i < ifd->tag_count; i++) {
+        tiff_free(&w->alloc, ifd->tags[i].data);
+    }
+
+    tiff_free(&w->alloc, ifd->tags);
+    tiff_free(&w->alloc, ifd->chunk_offsets);
+    tiff_free(&w->alloc, ifd->chunk_sizes);
+
+    tiff_free(&w->alloc, ifd);
+}
+
+static struct tiff_write_ifd *tiff_write_cur_ifd(tiff_writer_t *w)
+{
+    if (w->cur == NULL) {
+        w->cur = (struct tiff_write_ifd *)tiff_calloc(&w->alloc, 1,
+            sizeof(struct tiff_write_ifd));
+    }
+
+    return w->cur;
+}
+
+static TIFF_STATUS tiff_write_put_tag(tiff_writer_t *w, struct tiff_write_ifd *ifd,
+                                      tiff_tag_id_t id, int type, size_t count,
+                                      const void *data)
+{
+    size_t size = tiff_get_type_size(type), i;
+    struct tiff_write_tag *tag;
+    uint8_t *copy;
+
+    if (size == 0) {
+        return TIFF_UNKNOWN_TYPE;
+    }
+
+    if (count == 0 || count > UINT32_MAX / size) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    copy = (uint8_t *)tiff_malloc(&w->alloc, size * count);
+    if (copy == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+    memcpy(copy, data, size * count);
+
+    for (i = 0; i < ifd->tag_count && ifd->tags[i].id < id; i++);
+
+    if (i < ifd->tag_count && ifd->tags[i].id == id) {
+        /* Replace the old value */
+        tag = &ifd->tags[i];
+        tiff_free(&w->alloc, tag->data);
+    } else {
+        if (ifd->tag_count == ifd->tag_alloc) {
+            size_t alloc = ifd->tag_alloc ? ifd->tag_alloc * 2 : 16;
+            struct tiff_write_tag *tags = (struct tiff_write_tag *)tiff_realloc(
+                &w->alloc, ifd->tags, ifd->tag_alloc * sizeof(struct tiff_write_tag),
+                alloc * sizeof(struct tiff_write_tag));
+
+            if (tags == NULL) {
+                tiff_free(&w->alloc, copy);
+                return TIFF_NO_MEMORY;
+            }
+
+            ifd->tags = tags;
+            ifd->tag_alloc = alloc;
+        }
+
+        memmove(&ifd->tags[i + 1], &ifd->tags[i],
+            (ifd->tag_count - i) * sizeof(struct tiff_write_tag));
+        ifd->tag_count++;
+        tag = &ifd->tags[i];
+    }
+
+    tag->id = id;
+    tag->type = type;
+    tag->count = count;
+    tag->data = copy;
+
+    return TIFF_OK;
+}
+
+static int tiff_write_has_tag(struct tiff_write_ifd *ifd, tiff_tag_id_t id)
+{
+    size_t i;
+
+    for (i = 0; i < ifd->tag_count; i++) {
+        if (ifd->tags[i].id == id) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+TIFF_STATUS tiff_create_ex(tiff_writer_t **writer, tiff_file_mgr_t *mgr,
+                           const char *file)
+{
+    uint8_t header[TIFF_HEADER_LEN];
+    tiff_writer_t *w = NULL;
+    tiff_allocator_t alloc;
+    uint16_t magic = TIFF_MAGIC;
+    uint32_t root = 0;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(writer);
+    TIFF_ASSERT_ARG(mgr);
+    TIFF_ASSERT_ARG(file);
+
+    *writer = NULL;
+
+    if (mgr->write == NULL) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    tiff_get_allocator(&alloc);
+
+    w = (tiff_writer_t *)tiff_calloc(&alloc, 1, sizeof(tiff_writer_t));
+    if (w == NULL) {
+        return TIFF_NO_MEMORY;
+    }
+
+    w->mgr = mgr;
+    w->alloc = alloc;
+
+    w->buf = (uint8_t *)tiff_aligned_alloc(&alloc, TIFF_WRITE_BUFFER_ALIGN,
+        TIFF_WRITE_BUFFER_LEN);
+    if (w->buf == NULL) {
+        ret = TIFF_NO_MEMORY;
+        goto fail_free;
+    }
+
+    if ( (ret = mgr->open(&w->fp, file, "wb")) != TIFF_OK ) {
+        goto fail_free;
+    }
+
+    /* The IFD offset gets filled in when the writer is closed */
+    header[0] = header[1] = (MACH_ENDIANESS == ENDIAN_LITTLE) ?
+        ENDIANESS_INTEL : ENDIANESS_MOTOROLA;
+    memcpy(header + TIFF_HEADER_MAGIC, &magic, sizeof(magic));
+    memcpy(header + TIFF_HEADER_IFD, &root, sizeof(root));
+
+    if ( (ret = tiff_write_append(w, header, sizeof(header))) != TIFF_OK ) {
+        goto fail_close;
+    }
+
+    *writer = w;
+
+    return TIFF_OK;
+
+fail_close:
+    mgr->close(w->fp);
+
+fail_free:
+    tiff_aligned_free(&alloc, w->buf);
+    tiff_free(&alloc, w);
+    return ret;
+}
+
+TIFF_STATUS tiff_create(tiff_writer_t **writer, const char *file)
+{
+    return tiff_create_ex(writer, tiff_stdio_mgr, file);
+}
+
+TIFF_STATUS tiff_set_tag(tiff_writer_t *w, tiff_tag_id_t tag_id, int type,
+                         size_t count, const void *data)
+{
+    struct tiff_write_ifd *ifd;
+
+    TIFF_ASSERT_ARG(w);
+    TIFF_ASSERT_ARG(data);
+
+    /* The writer owns the chunk tables */
+    if (tag_id == TIFF_TAG_STRIPOFFSETS || tag_id == TIFF_TAG_STRIPBYTECOUNTS ||
+        tag_id == TIFF_TAG_TILEOFFSETS || tag_id == TIFF_TAG_TILEBYTECOUNTS)
+    {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if ( (ifd = tiff_write_cur_ifd(w)) == NULL ) {
+        return TIFF_NO_MEMORY;
+    }
+
+    return tiff_write_put_tag(w, ifd, tag_id, type, count, data);
+}
+
+TIFF_STATUS tiff_write_chunk(tiff_writer_t *w, size_t index, const void *data,
+                             size_t len)
+{
+    struct tiff_write_ifd *ifd;
+    tiff_off_t pos;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(w);
+    TIFF_ASSERT_ARG(data);
+
+    /* A zero byte count marks a chunk that hasn't been written */
+    if (len == 0) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if ( (ifd = tiff_write_cur_ifd(w)) == NULL ) {
+        return TIFF_NO_MEMORY;
+    }
+
+    if (index >= ifd->chunk_alloc) {
+        size_t alloc = ifd->chunk_alloc ? ifd->chunk_alloc : 64;
+        uint32_t *offsets, *sizes;
+
+        while (alloc <= index) alloc *= 2;
+
+        offsets = (uint32_t *)tiff_realloc(&w->alloc, ifd->chunk_offsets,
+            ifd->chunk_alloc * sizeof(uint32_t), alloc * sizeof(uint32_t));
+        if (offsets == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+        ifd->chunk_offsets = offsets;
+
+        sizes = (uint32_t *)tiff_realloc(&w->alloc, ifd->chunk_sizes,
+            ifd->chunk_alloc * sizeof(uint32_t), alloc * sizeof(uint32_t));
+        if (sizes == NULL) {
+            return TIFF_NO_MEMORY;
+        }
+        ifd->chunk_sizes = sizes;
+
+        memset(ifd->chunk_offsets + ifd->chunk_alloc, 0,
+            (alloc - ifd->chunk_alloc) * sizeof(uint32_t));
+        memset(ifd->chunk_sizes + ifd->chunk_alloc, 0,
+            (alloc - ifd->chunk_alloc) * sizeof(uint32_t));
+        ifd->chunk_alloc = alloc;
+    }
+
+    if ( (ret = tiff_write_align(w)) != TIFF_OK ) {
+        return ret;
+    }
+
+    pos = tiff_write_pos(w);
+
+    /* Classic TIFF can't point past 4GiB */
+    if (pos + len > UINT32_MAX) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if ( (ret = tiff_write_append(w, data, len)) != TIFF_OK ) {
+        return ret;
+    }
+
+    ifd->chunk_offsets[index] = (uint32_t)pos;
+    ifd->chunk_sizes[index] = (uint32_t)len;
+    if (index >= ifd->chunk_count) {
+        ifd->chunk_count = index + 1;
+    }
+
+    return TIFF_OK;
+}
+
+TIFF_STATUS tiff_finish_ifd(tiff_writer_t *w)
+{
+    struct tiff_write_ifd *ifd;
+    int tiled;
+    size_t i;
+    TIFF_STATUS ret;
+
+    TIFF_ASSERT_ARG(w);
+
+    if ( (ifd = w->cur) == NULL || ifd->tag_count == 0 ) {
+        return TIFF_RANGE_ERROR;
+    }
+
+    if (ifd->chunk_count > 0) {
+        for (i = 0; i < ifd->chunk_count; i++) {
+            if (ifd->chunk_sizes[i] == 0) {
+                TIFF_TRACE("Chunk %zd was never written\n", i);
+                return TIFF_RANGE_ERROR;
+            }
+        }
+
+        tiled = tiff_write_has_tag(ifd, TIFF_TAG_TILEWIDTH);
+
+        if ( (ret = tiff_write_put_tag(w, ifd,
+                tiled ? TIFF_TAG_TILEOFFSETS : TIFF_TAG_STRIPOFFSETS,
+                TIFF_TYPE_LONG, ifd->chunk_count, ifd->chunk_offsets)) != TIFF_OK ||
+             (ret = tiff_write_put_tag(w, ifd,
+                tiled ? TIFF_TAG_TILEBYTECOUNTS : TIFF_TAG_STRIPBYTECOUNTS,
+                TIFF_TYPE_LONG, ifd->chunk_count, ifd->chunk_sizes)) != TIFF_OK)
+        {
+            return ret;
+        }
+    }
+
+    /* The chunk tables live on as tags now */
+    tiff_free(&w->alloc, ifd->chunk_offsets);
+    tiff_free(&w->alloc, ifd->chunk_sizes);
+    ifd->chunk_offsets = ifd->chunk_sizes = NULL;
+    ifd->chunk_count = ifd->chunk_alloc = 0;
+
+    if (w->last) {
+        w->last->next = ifd;
+    } else {
+        w->first = ifd;
+    }
+    w->last = ifd;
+    w->cur = NULL;
+
+    return TIFF_OK;
+}
+
+/* Bytes of out-of-line values an IFD has, written just before it */
+static size_t tiff_write_ifd_data_size(struct tiff_write_ifd *ifd)
+{
+    size_t bytes = 0, len, i;
+
+    for (i = 0; i < ifd->tag_count; i++) {
+        len = tiff_get_type_size(ifd->tags[i].type) * ifd->tags[i].count;
+        if (len > TIFF_TAG_DATA_FIELD_SIZE) {
+            bytes += (len + 1) & ~(size_t)1;
+        }
+    }
+
+    return bytes;
+}
+
+/* Bytes of the directory itself: count, entries and next pointer */
+#define TIFF_WRITE_DIR_SIZE(ifd)    (2 + (ifd)->tag_count * IFD_ENTRY_LEN + 4)
+
+static TIFF_STATUS tiff_write_emit_ifd(tiff_writer_t *w, struct tiff_write_ifd *ifd,
+                                       uint32_t next)
+{
+    uint8_t entry[IFD_ENTRY_LEN];
+    uint32_t off, count32;
+    uint16_t id, type, entries = (uint16_t)ifd->tag_count;
+    size_t len, i;
+    TIFF_STATUS ret;
+
+    /* Out-of-line values first, so they can be pointed at as we go */
+    off = (uint32_t)tiff_write_pos(w);
+
+    for (i = 0; i < ifd->tag_count; i++) {
+        len = tiff_get_type_size(ifd->tags[i].type) * ifd->tags[i].count;
+        if (len > TIFF_TAG_DATA_FIELD_SIZE) {
+            if ( (ret = tiff_write_append(w, ifd->tags[i].data, len)) != TIFF_OK ||
+                 (ret = tiff_write_align(w)) != TIFF_OK)
+            {
+                return ret;
+            }
+        }
+    }
+
+    if ( (ret = tiff_write_append(w, &entries, sizeof(entries))) != TIFF_OK ) {
+        return ret;
+    }
+
+    for (i = 0; i < ifd->tag_count; i++) {
+        struct tiff_write_tag *tag = &ifd->tags[i];
+
+        len = tiff_get_type_size(tag->type) * tag->count;
+        id = tag->id;
+        type = (uint16_t)tag->type;
+        count32 = (uint32_t)tag->count;
+
+        memset(entry, 0, sizeof(entry));
+        memcpy(entry + IFD_ENTRY_TAG, &id, sizeof(id));
+        memcpy(entry + IFD_ENTRY_TYPE, &type, sizeof(type));
+        memcpy(entry + IFD_ENTRY_COUNT, &count32, sizeof(count32));
+
+        if (len > TIFF_TAG_DATA_FIELD_SIZE) {
+            memcpy(entry + IFD_ENTRY_OFFSET, &off, sizeof(off));
+            off += (uint32_t)((len + 1) & ~(size_t)1);
+        } else {
+            memcpy(entry + IFD_ENTRY_OFFSET, tag->data, len);
+        }
+
+        if ( (ret = tiff_write_append(w, entry, sizeof(entry))) != TIFF_OK ) {
+            return ret;
+        }
+    }
+
+    return tiff_write_append(w, &next, sizeof(next));
+}
+
+TIFF_STATUS tiff_writer_close(tiff_writer_t *w)
+{
+    struct tiff_write_ifd *ifd, *next;
+    tiff_allocator_t alloc;
+    tiff_off_t pos, root = 0;
+    uint32_t root32;
+    size_t count = 0;
+    TIFF_STATUS ret = TIFF_OK;
+
+    TIFF_ASSERT_ARG(w);
+
+    /* Finish off an IFD the caller left open. One with chunks but no
+     * tags fails, as it would in tiff_finish_ifd.
+     */
+    if (w->cur != NULL && (w->cur->tag_count > 0 || w->cur->chunk_count > 0)) {
+        if ( (ret = tiff_finish_ifd(w)) != TIFF_OK ) {
+            goto done;
+        }
+    }
+
+    if (w->first == NULL) {
+        TIFF_TRACE("No IFDs to write\n");
+        ret = TIFF_RANGE_ERROR;
+        goto done;
+    }
+
+    if ( (ret = tiff_write_align(w)) != TIFF_OK ) {
+        goto done;
+    }
+
+    /* Every IFD follows the previous one, so their offsets are known
+     * before anything is written.
+     */
+    pos = tiff_write_pos(w);
+    for (ifd = w->first; ifd; ifd = ifd->next) {
+        tiff_off_t ifd_pos = pos + tiff_write_ifd_data_size(ifd), next_pos = 0;
+
+        pos = ifd_pos + TIFF_WRITE_DIR_SIZE(ifd);
+
+        if (ifd->next) {
+            next_pos = pos + tiff_write_ifd_data_size(ifd->next);
+        }
+
+        if (ifd->tag_count > UINT16_MAX || pos > UINT32_MAX ||
+            next_pos > UINT32_MAX)
+        {
+            ret = TIFF_RANGE_ERROR;
+            goto done;
+        }
+
+        if (root == 0) {
+            root = ifd_pos;
+        }
+
+        if ( (ret = tiff_write_emit_ifd(w, ifd, (uint32_t)next_pos)) != TIFF_OK ) {
+            goto done;
+        }
+    }
+
+    if ( (ret = tiff_write_flush(w)) != TIFF_OK ) {
+        goto done;
+    }
+
+    /* Point the header at the first IFD */
+    root32 = (uint32_t)root;
+    if ( (ret = w->mgr->seek(w->fp, TIFF_HEADER_IFD, TIFF_SEEK_SET)) != TIFF_OK ||
+         (ret = w->mgr->write(w->fp, &root32, sizeof(root32), 1, &count)) != TIFF_OK)
+    {
+        goto done;
+    }
+
+    if (count != 1) {
+        ret = TIFF_END_OF_FILE;
+    }
+
+done:
+    w->mgr->close(w->fp);
+
+    for (ifd = w->first; ifd; ifd = next) {
+        next = ifd->next;
+        tiff_write_free_ifd(w, ifd);
+    }
+
+    if (w->cur) tiff_write_free_ifd(w, w->cur);
+
+    alloc = w->alloc;
+    tiff_aligned_free(&alloc, w->buf);
+    memset(w, 0, sizeof(tiff_writer_t));
+    tiff_free(&alloc, w);
+
+    return ret;
+}
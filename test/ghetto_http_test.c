@@ -0,0 +1,562 @@
+/* Checks the HTTP file manager against a stand-in server.
+ *
+ * A small HTTP/1.1 server runs on a thread, on a loopback port, serving
+ * one generated file. Each test opens that file over HTTP and locally,
+ * and checks that both give the same tags and image data. The server
+ * counts the body bytes it sends, to see how much a metadata walk costs.
+ * It can also ignore Range headers, or close connections after every
+ * response, to check the fallbacks. No network access is needed.
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_WIDTH          1024
+#define TEST_HEIGHT         4096
+#define TEST_ROWS_PER_STRIP 64
+#define TEST_THUMB          64
+
+#define SERVE_RANGES        0   /* Honour Range headers */
+#define SERVE_WHOLE         1   /* Always send the whole file */
+#define SERVE_CLOSE         2   /* Honour Range, close after each response */
+
+struct server {
+    int sock;
+    unsigned short port;
+    int mode;
+    const char *path;
+    uint8_t *data;
+    size_t size;
+    uint64_t bytes;             /* Body bytes sent */
+    uint64_t requests;
+};
+
+static struct server srv;
+static int failures;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+/*******************************************************************/
+/* Stand-in server                                                 */
+/*******************************************************************/
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t sent;
+
+    while (len > 0) {
+        if ( (sent = send(sock, p, len, MSG_NOSIGNAL)) <= 0 ) {
+            return -1;
+        }
+        p += sent;
+        len -= (size_t)sent;
+    }
+
+    return 0;
+}
+
+static void *serve_conn(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    char req[4096], path[1024], hdr[512], *end, *range;
+    size_t have = 0, first, last, len;
+    unsigned long long a, b;
+    ssize_t got;
+    int n, status;
+
+    req[0] = '\0';
+
+    for (;;) {
+        while ( (end = strstr(req, "\r\n\r\n")) == NULL || have == 0 ) {
+            if (have == sizeof(req) - 1) {
+                goto done;
+            }
+            if ( (got = recv(sock, req + have, sizeof(req) - 1 - have, 0)) <= 0 ) {
+                goto done;
+            }
+            have += (size_t)got;
+            req[have] = '\0';
+        }
+
+        *end = '\0';
+
+        if (sscanf(req, "GET %1023s HTTP/1.1", path) != 1) {
+            goto done;
+        }
+
+        first = 0;
+        last = srv.size - 1;
+        status = 200;
+
+        range = strstr(req, "\r\nRange: bytes=");
+        if (range != NULL && srv.mode != SERVE_WHOLE &&
+            sscanf(range, "\r\nRange: bytes=%llu-%llu", &a, &b) == 2)
+        {
+            status = a < srv.size ? 206 : 416;
+            first = (size_t)a;
+            last = b < srv.size ? (size_t)b : srv.size - 1;
+        }
+
+        if (strcmp(path, srv.path) != 0) {
+            status = 404;
+        }
+
+        switch (status) {
+        case 206:
+            n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Length: %zu\r\nContent-Range: bytes %zu-%zu/%zu\r\n"
+                "ETag: \"test\"\r\n%s\r\n", last - first + 1, first, last,
+                srv.size, srv.mode == SERVE_CLOSE ? "Connection: close\r\n" : "");
+            break;
+        case 416:
+            n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                "Content-Length: 0\r\nContent-Range: bytes */%zu\r\n\r\n", srv.size);
+            break;
+        case 404:
+            n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 404 Not Found\r\n"
+                "Content-Length: 0\r\n\r\n");
+            break;
+        default:
+            n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                "Content-Length: %zu\r\n\r\n", srv.size);
+            break;
+        }
+
+        len = (status == 200 || status == 206) ? last - first + 1 : 0;
+
+        __atomic_fetch_add(&srv.requests, 1, __ATOMIC_RELAXED);
+
+        if (send_all(sock, hdr, (size_t)n) || send_all(sock, srv.data + first, len)) {
+            goto done;
+        }
+
+        __atomic_fetch_add(&srv.bytes, len, __ATOMIC_RELAXED);
+
+        if (srv.mode == SERVE_CLOSE) {
+            goto done;
+        }
+
+        /* Keep whatever followed this request */
+        end += 4;
+        have -= (size_t)(end - req);
+        memmove(req, end, have);
+        req[have] = '\0';
+    }
+
+done:
+    close(sock);
+    return NULL;
+}
+
+static void *serve(void *arg)
+{
+    pthread_t tid;
+    int conn;
+
+    (void)arg;
+
+    while ( (conn = accept(srv.sock, NULL, NULL)) >= 0 ) {
+        if (pthread_create(&tid, NULL, serve_conn, (void *)(intptr_t)conn)) {
+            close(conn);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+static int start_server(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+    int one = 1;
+
+    srv.sock = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(srv.sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(srv.sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(srv.sock, 16) ||
+        getsockname(srv.sock, (struct sockaddr *)&addr, &len))
+    {
+        perror("server");
+        return -1;
+    }
+
+    srv.port = ntohs(addr.sin_port);
+
+    return pthread_create(&tid, NULL, serve, NULL);
+}
+
+/*******************************************************************/
+/* Test file                                                       */
+/*******************************************************************/
+
+static int set_long(tiff_writer_t *w, tiff_tag_id_t id, uint32_t val)
+{
+    return tiff_set_tag(w, id, TIFF_TYPE_LONG, 1, &val);
+}
+
+static int set_short(tiff_writer_t *w, tiff_tag_id_t id, uint16_t val)
+{
+    return tiff_set_tag(w, id, TIFF_TYPE_SHORT, 1, &val);
+}
+
+/* A big grey image with a long description, then a thumbnail. The
+ * writer puts the IFDs after the image data, at the far end of the file.
+ */
+static int make_file(const char *name)
+{
+    tiff_writer_t *w = NULL;
+    size_t strip = (size_t)TEST_WIDTH * TEST_ROWS_PER_STRIP, i, j;
+    char desc[3000];
+    uint8_t *buf;
+    int ret = 0;
+
+    if ( (buf = malloc(strip)) == NULL || tiff_create(&w, name) != TIFF_OK ) {
+        free(buf);
+        return -1;
+    }
+
+    memset(desc, 'd', sizeof(desc) - 1);
+    desc[sizeof(desc) - 1] = '\0';
+
+    ret |= set_long(w, 256, TEST_WIDTH);
+    ret |= set_long(w, 257, TEST_HEIGHT);
+    ret |= set_short(w, 258, 8);
+    ret |= set_short(w, 259, 1);
+    ret |= set_short(w, 262, 1);
+    ret |= set_short(w, 277, 1);
+    ret |= set_long(w, 278, TEST_ROWS_PER_STRIP);
+    ret |= tiff_set_tag(w, 270, TIFF_TYPE_ASCII, sizeof(desc), desc);
+
+    for (i = 0; i < TEST_HEIGHT / TEST_ROWS_PER_STRIP; i++) {
+        for (j = 0; j < strip; j++) {
+            buf[j] = (uint8_t)(i * 31 + j * 7 + (j >> 9));
+        }
+        ret |= tiff_write_chunk(w, i, buf, strip);
+    }
+
+    ret |= tiff_finish_ifd(w);
+
+    ret |= set_long(w, 256, TEST_THUMB);
+    ret |= set_long(w, 257, TEST_THUMB);
+    ret |= set_short(w, 258, 8);
+    ret |= set_short(w, 259, 1);
+    ret |= set_short(w, 262, 1);
+    ret |= tiff_write_chunk(w, 0, buf, TEST_THUMB * TEST_THUMB);
+
+    ret |= tiff_writer_close(w);
+
+    free(buf);
+
+    return ret == TIFF_OK ? 0 : -1;
+}
+
+static int load_file(const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    long len;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0) {
+        return -1;
+    }
+
+    rewind(f);
+
+    srv.size = (size_t)len;
+    srv.data = malloc(srv.size);
+
+    if (srv.data == NULL || fread(srv.data, 1, srv.size, f) != srv.size) {
+        return -1;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+/*******************************************************************/
+/* Tests                                                           */
+/*******************************************************************/
+
+static void reset_counters(int mode)
+{
+    srv.mode = mode;
+    srv.bytes = 0;
+    srv.requests = 0;
+}
+
+/* Walk the IFD chain of both, comparing every tag. Returns the IFD count. */
+static int compare_tags(tiff_t *http, tiff_t *local)
+{
+    tiff_ifd_t *a = NULL, *b = NULL;
+    tiff_off_t off_a, off_b;
+    tiff_tag_t *ta, *tb;
+    size_t count_a, count_b, i;
+    int id_a, id_b, type, n, ifds = 0;
+    uint8_t *da, *db;
+
+    tiff_get_base_ifd_offset(http, &off_a);
+    tiff_get_base_ifd_offset(local, &off_b);
+
+    while (off_a != 0 && off_b != 0) {
+        CHECK(off_a == off_b, "IFD offsets differ");
+
+        if (tiff_read_ifd(http, off_a, &a) != TIFF_OK ||
+            tiff_read_ifd(local, off_b, &b) != TIFF_OK)
+        {
+            CHECK(0, "can't read IFD at %llu", (unsigned long long)off_a);
+            return ifds;
+        }
+
+        tiff_get_ifd_tag_count(http, a, &count_a);
+        tiff_get_ifd_tag_count(local, b, &count_b);
+        CHECK(count_a == count_b, "tag counts differ");
+
+        for (i = 0; i < count_a && i < count_b; i++) {
+            tiff_get_tag_indexed(http, a, i, &ta);
+            tiff_get_tag_indexed(local, b, i, &tb);
+            tiff_get_tag_info(http, ta, &id_a, &type, &n);
+            tiff_get_tag_info(local, tb, &id_b, NULL, NULL);
+            CHECK(id_a == id_b, "tag ids differ");
+
+            da = calloc((size_t)n + 1, tiff_get_type_size(type));
+            db = calloc((size_t)n + 1, tiff_get_type_size(type));
+
+            CHECK(tiff_get_tag_data(http, a, ta, da) == TIFF_OK,
+                "can't read tag %d over HTTP", id_a);
+            tiff_get_tag_data(local, b, tb, db);
+            CHECK(!memcmp(da, db, (size_t)n * tiff_get_type_size(type)),
+                "tag %d differs", id_a);
+
+            free(da);
+            free(db);
+        }
+
+        tiff_get_next_ifd_offset(http, a, &off_a);
+        tiff_get_next_ifd_offset(local, b, &off_b);
+        tiff_free_ifd(http, a);
+        tiff_free_ifd(local, b);
+        ifds++;
+    }
+
+    CHECK(off_a == off_b, "IFD chains differ");
+
+    return ifds;
+}
+
+/* Read every chunk of IFD0 from both and compare */
+static void compare_chunks(tiff_t *http, tiff_t *local)
+{
+    tiff_ifd_t *a = NULL, *b = NULL;
+    tiff_off_t off;
+    size_t i, len, got_a, got_b;
+    uint8_t *da, *db;
+
+    tiff_get_base_ifd_offset(local, &off);
+    tiff_read_ifd(http, off, &a);
+    tiff_read_ifd(local, off, &b);
+
+    for (i = 0; tiff_get_chunk_info(local, b, i, NULL, &len) == TIFF_OK; i++) {
+        da = malloc(len);
+        db = malloc(len);
+        got_a = got_b = 0;
+
+        CHECK(tiff_read_chunk(http, a, i, da, len, &got_a) == TIFF_OK,
+            "can't read chunk %zu over HTTP", i);
+        tiff_read_chunk(local, b, i, db, len, &got_b);
+        CHECK(got_a == got_b && !memcmp(da, db, len), "chunk %zu differs", i);
+
+        free(da);
+        free(db);
+    }
+
+    tiff_free_ifd(http, a);
+    tiff_free_ifd(local, b);
+}
+
+static void test_mode(const char *url, const char *name, int mode,
+                      const char *what)
+{
+    tiff_t *http = NULL, *local = NULL;
+    uint64_t meta_bytes, meta_requests;
+    int ifds;
+
+    reset_counters(mode);
+
+    if (tiff_open_http(&http, url, NULL) != TIFF_OK ||
+        tiff_open(&local, name, "r") != TIFF_OK)
+    {
+        CHECK(0, "%s: can't open", what);
+        return;
+    }
+
+    ifds = compare_tags(http, local);
+    CHECK(ifds == 2, "%s: found %d IFDs", what, ifds);
+
+    meta_bytes = srv.bytes;
+    meta_requests = srv.requests;
+
+    compare_chunks(http, local);
+
+    printf("%-16s metadata: %llu bytes in %llu requests; "
+        "with image data: %llu bytes in %llu requests; file %zu bytes\n",
+        what, (unsigned long long)meta_bytes,
+        (unsigned long long)meta_requests, (unsigned long long)srv.bytes,
+        (unsigned long long)srv.requests, srv.size);
+
+    if (mode != SERVE_WHOLE) {
+        CHECK(meta_bytes < 256 * 1024, "%s: metadata walk fetched %llu bytes",
+            what, (unsigned long long)meta_bytes);
+        CHECK(srv.bytes < srv.size + srv.size / 8,
+            "%s: reading everything fetched %llu bytes", what,
+            (unsigned long long)srv.bytes);
+    } else {
+        /* The file comes whole with the first response, and only then */
+        CHECK(srv.requests == 1 && srv.bytes == srv.size,
+            "%s: reading everything took %llu bytes in %llu requests", what,
+            (unsigned long long)srv.bytes, (unsigned long long)srv.requests);
+    }
+
+    tiff_close(http);
+    tiff_close(local);
+}
+
+/* Small blocks and cache, so reads span and evict blocks */
+static void test_small_cache(const char *url, const char *name)
+{
+    tiff_http_options_t opts;
+    tiff_t *http = NULL, *local = NULL;
+
+    reset_counters(SERVE_RANGES);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.prefix_bytes = 100;
+    opts.block_size = 1000;
+    opts.cache_blocks = 3;
+
+    if (tiff_open_http(&http, url, &opts) != TIFF_OK ||
+        tiff_open(&local, name, "r") != TIFF_OK)
+    {
+        CHECK(0, "small cache: can't open");
+        return;
+    }
+
+    compare_tags(http, local);
+    compare_chunks(http, local);
+
+    tiff_close(http);
+    tiff_close(local);
+}
+
+/* A file too big to hold whole can't be read from a server that
+ * ignores Range.
+ */
+static void test_whole_too_big(const char *url)
+{
+    tiff_http_options_t opts;
+    tiff_t *http = NULL;
+    TIFF_STATUS ret;
+
+    reset_counters(SERVE_WHOLE);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.max_whole_bytes = srv.size - 1;
+
+    ret = tiff_open_http(&http, url, &opts);
+    CHECK(ret == TIFF_UNSUPPORTED, "oversized whole file gave %d", ret);
+
+    if (http) tiff_close(http);
+}
+
+static void test_errors(void)
+{
+    tiff_t *fp = NULL;
+    char url[256];
+
+    reset_counters(SERVE_RANGES);
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/missing.tif", srv.port);
+    CHECK(tiff_open_http(&fp, url, NULL) == TIFF_FILE_NOT_FOUND,
+        "missing file not reported");
+
+    CHECK(tiff_open_http(&fp, "https://127.0.0.1/x.tif", NULL) == TIFF_UNSUPPORTED,
+        "https not refused");
+
+    CHECK(tiff_open_ex(&fp, tiff_http_mgr, "http://127.0.0.1:1/x.tif", "r")
+        == TIFF_FILE_NOT_FOUND, "refused connection not reported");
+}
+
+int main(int argc, char *argv[])
+{
+    char name[] = "/tmp/ghetto_http_XXXXXX";
+    char url[256];
+    int fd;
+
+    (void)argc;
+    (void)argv;
+
+    if ( (fd = mkstemp(name)) < 0 ) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    if (make_file(name) || load_file(name)) {
+        printf("can't build the test file\n");
+        unlink(name);
+        return 1;
+    }
+
+    srv.path = "/image.tif";
+
+    if (start_server()) {
+        unlink(name);
+        return 1;
+    }
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u%s", srv.port, srv.path);
+
+    test_mode(url, name, SERVE_RANGES, "ranges");
+    test_mode(url, name, SERVE_CLOSE, "no keep-alive");
+    test_mode(url, name, SERVE_WHOLE, "no ranges");
+    test_small_cache(url, name);
+    test_whole_too_big(url);
+    test_errors();
+
+    unlink(name);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+
+    return 0;
+}
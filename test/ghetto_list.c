@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <ctype.h>
 
 #define TIFF_TAG_SUBIFD     330
@@ -255,6 +256,7 @@ int main(int argc, const char *argv[])
 {
     tiff_t *fp;
     TIFF_STATUS ret;
+    tiff_ifd_chain_t chain;
     tiff_off_t ifd_off;
     tiff_ifd_t *ifd;
 
@@ -277,6 +279,7 @@ int main(int argc, const char *argv[])
         return -1;
     }
 
+    memset(&chain, 0, sizeof(chain));
     tiff_get_base_ifd_offset(fp, &ifd_off);
 
     do {
@@ -286,7 +289,7 @@ int main(int argc, const char *argv[])
         read_ifd(fp, ifd, TIFF_TAG_SUBIFD);
         read_ifd(fp, ifd, TIFF_TAG_EXIFIFD);
 
-        tiff_get_next_ifd_offset(fp, ifd, &ifd_off);
+        tiff_next_ifd(fp, &chain, ifd, &ifd_off);
         tiff_free_ifd(fp, ifd);
     } while (ifd_off != 0);
 
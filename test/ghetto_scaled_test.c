@@ -0,0 +1,171 @@
+/* Checks reduced-resolution reads against the sample format.
+ *
+ * Small 4x2 images are written with alternating sample values and read
+ * back halved. The averaging filters only know unsigned integers, so
+ * signed and floating point images must be refused rather than averaged
+ * as raw bits; subsampling copies samples and works for any format.
+ */
+
+#include <ghetto.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_WIDTH          4
+#define TEST_HEIGHT         2
+
+static int failures;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+static int set_short(tiff_writer_t *w, tiff_tag_id_t id, uint16_t val)
+{
+    return tiff_set_tag(w, id, TIFF_TYPE_SHORT, 1, &val);
+}
+
+/* One strip of TEST_WIDTH x TEST_HEIGHT grey samples */
+static int write_image(const char *name, int bits, int format,
+                       const void *pixels)
+{
+    tiff_writer_t *w = NULL;
+    int ret = 0;
+
+    if (tiff_create(&w, name) != TIFF_OK) {
+        return -1;
+    }
+
+    ret |= set_short(w, 256, TEST_WIDTH);
+    ret |= set_short(w, 257, TEST_HEIGHT);
+    ret |= set_short(w, 258, (uint16_t)bits);
+    ret |= set_short(w, 259, 1);
+    ret |= set_short(w, 262, 1);
+    ret |= set_short(w, 277, 1);
+    ret |= set_short(w, 278, TEST_HEIGHT);
+    ret |= set_short(w, 339, (uint16_t)format);
+    ret |= tiff_write_chunk(w, 0, pixels,
+        (size_t)TEST_WIDTH * TEST_HEIGHT * (bits / 8));
+
+    ret |= tiff_writer_close(w);
+
+    return ret == TIFF_OK ? 0 : -1;
+}
+
+/* Scale the first image of name by 2 with mode into dst */
+static TIFF_STATUS read_halved(const char *name, int mode, void *dst,
+                               size_t dst_len, TIFF_STATUS *size_ret)
+{
+    tiff_t *fp = NULL;
+    tiff_ifd_t *ifd = NULL;
+    tiff_off_t off = 0;
+    unsigned w, h, s;
+    TIFF_STATUS ret;
+
+    if ( (ret = tiff_open(&fp, name, "r")) != TIFF_OK ) {
+        return ret;
+    }
+
+    tiff_get_base_ifd_offset(fp, &off);
+
+    if ( (ret = tiff_read_ifd(fp, off, &ifd)) == TIFF_OK ) {
+        *size_ret = tiff_get_scaled_size(fp, ifd, 2, mode, &w, &h, &s);
+        ret = tiff_read_scaled(fp, ifd, 2, mode, dst, dst_len);
+        tiff_free_ifd(fp, ifd);
+    }
+
+    tiff_close(fp);
+
+    return ret;
+}
+
+static void test_unsigned(const char *name)
+{
+    uint16_t px[TEST_WIDTH * TEST_HEIGHT] = { 3, 1, 3, 1, 3, 1, 3, 1 };
+    uint16_t out[2] = { 0, 0 };
+    TIFF_STATUS ret, size_ret;
+
+    CHECK(write_image(name, 16, TIFF_SAMPLEFORMAT_UINT, px) == 0,
+        "can't write the unsigned image");
+
+    ret = read_halved(name, TIFF_SCALE_BOX, out, sizeof(out), &size_ret);
+    CHECK(ret == TIFF_OK && size_ret == TIFF_OK, "unsigned box gave %d/%d",
+        ret, size_ret);
+    CHECK(out[0] == 2 && out[1] == 2, "unsigned box averaged to %u %u",
+        out[0], out[1]);
+}
+
+static void test_signed(const char *name)
+{
+    int16_t px[TEST_WIDTH * TEST_HEIGHT] = { 2, -2, 2, -2, 2, -2, 2, -2 };
+    int16_t out[2] = { 0, 0 };
+    TIFF_STATUS ret, size_ret;
+
+    CHECK(write_image(name, 16, TIFF_SAMPLEFORMAT_INT, px) == 0,
+        "can't write the signed image");
+
+    ret = read_halved(name, TIFF_SCALE_BOX, out, sizeof(out), &size_ret);
+    CHECK(ret == TIFF_UNSUPPORTED && size_ret == TIFF_UNSUPPORTED,
+        "signed box gave %d/%d", ret, size_ret);
+
+    ret = read_halved(name, TIFF_SCALE_SUBSAMPLE, out, sizeof(out), &size_ret);
+    CHECK(ret == TIFF_OK && out[0] == 2 && out[1] == 2,
+        "signed subsample gave %d: %d %d", ret, out[0], out[1]);
+}
+
+static void test_float(const char *name)
+{
+    float px[TEST_WIDTH * TEST_HEIGHT] = { 3, 1, 3, 1, 3, 1, 3, 1 };
+    float out[2] = { 0, 0 };
+    TIFF_STATUS ret, size_ret;
+
+    CHECK(write_image(name, 32, TIFF_SAMPLEFORMAT_IEEEFP, px) == 0,
+        "can't write the float image");
+
+    ret = read_halved(name, TIFF_SCALE_BOX, out, sizeof(out), &size_ret);
+    CHECK(ret == TIFF_UNSUPPORTED && size_ret == TIFF_UNSUPPORTED,
+        "float box gave %d/%d", ret, size_ret);
+
+    ret = read_halved(name, TIFF_SCALE_SUBSAMPLE, out, sizeof(out), &size_ret);
+    CHECK(ret == TIFF_OK && out[0] == 3.0f && out[1] == 3.0f,
+        "float subsample gave %d: %g %g", ret, out[0], out[1]);
+}
+
+int main(int argc, char *argv[])
+{
+    char name[] = "/tmp/ghetto_scaled_XXXXXX";
+    int fd;
+
+    (void)argc;
+    (void)argv;
+
+    if ( (fd = mkstemp(name)) < 0 ) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_unsigned(name);
+    test_signed(name);
+    test_float(name);
+
+    unlink(name);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+
+    return 0;
+}
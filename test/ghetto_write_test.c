@@ -0,0 +1,317 @@
+/* Checks the writer by reading back what it wrote.
+ *
+ * A tiled RGB image and a 16-bit strip image, both with partial chunks
+ * at the right and bottom edges, are written with their chunks out of
+ * order. The file is then opened with the reader and every pixel is
+ * compared with the source. The writer's error cases are checked too.
+ */
+
+#include <ghetto.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TILED_WIDTH         100
+#define TILED_HEIGHT        70
+#define TILED_SAMPLES       3
+#define TILE_SIZE           32
+
+#define STRIP_WIDTH         77
+#define STRIP_HEIGHT        50
+#define ROWS_PER_STRIP      8
+
+static int failures;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+static int set_long(tiff_writer_t *w, tiff_tag_id_t id, uint32_t val)
+{
+    return tiff_set_tag(w, id, TIFF_TYPE_LONG, 1, &val);
+}
+
+static int set_short(tiff_writer_t *w, tiff_tag_id_t id, uint16_t val)
+{
+    return tiff_set_tag(w, id, TIFF_TYPE_SHORT, 1, &val);
+}
+
+/*******************************************************************/
+/* Source images                                                   */
+/*******************************************************************/
+
+static uint8_t *make_tiled_pixels(void)
+{
+    uint8_t *px = malloc(TILED_WIDTH * TILED_HEIGHT * TILED_SAMPLES);
+    size_t x, y, s;
+
+    if (px == NULL) {
+        return NULL;
+    }
+
+    for (y = 0; y < TILED_HEIGHT; y++) {
+        for (x = 0; x < TILED_WIDTH; x++) {
+            for (s = 0; s < TILED_SAMPLES; s++) {
+                px[(y * TILED_WIDTH + x) * TILED_SAMPLES + s] =
+                    (uint8_t)(x * 3 + y * 5 + s * 71);
+            }
+        }
+    }
+
+    return px;
+}
+
+static uint16_t *make_strip_pixels(void)
+{
+    uint16_t *px = malloc(STRIP_WIDTH * STRIP_HEIGHT * sizeof(uint16_t));
+    size_t x, y;
+
+    if (px == NULL) {
+        return NULL;
+    }
+
+    for (y = 0; y < STRIP_HEIGHT; y++) {
+        for (x = 0; x < STRIP_WIDTH; x++) {
+            px[y * STRIP_WIDTH + x] = (uint16_t)(x * 769 + y * 257 + 1);
+        }
+    }
+
+    return px;
+}
+
+/*******************************************************************/
+/* Writing                                                         */
+/*******************************************************************/
+
+/* Tiles are padded out to full size, as TIFF requires, and written last
+ * one first.
+ */
+static int write_tiled(tiff_writer_t *w, const uint8_t *px)
+{
+    size_t across = (TILED_WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+    size_t down = (TILED_HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tile_len = TILE_SIZE * TILE_SIZE * TILED_SAMPLES, t, x, y;
+    uint16_t bps[TILED_SAMPLES] = { 8, 8, 8 };
+    uint8_t *tile;
+    int ret = 0;
+
+    if ( (tile = malloc(tile_len)) == NULL ) {
+        return -1;
+    }
+
+    ret |= set_long(w, 256, TILED_WIDTH);
+    ret |= set_long(w, 257, TILED_HEIGHT);
+    ret |= tiff_set_tag(w, 258, TIFF_TYPE_SHORT, TILED_SAMPLES, bps);
+    ret |= set_short(w, 259, 1);
+    ret |= set_short(w, 262, 2);
+    ret |= set_short(w, 277, TILED_SAMPLES);
+    ret |= set_short(w, 284, 1);
+    ret |= set_long(w, 322, TILE_SIZE);
+    ret |= set_long(w, 323, TILE_SIZE);
+
+    for (t = across * down; t-- > 0; ) {
+        size_t x0 = (t % across) * TILE_SIZE, y0 = (t / across) * TILE_SIZE;
+
+        memset(tile, 0xee, tile_len);
+
+        for (y = 0; y < TILE_SIZE && y0 + y < TILED_HEIGHT; y++) {
+            x = TILE_SIZE;
+            if (x0 + x > TILED_WIDTH) x = TILED_WIDTH - x0;
+
+            memcpy(tile + y * TILE_SIZE * TILED_SAMPLES,
+                px + ((y0 + y) * TILED_WIDTH + x0) * TILED_SAMPLES,
+                x * TILED_SAMPLES);
+        }
+
+        ret |= tiff_write_chunk(w, t, tile, tile_len);
+    }
+
+    free(tile);
+
+    return ret;
+}
+
+/* The last strip holds only the rows that are left. Even strips go first,
+ * then odd ones.
+ */
+static int write_strips(tiff_writer_t *w, const uint16_t *px)
+{
+    size_t strips = (STRIP_HEIGHT + ROWS_PER_STRIP - 1) / ROWS_PER_STRIP, i, n;
+    size_t row_len = STRIP_WIDTH * sizeof(uint16_t), rows;
+    int ret = 0;
+
+    ret |= set_long(w, 256, STRIP_WIDTH);
+    ret |= set_long(w, 257, STRIP_HEIGHT);
+    ret |= set_short(w, 258, 16);
+    ret |= set_short(w, 259, 1);
+    ret |= set_short(w, 262, 1);
+    ret |= set_short(w, 277, 1);
+    ret |= set_long(w, 278, ROWS_PER_STRIP);
+
+    for (n = 0; n < strips; n++) {
+        i = n < (strips + 1) / 2 ? n * 2 : (n - (strips + 1) / 2) * 2 + 1;
+
+        rows = STRIP_HEIGHT - i * ROWS_PER_STRIP;
+        if (rows > ROWS_PER_STRIP) rows = ROWS_PER_STRIP;
+
+        ret |= tiff_write_chunk(w, i, px + i * ROWS_PER_STRIP * STRIP_WIDTH,
+            rows * row_len);
+    }
+
+    return ret;
+}
+
+/*******************************************************************/
+/* Tests                                                           */
+/*******************************************************************/
+
+static void test_round_trip(const char *name)
+{
+    uint8_t *tiled = make_tiled_pixels(), *tiled_back = NULL;
+    uint16_t *strips = make_strip_pixels(), *strips_back = NULL;
+    size_t tiled_len = TILED_WIDTH * TILED_HEIGHT * TILED_SAMPLES;
+    size_t strips_len = STRIP_WIDTH * STRIP_HEIGHT * sizeof(uint16_t);
+    tiff_writer_t *w = NULL;
+    tiff_t *fp = NULL;
+    tiff_ifd_t *ifd = NULL;
+    tiff_off_t off = 0;
+    TIFF_STATUS ret;
+
+    tiled_back = malloc(tiled_len);
+    strips_back = malloc(strips_len);
+
+    if (tiled == NULL || strips == NULL || tiled_back == NULL ||
+        strips_back == NULL)
+    {
+        CHECK(0, "out of memory");
+        goto done;
+    }
+
+    CHECK(tiff_create(&w, name) == TIFF_OK, "can't create %s", name);
+    if (w == NULL) {
+        goto done;
+    }
+
+    CHECK(write_tiled(w, tiled) == 0, "can't write the tiled image");
+    CHECK(tiff_finish_ifd(w) == TIFF_OK, "can't finish the tiled IFD");
+    CHECK(write_strips(w, strips) == 0, "can't write the strip image");
+
+    /* The strip IFD is left open for close to finish */
+    CHECK( (ret = tiff_writer_close(w)) == TIFF_OK, "close gave %d", ret);
+
+    if ( (ret = tiff_open(&fp, name, "r")) != TIFF_OK ) {
+        CHECK(0, "can't reopen %s: %d", name, ret);
+        goto done;
+    }
+
+    tiff_get_base_ifd_offset(fp, &off);
+
+    if ( (ret = tiff_read_ifd(fp, off, &ifd)) != TIFF_OK ) {
+        CHECK(0, "can't read the tiled IFD: %d", ret);
+        goto done;
+    }
+
+    memset(tiled_back, 0, tiled_len);
+    ret = tiff_read_image(fp, ifd, TIFF_LAYOUT_CHUNKY, tiled_back, tiled_len);
+    CHECK(ret == TIFF_OK, "can't read the tiled image: %d", ret);
+    CHECK(!memcmp(tiled, tiled_back, tiled_len), "tiled pixels differ");
+
+    tiff_get_next_ifd_offset(fp, ifd, &off);
+    tiff_free_ifd(fp, ifd);
+    ifd = NULL;
+
+    if ( (ret = tiff_read_ifd(fp, off, &ifd)) != TIFF_OK ) {
+        CHECK(0, "can't read the strip IFD: %d", ret);
+        goto done;
+    }
+
+    memset(strips_back, 0, strips_len);
+    ret = tiff_read_image(fp, ifd, TIFF_LAYOUT_CHUNKY, strips_back, strips_len);
+    CHECK(ret == TIFF_OK, "can't read the strip image: %d", ret);
+    CHECK(!memcmp(strips, strips_back, strips_len), "strip pixels differ");
+
+    tiff_get_next_ifd_offset(fp, ifd, &off);
+    CHECK(off == 0, "more than two IFDs");
+
+done:
+    if (ifd) tiff_free_ifd(fp, ifd);
+    if (fp) tiff_close(fp);
+    free(tiled);
+    free(tiled_back);
+    free(strips);
+    free(strips_back);
+}
+
+static void test_errors(const char *name)
+{
+    tiff_writer_t *w = NULL;
+    uint8_t chunk[16] = { 0 };
+    TIFF_STATUS ret;
+
+    /* An empty chunk can't be told from one that was never written */
+    if (tiff_create(&w, name) == TIFF_OK) {
+        set_long(w, 256, 16);
+        set_long(w, 257, 1);
+        ret = tiff_write_chunk(w, 0, chunk, 0);
+        CHECK(ret == TIFF_RANGE_ERROR, "empty chunk gave %d", ret);
+        tiff_write_chunk(w, 1, chunk, sizeof(chunk));
+        ret = tiff_finish_ifd(w);
+        CHECK(ret == TIFF_RANGE_ERROR, "missing chunk gave %d", ret);
+        tiff_writer_close(w);
+    }
+
+    /* Chunks without any tags aren't dropped quietly */
+    if (tiff_create(&w, name) == TIFF_OK) {
+        set_long(w, 256, 16);
+        set_long(w, 257, 1);
+        tiff_write_chunk(w, 0, chunk, sizeof(chunk));
+        CHECK(tiff_finish_ifd(w) == TIFF_OK, "can't finish the IFD");
+        tiff_write_chunk(w, 0, chunk, sizeof(chunk));
+        ret = tiff_writer_close(w);
+        CHECK(ret == TIFF_RANGE_ERROR, "untagged chunks gave %d", ret);
+    }
+
+    /* Nothing at all to write */
+    if (tiff_create(&w, name) == TIFF_OK) {
+        ret = tiff_writer_close(w);
+        CHECK(ret == TIFF_RANGE_ERROR, "empty file gave %d", ret);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char name[] = "/tmp/ghetto_write_XXXXXX";
+    int fd;
+
+    (void)argc;
+    (void)argv;
+
+    if ( (fd = mkstemp(name)) < 0 ) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_round_trip(name);
+    test_errors(name);
+
+    unlink(name);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+
+    return 0;
+}
@@ -0,0 +1,1100 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Bulk metadata scanner. Walks directory trees with a pool of threads,
+ * pulls a chosen set of tags out of every TIFF (or TIFF based raw) file
+ * it finds, and writes them out in a columnar binary format. When done,
+ * files/s and bytes read per file are reported on stderr.
+ *
+ * Usage: ghetto_scan [-j threads] [-c columns] [-o output] [-g rows]
+ *                    [-m pread|stdio] path...
+ *
+ * Columns are a comma separated list of names from named_columns below,
+ * or of [ifd0:|exif:|maker:]tag[/kind], where kind is one of
+ *   u  unsigned integer (the default)    i  signed integer
+ *   f  floating point                    s  string (ASCII, BYTE, UNDEFINED)
+ *   n  count of values
+ * e.g. "make,model,exif:33434/f,maker:0x7/s". The maker IFD is the
+ * MakerNote read as an IFD, either bare (Canon and others) or behind a
+ * Nikon header; other MakerNotes give no values.
+ *
+ * Output is written in groups of rows, each group holding every column's
+ * values in turn. Everything after the byte order mark is in the byte
+ * order it gives, and every array starts on an 8 byte boundary, so the
+ * file can be mapped and its columns used in place:
+ *
+ *   header:   char magic[8]        "GHSCAN01"
+ *             char order[2]        "II" or "MM"
+ *             UINT16 reserved
+ *             UINT32 columns
+ *             UINT64 reserved
+ *   column:   char name[32]        NUL padded
+ *             UINT32 kind          1 unsigned, 2 signed, 3 double, 4 string
+ *             UINT32 ifd           0 ifd0, 1 exif, 2 maker, 3 the scan
+ *             UINT32 tag
+ *             UINT32 reserved
+ *   group:    UINT64 rows          0 ends the file
+ *             UINT64 heap_bytes    a multiple of 8
+ *             for each column, rows UINT64 values and then (rows + 63) / 64
+ *             UINT64 words with bit r set if row r has a value
+ *             heap_bytes of strings
+ *
+ * A string value holds its offset in the group's string heap in the low
+ * 32 bits and its length in the high 32 bits; strings are not terminated.
+ * The first columns describe the scan: path, status (the first error hit
+ * while parsing, 0 if none), file_size, bytes_read, reads and ifds (the
+ * number of images in the main IFD chain).
+ */
+
+#include <ghetto.h>
+#include <ghetto_fp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TAG_EXIFIFD         34665
+#define TAG_MAKERNOTE       37500
+
+/* Kinds of column, as written to the file */
+#define KIND_UNSIGNED       1
+#define KIND_SIGNED         2
+#define KIND_DOUBLE         3
+#define KIND_STRING         4
+
+/* Where a column's values come from */
+#define IFD_0               0
+#define IFD_EXIF            1
+#define IFD_MAKER           2
+#define IFD_SCAN            3
+#define IFD_SOURCES         3   /* Those that are IFDs */
+
+/* The columns every scan starts with */
+#define SCAN_PATH           0
+#define SCAN_STATUS         1
+#define SCAN_FILE_SIZE      2
+#define SCAN_BYTES_READ     3
+#define SCAN_READS          4
+#define SCAN_IFDS           5
+#define SCAN_COLUMNS        6
+
+#define NAME_LEN            32
+#define MAX_COLUMNS         256
+#define MAX_THREADS         256
+#define MAX_STRING          4096        /* Longer strings are left out */
+#define MAX_HEAP            (1ul << 30) /* Of a group; offsets are 32 bits */
+#define DEFAULT_GROUP_ROWS  16384
+
+#define DEFAULT_COLUMNS     "make,model,datetime_original,exposure_time," \
+                            "fnumber,iso,focal_length,lens_model,width," \
+                            "height,makernote_size"
+
+struct column {
+    char name[NAME_LEN];
+    int kind;
+    int ifd;
+    unsigned tag;
+    int count;                  /* Store the tag's count, not its value */
+};
+
+static const struct column scan_columns[SCAN_COLUMNS] = {
+    { "path",        KIND_STRING,   IFD_SCAN, SCAN_PATH },
+    { "status",      KIND_UNSIGNED, IFD_SCAN, SCAN_STATUS },
+    { "file_size",   KIND_UNSIGNED, IFD_SCAN, SCAN_FILE_SIZE },
+    { "bytes_read",  KIND_UNSIGNED, IFD_SCAN, SCAN_BYTES_READ },
+    { "reads",       KIND_UNSIGNED, IFD_SCAN, SCAN_READS },
+    { "ifds",        KIND_UNSIGNED, IFD_SCAN, SCAN_IFDS },
+};
+
+static const struct column named_columns[] = {
+    { "width",             KIND_UNSIGNED, IFD_0,    256 },
+    { "height",            KIND_UNSIGNED, IFD_0,    257 },
+    { "bits",              KIND_UNSIGNED, IFD_0,    258 },
+    { "compression",       KIND_UNSIGNED, IFD_0,    259 },
+    { "photometric",       KIND_UNSIGNED, IFD_0,    262 },
+    { "make",              KIND_STRING,   IFD_0,    271 },
+    { "model",             KIND_STRING,   IFD_0,    272 },
+    { "orientation",       KIND_UNSIGNED, IFD_0,    274 },
+    { "software",          KIND_STRING,   IFD_0,    305 },
+    { "datetime",          KIND_STRING,   IFD_0,    306 },
+    { "artist",            KIND_STRING,   IFD_0,    315 },
+    { "exposure_time",     KIND_DOUBLE,   IFD_EXIF, 33434 },
+    { "fnumber",           KIND_DOUBLE,   IFD_EXIF, 33437 },
+    { "iso",               KIND_UNSIGNED, IFD_EXIF, 34855 },
+    { "datetime_original", KIND_STRING,   IFD_EXIF, 36867 },
+    { "exposure_bias",     KIND_DOUBLE,   IFD_EXIF, 37380 },
+    { "focal_length",      KIND_DOUBLE,   IFD_EXIF, 37386 },
+    { "body_serial",       KIND_STRING,   IFD_EXIF, 42033 },
+    { "lens_model",        KIND_STRING,   IFD_EXIF, 42036 },
+    { "makernote_size",    KIND_UNSIGNED, IFD_EXIF, TAG_MAKERNOTE, 1 },
+};
+
+#define NAMED_COLUMNS   (sizeof(named_columns) / sizeof(named_columns[0]))
+
+/* On-disk header and column descriptor, see the top of the file */
+struct file_header {
+    char magic[8];
+    char order[2];
+    UINT16 reserved;
+    UINT32 columns;
+    UINT64 reserved2;
+};
+
+struct file_column {
+    char name[NAME_LEN];
+    UINT32 kind;
+    UINT32 ifd;
+    UINT32 tag;
+    UINT32 reserved;
+};
+
+/* A path waiting to be scanned. Directories found while scanning are
+ * pushed back onto the queue, so the walk itself is spread over the pool.
+ */
+#define ITEM_ROOT           0   /* Named on the command line */
+#define ITEM_DIR            1
+#define ITEM_FILE           2
+#define ITEM_UNKNOWN        3   /* readdir couldn't say */
+
+struct item {
+    struct item *next;
+    int type;
+    char path[];
+};
+
+struct scan {
+    const struct column *columns;
+    size_t column_count;
+    size_t group_rows;
+    int need_exif;
+    int need_maker;
+    tiff_file_mgr_t *mgr;
+    tiff_limits_t limits;
+
+    /* Work queue, a stack so the walk stays depth first */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct item *work;
+    size_t busy;                /* Items being worked on */
+
+    pthread_mutex_t out_lock;
+    FILE *out;
+};
+
+/* Rows being filled in by one worker, column major */
+struct group {
+    size_t rows;
+    UINT64 *values;             /* group_rows values per column */
+    UINT64 *valid;              /* group_words words per column */
+    size_t group_words;
+    char *heap;
+    size_t heap_len;
+    size_t heap_size;
+};
+
+struct worker {
+    struct scan *s;
+    pthread_t thread;
+    struct group g;
+
+    UINT64 files;               /* TIFF files, opened or not */
+    UINT64 opened;
+    UINT64 not_tiff;
+    UINT64 failed;              /* With a non-zero status */
+    UINT64 bytes_read;
+    UINT64 reads;
+};
+
+/*******************************************************************/
+/* Columns                                                         */
+/*******************************************************************/
+/* Parse a column name, or [ifd0:|exif:|maker:]tag[/kind] */
+static int parse_column(const char *spec, struct column *col)
+{
+    const char *p = spec;
+    unsigned long tag;
+    char *end;
+    size_t i;
+
+    for (i = 0; i < NAMED_COLUMNS; i++) {
+        if (!strcmp(named_columns[i].name, spec)) {
+            *col = named_columns[i];
+            return 0;
+        }
+    }
+
+    memset(col, 0, sizeof(*col));
+    snprintf(col->name, sizeof(col->name), "%s", spec);
+    col->kind = KIND_UNSIGNED;
+    col->ifd = IFD_0;
+
+    if (!strncmp(p, "ifd0:", 5)) {
+        p += 5;
+    } else if (!strncmp(p, "exif:", 5)) {
+        col->ifd = IFD_EXIF;
+        p += 5;
+    } else if (!strncmp(p, "maker:", 6)) {
+        col->ifd = IFD_MAKER;
+        p += 6;
+    }
+
+    errno = 0;
+    tag = strtoul(p, &end, 0);
+    if (end == p || errno != 0 || tag > 65535) {
+        return -1;
+    }
+    col->tag = (unsigned)tag;
+
+    if (*end == '\0') {
+        return 0;
+    }
+
+    if (*end != '/' || end[1] == '\0' || end[2] != '\0') {
+        return -1;
+    }
+
+    switch (end[1]) {
+    case 'u':
+        break;
+    case 'i':
+        col->kind = KIND_SIGNED;
+        break;
+    case 'f':
+        col->kind = KIND_DOUBLE;
+        break;
+    case 's':
+        col->kind = KIND_STRING;
+        break;
+    case 'n':
+        col->count = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Build the column list: the scan columns, then those asked for */
+static int parse_columns(struct scan *s, const char *list)
+{
+    struct column *cols;
+    char *copy, *spec, *save = NULL;
+    size_t n = SCAN_COLUMNS;
+
+    if ( (cols = calloc(MAX_COLUMNS, sizeof(*cols))) == NULL ||
+         (copy = strdup(list)) == NULL )
+    {
+        free(cols);
+        return -1;
+    }
+
+    memcpy(cols, scan_columns, sizeof(scan_columns));
+
+    for (spec = strtok_r(copy, ",", &save); spec != NULL;
+         spec = strtok_r(NULL, ",", &save))
+    {
+        if (n == MAX_COLUMNS) {
+            fprintf(stderr, "too many columns (at most %d)\n",
+                MAX_COLUMNS - SCAN_COLUMNS);
+            goto fail;
+        }
+
+        if (parse_column(spec, &cols[n])) {
+            fprintf(stderr, "bad column: %s\n", spec);
+            goto fail;
+        }
+
+        s->need_exif |= cols[n].ifd != IFD_0;
+        s->need_maker |= cols[n].ifd == IFD_MAKER;
+        n++;
+    }
+
+    free(copy);
+    s->columns = cols;
+    s->column_count = n;
+
+    return 0;
+
+fail:
+    free(copy);
+    free(cols);
+    return -1;
+}
+
+/*******************************************************************/
+/* Row groups                                                      */
+/*******************************************************************/
+static int group_init(struct group *g, const struct scan *s)
+{
+    memset(g, 0, sizeof(*g));
+
+    g->group_words = (s->group_rows + 63) / 64;
+    g->values = calloc(s->column_count * s->group_rows, sizeof(UINT64));
+    g->valid = calloc(s->column_count * g->group_words, sizeof(UINT64));
+
+    return g->values == NULL || g->valid == NULL;
+}
+
+static void group_free(struct group *g)
+{
+    free(g->values);
+    free(g->valid);
+    free(g->heap);
+}
+
+/* Append the group to the output and empty it */
+static void group_flush(struct group *g, struct scan *s)
+{
+    static const char pad[8];
+    UINT64 hdr[2];
+    size_t words = (g->rows + 63) / 64, tail, c;
+
+    if (g->rows == 0) {
+        return;
+    }
+
+    tail = (8 - g->heap_len % 8) % 8;
+    hdr[0] = g->rows;
+    hdr[1] = g->heap_len + tail;
+
+    pthread_mutex_lock(&s->out_lock);
+
+    fwrite(hdr, sizeof(hdr), 1, s->out);
+    for (c = 0; c < s->column_count; c++) {
+        fwrite(g->values + c * s->group_rows, sizeof(UINT64), g->rows, s->out);
+        fwrite(g->valid + c * g->group_words, sizeof(UINT64), words, s->out);
+    }
+    fwrite(g->heap, 1, g->heap_len, s->out);
+    fwrite(pad, 1, tail, s->out);
+
+    pthread_mutex_unlock(&s->out_lock);
+
+    memset(g->values, 0, s->column_count * s->group_rows * sizeof(UINT64));
+    memset(g->valid, 0, s->column_count * g->group_words * sizeof(UINT64));
+    g->rows = 0;
+    g->heap_len = 0;
+}
+
+/* Make room for a row, flushing the group if it is full or its heap
+ * might not take another row's worth of strings.
+ */
+static void group_begin_row(struct group *g, struct scan *s)
+{
+    if (g->rows == s->group_rows ||
+        g->heap_len + s->column_count * MAX_STRING > MAX_HEAP)
+    {
+        group_flush(g, s);
+    }
+}
+
+static void set_value(struct worker *w, size_t col, UINT64 value)
+{
+    struct group *g = &w->g;
+    size_t row = g->rows;
+
+    g->values[col * w->s->group_rows + row] = value;
+    g->valid[col * g->group_words + row / 64] |= 1ull << (row % 64);
+}
+
+static void set_string(struct worker *w, size_t col, const char *str,
+                       size_t len)
+{
+    struct group *g = &w->g;
+    size_t size;
+    char *heap;
+
+    if (len > MAX_STRING) {
+        return;
+    }
+
+    if (g->heap_len + len > g->heap_size) {
+        size = g->heap_size ? g->heap_size : 65536;
+        while (size < g->heap_len + len) {
+            size *= 2;
+        }
+
+        if ( (heap = realloc(g->heap, size)) == NULL ) {
+            return;
+        }
+
+        g->heap = heap;
+        g->heap_size = size;
+    }
+
+    memcpy(g->heap + g->heap_len, str, len);
+    set_value(w, col, (UINT64)g->heap_len | ((UINT64)len << 32));
+    g->heap_len += len;
+}
+
+/*******************************************************************/
+/* Tag extraction                                                  */
+/*******************************************************************/
+static unsigned get_word(const unsigned char *p, int big)
+{
+    return big ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static UINT32 get_dword(const unsigned char *p, int big)
+{
+    return big ?
+        ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | (p[2] << 8) | p[3] :
+        p[0] | (p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+/* Read the MakerNote as an IFD. It is either bare, with offsets from the
+ * start of the file (Canon and others), or behind a Nikon header, with
+ * offsets from the TIFF header embedded in it. Only the directory itself
+ * is read, however big the MakerNote is.
+ */
+static TIFF_STATUS read_makernote(tiff_t *fp, tiff_ifd_t *exif,
+                                  tiff_ifd_t **ifd)
+{
+    tiff_tag_t *tag;
+    tiff_off_t start, off, base = 0;
+    unsigned char hdr[18], *buf;
+    size_t avail, len, got;
+    unsigned entries;
+    int type, count, big;
+    UINT32 rel;
+    TIFF_STATUS ret;
+
+    if ( (ret = tiff_get_tag(fp, exif, TAG_MAKERNOTE, &tag)) != TIFF_OK ||
+         (ret = tiff_get_tag_info(fp, tag, NULL, &type, &count)) != TIFF_OK ||
+         (ret = tiff_get_raw_tag_field(fp, tag, &start)) != TIFF_OK )
+    {
+        return ret;
+    }
+
+    if (tiff_get_type_size(type) != 1 || count < (int)sizeof(hdr)) {
+        return TIFF_UNSUPPORTED;
+    }
+
+    /* The file's byte order, from its header */
+    if ( (ret = tiff_read(fp, 0, 1, 2, hdr, NULL)) != TIFF_OK ) {
+        return ret;
+    }
+    big = hdr[0] == 'M';
+
+    if ( (ret = tiff_read(fp, start, 1, sizeof(hdr), hdr, &got)) != TIFF_OK ) {
+        return ret;
+    }
+    if (got != sizeof(hdr)) {
+        return TIFF_END_OF_FILE;
+    }
+
+    off = start;
+    avail = count;
+
+    if (!memcmp(hdr, "Nikon\0", 6)) {
+        /* Version, then a TIFF header that must match the file's */
+        if (hdr[10] != hdr[11] || (hdr[10] == 'M') != big) {
+            return TIFF_UNSUPPORTED;
+        }
+
+        rel = get_dword(hdr + 14, big);
+        if (rel > avail - 10) {
+            return TIFF_UNSUPPORTED;
+        }
+
+        base = start + 10;
+        off = base + rel;
+        avail -= 10 + rel;
+
+        if (avail < 14 ||
+            (ret = tiff_read(fp, off, 1, 14, hdr, &got)) != TIFF_OK)
+        {
+            return avail < 14 ? TIFF_UNSUPPORTED : ret;
+        }
+        if (got != 14) {
+            return TIFF_END_OF_FILE;
+        }
+    }
+
+    /* Vendor text or binary data where the directory would be is caught
+     * by an entry count that doesn't fit, or a first entry of no known
+     * type.
+     */
+    entries = get_word(hdr, big);
+    len = 2 + (size_t)entries * 12;
+    type = get_word(hdr + 4, big);
+    if (entries == 0 || len > avail || type < TIFF_TYPE_BYTE ||
+        type > TIFF_TYPE_DOUBLE)
+    {
+        return TIFF_UNSUPPORTED;
+    }
+
+    /* Room for the next IFD offset, which is left as zero */
+    if ( (buf = calloc(1, len + 4)) == NULL ) {
+        return TIFF_NO_MEMORY;
+    }
+
+    if ( (ret = tiff_read(fp, off, 1, len, buf, &got)) == TIFF_OK ) {
+        ret = got == len ? tiff_make_ifd(fp, buf, len + 4, base, ifd) :
+            TIFF_END_OF_FILE;
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+static void get_string(struct worker *w, tiff_t *fp, tiff_ifd_t *ifd,
+                       size_t col)
+{
+    char buf[MAX_STRING];
+    tiff_tag_t *tag;
+    int type, count;
+    size_t len;
+
+    if (tiff_get_tag(fp, ifd, w->s->columns[col].tag, &tag) != TIFF_OK ||
+        tiff_get_tag_info(fp, tag, NULL, &type, &count) != TIFF_OK ||
+        tiff_get_type_size(type) != 1 || count <= 0 || count > MAX_STRING ||
+        tiff_get_tag_data(fp, ifd, tag, buf) != TIFF_OK)
+    {
+        return;
+    }
+
+    len = count;
+
+    /* Up to the NUL, less the padding some cameras leave */
+    if (type == TIFF_TYPE_ASCII) {
+        len = strnlen(buf, len);
+        while (len > 0 && buf[len - 1] == ' ') {
+            len--;
+        }
+    }
+
+    set_string(w, col, buf, len);
+}
+
+static void get_column(struct worker *w, tiff_t *fp, tiff_ifd_t *ifd,
+                       size_t col)
+{
+    const struct column *c = &w->s->columns[col];
+    tiff_tag_t *tag;
+    UINT64 u;
+    INT64 i;
+    double d;
+    int count;
+
+    if (c->count) {
+        if (tiff_get_tag(fp, ifd, c->tag, &tag) == TIFF_OK &&
+            tiff_get_tag_info(fp, tag, NULL, NULL, &count) == TIFF_OK)
+        {
+            set_value(w, col, (UINT64)count);
+        }
+        return;
+    }
+
+    switch (c->kind) {
+    case KIND_UNSIGNED:
+        if (tiff_get_tag_u64(fp, ifd, c->tag, &u) == TIFF_OK) {
+            set_value(w, col, u);
+        }
+        break;
+    case KIND_SIGNED:
+        /* Every signed TIFF type fits in a double exactly */
+        if (tiff_get_tag_double(fp, ifd, c->tag, &d) == TIFF_OK &&
+            d >= -9.2e18 && d <= 9.2e18)
+        {
+            i = (INT64)d;
+            set_value(w, col, (UINT64)i);
+        }
+        break;
+    case KIND_DOUBLE:
+        if (tiff_get_tag_double(fp, ifd, c->tag, &d) == TIFF_OK) {
+            memcpy(&u, &d, sizeof(u));
+            set_value(w, col, u);
+        }
+        break;
+    case KIND_STRING:
+        get_string(w, fp, ifd, col);
+        break;
+    }
+}
+
+/*******************************************************************/
+/* Scanning                                                        */
+/*******************************************************************/
+static void scan_file(struct worker *w, const char *path, UINT64 size)
+{
+    struct scan *s = w->s;
+    tiff_ifd_t *ifds[IFD_SOURCES] = { NULL, NULL, NULL };
+    tiff_open_options_t opts;
+    tiff_file_stats_t stats;
+    tiff_ifd_chain_t chain;
+    tiff_ifd_t *next;
+    tiff_off_t off;
+    tiff_t *fp = NULL;
+    TIFF_STATUS ret, status = TIFF_OK;
+    UINT32 exif_off;
+    UINT64 images;
+    size_t c;
+    int i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.mgr = s->mgr;
+    opts.limits = &s->limits;
+
+    if ( (ret = tiff_open_opts(&fp, path, "r", &opts)) == TIFF_NOT_TIFF ) {
+        w->not_tiff++;
+        return;
+    }
+
+    group_begin_row(&w->g, s);
+    set_string(w, SCAN_PATH, path, strlen(path));
+    set_value(w, SCAN_FILE_SIZE, size);
+
+    if (ret != TIFF_OK) {
+        fp = NULL;
+        status = ret;
+        goto done;
+    }
+
+    if ( (status = tiff_get_base_ifd_offset(fp, &off)) != TIFF_OK ||
+         (status = tiff_read_ifd(fp, off, &ifds[IFD_0])) != TIFF_OK )
+    {
+        goto done;
+    }
+
+    if (s->need_exif &&
+        tiff_get_tag_u32(fp, ifds[IFD_0], TAG_EXIFIFD, &exif_off) == TIFF_OK)
+    {
+        status = tiff_read_ifd(fp, exif_off, &ifds[IFD_EXIF]);
+    }
+
+    /* The MakerNote is the vendor's business, so if it can't be read as
+     * an IFD its columns are just left empty.
+     */
+    if (s->need_maker && ifds[IFD_EXIF] != NULL) {
+        read_makernote(fp, ifds[IFD_EXIF], &ifds[IFD_MAKER]);
+    }
+
+    for (c = SCAN_COLUMNS; c < s->column_count; c++) {
+        if (ifds[s->columns[c].ifd] != NULL) {
+            get_column(w, fp, ifds[s->columns[c].ifd], c);
+        }
+    }
+
+    /* Count the images in the main chain */
+    images = 1;
+    memset(&chain, 0, sizeof(chain));
+    ret = tiff_next_ifd(fp, &chain, ifds[IFD_0], &off);
+    while (ret == TIFF_OK && off != 0) {
+        if ( (ret = tiff_read_ifd(fp, off, &next)) != TIFF_OK ) {
+            break;
+        }
+        images++;
+        ret = tiff_next_ifd(fp, &chain, next, &off);
+        tiff_free_ifd(fp, next);
+    }
+
+    set_value(w, SCAN_IFDS, images);
+    if (status == TIFF_OK) {
+        status = ret;
+    }
+
+done:
+    set_value(w, SCAN_STATUS, status);
+
+    w->files++;
+    w->failed += status != TIFF_OK;
+
+    if (fp != NULL) {
+        for (i = 0; i < IFD_SOURCES; i++) {
+            if (ifds[i] != NULL) {
+                tiff_free_ifd(fp, ifds[i]);
+            }
+        }
+
+        if (tiff_get_stats(fp, &stats) == TIFF_OK) {
+            set_value(w, SCAN_BYTES_READ, stats.bytes_read);
+            set_value(w, SCAN_READS, stats.reads);
+            w->bytes_read += stats.bytes_read;
+            w->reads += stats.reads;
+        }
+
+        w->opened++;
+        tiff_close(fp);
+    }
+
+    w->g.rows++;
+}
+
+static struct item *item_new(const char *dir, const char *name, int type)
+{
+    size_t dlen = strlen(dir), nlen = name ? strlen(name) : 0;
+    struct item *it;
+    int sep;
+
+    sep = name != NULL && dlen > 0 && dir[dlen - 1] != '/';
+
+    if ( (it = malloc(sizeof(*it) + dlen + sep + nlen + 1)) == NULL ) {
+        return NULL;
+    }
+
+    it->next = NULL;
+    it->type = type;
+    memcpy(it->path, dir, dlen);
+    if (sep) {
+        it->path[dlen] = '/';
+    }
+    if (name) {
+        memcpy(it->path + dlen + sep, name, nlen);
+    }
+    it->path[dlen + sep + nlen] = '\0';
+
+    return it;
+}
+
+static void queue_push(struct scan *s, struct item *head, struct item *tail)
+{
+    pthread_mutex_lock(&s->lock);
+    tail->next = s->work;
+    s->work = head;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Take the next item, or NULL once the queue is empty and nobody is
+ * working on anything that could add to it.
+ */
+static struct item *queue_pop(struct scan *s)
+{
+    struct item *it;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (s->work == NULL && s->busy != 0) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+
+    if ( (it = s->work) != NULL ) {
+        s->work = it->next;
+        s->busy++;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return it;
+}
+
+static void queue_done(struct scan *s)
+{
+    pthread_mutex_lock(&s->lock);
+    if (--s->busy == 0 && s->work == NULL) {
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Queue everything in a directory, in one go */
+static void scan_dir(struct worker *w, const char *path)
+{
+    struct item *head = NULL, *tail = NULL, *it;
+    struct dirent *de;
+    DIR *dir;
+    int type;
+
+    if ( (dir = opendir(path)) == NULL ) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    while ( (de = readdir(dir)) != NULL ) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+
+        /* Links are not followed, so the walk can't loop */
+        switch (de->d_type) {
+        case DT_DIR:
+            type = ITEM_DIR;
+            break;
+        case DT_REG:
+            type = ITEM_FILE;
+            break;
+        case DT_UNKNOWN:
+            type = ITEM_UNKNOWN;
+            break;
+        default:
+            continue;
+        }
+
+        if ( (it = item_new(path, de->d_name, type)) == NULL ) {
+            break;
+        }
+
+        if (head == NULL) {
+            tail = it;
+        }
+        it->next = head;
+        head = it;
+    }
+
+    closedir(dir);
+
+    if (head != NULL) {
+        queue_push(w->s, head, tail);
+    }
+}
+
+static void scan_item(struct worker *w, struct item *it)
+{
+    struct stat st;
+    int ret;
+
+    if (it->type == ITEM_DIR) {
+        scan_dir(w, it->path);
+        return;
+    }
+
+    ret = it->type == ITEM_ROOT ? stat(it->path, &st) : lstat(it->path, &st);
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s\n", it->path, strerror(errno));
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        scan_dir(w, it->path);
+    } else if (S_ISREG(st.st_mode)) {
+        scan_file(w, it->path, st.st_size);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct item *it;
+
+    while ( (it = queue_pop(w->s)) != NULL ) {
+        scan_item(w, it);
+        free(it);
+        queue_done(w->s);
+    }
+
+    group_flush(&w->g, w->s);
+
+    return NULL;
+}
+
+/*******************************************************************/
+/* Driver                                                          */
+/*******************************************************************/
+static void write_header(struct scan *s)
+{
+    struct file_header hdr;
+    struct file_column col;
+    const UINT16 one = 1;
+    size_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "GHSCAN01", sizeof(hdr.magic));
+    memcpy(hdr.order, *(const char *)&one ? "II" : "MM", sizeof(hdr.order));
+    hdr.columns = s->column_count;
+    fwrite(&hdr, sizeof(hdr), 1, s->out);
+
+    for (i = 0; i < s->column_count; i++) {
+        memset(&col, 0, sizeof(col));
+        strncpy(col.name, s->columns[i].name, sizeof(col.name));
+        col.kind = s->columns[i].kind;
+        col.ifd = s->columns[i].ifd;
+        col.tag = s->columns[i].tag;
+        fwrite(&col, sizeof(col), 1, s->out);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-c columns] [-o output] "
+            "[-g rows] [-m pread|stdio] path...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct scan s;
+    struct worker *workers = NULL;
+    struct item *it;
+    const char *columns = DEFAULT_COLUMNS, *output = NULL;
+    const UINT64 end[2] = { 0, 0 };
+    UINT64 files = 0, opened = 0, not_tiff = 0, failed = 0, bytes = 0;
+    UINT64 reads = 0;
+    long threads;
+    double start, elapsed;
+    int opt, i, started = 0, ret = 1;
+
+    memset(&s, 0, sizeof(s));
+    s.group_rows = DEFAULT_GROUP_ROWS;
+    s.mgr = tiff_pread_mgr;
+
+    /* Hostile files get cut off rather than stall the scan */
+    s.limits.max_ifds = 1024;
+    s.limits.max_tags_per_ifd = 4096;
+    s.limits.max_payload_bytes = 16 << 20;
+    s.limits.max_bytes_read = 64 << 20;
+    s.limits.max_chain_depth = 1024;
+
+    if ( (threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1 ) {
+        threads = 1;
+    }
+
+    while ( (opt = getopt(argc, argv, "j:c:o:g:m:")) != -1 ) {
+        switch (opt) {
+        case 'j':
+            threads = atol(optarg);
+            break;
+        case 'c':
+            columns = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'g':
+            s.group_rows = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "pread")) {
+                s.mgr = tiff_pread_mgr;
+            } else if (!strcmp(optarg, "stdio")) {
+                s.mgr = tiff_stdio_mgr;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc || threads < 1 || threads > MAX_THREADS ||
+        s.group_rows == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (parse_columns(&s, columns)) {
+        return 1;
+    }
+
+    if (output == NULL || !strcmp(output, "-")) {
+        s.out = stdout;
+    } else if ( (s.out = fopen(output, "wb")) == NULL ) {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        goto done;
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    pthread_mutex_init(&s.out_lock, NULL);
+
+    write_header(&s);
+
+    for (i = argc - 1; i >= optind; i--) {
+        if ( (it = item_new(argv[i], NULL, ITEM_ROOT)) == NULL ) {
+            goto done;
+        }
+        queue_push(&s, it, it);
+    }
+
+    if ( (workers = calloc(threads, sizeof(*workers))) == NULL ) {
+        goto done;
+    }
+
+    start = now();
+
+    for (started = 0; started < threads; started++) {
+        workers[started].s = &s;
+        if (group_init(&workers[started].g, &s) ||
+            pthread_create(&workers[started].thread, NULL, worker_main,
+                &workers[started]))
+        {
+            fprintf(stderr, "failed to start worker %d\n", started);
+            group_free(&workers[started].g);
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        group_free(&workers[i].g);
+
+        files += workers[i].files;
+        opened += workers[i].opened;
+        not_tiff += workers[i].not_tiff;
+        failed += workers[i].failed;
+        bytes += workers[i].bytes_read;
+        reads += workers[i].reads;
+    }
+
+    elapsed = now() - start;
+
+    fwrite(end, sizeof(end), 1, s.out);
+
+    if (started < threads || fflush(s.out) != 0 || ferror(s.out)) {
+        fprintf(stderr, "%s: write failed\n", output ? output : "stdout");
+        goto done;
+    }
+
+    fprintf(stderr, "%llu files (%llu not TIFF, %llu with errors) in %.2f s: "
+            "%.0f files/s, %.0f bytes read/file, %.1f reads/file\n",
+            files, not_tiff, failed, elapsed,
+            elapsed > 0 ? (files + not_tiff) / elapsed : 0.0,
+            opened ? (double)bytes / opened : 0.0,
+            opened ? (double)reads / opened : 0.0);
+
+    ret = 0;
+
+done:
+    free(workers);
+    free((void *)s.columns);
+    if (s.out != NULL && s.out != stdout) {
+        fclose(s.out);
+    }
+
+    return ret;
+}